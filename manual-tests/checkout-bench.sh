@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# PURPOSE: Compare the time taken by a serial checkout with
+# `ostree checkout --jobs`, on a synthetic tree of many small files.
+# Usage: checkout-bench.sh [NDIRS] [NFILES_PER_DIR] [JOBS]
+
+set -euo pipefail
+
+ndirs=${1:-200}
+nfiles=${2:-200}
+jobs=${3:-$(nproc)}
+
+tmpdir=$(mktemp -d /var/tmp/ostree-checkout-bench.XXXXXX)
+trap 'rm -rf ${tmpdir}' EXIT
+cd ${tmpdir}
+
+ostree --repo=repo init --mode=bare-user
+mkdir tree
+for d in $(seq ${ndirs}); do
+    mkdir -p tree/d${d}/sub
+    for f in $(seq ${nfiles}); do
+        echo "${d} ${f}" > tree/d${d}/sub/f${f}
+    done
+done
+ostree --repo=repo commit -b bench --tree=dir=tree >/dev/null
+
+for mode in serial jobs; do
+    sync
+    if [ ${mode} = serial ]; then
+        args=""
+    else
+        args="--jobs=${jobs}"
+    fi
+    start=$(date +%s.%N)
+    ostree --repo=repo checkout -U ${args} bench co-${mode}
+    end=$(date +%s.%N)
+    echo "${mode}: $(echo "${end} - ${start}" | bc) seconds"
+done
+
+diff -r co-serial co-jobs
+echo "checkouts are identical"
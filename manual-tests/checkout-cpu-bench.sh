@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# PURPOSE: Compare the CPU time per file of checking out through
+# ostree_repo_checkout_tree(), which walks the tree with OstreeRepoFile
+# objects, and ostree_repo_checkout_tree_at(), which walks the dirtree
+# objects directly.  `ostree checkout` uses the former by default, and
+# the latter with --disable-cache; in a bare-user repository there is
+# no cache, so both produce the same tree.
+# Usage: checkout-cpu-bench.sh [NDIRS] [NFILES_PER_DIR] [ROUNDS]
+
+set -euo pipefail
+
+ndirs=${1:-200}
+nfiles=${2:-1000}
+rounds=${3:-3}
+total=$((ndirs * nfiles))
+
+tmpdir=$(mktemp -d /var/tmp/ostree-checkout-cpu-bench.XXXXXX)
+trap 'rm -rf ${tmpdir}' EXIT
+cd ${tmpdir}
+
+ostree --repo=repo init --mode=bare-user
+mkdir tree
+for d in $(seq ${ndirs}); do
+    mkdir -p tree/d${d}
+    for f in $(seq ${nfiles}); do
+        echo "${d} ${f}" > tree/d${d}/f${f}
+    done
+done
+ostree --repo=repo commit -b bench --tree=dir=tree >/dev/null
+echo "${total} files in ${ndirs} directories"
+
+TIMEFORMAT='%U %S'
+for mode in repofile dirtree; do
+    if [ ${mode} = repofile ]; then
+        args=""
+    else
+        args="--disable-cache"
+    fi
+    best=""
+    for round in $(seq ${rounds}); do
+        rm -rf co-${mode}
+        cpu=$( { time ostree --repo=repo checkout -U --fsync=false ${args} bench co-${mode} ; } 2>&1 | awk '{ print $1 + $2 }')
+        if [ -z "${best}" ] || [ $(echo "${cpu} < ${best}" | bc) = 1 ]; then
+            best=${cpu}
+        fi
+    done
+    echo "${mode}: ${best} s CPU, $(echo "scale=2; ${best} * 1000000 / ${total}" | bc) usec per file"
+done
+
+diff -r co-repofile co-dirtree
+echo "checkouts are identical"
@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include "ostree-checksum-input-stream.h"
+#include "ostree-core-private.h"
 
 enum {
   PROP_0,
@@ -31,6 +32,7 @@ G_DEFINE_TYPE (OstreeChecksumInputStream, ostree_checksum_input_stream, G_TYPE_F
 
 struct _OstreeChecksumInputStreamPrivate {
   GChecksum *checksum;
+  OtSha256 *sha256;
 };
 
 static void     ostree_checksum_input_stream_set_property (GObject              *object,
@@ -141,6 +143,28 @@ ostree_checksum_input_stream_new (GInputStream    *base,
   return (OstreeChecksumInputStream*) (stream);
 }
 
+/*
+ * _ostree_checksum_input_stream_new_sha256:
+ *
+ * Like ostree_checksum_input_stream_new(), but updating an #OtSha256,
+ * which may use the CPU's SHA-256 instructions.
+ */
+OstreeChecksumInputStream *
+_ostree_checksum_input_stream_new_sha256 (GInputStream    *base,
+                                          OtSha256        *checksum)
+{
+  OstreeChecksumInputStream *stream;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (base), NULL);
+
+  stream = g_object_new (OSTREE_TYPE_CHECKSUM_INPUT_STREAM,
+                         "base-stream", base,
+                         NULL);
+  stream->priv->sha256 = checksum;
+
+  return stream;
+}
+
 static gssize
 ostree_checksum_input_stream_read (GInputStream  *stream,
                                    void          *buffer,
@@ -161,7 +185,12 @@ ostree_checksum_input_stream_read (GInputStream  *stream,
                              cancellable,
                              error);
   if (res > 0)
-    g_checksum_update (self->priv->checksum, buffer, res);
+    {
+      if (self->priv->sha256)
+        ot_sha256_update (self->priv->sha256, buffer, res);
+      else
+        g_checksum_update (self->priv->checksum, buffer, res);
+    }
 
   return res;
 }
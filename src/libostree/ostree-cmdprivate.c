@@ -22,6 +22,7 @@
 
 #include "ostree-cmdprivate.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-pack-private.h"
 #include "ostree-core-private.h"
 #include "ostree-sysroot.h"
 #include "ostree-bootloader-grub2.h"
@@ -34,6 +35,36 @@ impl_ostree_generate_grub2_config (OstreeSysroot *sysroot, int bootversion, int
   return _ostree_bootloader_grub2_generate_config (sysroot, bootversion, target_fd, cancellable, error);
 }
 
+static gboolean
+impl_ostree_repo_traverse_commits_union (OstreeRepo *repo, const char * const *commits, guint n_commits, int maxdepth, GHashTable *inout_reachable, guint n_threads, GCancellable *cancellable, GError **error)
+{
+  return _ostree_repo_traverse_commits_union_reachable (repo, commits, n_commits, maxdepth, inout_reachable, n_threads, cancellable, error);
+}
+
+static gboolean
+impl_ostree_repo_traverse_commits_foreach (OstreeRepo *repo, const char * const *commits, guint n_commits, int maxdepth, guint n_threads, void (*func) (const guchar *csum, OstreeObjectType objtype, gpointer user_data), gpointer user_data, GCancellable *cancellable, GError **error)
+{
+  gboolean ret;
+  OstreeObjectSet *reachable = _ostree_object_set_new ();
+
+  ret = _ostree_repo_traverse_commits_union_full (repo, commits, n_commits, maxdepth, reachable, n_threads,
+                                                  func, user_data, cancellable, error);
+  _ostree_object_set_unref (reachable);
+  return ret;
+}
+
+static gboolean
+impl_ostree_repo_stat_object (OstreeRepo *repo, OstreeObjectType objtype, const char *checksum, struct stat *out_stbuf, GCancellable *cancellable, GError **error)
+{
+  return _ostree_repo_stat_object (repo, objtype, checksum, out_stbuf, cancellable, error);
+}
+
+static void
+impl_ostree_repo_fsck_packs (OstreeRepo *repo, GPtrArray *out_messages)
+{
+  _ostree_repo_fsck_packs (repo, out_messages);
+}
+
 /**
  * ostree_cmdprivate: (skip)
  *
@@ -44,7 +75,11 @@ const OstreeCmdPrivateVTable *
 ostree_cmd__private__ (void)
 {
   static OstreeCmdPrivateVTable table = {
-    impl_ostree_generate_grub2_config
+    impl_ostree_generate_grub2_config,
+    impl_ostree_repo_traverse_commits_union,
+    impl_ostree_repo_traverse_commits_foreach,
+    impl_ostree_repo_stat_object,
+    impl_ostree_repo_fsck_packs
   };
 
   return &table;
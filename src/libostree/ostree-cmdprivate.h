@@ -20,12 +20,18 @@
 
 #pragma once
 
+#include <sys/stat.h>
+
 #include "ostree-types.h"
 
 G_BEGIN_DECLS
 
 typedef struct {
   gboolean (* ostree_generate_grub2_config) (OstreeSysroot *sysroot, int bootversion, int target_fd, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_repo_traverse_commits_union) (OstreeRepo *repo, const char * const *commits, guint n_commits, int maxdepth, GHashTable *inout_reachable, guint n_threads, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_repo_traverse_commits_foreach) (OstreeRepo *repo, const char * const *commits, guint n_commits, int maxdepth, guint n_threads, void (*func) (const guchar *csum, OstreeObjectType objtype, gpointer user_data), gpointer user_data, GCancellable *cancellable, GError **error);
+  gboolean (* ostree_repo_stat_object) (OstreeRepo *repo, OstreeObjectType objtype, const char *checksum, struct stat *out_stbuf, GCancellable *cancellable, GError **error);
+  void (* ostree_repo_fsck_packs) (OstreeRepo *repo, GPtrArray *out_messages);
 } OstreeCmdPrivateVTable;
 
 const OstreeCmdPrivateVTable *
@@ -21,6 +21,8 @@
 #pragma once
 
 #include "ostree-core.h"
+#include "ostree-checksum-input-stream.h"
+#include "ot-sha256.h"
 
 G_BEGIN_DECLS
 
@@ -59,18 +61,38 @@ G_BEGIN_DECLS
  * s - symlink target 
  * a(ayay) - xattrs
  * ---
- * zlib-compressed data
+ * compressed data: raw zlib in archive-z2 repositories, or a single
+ * zstd frame in archive-zstd ones
  */
 #define _OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT G_VARIANT_TYPE ("(tuuuusa(ayay))")
 
+/* Both archive modes share the object layout and file header, and
+ * differ only in how new content objects are compressed.
+ */
+#define _OSTREE_REPO_MODE_IS_ARCHIVE(mode) \
+  ((mode) == OSTREE_REPO_MODE_ARCHIVE_Z2 || (mode) == OSTREE_REPO_MODE_ARCHIVE_ZSTD)
+
+/* The first bytes of a zstd frame; see _ostree_open_compressed_content() */
+#define _OSTREE_ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+
 GVariant *_ostree_zlib_file_header_new (GFileInfo         *file_info,
                                         GVariant          *xattrs);
 
+gboolean _ostree_zlib_file_header_parse (GVariant         *metadata,
+                                         GFileInfo       **out_file_info,
+                                         GVariant        **out_xattrs,
+                                         GError          **error);
+
+gboolean _ostree_open_compressed_content (GInputStream   *input,
+                                          GInputStream  **out_input,
+                                          GCancellable   *cancellable,
+                                          GError        **error);
+
 gboolean _ostree_write_variant_with_size (GOutputStream      *output,
                                           GVariant           *variant,
                                           guint64             alignment_offset,
                                           gsize              *out_bytes_written,
-                                          GChecksum          *checksum,
+                                          OtSha256           *checksum,
                                           GCancellable       *cancellable,
                                           GError            **error);
 
@@ -112,6 +134,15 @@ _ostree_get_relative_static_delta_part_path (const char        *from,
                                              const char        *to,
                                              guint              i);
 
+char *
+_ostree_get_relative_static_delta_zstd_superblock_path (const char        *from,
+                                                        const char        *to);
+
+char *
+_ostree_get_relative_static_delta_zstd_part_path (const char        *from,
+                                                  const char        *to,
+                                                  guint              i);
+
 static inline char *
 _ostree_get_commitpartial_path (const char *checksum)
 {
@@ -146,4 +177,8 @@ _ostree_detached_metadata_append_gpg_sig (GVariant   *existing_metadata,
 GFile *
 _ostree_get_default_sysroot_path (void);
 
+OstreeChecksumInputStream *
+_ostree_checksum_input_stream_new_sha256 (GInputStream    *base,
+                                          OtSha256        *checksum);
+
 G_END_DECLS
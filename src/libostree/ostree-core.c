@@ -29,6 +29,9 @@
 #include "ostree.h"
 #include "ostree-core-private.h"
 #include "ostree-chain-input-stream.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-decompressor.h"
+#endif
 #include "otutil.h"
 #include "libglnx.h"
 
@@ -40,11 +43,6 @@ file_header_parse (GVariant         *metadata,
                    GFileInfo       **out_file_info,
                    GVariant        **out_xattrs,
                    GError          **error);
-static gboolean
-zlib_file_header_parse (GVariant         *metadata,
-                        GFileInfo       **out_file_info,
-                        GVariant        **out_xattrs,
-                        GError          **error);
 
 /**
  * SECTION:libostree-core
@@ -277,7 +275,7 @@ write_padding (GOutputStream    *output,
                guint             alignment,
                gsize             offset,
                gsize            *out_bytes_written,
-               GChecksum        *checksum,
+               OtSha256         *checksum,
                GCancellable     *cancellable,
                GError          **error)
 {
@@ -325,7 +323,7 @@ _ostree_write_variant_with_size (GOutputStream      *output,
                                  GVariant           *variant,
                                  guint64             alignment_offset,
                                  gsize              *out_bytes_written,
-                                 GChecksum          *checksum,
+                                 OtSha256           *checksum,
                                  GCancellable       *cancellable,
                                  GError            **error)
 {
@@ -383,7 +381,7 @@ _ostree_write_variant_with_size (GOutputStream      *output,
 static gboolean
 write_file_header_update_checksum (GOutputStream         *out,
                                    GVariant              *header,
-                                   GChecksum             *checksum,
+                                   OtSha256              *checksum,
                                    GCancellable          *cancellable,
                                    GError               **error)
 {
@@ -462,9 +460,57 @@ ostree_raw_file_to_content_stream (GInputStream       *input,
   return ret;
 }
 
+/* Archive content objects are compressed with either raw zlib
+ * (archive-z2) or zstd (archive-zstd).  A zstd frame starts with a
+ * magic number that can never begin a valid raw deflate stream, so
+ * the format is detected from the data itself; this lets objects be
+ * copied between the two modes without rewriting them.
+ */
+gboolean
+_ostree_open_compressed_content (GInputStream   *input,
+                                 GInputStream  **out_input,
+                                 GCancellable   *cancellable,
+                                 GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GInputStream) buffered = g_buffered_input_stream_new (input);
+  g_autoptr(GConverter) decomp = NULL;
+  const guint8 *peek;
+  gsize avail;
+
+  while ((avail = g_buffered_input_stream_get_available ((GBufferedInputStream*)buffered)) < 4)
+    {
+      gssize n = g_buffered_input_stream_fill ((GBufferedInputStream*)buffered, 4 - avail,
+                                               cancellable, error);
+      if (n < 0)
+        goto out;
+      if (n == 0)
+        break;
+    }
+
+  peek = g_buffered_input_stream_peek_buffer ((GBufferedInputStream*)buffered, &avail);
+  if (avail >= 4 && memcmp (peek, _OSTREE_ZSTD_MAGIC, 4) == 0)
+    {
+#ifdef HAVE_ZSTD
+      decomp = (GConverter*)_ostree_zstd_decompressor_new ();
+#else
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "Content object is zstd-compressed, but this build does not support zstd");
+      goto out;
+#endif
+    }
+  else
+    decomp = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+
+  ret = TRUE;
+  *out_input = g_converter_input_stream_new (buffered, decomp);
+ out:
+  return ret;
+}
+
 /**
  * ostree_content_stream_parse:
- * @compressed: Whether or not the stream is zlib-compressed
+ * @compressed: Whether or not the stream is in the compressed archive format
  * @input: Object content stream
  * @input_length: Length of stream
  * @trusted: If %TRUE, assume the content has been validated
@@ -534,10 +580,10 @@ ostree_content_stream_parse (gboolean                compressed,
 
   if (compressed)
     {
-      if (!zlib_file_header_parse (file_header,
-                                   out_file_info ? &ret_file_info : NULL,
-                                   out_xattrs ? &ret_xattrs : NULL,
-                                   error))
+      if (!_ostree_zlib_file_header_parse (file_header,
+                                           out_file_info ? &ret_file_info : NULL,
+                                           out_xattrs ? &ret_xattrs : NULL,
+                                           error))
         goto out;
     }
   else
@@ -560,8 +606,8 @@ ostree_content_stream_parse (gboolean                compressed,
        **/
       if (compressed)
         {
-          g_autoptr(GConverter) zlib_decomp = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
-          ret_input = g_converter_input_stream_new (input, zlib_decomp);
+          if (!_ostree_open_compressed_content (input, &ret_input, cancellable, error))
+            goto out;
         }
       else
         ret_input = g_object_ref (input);
@@ -683,9 +729,9 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
 {
   gboolean ret = FALSE;
   g_autofree guchar *ret_csum = NULL;
-  GChecksum *checksum = NULL;
+  OtSha256 *checksum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = ot_sha256_new ();
 
   if (OSTREE_OBJECT_TYPE_IS_META (objtype))
     {
@@ -695,8 +741,8 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
   else if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
     {
       g_autoptr(GVariant) dirmeta = ostree_create_directory_metadata (file_info, xattrs);
-      g_checksum_update (checksum, g_variant_get_data (dirmeta),
-                         g_variant_get_size (dirmeta));
+      ot_sha256_update (checksum, g_variant_get_data (dirmeta),
+                        g_variant_get_size (dirmeta));
       
     }
   else
@@ -716,12 +762,13 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
         }
     }
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = g_malloc (32);
+  ot_sha256_get_digest (checksum, ret_csum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify)g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify)ot_sha256_free);
   return ret;
 }
 
@@ -1393,7 +1440,7 @@ _ostree_loose_path_with_suffix (char              *buf,
   buf++;
   snprintf (buf, _OSTREE_LOOSE_PATH_MAX - 2, "/%s.%s%s%s",
             checksum + 2, ostree_object_type_to_string (objtype),
-            (!OSTREE_OBJECT_TYPE_IS_META (objtype) && mode == OSTREE_REPO_MODE_ARCHIVE_Z2) ? "z" : "",
+            (!OSTREE_OBJECT_TYPE_IS_META (objtype) && _OSTREE_REPO_MODE_IS_ARCHIVE (mode)) ? "z" : "",
             suffix);
 }
 
@@ -1496,6 +1543,26 @@ _ostree_get_relative_static_delta_part_path (const char        *from,
   return _ostree_get_relative_static_delta_path (from, to, partstr);
 }
 
+/* A delta generated with zstd compression has a second superblock
+ * whose parts are zstd-compressed, next to the usual lzma one.  Only
+ * clients which know about it look for it.
+ */
+char *
+_ostree_get_relative_static_delta_zstd_superblock_path (const char        *from,
+                                                        const char        *to)
+{
+  return _ostree_get_relative_static_delta_path (from, to, "superblock.zstd");
+}
+
+char *
+_ostree_get_relative_static_delta_zstd_part_path (const char        *from,
+                                                  const char        *to,
+                                                  guint              i)
+{
+  g_autofree char *partstr = g_strdup_printf ("%u.zstd", i);
+  return _ostree_get_relative_static_delta_path (from, to, partstr);
+}
+
 void
 _ostree_parse_delta_name (const char  *delta_name,
                           char        **out_from,
@@ -1576,7 +1643,7 @@ file_header_parse (GVariant         *metadata,
 }
 
 /*
- * zlib_file_header_parse:
+ * _ostree_zlib_file_header_parse:
  * @metadata: A metadata variant of type %OSTREE_FILE_HEADER_GVARIANT_FORMAT
  * @out_file_info: (out): Parsed file information
  * @out_xattrs: (out): Parsed extended attribute set
@@ -1585,11 +1652,11 @@ file_header_parse (GVariant         *metadata,
  * Like ostree_file_header_parse(), but operates on zlib-compressed
  * content.
  */
-static gboolean
-zlib_file_header_parse (GVariant         *metadata,
-                        GFileInfo       **out_file_info,
-                        GVariant        **out_xattrs,
-                        GError          **error)
+gboolean
+_ostree_zlib_file_header_parse (GVariant         *metadata,
+                                GFileInfo       **out_file_info,
+                                GVariant        **out_xattrs,
+                                GError          **error)
 {
   gboolean ret = FALSE;
   guint64 size;
@@ -150,6 +150,7 @@ typedef enum {
  * @OSTREE_REPO_MODE_BARE: Files are stored as themselves; can only be written as root
  * @OSTREE_REPO_MODE_ARCHIVE_Z2: Files are compressed, should be owned by non-root.  Can be served via HTTP
  * @OSTREE_REPO_MODE_BARE_USER: Files are stored as themselves, except ownership; can be written by user
+ * @OSTREE_REPO_MODE_ARCHIVE_ZSTD: Like %OSTREE_REPO_MODE_ARCHIVE_Z2, but files are compressed with zstd
  *
  * See the documentation of #OstreeRepo for more information about the
  * possible modes.
@@ -157,7 +158,8 @@ typedef enum {
 typedef enum {
   OSTREE_REPO_MODE_BARE,
   OSTREE_REPO_MODE_ARCHIVE_Z2,
-  OSTREE_REPO_MODE_BARE_USER
+  OSTREE_REPO_MODE_BARE_USER,
+  OSTREE_REPO_MODE_ARCHIVE_ZSTD
 } OstreeRepoMode;
 
 const GVariantType *ostree_metadata_variant_type (OstreeObjectType objtype);
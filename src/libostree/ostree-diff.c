@@ -23,11 +23,64 @@
 #include "config.h"
 
 #include "ostree.h"
+#include "ostree-core-private.h"
 #include "otutil.h"
 
+typedef struct DiffDirTask DiffDirTask;
+
+/* State shared by all directories of one diff; @pool is only set for
+ * %OSTREE_DIFF_FLAGS_PARALLEL.
+ */
+typedef struct {
+  OstreeDiffFlags  flags;
+  GThreadPool     *pool;
+  GCancellable    *cancellable;
+
+  GMutex           lock;
+  GCond            cond;
+  guint            n_outstanding;
+  GError          *error;
+} DiffData;
+
+/* One pair of directories in a parallel diff.  Each task collects its
+ * own results, along with the tasks for the subdirectories it queued,
+ * so that they can be merged in a stable order once all workers are
+ * done.
+ */
+struct DiffDirTask {
+  DiffData  *data;
+  GFile     *a;
+  GFile     *b;
+  GPtrArray *modified;
+  GPtrArray *removed;
+  GPtrArray *added;
+  GPtrArray *subtasks;
+};
+
+typedef enum {
+  DIFF_STAT_UNKNOWN,
+  DIFF_STAT_SAME,
+  DIFF_STAT_DIFFERENT
+} DiffStatResult;
+
+static gboolean
+diff_dirs_recurse (DiffData       *data,
+                   DiffDirTask    *task,
+                   GFile          *a,
+                   GFile          *b,
+                   GPtrArray      *modified,
+                   GPtrArray      *removed,
+                   GPtrArray      *added,
+                   GCancellable   *cancellable,
+                   GError        **error);
+
+/* @parent_dfd is the physical directory containing @f, or -1 to read
+ * it through #GFile.
+ */
 static gboolean
 get_file_checksum (OstreeDiffFlags  flags,
                    GFile *f,
+                   int    parent_dfd,
                    GFileInfo *f_info,
                    char  **out_checksum,
                    GCancellable *cancellable,
@@ -45,18 +98,34 @@ get_file_checksum (OstreeDiffFlags  flags,
     {
       g_autoptr(GVariant) xattrs = NULL;
       g_autoptr(GInputStream) in = NULL;
+      const char *name = g_file_info_get_name (f_info);
 
       if (!(flags & OSTREE_DIFF_FLAGS_IGNORE_XATTRS))
         {
-          if (!gs_file_get_all_xattrs (f, &xattrs, cancellable, error))
+          if (parent_dfd != -1)
+            {
+              if (!gs_dfd_and_name_get_all_xattrs (parent_dfd, name, &xattrs,
+                                                   cancellable, error))
+                goto out;
+            }
+          else if (!gs_file_get_all_xattrs (f, &xattrs, cancellable, error))
             goto out;
         }
 
       if (g_file_info_get_file_type (f_info) == G_FILE_TYPE_REGULAR)
         {
-          in = (GInputStream*)g_file_read (f, cancellable, error);
-          if (!in)
-            goto out;
+          if (parent_dfd != -1)
+            {
+              if (!ot_openat_read_stream (parent_dfd, name, FALSE, &in,
+                                          cancellable, error))
+                goto out;
+            }
+          else
+            {
+              in = (GInputStream*)g_file_read (f, cancellable, error);
+              if (!in)
+                goto out;
+            }
         }
 
       if (!ostree_checksum_file_from_input (f_info, xattrs, in,
@@ -103,8 +172,8 @@ diff_item_new (GFile          *a,
                GFileInfo      *a_info,
                GFile          *b,
                GFileInfo      *b_info,
-               char           *checksum_a,
-               char           *checksum_b)
+               const char     *checksum_a,
+               const char     *checksum_b)
 {
   OstreeDiffItem *ret = g_new0 (OstreeDiffItem, 1);
   ret->refcount = 1;
@@ -117,11 +186,55 @@ diff_item_new (GFile          *a,
   return ret;
 }
 
+/* Compare the attributes which go into the checksum of a file, so
+ * that most modified files are found without reading them.  Two
+ * physical names for the same inode are identical as well.
+ */
+static DiffStatResult
+diff_compare_infos (GFileInfo *a_info,
+                    GFileInfo *b_info,
+                    gboolean   both_physical)
+{
+  if (both_physical
+      && g_file_info_get_attribute_uint32 (a_info, "unix::device") ==
+         g_file_info_get_attribute_uint32 (b_info, "unix::device")
+      && g_file_info_get_attribute_uint64 (a_info, "unix::inode") ==
+         g_file_info_get_attribute_uint64 (b_info, "unix::inode"))
+    return DIFF_STAT_SAME;
+
+  if (g_file_info_get_attribute_uint32 (a_info, "unix::mode") !=
+      g_file_info_get_attribute_uint32 (b_info, "unix::mode")
+      || g_file_info_get_attribute_uint32 (a_info, "unix::uid") !=
+         g_file_info_get_attribute_uint32 (b_info, "unix::uid")
+      || g_file_info_get_attribute_uint32 (a_info, "unix::gid") !=
+         g_file_info_get_attribute_uint32 (b_info, "unix::gid"))
+    return DIFF_STAT_DIFFERENT;
+
+  switch (g_file_info_get_file_type (a_info))
+    {
+    case G_FILE_TYPE_REGULAR:
+      if (g_file_info_get_size (a_info) != g_file_info_get_size (b_info))
+        return DIFF_STAT_DIFFERENT;
+      break;
+    case G_FILE_TYPE_SYMBOLIC_LINK:
+      if (strcmp (g_file_info_get_symlink_target (a_info),
+                  g_file_info_get_symlink_target (b_info)) != 0)
+        return DIFF_STAT_DIFFERENT;
+      break;
+    default:
+      break;
+    }
+
+  return DIFF_STAT_UNKNOWN;
+}
+
 static gboolean
 diff_files (OstreeDiffFlags  flags,
             GFile           *a,
+            int              a_dfd,
             GFileInfo       *a_info,
             GFile           *b,
+            int              b_dfd,
             GFileInfo       *b_info,
             OstreeDiffItem **out_item,
             GCancellable    *cancellable,
@@ -132,15 +245,25 @@ diff_files (OstreeDiffFlags  flags,
   g_autofree char *checksum_b = NULL;
   OstreeDiffItem *ret_item = NULL;
 
-  if (!get_file_checksum (flags, a, a_info, &checksum_a, cancellable, error))
-    goto out;
-  if (!get_file_checksum (flags, b, b_info, &checksum_b, cancellable, error))
-    goto out;
-
-  if (strcmp (checksum_a, checksum_b) != 0)
+  switch (diff_compare_infos (a_info, b_info, a_dfd != -1 && b_dfd != -1))
     {
-      ret_item = diff_item_new (a, a_info, b, b_info,
-                                checksum_a, checksum_b);
+    case DIFF_STAT_SAME:
+      break;
+    case DIFF_STAT_DIFFERENT:
+      ret_item = diff_item_new (a, a_info, b, b_info, NULL, NULL);
+      break;
+    case DIFF_STAT_UNKNOWN:
+      if (!get_file_checksum (flags, a, a_dfd, a_info, &checksum_a, cancellable, error))
+        goto out;
+      if (!get_file_checksum (flags, b, b_dfd, b_info, &checksum_b, cancellable, error))
+        goto out;
+
+      if (strcmp (checksum_a, checksum_b) != 0)
+        {
+          ret_item = diff_item_new (a, a_info, b, b_info,
+                                    checksum_a, checksum_b);
+        }
+      break;
     }
 
   ret = TRUE;
@@ -200,207 +323,787 @@ diff_add_dir_recurse (GFile          *d,
   return ret;
 }
 
-/**
- * ostree_diff_dirs:
- * @flags: Flags
- * @a: First directory path, or %NULL
- * @b: First directory path
- * @modified: (element-type OstreeDiffItem): Modified files
- * @removed: (element-type Gio.File): Removed files
- * @added: (element-type Gio.File): Added files
- *
- * Compute the difference between directory @a and @b as 3 separate
- * sets of #OstreeDiffItem in @modified, @removed, and @added.
+/* Physical directories are compared relative to an open fd; anything
+ * else, in practice an #OstreeRepoFile, goes through #GFile and gets
+ * -1 in @out_dfd.
  */
-gboolean
-ostree_diff_dirs (OstreeDiffFlags flags,
-                  GFile          *a,
-                  GFile          *b,
-                  GPtrArray      *modified,
-                  GPtrArray      *removed,
-                  GPtrArray      *added,
+static gboolean
+diff_dir_open (GFile          *dir,
+               int            *out_dfd,
+               GError        **error)
+{
+  g_autofree char *path = NULL;
+
+  *out_dfd = -1;
+  if (OSTREE_IS_REPO_FILE (dir) || !g_file_is_native (dir))
+    return TRUE;
+
+  path = g_file_get_path (dir);
+  return glnx_opendirat (AT_FDCWD, path, TRUE, out_dfd, error);
+}
+
+/* Look up @name in @dir, which is open as @dfd if it is physical.
+ * @out_info is set to %NULL if there is no such entry.
+ */
+static gboolean
+diff_query_child (GFile          *dir,
+                  int             dfd,
+                  const char     *name,
+                  GFileInfo     **out_info,
                   GCancellable   *cancellable,
                   GError        **error)
 {
   gboolean ret = FALSE;
   GError *temp_error = NULL;
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) ret_info = NULL;
+
+  if (dfd != -1)
+    {
+      struct stat stbuf;
+
+      if (fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          if (errno != ENOENT)
+            {
+              glnx_set_error_from_errno (error);
+              goto out;
+            }
+        }
+      else
+        {
+          ret_info = _ostree_header_gfile_info_new (stbuf.st_mode, stbuf.st_uid, stbuf.st_gid);
+          g_file_info_set_name (ret_info, name);
+          g_file_info_set_attribute_uint32 (ret_info, "unix::device", stbuf.st_dev);
+          g_file_info_set_attribute_uint64 (ret_info, "unix::inode", stbuf.st_ino);
+
+          if (S_ISREG (stbuf.st_mode))
+            g_file_info_set_size (ret_info, stbuf.st_size);
+          else if (S_ISLNK (stbuf.st_mode))
+            {
+              if (!ot_readlinkat_gfile_info (dfd, name, ret_info, cancellable, error))
+                goto out;
+            }
+        }
+    }
+  else
+    {
+      g_autoptr(GFile) child = g_file_get_child (dir, name);
+
+      ret_info = g_file_query_info (child, OSTREE_GIO_FAST_QUERYINFO,
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    cancellable, &temp_error);
+      if (!ret_info)
+        {
+          if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
+          g_clear_error (&temp_error);
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_info, &ret_info);
+ out:
+  return ret;
+}
+
+typedef struct {
+  GFile             *dir;
+  int                dfd;
+  GLnxDirFdIterator  dfd_iter;
+  GFileEnumerator   *dir_enum;
+} DiffDirIter;
+
+static gboolean
+diff_dir_iter_init (DiffDirIter    *iter,
+                    GFile          *dir,
+                    int             dfd,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  iter->dir = dir;
+  iter->dfd = dfd;
+
+  if (dfd != -1)
+    return glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &iter->dfd_iter, error);
+
+  iter->dir_enum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
+                                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                              cancellable, error);
+  return iter->dir_enum != NULL;
+}
+
+/* Sets @out_info to %NULL at the end of the directory */
+static gboolean
+diff_dir_iter_next (DiffDirIter    *iter,
+                    GFileInfo     **out_info,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  g_autoptr(GFileInfo) ret_info = NULL;
+
+  if (iter->dfd == -1)
+    {
+      ret_info = g_file_enumerator_next_file (iter->dir_enum, cancellable, &temp_error);
+      if (temp_error != NULL)
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+    }
+  else
+    {
+      /* Entries which went away since the directory was read are skipped */
+      while (ret_info == NULL)
+        {
+          struct dirent *dent;
+
+          if (!glnx_dirfd_iterator_next_dent (&iter->dfd_iter, &dent, cancellable, error))
+            goto out;
+
+          if (dent == NULL)
+            break;
+
+          if (!diff_query_child (iter->dir, iter->dfd, dent->d_name, &ret_info,
+                                 cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_info, &ret_info);
+ out:
+  return ret;
+}
+
+static void
+diff_dir_iter_clear (DiffDirIter *iter)
+{
+  glnx_dirfd_iterator_clear (&iter->dfd_iter);
+  g_clear_object (&iter->dir_enum);
+}
+
+static void
+diff_dir_task_free (DiffDirTask *task)
+{
+  g_object_unref (task->a);
+  g_object_unref (task->b);
+  g_ptr_array_unref (task->modified);
+  g_ptr_array_unref (task->removed);
+  g_ptr_array_unref (task->added);
+  g_ptr_array_unref (task->subtasks);
+  g_free (task);
+}
+
+static DiffDirTask *
+diff_dir_task_new (DiffData       *data,
+                   GFile          *a,
+                   GFile          *b)
+{
+  DiffDirTask *task = g_new0 (DiffDirTask, 1);
+
+  task->data = data;
+  task->a = g_object_ref (a);
+  task->b = g_object_ref (b);
+  task->modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
+  task->removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  task->added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  task->subtasks = g_ptr_array_new_with_free_func ((GDestroyNotify) diff_dir_task_free);
+  return task;
+}
+
+static void
+diff_dir_task_push (DiffData       *data,
+                    DiffDirTask    *task)
+{
+  g_mutex_lock (&data->lock);
+  data->n_outstanding++;
+  g_mutex_unlock (&data->lock);
+
+  g_thread_pool_push (data->pool, task, NULL);
+}
+
+/* Append the results of @task, then those of its subdirectories in the
+ * order they were found.
+ */
+static void
+diff_dir_task_collect (DiffDirTask    *task,
+                       GPtrArray      *modified,
+                       GPtrArray      *removed,
+                       GPtrArray      *added)
+{
+  guint i;
+
+  for (i = 0; i < task->modified->len; i++)
+    g_ptr_array_add (modified, ostree_diff_item_ref (task->modified->pdata[i]));
+  for (i = 0; i < task->removed->len; i++)
+    g_ptr_array_add (removed, g_object_ref (task->removed->pdata[i]));
+  for (i = 0; i < task->added->len; i++)
+    g_ptr_array_add (added, g_object_ref (task->added->pdata[i]));
+  for (i = 0; i < task->subtasks->len; i++)
+    diff_dir_task_collect (task->subtasks->pdata[i], modified, removed, added);
+}
+
+/* Compare the subdirectories @a and @b; in a parallel diff, they are
+ * queued as a new task of their own instead.
+ */
+static gboolean
+diff_subdirs (DiffData       *data,
+              DiffDirTask    *task,
+              GFile          *a,
+              GFile          *b,
+              GPtrArray      *modified,
+              GPtrArray      *removed,
+              GPtrArray      *added,
+              GCancellable   *cancellable,
+              GError        **error)
+{
+  if (data->pool)
+    {
+      DiffDirTask *subtask = diff_dir_task_new (data, a, b);
+
+      g_ptr_array_add (task->subtasks, subtask);
+      diff_dir_task_push (data, subtask);
+      return TRUE;
+    }
+
+  return diff_dirs_recurse (data, NULL, a, b, modified, removed, added,
+                            cancellable, error);
+}
+
+/* Find @name in the sorted dirtree entries @entries */
+static gboolean
+diff_entries_lookup (GVariant    *entries,
+                     const char  *name,
+                     gsize       *out_index)
+{
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (entries);
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      g_autoptr(GVariant) entry = g_variant_get_child_value (entries, mid);
+      const char *cur;
+      int c;
+
+      g_variant_get_child (entry, 0, "&s", &cur);
+      c = strcmp (name, cur);
+      if (c == 0)
+        {
+          if (out_index)
+            *out_index = mid;
+          return TRUE;
+        }
+      else if (c < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return FALSE;
+}
+
+/* Create the item for @name, which differs between the repository
+ * directories @a and @b.
+ */
+static gboolean
+diff_repo_item_new (OstreeRepoFile  *a,
+                    OstreeRepoFile  *b,
+                    const char      *name,
+                    const char      *checksum_a,
+                    const char      *checksum_b,
+                    OstreeDiffItem **out_item,
+                    GCancellable    *cancellable,
+                    GError         **error)
+{
+  gboolean ret = FALSE;
   g_autoptr(GFile) child_a = NULL;
   g_autoptr(GFile) child_b = NULL;
   g_autoptr(GFileInfo) child_a_info = NULL;
   g_autoptr(GFileInfo) child_b_info = NULL;
 
-  if (a == NULL)
-    {
-      if (!diff_add_dir_recurse (b, added, cancellable, error))
-        goto out;
-
-      ret = TRUE;
-      goto out;
-    }
+  child_a = g_file_get_child ((GFile*)a, name);
+  child_b = g_file_get_child ((GFile*)b, name);
 
-  child_a_info = g_file_query_info (a, OSTREE_GIO_FAST_QUERYINFO,
+  child_a_info = g_file_query_info (child_a, OSTREE_GIO_FAST_QUERYINFO,
                                     G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                     cancellable, error);
   if (!child_a_info)
     goto out;
 
-  child_b_info = g_file_query_info (b, OSTREE_GIO_FAST_QUERYINFO,
+  child_b_info = g_file_query_info (child_b, OSTREE_GIO_FAST_QUERYINFO,
                                     G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                     cancellable, error);
   if (!child_b_info)
     goto out;
 
-  /* Fast path test for unmodified directories */
-  if (g_file_info_get_file_type (child_a_info) == G_FILE_TYPE_DIRECTORY
-      && g_file_info_get_file_type (child_b_info) == G_FILE_TYPE_DIRECTORY
-      && OSTREE_IS_REPO_FILE (a)
-      && OSTREE_IS_REPO_FILE (b))
+  ret = TRUE;
+  *out_item = diff_item_new (child_a, child_a_info, child_b, child_b_info,
+                             checksum_a, checksum_b);
+ out:
+  return ret;
+}
+
+static gboolean
+checksum_bytes_equal (GVariant *a_csum_v,
+                      GVariant *b_csum_v)
+{
+  return memcmp (ostree_checksum_bytes_peek (a_csum_v),
+                 ostree_checksum_bytes_peek (b_csum_v), 32) == 0;
+}
+
+/* Compare two directories of repository trees by walking their dirtree
+ * objects.  Files whose content checksums match are skipped without
+ * creating #GFile objects for them, and subdirectories whose contents
+ * and metadata checksums both match are not descended into at all.
+ */
+static gboolean
+diff_repo_dirs (DiffData       *data,
+                DiffDirTask    *task,
+                OstreeRepoFile *a,
+                OstreeRepoFile *b,
+                GPtrArray      *modified,
+                GPtrArray      *removed,
+                GPtrArray      *added,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GVariant) a_files = NULL;
+  g_autoptr(GVariant) a_dirs = NULL;
+  g_autoptr(GVariant) b_files = NULL;
+  g_autoptr(GVariant) b_dirs = NULL;
+  gsize i, n;
+  guint j;
+
+  if (!ostree_repo_file_ensure_resolved (a, error))
+    goto out;
+  if (!ostree_repo_file_ensure_resolved (b, error))
+    goto out;
+
+  if (ostree_repo_file_tree_get_contents (a) == NULL
+      || ostree_repo_file_tree_get_contents (b) == NULL)
     {
-      OstreeRepoFile *a_repof = (OstreeRepoFile*) a;
-      OstreeRepoFile *b_repof = (OstreeRepoFile*) b;
-      
-      if (strcmp (ostree_repo_file_tree_get_contents_checksum (a_repof),
-                  ostree_repo_file_tree_get_contents_checksum (b_repof)) == 0)
-        {
-          ret = TRUE;
-          goto out;
-        }
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                   "Not a directory");
+      goto out;
     }
 
-  g_clear_object (&child_a_info);
-  g_clear_object (&child_b_info);
+  /* The metadata of @a and @b themselves is compared by the caller */
+  if (strcmp (ostree_repo_file_tree_get_contents_checksum (a),
+              ostree_repo_file_tree_get_contents_checksum (b)) == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
 
-  dir_enum = g_file_enumerate_children (a, OSTREE_GIO_FAST_QUERYINFO, 
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable, error);
-  if (!dir_enum)
-    goto out;
+  a_files = g_variant_get_child_value (ostree_repo_file_tree_get_contents (a), 0);
+  a_dirs = g_variant_get_child_value (ostree_repo_file_tree_get_contents (a), 1);
+  b_files = g_variant_get_child_value (ostree_repo_file_tree_get_contents (b), 0);
+  b_dirs = g_variant_get_child_value (ostree_repo_file_tree_get_contents (b), 1);
 
-  while ((child_a_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+  n = g_variant_n_children (a_files);
+  for (i = 0; i < n; i++)
     {
       const char *name;
-      GFileType child_a_type;
-      GFileType child_b_type;
+      g_autoptr(GVariant) a_csum_v = NULL;
+      g_autoptr(GVariant) b_csum_v = NULL;
+      gsize b_index;
+      OstreeDiffItem *diff_item = NULL;
 
-      name = g_file_info_get_name (child_a_info);
+      g_variant_get_child (a_files, i, "(&s@ay)", &name, &a_csum_v);
 
-      g_clear_object (&child_a);
-      child_a = g_file_get_child (a, name);
-      child_a_type = g_file_info_get_file_type (child_a_info);
+      if (diff_entries_lookup (b_files, name, &b_index))
+        {
+          char checksum_a[65];
+          char checksum_b[65];
 
-      g_clear_object (&child_b);
-      child_b = g_file_get_child (b, name);
+          g_variant_get_child (b_files, b_index, "(&s@ay)", NULL, &b_csum_v);
+          if (checksum_bytes_equal (a_csum_v, b_csum_v))
+            continue;
 
-      g_clear_object (&child_b_info);
-      child_b_info = g_file_query_info (child_b, OSTREE_GIO_FAST_QUERYINFO,
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable,
-                                        &temp_error);
-      if (!child_b_info)
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (a_csum_v), checksum_a);
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (b_csum_v), checksum_b);
+          if (!diff_repo_item_new (a, b, name, checksum_a, checksum_b, &diff_item,
+                                   cancellable, error))
+            goto out;
+        }
+      else if (diff_entries_lookup (b_dirs, name, NULL))
         {
-          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-            {
-              g_clear_error (&temp_error);
-              g_ptr_array_add (removed, g_object_ref (child_a));
-            }
-          else
-            {
-              g_propagate_error (error, temp_error);
-              goto out;
-            }
+          if (!diff_repo_item_new (a, b, name, NULL, NULL, &diff_item,
+                                   cancellable, error))
+            goto out;
         }
       else
         {
-          child_b_type = g_file_info_get_file_type (child_b_info);
-          if (child_a_type != child_b_type)
+          g_ptr_array_add (removed, g_file_get_child ((GFile*)a, name));
+          continue;
+        }
+
+      g_ptr_array_add (modified, diff_item);
+    }
+
+  n = g_variant_n_children (a_dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) a_contents_v = NULL;
+      g_autoptr(GVariant) a_meta_v = NULL;
+      g_autoptr(GVariant) b_contents_v = NULL;
+      g_autoptr(GVariant) b_meta_v = NULL;
+      gsize b_index;
+
+      g_variant_get_child (a_dirs, i, "(&s@ay@ay)", &name, &a_contents_v, &a_meta_v);
+
+      if (diff_entries_lookup (b_dirs, name, &b_index))
+        {
+          g_variant_get_child (b_dirs, b_index, "(&s@ay@ay)", NULL, &b_contents_v, &b_meta_v);
+
+          if (!checksum_bytes_equal (a_meta_v, b_meta_v))
             {
-              OstreeDiffItem *diff_item = diff_item_new (child_a, child_a_info,
-                                                   child_b, child_b_info, NULL, NULL);
-              
+              OstreeDiffItem *diff_item = NULL;
+              char checksum_a[65];
+              char checksum_b[65];
+
+              ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (a_meta_v), checksum_a);
+              ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (b_meta_v), checksum_b);
+              if (!diff_repo_item_new (a, b, name, checksum_a, checksum_b, &diff_item,
+                                       cancellable, error))
+                goto out;
               g_ptr_array_add (modified, diff_item);
             }
-          else
+
+          if (!checksum_bytes_equal (a_contents_v, b_contents_v))
             {
-              OstreeDiffItem *diff_item = NULL;
+              g_autoptr(GFile) child_a = g_file_get_child ((GFile*)a, name);
+              g_autoptr(GFile) child_b = g_file_get_child ((GFile*)b, name);
 
-              if (!diff_files (flags, child_a, child_a_info, child_b, child_b_info, &diff_item,
-                               cancellable, error))
+              if (!diff_subdirs (data, task, child_a, child_b, modified, removed, added,
+                                 cancellable, error))
                 goto out;
-              
-              if (diff_item)
-                g_ptr_array_add (modified, diff_item); /* Transfer ownership */
-
-              if (child_a_type == G_FILE_TYPE_DIRECTORY)
-                {
-                  if (!ostree_diff_dirs (flags, child_a, child_b, modified,
-                                         removed, added, cancellable, error))
-                    goto out;
-                }
             }
         }
-      
-      g_clear_object (&child_a_info);
+      else if (diff_entries_lookup (b_files, name, NULL))
+        {
+          OstreeDiffItem *diff_item = NULL;
+
+          if (!diff_repo_item_new (a, b, name, NULL, NULL, &diff_item,
+                                   cancellable, error))
+            goto out;
+          g_ptr_array_add (modified, diff_item);
+        }
+      else
+        g_ptr_array_add (removed, g_file_get_child ((GFile*)a, name));
     }
-  if (temp_error != NULL)
+
+  for (j = 0; j < 2; j++)
     {
-      g_propagate_error (error, temp_error);
-      goto out;
+      GVariant *b_entries = j == 0 ? b_files : b_dirs;
+
+      n = g_variant_n_children (b_entries);
+      for (i = 0; i < n; i++)
+        {
+          g_autoptr(GVariant) entry = g_variant_get_child_value (b_entries, i);
+          g_autoptr(GFile) child_b = NULL;
+          const char *name;
+
+          g_variant_get_child (entry, 0, "&s", &name);
+          if (diff_entries_lookup (a_files, name, NULL)
+              || diff_entries_lookup (a_dirs, name, NULL))
+            continue;
+
+          child_b = g_file_get_child ((GFile*)b, name);
+          g_ptr_array_add (added, g_object_ref (child_b));
+
+          if (b_entries == b_dirs)
+            {
+              if (!diff_add_dir_recurse (child_b, added, cancellable, error))
+                goto out;
+            }
+        }
     }
 
-  g_clear_object (&dir_enum);
-  dir_enum = g_file_enumerate_children (b, OSTREE_GIO_FAST_QUERYINFO, 
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable, error);
-  if (!dir_enum)
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Compare directories of which at least one is not part of a
+ * repository.  Physical directories are read with readdir() and
+ * fstatat(), and diff_files() avoids reading any file whose size,
+ * mode or ownership already differ.
+ */
+static gboolean
+diff_dirs_at (DiffData       *data,
+              DiffDirTask    *task,
+              GFile          *a,
+              GFile          *b,
+              GPtrArray      *modified,
+              GPtrArray      *removed,
+              GPtrArray      *added,
+              GCancellable   *cancellable,
+              GError        **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int a_dfd = -1;
+  glnx_fd_close int b_dfd = -1;
+  DiffDirIter iter = { 0, };
+
+  if (!diff_dir_open (a, &a_dfd, error))
+    goto out;
+  if (!diff_dir_open (b, &b_dfd, error))
     goto out;
 
-  g_clear_object (&child_b_info);
-  while ((child_b_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+  if (!diff_dir_iter_init (&iter, a, a_dfd, cancellable, error))
+    goto out;
+
+  while (TRUE)
     {
+      g_autoptr(GFileInfo) child_a_info = NULL;
+      g_autoptr(GFileInfo) child_b_info = NULL;
+      g_autoptr(GFile) child_a = NULL;
+      g_autoptr(GFile) child_b = NULL;
       const char *name;
+      GFileType child_a_type;
 
-      name = g_file_info_get_name (child_b_info);
+      if (!diff_dir_iter_next (&iter, &child_a_info, cancellable, error))
+        goto out;
+      if (child_a_info == NULL)
+        break;
 
-      g_clear_object (&child_a);
+      name = g_file_info_get_name (child_a_info);
       child_a = g_file_get_child (a, name);
+      child_a_type = g_file_info_get_file_type (child_a_info);
+
+      if (!diff_query_child (b, b_dfd, name, &child_b_info, cancellable, error))
+        goto out;
+
+      if (child_b_info == NULL)
+        {
+          g_ptr_array_add (removed, g_object_ref (child_a));
+          continue;
+        }
 
-      g_clear_object (&child_b);
       child_b = g_file_get_child (b, name);
 
-      g_clear_object (&child_a_info);
-      child_a_info = g_file_query_info (child_a, OSTREE_GIO_FAST_QUERYINFO,
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable,
-                                        &temp_error);
-      if (!child_a_info)
+      if (child_a_type != g_file_info_get_file_type (child_b_info))
         {
-          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-            {
-              g_clear_error (&temp_error);
-              g_ptr_array_add (added, g_object_ref (child_b));
-              if (g_file_info_get_file_type (child_b_info) == G_FILE_TYPE_DIRECTORY)
-                {
-                  if (!diff_add_dir_recurse (child_b, added, cancellable, error))
-                    goto out;
-                }
-            }
-          else
+          OstreeDiffItem *diff_item = diff_item_new (child_a, child_a_info,
+                                                     child_b, child_b_info, NULL, NULL);
+
+          g_ptr_array_add (modified, diff_item);
+        }
+      else
+        {
+          OstreeDiffItem *diff_item = NULL;
+
+          if (!diff_files (data->flags, child_a, a_dfd, child_a_info,
+                           child_b, b_dfd, child_b_info, &diff_item,
+                           cancellable, error))
+            goto out;
+
+          if (diff_item)
+            g_ptr_array_add (modified, diff_item); /* Transfer ownership */
+
+          if (child_a_type == G_FILE_TYPE_DIRECTORY)
             {
-              g_propagate_error (error, temp_error);
-              goto out;
+              if (!diff_subdirs (data, task, child_a, child_b, modified, removed, added,
+                                 cancellable, error))
+                goto out;
             }
         }
-      g_clear_object (&child_b_info);
     }
-  if (temp_error != NULL)
+
+  diff_dir_iter_clear (&iter);
+  if (!diff_dir_iter_init (&iter, b, b_dfd, cancellable, error))
+    goto out;
+
+  while (TRUE)
     {
-      g_propagate_error (error, temp_error);
+      g_autoptr(GFileInfo) child_a_info = NULL;
+      g_autoptr(GFileInfo) child_b_info = NULL;
+      g_autoptr(GFile) child_b = NULL;
+      const char *name;
+
+      if (!diff_dir_iter_next (&iter, &child_b_info, cancellable, error))
+        goto out;
+      if (child_b_info == NULL)
+        break;
+
+      name = g_file_info_get_name (child_b_info);
+
+      if (!diff_query_child (a, a_dfd, name, &child_a_info, cancellable, error))
+        goto out;
+
+      if (child_a_info != NULL)
+        continue;
+
+      child_b = g_file_get_child (b, name);
+      g_ptr_array_add (added, g_object_ref (child_b));
+
+      if (g_file_info_get_file_type (child_b_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!diff_add_dir_recurse (child_b, added, cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  diff_dir_iter_clear (&iter);
+  return ret;
+}
+
+static gboolean
+diff_dirs_recurse (DiffData       *data,
+                   DiffDirTask    *task,
+                   GFile          *a,
+                   GFile          *b,
+                   GPtrArray      *modified,
+                   GPtrArray      *removed,
+                   GPtrArray      *added,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  if (OSTREE_IS_REPO_FILE (a) && OSTREE_IS_REPO_FILE (b))
+    return diff_repo_dirs (data, task, (OstreeRepoFile*)a, (OstreeRepoFile*)b,
+                           modified, removed, added, cancellable, error);
+
+  return diff_dirs_at (data, task, a, b, modified, removed, added,
+                       cancellable, error);
+}
+
+static void
+diff_parallel_worker (gpointer datap,
+                      gpointer user_data)
+{
+  DiffDirTask *task = datap;
+  DiffData *data = user_data;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&data->lock);
+  failed = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!failed && !g_cancellable_is_cancelled (data->cancellable))
+    (void) diff_dirs_recurse (data, task, task->a, task->b,
+                              task->modified, task->removed, task->added,
+                              data->cancellable, &local_error);
+
+  g_mutex_lock (&data->lock);
+  if (local_error != NULL)
+    {
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  data->n_outstanding--;
+  if (data->n_outstanding == 0)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/**
+ * ostree_diff_dirs:
+ * @flags: Flags
+ * @a: First directory path, or %NULL
+ * @b: First directory path
+ * @modified: (element-type OstreeDiffItem): Modified files
+ * @removed: (element-type Gio.File): Removed files
+ * @added: (element-type Gio.File): Added files
+ *
+ * Compute the difference between directory @a and @b as 3 separate
+ * sets of #OstreeDiffItem in @modified, @removed, and @added.
+ *
+ * Subdirectories of two repository trees whose contents and metadata
+ * checksums match are skipped without being traversed.  Files in
+ * physical directories are only read when their size, mode and
+ * ownership match; when one of those differs, the checksums of the
+ * resulting #OstreeDiffItem are %NULL, as they are when the type of a
+ * file changes.
+ *
+ * With %OSTREE_DIFF_FLAGS_PARALLEL, directories are compared by a pool
+ * of threads.  The same entries are found, but the entries of a
+ * directory are then listed before those of its subdirectories.
+ */
+gboolean
+ostree_diff_dirs (OstreeDiffFlags flags,
+                  GFile          *a,
+                  GFile          *b,
+                  GPtrArray      *modified,
+                  GPtrArray      *removed,
+                  GPtrArray      *added,
+                  GCancellable   *cancellable,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  DiffData data = { 0, };
+  DiffDirTask *root = NULL;
+  GError *local_error = NULL;
+
+  data.flags = flags;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  if (a == NULL)
+    {
+      if (!diff_add_dir_recurse (b, added, cancellable, error))
+        goto out;
+
+      ret = TRUE;
       goto out;
     }
 
+  if ((flags & OSTREE_DIFF_FLAGS_PARALLEL) == 0)
+    {
+      if (!diff_dirs_recurse (&data, NULL, a, b, modified, removed, added,
+                              cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
+    }
+
+  data.pool = g_thread_pool_new (diff_parallel_worker, &data,
+                                 g_get_num_processors (), FALSE, &local_error);
+  g_assert_no_error (local_error);
+
+  root = diff_dir_task_new (&data, a, b);
+  diff_dir_task_push (&data, root);
+
+  g_mutex_lock (&data.lock);
+  while (data.n_outstanding > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      data.error = NULL;
+      goto out;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  diff_dir_task_collect (root, modified, removed, added);
+
   ret = TRUE;
  out:
+  if (root)
+    diff_dir_task_free (root);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
   return ret;
 }
 
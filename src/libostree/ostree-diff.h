@@ -29,7 +29,8 @@ G_BEGIN_DECLS
 
 typedef enum {
   OSTREE_DIFF_FLAGS_NONE = 0,
-  OSTREE_DIFF_FLAGS_IGNORE_XATTRS = (1 << 0)
+  OSTREE_DIFF_FLAGS_IGNORE_XATTRS = (1 << 0),
+  OSTREE_DIFF_FLAGS_PARALLEL = (1 << 1)
 } OstreeDiffFlags;
 
 typedef struct _OstreeDiffItem OstreeDiffItem;
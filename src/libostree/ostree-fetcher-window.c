@@ -0,0 +1,152 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-fetcher-window.h"
+
+/* Start with a fixed window of @initial requests */
+void
+_ostree_fetcher_window_init (OstreeFetcherWindow *window,
+                             gint                 initial)
+{
+  memset (window, 0, sizeof (*window));
+  window->adaptive = FALSE;
+  window->min_window = window->max_window = window->window = initial;
+}
+
+/* If @adaptive is %TRUE, the window is adjusted between @min_window
+ * and @max_window by _ostree_fetcher_window_update(); otherwise the
+ * current window is just clamped to the bounds.
+ */
+void
+_ostree_fetcher_window_set_bounds (OstreeFetcherWindow *window,
+                                   gint                 min_window,
+                                   gint                 max_window,
+                                   gboolean             adaptive)
+{
+  g_return_if_fail (min_window > 0);
+  g_return_if_fail (min_window <= max_window);
+
+  window->adaptive = adaptive;
+  window->min_window = min_window;
+  window->max_window = max_window;
+  window->window = CLAMP (window->window, min_window, max_window);
+}
+
+void
+_ostree_fetcher_window_sample_rtt (OstreeFetcherWindow *window,
+                                   gint64               now,
+                                   gint64               rtt_usec)
+{
+  gint64 slot = now / _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOT_USEC;
+  guint i = slot % _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS;
+
+  rtt_usec = MAX (rtt_usec, 1);
+
+  /* Each slot holds the minimum of one second's samples; reuse the
+   * oldest one as time moves on.
+   */
+  if (window->min_rtt_slot[i] != slot || window->min_rtt_usec[i] == 0)
+    {
+      window->min_rtt_slot[i] = slot;
+      window->min_rtt_usec[i] = rtt_usec;
+    }
+  else if (rtt_usec < window->min_rtt_usec[i])
+    window->min_rtt_usec[i] = rtt_usec;
+
+  if (window->srtt_usec == 0)
+    window->srtt_usec = rtt_usec;
+  else
+    window->srtt_usec = (7 * window->srtt_usec + rtt_usec) / 8;
+}
+
+/* Returns: The lowest latency sampled recently, or 0 if there was none */
+gint64
+_ostree_fetcher_window_get_min_rtt (OstreeFetcherWindow *window,
+                                    gint64               now)
+{
+  gint64 slot = now / _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOT_USEC;
+  gint64 ret = 0;
+  guint i;
+
+  for (i = 0; i < _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS; i++)
+    {
+      if (window->min_rtt_usec[i] == 0
+          || slot - window->min_rtt_slot[i] >= _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS)
+        continue;
+      if (ret == 0 || window->min_rtt_usec[i] < ret)
+        ret = window->min_rtt_usec[i];
+    }
+
+  return ret;
+}
+
+/* Called as each download completes, with the number of @bytes it
+ * transferred.  Once per interval, if latency has grown well past the
+ * recent minimum, more concurrency is only queueing requests, so back
+ * off multiplicatively.  Otherwise, if requests are waiting on the
+ * window (@window_limited) and throughput is holding up, probe
+ * upwards.
+ */
+void
+_ostree_fetcher_window_update (OstreeFetcherWindow *window,
+                               gint64               now,
+                               guint64              bytes,
+                               gboolean             window_limited)
+{
+  gint64 elapsed;
+  gint64 min_rtt;
+
+  window->interval_bytes += bytes;
+
+  if (window->interval_start == 0)
+    {
+      window->interval_start = now;
+      return;
+    }
+
+  elapsed = now - window->interval_start;
+  if (elapsed < _OSTREE_FETCHER_WINDOW_INTERVAL_USEC)
+    return;
+
+  window->throughput = window->interval_bytes * G_USEC_PER_SEC / elapsed;
+
+  if (window->adaptive)
+    {
+      min_rtt = _ostree_fetcher_window_get_min_rtt (window, now);
+
+      if (min_rtt > 0 && window->srtt_usec > _OSTREE_FETCHER_WINDOW_RTT_INFLATION * min_rtt)
+        {
+          window->window = MAX (window->min_window, (window->window * 3) / 4);
+          /* Let the latency estimate settle at the new window */
+          window->srtt_usec = min_rtt * _OSTREE_FETCHER_WINDOW_RTT_INFLATION;
+        }
+      else if (window_limited && window->throughput >= (window->last_throughput * 95) / 100)
+        window->window = MIN (window->max_window,
+                              window->window + MAX (1, window->window / 8));
+    }
+
+  window->last_throughput = window->throughput;
+  window->interval_start = now;
+  window->interval_bytes = 0;
+}
@@ -0,0 +1,84 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* How often to reconsider the window */
+#define _OSTREE_FETCHER_WINDOW_INTERVAL_USEC (G_USEC_PER_SEC / 2)
+
+/* Treat response latency above this multiple of the recent minimum as
+ * a sign that requests are queueing somewhere rather than using more
+ * bandwidth.
+ */
+#define _OSTREE_FETCHER_WINDOW_RTT_INFLATION (2)
+
+/* The minimum latency is taken over the samples of the last
+ * _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS slots of this length, so that
+ * a route change or a slower server is eventually accepted as the new
+ * baseline, but a single inflated sample never becomes it.
+ */
+#define _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOT_USEC (G_USEC_PER_SEC)
+#define _OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS (5)
+
+/* Additive increase, multiplicative decrease of the number of
+ * requests in flight.  All times are passed in, so that the logic can
+ * be tested without a network.
+ */
+typedef struct {
+  gboolean adaptive;
+  gint     min_window;
+  gint     max_window;
+  gint     window;
+
+  gint64   srtt_usec;
+  gint64   min_rtt_usec[_OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS];
+  gint64   min_rtt_slot[_OSTREE_FETCHER_WINDOW_MIN_RTT_SLOTS];
+
+  gint64   interval_start;
+  guint64  interval_bytes;
+  guint64  last_throughput;
+  guint64  throughput;
+} OstreeFetcherWindow;
+
+void _ostree_fetcher_window_init (OstreeFetcherWindow *window,
+                                  gint                 initial);
+
+void _ostree_fetcher_window_set_bounds (OstreeFetcherWindow *window,
+                                        gint                 min_window,
+                                        gint                 max_window,
+                                        gboolean             adaptive);
+
+void _ostree_fetcher_window_sample_rtt (OstreeFetcherWindow *window,
+                                        gint64               now,
+                                        gint64               rtt_usec);
+
+gint64 _ostree_fetcher_window_get_min_rtt (OstreeFetcherWindow *window,
+                                           gint64               now);
+
+void _ostree_fetcher_window_update (OstreeFetcherWindow *window,
+                                    gint64               now,
+                                    guint64              bytes,
+                                    gboolean             window_limited);
+
+G_END_DECLS
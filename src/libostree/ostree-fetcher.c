@@ -26,6 +26,7 @@
 #include <gio/gunixoutputstream.h>
 
 #include "ostree-fetcher.h"
+#include "ostree-fetcher-window.h"
 #ifdef HAVE_LIBSOUP_CLIENT_CERTS
 #include "ostree-tls-cert-interaction.h"
 #endif
@@ -49,6 +50,7 @@ typedef struct {
   SoupRequest *request;
 
   gboolean is_stream;
+  gboolean not_modified;
   GInputStream *request_body;
   char *out_tmpfile;
   GOutputStream *out_stream;
@@ -57,6 +59,11 @@ typedef struct {
   guint64 current_size;
   guint64 content_length;
 
+  /* When libsoup started writing the request, so that time spent
+   * waiting for a connection isn't counted as latency.
+   */
+  gint64 request_started_time;
+
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
 } OstreeFetcherPendingURI;
@@ -112,7 +119,19 @@ struct OstreeFetcher
   /* Queue for libsoup, see bgo#708591 */
   gint outstanding;
   GQueue pending_queue;
-  gint max_outstanding;
+
+  /* Adaptive concurrency; window.window is the maximum number of
+   * requests outstanding.
+   */
+  OstreeFetcherWindow window;
+  gint base_max_conns;
+
+  /* Bodies of responses to conditional requests, with their
+   * validators; -1 if disabled.
+   */
+  int cache_dfd;
+  guint cache_hits;
+  guint cache_misses;
 };
 
 G_DEFINE_TYPE (OstreeFetcher, _ostree_fetcher, G_TYPE_OBJECT)
@@ -127,6 +146,9 @@ _ostree_fetcher_finalize (GObject *object)
   g_clear_object (&self->session);
   g_clear_object (&self->client_cert);
 
+  if (self->cache_dfd != -1)
+    (void) close (self->cache_dfd);
+
   g_hash_table_destroy (self->sending_messages);
   g_hash_table_destroy (self->message_to_request);
   g_hash_table_destroy (self->output_stream_set);
@@ -151,8 +173,16 @@ on_request_started (SoupSession  *session,
                     gpointer      user_data)
 {
   OstreeFetcher *self = user_data;
+  OstreeFetcherPendingURI *pending;
   
   g_hash_table_insert (self->sending_messages, msg, g_object_ref (msg));
+
+  /* Emitted again for redirects and retries; the latest one is what
+   * the response answers.
+   */
+  pending = g_hash_table_lookup (self->message_to_request, msg);
+  if (pending)
+    pending->request_started_time = g_get_monotonic_time ();
 }
 
 static void
@@ -172,6 +202,7 @@ _ostree_fetcher_init (OstreeFetcher *self)
   const char *http_proxy;
 
   g_queue_init (&self->pending_queue);
+  self->cache_dfd = -1;
   self->session = soup_session_async_new_with_options (SOUP_SESSION_USER_AGENT, "ostree ",
                                                        SOUP_SESSION_SSL_USE_SYSTEM_CA_FILE, TRUE,
                                                        SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
@@ -199,7 +230,8 @@ _ostree_fetcher_init (OstreeFetcher *self)
       g_object_set (self->session, "max-conns-per-host", max_conns, NULL);
     }
 
-  self->max_outstanding = 3 * max_conns;
+  self->base_max_conns = max_conns;
+  _ostree_fetcher_window_init (&self->window, 3 * max_conns);
 
   g_signal_connect_object (self->session, "request-started",
                            G_CALLBACK (on_request_started), self, 0);
@@ -276,6 +308,99 @@ _ostree_fetcher_set_tls_database (OstreeFetcher *self,
     g_object_set ((GObject*)self->session, "ssl-use-system-ca-file", TRUE, NULL);
 }
 
+/* If @adaptive is %TRUE, the number of requests in flight starts at
+ * the default and is adjusted between @min_window and @max_window
+ * based on the measured throughput and response latency; otherwise
+ * the default is just clamped to the bounds.
+ */
+void
+_ostree_fetcher_set_concurrency (OstreeFetcher *self,
+                                 guint          min_window,
+                                 guint          max_window,
+                                 gboolean       adaptive)
+{
+  g_return_if_fail (min_window > 0);
+  g_return_if_fail (min_window <= max_window);
+
+  _ostree_fetcher_window_set_bounds (&self->window, min_window, max_window, adaptive);
+}
+
+guint
+_ostree_fetcher_get_concurrency (OstreeFetcher *self)
+{
+  return self->window.window;
+}
+
+guint64
+_ostree_fetcher_get_rtt_usec (OstreeFetcher *self)
+{
+  return self->window.srtt_usec;
+}
+
+guint64
+_ostree_fetcher_get_throughput (OstreeFetcher *self)
+{
+  return self->window.throughput;
+}
+
+/* Takes ownership of @dfd, a directory in which the bodies fetched by
+ * _ostree_fetcher_request_uri_to_membuf_cached() are kept along with
+ * their ETag and Last-Modified validators.  Later requests for the
+ * same URIs are made conditional, so that an unchanged file costs a
+ * 304 response rather than the whole body.
+ */
+void
+_ostree_fetcher_set_cache_dfd (OstreeFetcher *self,
+                               int            dfd)
+{
+  if (self->cache_dfd != -1)
+    (void) close (self->cache_dfd);
+  self->cache_dfd = dfd;
+}
+
+guint
+_ostree_fetcher_get_cache_hits (OstreeFetcher *self)
+{
+  return self->cache_hits;
+}
+
+guint
+_ostree_fetcher_get_cache_misses (OstreeFetcher *self)
+{
+  return self->cache_misses;
+}
+
+static void
+ostree_fetcher_sample_rtt (OstreeFetcher *self,
+                           gint64         rtt_usec)
+{
+  _ostree_fetcher_window_sample_rtt (&self->window, g_get_monotonic_time (), rtt_usec);
+}
+
+static void
+ostree_fetcher_adapt_window (OstreeFetcher *self,
+                             guint64        bytes)
+{
+  gboolean window_limited = g_queue_peek_head (&self->pending_queue) != NULL;
+
+  gint max_conns, want_conns;
+
+  _ostree_fetcher_window_update (&self->window, g_get_monotonic_time (),
+                                 bytes, window_limited);
+
+  /* Only open more connections per host than the default once the
+   * window has actually grown past what they can carry, and follow it
+   * back down.
+   */
+  if (!self->window.adaptive)
+    return;
+  want_conns = MAX (self->base_max_conns, self->window.window / 3);
+  g_object_get (self->session, "max-conns-per-host", &max_conns, NULL);
+  if (max_conns != want_conns)
+    g_object_set (self->session, "max-conns-per-host", want_conns,
+                  "max-conns", MAX (want_conns, 10), NULL);
+}
+
 static void
 on_request_sent (GObject        *object, GAsyncResult   *result, gpointer        user_data);
 
@@ -284,7 +409,7 @@ ostree_fetcher_process_pending_queue (OstreeFetcher *self)
 {
 
   while (g_queue_peek_head (&self->pending_queue) != NULL &&
-         self->outstanding < self->max_outstanding)
+         self->outstanding < self->window.window)
     {
       OstreeFetcherPendingURI *next = g_queue_pop_head (&self->pending_queue);
 
@@ -323,6 +448,7 @@ finish_stream (OstreeFetcherPendingURI *pending,
    * requests.
    */
   pending->self->outstanding--;
+  ostree_fetcher_adapt_window (pending->self, pending->current_size);
   ostree_fetcher_process_pending_queue (pending->self);
 
   if (stbuf.st_size < pending->content_length)
@@ -466,6 +592,15 @@ on_request_sent (GObject        *object,
           g_object_unref (pending->result);
           return;
         }
+      else if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && pending->is_stream)
+        {
+          /* Only sent in reply to validators from our cache */
+          pending->not_modified = TRUE;
+          (void) g_input_stream_close (pending->request_body, NULL, NULL);
+          g_simple_async_result_complete (pending->result);
+          g_object_unref (pending->result);
+          return;
+        }
       else if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
         {
           GIOErrorEnum code;
@@ -486,6 +621,9 @@ on_request_sent (GObject        *object,
     }
 
   pending->state = OSTREE_FETCHER_STATE_DOWNLOADING;
+
+  if (pending->request_started_time > 0)
+    ostree_fetcher_sample_rtt (pending->self, g_get_monotonic_time () - pending->request_started_time);
   
   pending->content_length = soup_request_get_content_length (pending->request);
 
@@ -535,6 +673,8 @@ static OstreeFetcherPendingURI *
 ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
                                      SoupURI               *uri,
                                      gboolean               is_stream,
+                                     const char            *if_none_match,
+                                     const char            *if_modified_since,
                                      guint64                max_size,
                                      int                    priority,
                                      GCancellable          *cancellable,
@@ -566,9 +706,14 @@ ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
     {
       if (SOUP_IS_REQUEST_HTTP (pending->request))
         {
-          g_hash_table_insert (self->message_to_request,
-                               soup_request_http_get_message ((SoupRequestHTTP*)pending->request),
-                               pending);
+          SoupMessage *msg;
+          msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+          if (if_none_match)
+            soup_message_headers_replace (msg->request_headers, "If-None-Match", if_none_match);
+          if (if_modified_since)
+            soup_message_headers_replace (msg->request_headers, "If-Modified-Since", if_modified_since);
+          /* Transfer ownership */
+          g_hash_table_insert (self->message_to_request, msg, pending);
         }
       soup_request_send_async (pending->request, cancellable,
                                on_request_sent, pending);
@@ -633,7 +778,7 @@ _ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
                                                GAsyncReadyCallback    callback,
                                                gpointer               user_data)
 {
-  ostree_fetcher_request_uri_internal (self, uri, FALSE, max_size, priority, cancellable,
+  ostree_fetcher_request_uri_internal (self, uri, FALSE, NULL, NULL, max_size, priority, cancellable,
                                        callback, user_data,
                                        _ostree_fetcher_request_uri_with_partial_async);
 }
@@ -656,23 +801,385 @@ _ostree_fetcher_request_uri_with_partial_finish (OstreeFetcher         *self,
   return g_strdup (pending->out_tmpfile);
 }
 
+typedef struct {
+  OstreeFetcher *self;
+  SoupRequest *request;
+  SoupRange *ranges;
+  guint n_ranges;
+  GMemoryOutputStream *buf;
+  gsize max_size;
+  GCancellable *cancellable;
+  GPtrArray *parts;
+} OstreeFetcherRangesRequest;
+
+/* Room for the multipart boundaries and part headers of a range
+ * response, on top of the requested bytes themselves.
+ */
+#define RANGES_RESPONSE_OVERHEAD (4096)
+#define RANGES_RESPONSE_PART_OVERHEAD (512)
+
+static void
+ranges_request_free (OstreeFetcherRangesRequest *req)
+{
+  g_clear_object (&req->self);
+  g_clear_object (&req->request);
+  g_free (req->ranges);
+  g_clear_object (&req->buf);
+  g_clear_object (&req->cancellable);
+  g_clear_pointer (&req->parts, (GDestroyNotify) g_ptr_array_unref);
+  g_free (req);
+}
+
+/* Return a reference to @len bytes at @data, which libsoup may have
+ * handed back as a pointer into @body; avoid copying in that case.
+ */
+static GBytes *
+bytes_new_from_body (GBytes        *body,
+                     gconstpointer  data,
+                     gsize          len)
+{
+  gsize body_len;
+  const guint8 *body_data = g_bytes_get_data (body, &body_len);
+  const guint8 *p = data;
+
+  if (p >= body_data && p + len <= body_data + body_len)
+    return g_bytes_new_from_bytes (body, p - body_data, len);
+  return g_bytes_new (data, len);
+}
+
+/* Split a 206 response into the requested ranges.  The server may
+ * answer with a single range or a multipart/byteranges body, and is
+ * allowed to coalesce adjacent ranges into one part, so look up each
+ * requested range in whatever segments were returned.
+ */
+static gboolean
+split_ranges_response (OstreeFetcherRangesRequest  *req,
+                       SoupMessage                 *msg,
+                       GBytes                      *body,
+                       GError                     **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GPtrArray) segments = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  g_autoptr(GArray) segment_starts = g_array_new (FALSE, FALSE, sizeof (goffset));
+  const char *content_type;
+  guint i, j;
+
+  content_type = soup_message_headers_get_content_type (msg->response_headers, NULL);
+  if (content_type && g_ascii_strcasecmp (content_type, "multipart/byteranges") == 0)
+    {
+      SoupMessageBody *msgbody = soup_message_body_new ();
+      SoupBuffer *buffer;
+      SoupMultipart *multipart;
+      guint n_parts;
+
+      buffer = soup_buffer_new_with_owner (g_bytes_get_data (body, NULL),
+                                           g_bytes_get_size (body),
+                                           g_bytes_ref (body),
+                                           (GDestroyNotify) g_bytes_unref);
+      soup_message_body_append_buffer (msgbody, buffer);
+      soup_buffer_free (buffer);
+      multipart = soup_multipart_new_from_message (msg->response_headers, msgbody);
+      soup_message_body_free (msgbody);
+      if (!multipart)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid multipart/byteranges response");
+          goto out;
+        }
+
+      n_parts = soup_multipart_get_length (multipart);
+      for (i = 0; i < n_parts; i++)
+        {
+          SoupMessageHeaders *part_headers;
+          SoupBuffer *part_body;
+          goffset start, end, total_length;
+
+          if (!soup_multipart_get_part (multipart, i, &part_headers, &part_body)
+              || !soup_message_headers_get_content_range (part_headers, &start, &end, &total_length)
+              || (goffset) part_body->length != end - start + 1)
+            {
+              soup_multipart_free (multipart);
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Invalid part %u in multipart/byteranges response", i);
+              goto out;
+            }
+
+          g_ptr_array_add (segments, bytes_new_from_body (body, part_body->data, part_body->length));
+          g_array_append_val (segment_starts, start);
+        }
+      soup_multipart_free (multipart);
+    }
+  else
+    {
+      goffset start, end, total_length;
+
+      if (!soup_message_headers_get_content_range (msg->response_headers, &start, &end, &total_length)
+          || (goffset) g_bytes_get_size (body) != end - start + 1)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid Content-Range in partial response");
+          goto out;
+        }
+
+      g_ptr_array_add (segments, g_bytes_ref (body));
+      g_array_append_val (segment_starts, start);
+    }
+
+  req->parts = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  for (i = 0; i < req->n_ranges; i++)
+    {
+      const SoupRange *range = &req->ranges[i];
+      GBytes *part = NULL;
+
+      for (j = 0; j < segments->len && !part; j++)
+        {
+          goffset segment_start = g_array_index (segment_starts, goffset, j);
+          gsize segment_len = g_bytes_get_size (segments->pdata[j]);
+
+          if (range->start >= segment_start
+              && range->end < segment_start + (goffset) segment_len)
+            part = g_bytes_new_from_bytes (segments->pdata[j],
+                                           range->start - segment_start,
+                                           range->end - range->start + 1);
+        }
+
+      if (!part)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Server response is missing range %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT,
+                       (gint64) range->start, (gint64) range->end);
+          goto out;
+        }
+
+      g_ptr_array_add (req->parts, part);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+on_ranges_body_spliced (GObject        *object,
+                        GAsyncResult   *result,
+                        gpointer        user_data)
+{
+  GSimpleAsyncResult *simple = user_data;
+  OstreeFetcherRangesRequest *req = g_simple_async_result_get_op_res_gpointer (simple);
+  GError *local_error = NULL;
+  g_autoptr(GBytes) body = NULL;
+  glnx_unref_object SoupMessage *msg = NULL;
+
+  if (g_output_stream_splice_finish ((GOutputStream*) object, result, &local_error) < 0)
+    {
+      /* The buffer can't grow past req->max_size */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+        {
+          g_clear_error (&local_error);
+          g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Range response is larger than the %" G_GSIZE_FORMAT " bytes expected",
+                       req->max_size);
+        }
+      goto out;
+    }
+
+  body = g_memory_output_stream_steal_as_bytes (req->buf);
+  req->self->total_downloaded += g_bytes_get_size (body);
+  ostree_fetcher_adapt_window (req->self, g_bytes_get_size (body));
+
+  msg = soup_request_http_get_message ((SoupRequestHTTP*) req->request);
+  if (!split_ranges_response (req, msg, body, &local_error))
+    goto out;
+
+ out:
+  if (local_error)
+    g_simple_async_result_take_error (simple, local_error);
+  g_simple_async_result_complete (simple);
+  g_object_unref (simple);
+}
+
+static void
+on_ranges_request_sent (GObject        *object,
+                        GAsyncResult   *result,
+                        gpointer        user_data)
+{
+  GSimpleAsyncResult *simple = user_data;
+  OstreeFetcherRangesRequest *req = g_simple_async_result_get_op_res_gpointer (simple);
+  GError *local_error = NULL;
+  g_autoptr(GInputStream) body = NULL;
+  glnx_unref_object SoupMessage *msg = NULL;
+
+  body = soup_request_send_finish ((SoupRequest*) object, result, &local_error);
+  if (!body)
+    goto out;
+
+  msg = soup_request_http_get_message ((SoupRequestHTTP*) object);
+  if (msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      /* A 200 would mean downloading the whole file; let the caller
+       * fall back to something else instead.
+       */
+      if (msg->status_code == 404 || msg->status_code == 410)
+        g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                     "Server returned status %u: %s",
+                     msg->status_code, soup_status_get_phrase (msg->status_code));
+      else if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+        g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                     "Server does not support range requests");
+      else
+        g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Server returned status %u: %s",
+                     msg->status_code, soup_status_get_phrase (msg->status_code));
+      (void) g_input_stream_close (body, NULL, NULL);
+      goto out;
+    }
+
+  if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH
+      && soup_message_headers_get_content_length (msg->response_headers) > req->max_size)
+    {
+      g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Range response is larger than the %" G_GSIZE_FORMAT " bytes expected",
+                   req->max_size);
+      (void) g_input_stream_close (body, NULL, NULL);
+      goto out;
+    }
+
+  /* Without a realloc function the stream refuses to grow, so a server
+   * sending more than was asked for can't exhaust our memory.
+   */
+  req->buf = (GMemoryOutputStream*)g_memory_output_stream_new (g_malloc (req->max_size), req->max_size,
+                                                               NULL, g_free);
+  g_output_stream_splice_async ((GOutputStream*) req->buf, body,
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                G_PRIORITY_DEFAULT, req->cancellable,
+                                on_ranges_body_spliced, simple);
+
+ out:
+  if (local_error)
+    {
+      g_simple_async_result_take_error (simple, local_error);
+      g_simple_async_result_complete (simple);
+      g_object_unref (simple);
+    }
+}
+
+/* Fetch @n_ranges byte ranges of @uri with a single request.  The
+ * ranges must have an explicit end.  This bypasses the request queue;
+ * callers are expected to bound how many of these they have in
+ * flight, since each response is held in memory.  A response much
+ * larger than the ranges asked for fails the request.
+ */
+void
+_ostree_fetcher_request_uri_ranges_async (OstreeFetcher         *self,
+                                          SoupURI               *uri,
+                                          const SoupRange       *ranges,
+                                          guint                  n_ranges,
+                                          GCancellable          *cancellable,
+                                          GAsyncReadyCallback    callback,
+                                          gpointer               user_data)
+{
+  GSimpleAsyncResult *simple;
+  OstreeFetcherRangesRequest *req;
+  GError *local_error = NULL;
+  glnx_unref_object SoupMessage *msg = NULL;
+  guint i;
+
+  g_return_if_fail (n_ranges > 0);
+
+  req = g_new0 (OstreeFetcherRangesRequest, 1);
+  req->self = g_object_ref (self);
+  req->ranges = g_memdup (ranges, sizeof (SoupRange) * n_ranges);
+  req->n_ranges = n_ranges;
+  req->max_size = RANGES_RESPONSE_OVERHEAD;
+  for (i = 0; i < n_ranges; i++)
+    req->max_size += (ranges[i].end - ranges[i].start + 1) + RANGES_RESPONSE_PART_OVERHEAD;
+  req->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+  simple = g_simple_async_result_new ((GObject*) self, callback, user_data,
+                                      _ostree_fetcher_request_uri_ranges_async);
+  g_simple_async_result_set_op_res_gpointer (simple, req,
+                                             (GDestroyNotify) ranges_request_free);
+
+  req->request = soup_requester_request_uri (self->requester, uri, &local_error);
+  if (!req->request)
+    goto out;
+
+  if (!SOUP_IS_REQUEST_HTTP (req->request))
+    {
+      g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Range requests are only supported over HTTP");
+      goto out;
+    }
+
+  msg = soup_request_http_get_message ((SoupRequestHTTP*) req->request);
+  soup_message_headers_set_ranges (msg->request_headers, req->ranges, n_ranges);
+
+  self->total_requests++;
+  soup_request_send_async (req->request, cancellable,
+                           on_ranges_request_sent, simple);
+
+ out:
+  if (local_error)
+    {
+      g_simple_async_result_take_error (simple, local_error);
+      g_simple_async_result_complete_in_idle (simple);
+      g_object_unref (simple);
+    }
+}
+
+/*
+ * Returns: (transfer container) (element-type GBytes): The contents
+ * of each requested range, in the order they were requested
+ */
+GPtrArray *
+_ostree_fetcher_request_uri_ranges_finish (OstreeFetcher         *self,
+                                           GAsyncResult          *result,
+                                           GError               **error)
+{
+  GSimpleAsyncResult *simple;
+  OstreeFetcherRangesRequest *req;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, (GObject*)self, _ostree_fetcher_request_uri_ranges_async), NULL);
+
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+  req = g_simple_async_result_get_op_res_gpointer (simple);
+
+  return g_ptr_array_ref (req->parts);
+}
+
+/* If @if_none_match or @if_modified_since are given, the request is
+ * conditional; see ostree_fetcher_stream_uri_finish().
+ */
 static void
 ostree_fetcher_stream_uri_async (OstreeFetcher         *self,
                                  SoupURI               *uri,
+                                 const char            *if_none_match,
+                                 const char            *if_modified_since,
                                  guint64                max_size,
                                  int                    priority,
                                  GCancellable          *cancellable,
                                  GAsyncReadyCallback    callback,
                                  gpointer               user_data)
 {
-  ostree_fetcher_request_uri_internal (self, uri, TRUE, max_size, priority, cancellable,
+  ostree_fetcher_request_uri_internal (self, uri, TRUE, if_none_match, if_modified_since,
+                                       max_size, priority, cancellable,
                                        callback, user_data,
                                        ostree_fetcher_stream_uri_async);
 }
 
+/* Sets @out_not_modified if the server answered a conditional request
+ * with 304, in which case the returned stream is empty, and returns
+ * the validators of the response in @out_etag and @out_last_modified.
+ */
 static GInputStream *
 ostree_fetcher_stream_uri_finish (OstreeFetcher         *self,
                                   GAsyncResult          *result,
+                                  gboolean              *out_not_modified,
+                                  char                 **out_etag,
+                                  char                 **out_last_modified,
                                   GError               **error)
 {
   GSimpleAsyncResult *simple;
@@ -685,6 +1192,16 @@ ostree_fetcher_stream_uri_finish (OstreeFetcher         *self,
     return NULL;
   pending = g_simple_async_result_get_op_res_gpointer (simple);
 
+  if (SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      glnx_unref_object SoupMessage *msg =
+        soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+
+      *out_etag = g_strdup (soup_message_headers_get_one (msg->response_headers, "ETag"));
+      *out_last_modified = g_strdup (soup_message_headers_get_one (msg->response_headers, "Last-Modified"));
+    }
+  *out_not_modified = pending->not_modified;
+
   return g_object_ref (pending->request_body);
 }
 
@@ -714,6 +1231,9 @@ _ostree_fetcher_bytes_transferred (OstreeFetcher       *self)
 typedef struct
 {
   GInputStream   *result_stream;
+  gboolean         not_modified;
+  char            *etag;
+  char            *last_modified;
   gboolean         done;
   GError         **error;
 }
@@ -727,33 +1247,141 @@ fetch_uri_sync_on_complete (GObject        *object,
   FetchUriSyncData *data = user_data;
 
   data->result_stream = ostree_fetcher_stream_uri_finish ((OstreeFetcher*)object,
-                                                          result, data->error);
+                                                          result,
+                                                          &data->not_modified,
+                                                          &data->etag,
+                                                          &data->last_modified,
+                                                          data->error);
   data->done = TRUE;
 }
 
-gboolean
-_ostree_fetcher_request_uri_to_membuf (OstreeFetcher  *fetcher,
-                                       SoupURI        *uri,
-                                       gboolean        add_nul,
-                                       gboolean        allow_noent,
-                                       GBytes         **out_contents,
-                                       guint64        max_size,
-                                       GCancellable   *cancellable,
-                                       GError         **error)
+/* Cache entries are named after the checksum of the URI, and hold
+ * (ETag, Last-Modified, body); a missing validator is empty.
+ */
+#define OSTREE_FETCHER_CACHE_ENTRY_FORMAT G_VARIANT_TYPE ("(ssay)")
+
+static gboolean
+cache_entry_load (OstreeFetcher  *self,
+                  const char     *name,
+                  GVariant      **out_entry,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) ret_entry = NULL;
+
+  fd = openat (self->cache_dfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+  else
+    {
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+      if (!mfile)
+        goto out;
+      bytes = g_mapped_file_get_bytes (mfile);
+      ret_entry = g_variant_new_from_bytes (OSTREE_FETCHER_CACHE_ENTRY_FORMAT, bytes, FALSE);
+      g_variant_ref_sink (ret_entry);
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_entry, &ret_entry);
+ out:
+  return ret;
+}
+
+static gboolean
+cache_entry_store (OstreeFetcher  *self,
+                   const char     *name,
+                   const char     *etag,
+                   const char     *last_modified,
+                   GBytes         *body,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GBytes) entry_bytes = NULL;
+
+  entry = g_variant_new ("(ss@ay)", etag ? etag : "", last_modified ? last_modified : "",
+                         g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), body, TRUE));
+  g_variant_ref_sink (entry);
+  entry_bytes = g_variant_get_data_as_bytes (entry);
+
+  /* This is only a cache, so don't bother syncing it */
+  return ot_file_replace_contents_at (self->cache_dfd, name, entry_bytes, FALSE,
+                                      cancellable, error);
+}
+
+/* The cache is only an optimization, and e.g. an unprivileged user
+ * may not be able to write to (or read) the cache of the system
+ * repository; so failures to use it are logged and otherwise ignored.
+ */
+static void
+cache_entry_remove (OstreeFetcher  *self,
+                    const char     *name)
+{
+  if (unlinkat (self->cache_dfd, name, 0) != 0 && errno != ENOENT)
+    g_debug ("Failed to remove cache entry %s: %s", name, g_strerror (errno));
+}
+
+static gboolean
+request_uri_to_membuf (OstreeFetcher  *fetcher,
+                       SoupURI        *uri,
+                       gboolean        add_nul,
+                       gboolean        allow_noent,
+                       gboolean        use_cache,
+                       GBytes         **out_contents,
+                       guint64        max_size,
+                       GCancellable   *cancellable,
+                       GError         **error)
 {
   gboolean ret = FALSE;
   const guint8 nulchar = 0;
   g_autofree char *ret_contents = NULL;
   g_autoptr(GMemoryOutputStream) buf = NULL;
   g_autoptr(GMainContext) mainctx = NULL;
-  FetchUriSyncData data;
+  g_autofree char *cache_name = NULL;
+  g_autoptr(GVariant) cache_entry = NULL;
+  const char *cached_etag = NULL;
+  const char *cached_last_modified = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  FetchUriSyncData data = { NULL, };
   g_assert (error != NULL);
 
-  data.result_stream = NULL;
-
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
+  if (use_cache && fetcher->cache_dfd != -1)
+    {
+      g_autofree char *uristring = soup_uri_to_string (uri, FALSE);
+
+      GError *local_error = NULL;
+
+      cache_name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uristring, strlen (uristring));
+      if (!cache_entry_load (fetcher, cache_name, &cache_entry, &local_error))
+        {
+          /* Just make an unconditional request */
+          g_debug ("Failed to load cache entry for %s: %s", uristring, local_error->message);
+          g_clear_error (&local_error);
+        }
+
+      if (cache_entry)
+        {
+          g_variant_get (cache_entry, "(&s&s@ay)", &cached_etag, &cached_last_modified, NULL);
+          if (!*cached_etag)
+            cached_etag = NULL;
+          if (!*cached_last_modified)
+            cached_last_modified = NULL;
+        }
+    }
+
   mainctx = g_main_context_new ();
   g_main_context_push_thread_default (mainctx);
 
@@ -761,6 +1389,7 @@ _ostree_fetcher_request_uri_to_membuf (OstreeFetcher  *fetcher,
   data.error = error;
 
   ostree_fetcher_stream_uri_async (fetcher, uri,
+                                   cached_etag, cached_last_modified,
                                    max_size,
                                    OSTREE_FETCHER_DEFAULT_PRIORITY,
                                    cancellable,
@@ -775,6 +1404,8 @@ _ostree_fetcher_request_uri_to_membuf (OstreeFetcher  *fetcher,
           if (g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
             {
               g_clear_error (error);
+              if (cache_entry)
+                cache_entry_remove (fetcher, cache_name);
               ret = TRUE;
               *out_contents = NULL;
             }
@@ -782,26 +1413,108 @@ _ostree_fetcher_request_uri_to_membuf (OstreeFetcher  *fetcher,
       goto out;
     }
 
-  buf = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  if (g_output_stream_splice ((GOutputStream*)buf, data.result_stream,
-                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                              cancellable, error) < 0)
-    goto out;
+  if (data.not_modified)
+    {
+      g_autoptr(GVariant) body = NULL;
 
-  if (add_nul)
+      if (!cache_entry)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Server returned status 304 to an unconditional request");
+          goto out;
+        }
+
+      fetcher->cache_hits++;
+      body = g_variant_get_child_value (cache_entry, 2);
+      contents = g_variant_get_data_as_bytes (body);
+    }
+  else
     {
-      if (!g_output_stream_write ((GOutputStream*)buf, &nulchar, 1, cancellable, error))
+      buf = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+      if (g_output_stream_splice ((GOutputStream*)buf, data.result_stream,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                  cancellable, error) < 0)
         goto out;
+
+      if (!g_output_stream_close ((GOutputStream*)buf, cancellable, error))
+        goto out;
+
+      contents = g_memory_output_stream_steal_as_bytes (buf);
+
+      if (cache_name)
+        {
+          fetcher->cache_misses++;
+
+          if (data.etag || data.last_modified)
+            {
+              GError *local_error = NULL;
+
+              if (!cache_entry_store (fetcher, cache_name, data.etag, data.last_modified,
+                                      contents, cancellable, &local_error))
+                {
+                  g_debug ("Failed to store cache entry %s: %s", cache_name, local_error->message);
+                  g_clear_error (&local_error);
+                  /* Don't leave a stale entry behind */
+                  if (cache_entry)
+                    cache_entry_remove (fetcher, cache_name);
+                }
+            }
+          else if (cache_entry)
+            cache_entry_remove (fetcher, cache_name);
+        }
     }
 
-  if (!g_output_stream_close ((GOutputStream*)buf, cancellable, error))
-    goto out;
+  if (add_nul)
+    {
+      gsize len;
+      const guint8 *data_bytes = g_bytes_get_data (contents, &len);
+      guint8 *with_nul = g_malloc (len + 1);
+
+      memcpy (with_nul, data_bytes, len);
+      with_nul[len] = nulchar;
+      g_bytes_unref (contents);
+      contents = g_bytes_new_take (with_nul, len + 1);
+    }
 
   ret = TRUE;
-  *out_contents = g_memory_output_stream_steal_as_bytes (buf);
+  *out_contents = g_steal_pointer (&contents);
  out:
   if (mainctx)
     g_main_context_pop_thread_default (mainctx);
   g_clear_object (&(data.result_stream));
+  g_free (data.etag);
+  g_free (data.last_modified);
   return ret;
 }
+
+gboolean
+_ostree_fetcher_request_uri_to_membuf (OstreeFetcher  *fetcher,
+                                       SoupURI        *uri,
+                                       gboolean        add_nul,
+                                       gboolean        allow_noent,
+                                       GBytes         **out_contents,
+                                       guint64        max_size,
+                                       GCancellable   *cancellable,
+                                       GError         **error)
+{
+  return request_uri_to_membuf (fetcher, uri, add_nul, allow_noent, FALSE,
+                                out_contents, max_size, cancellable, error);
+}
+
+/* Like _ostree_fetcher_request_uri_to_membuf(), but for files which
+ * are polled, such as the summary and refs: if a cache directory is
+ * set, make the request conditional on the cached copy being stale.
+ */
+gboolean
+_ostree_fetcher_request_uri_to_membuf_cached (OstreeFetcher  *fetcher,
+                                              SoupURI        *uri,
+                                              gboolean        add_nul,
+                                              gboolean        allow_noent,
+                                              GBytes         **out_contents,
+                                              guint64        max_size,
+                                              GCancellable   *cancellable,
+                                              GError         **error)
+{
+  return request_uri_to_membuf (fetcher, uri, add_nul, allow_noent, TRUE,
+                                out_contents, max_size, cancellable, error);
+}
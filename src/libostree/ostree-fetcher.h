@@ -68,6 +68,24 @@ void _ostree_fetcher_set_client_cert (OstreeFetcher *fetcher,
 void _ostree_fetcher_set_tls_database (OstreeFetcher *self,
                                        GTlsDatabase *db);
 
+void _ostree_fetcher_set_concurrency (OstreeFetcher *self,
+                                      guint          min_window,
+                                      guint          max_window,
+                                      gboolean       adaptive);
+
+guint _ostree_fetcher_get_concurrency (OstreeFetcher *self);
+
+guint64 _ostree_fetcher_get_rtt_usec (OstreeFetcher *self);
+
+guint64 _ostree_fetcher_get_throughput (OstreeFetcher *self);
+
+void _ostree_fetcher_set_cache_dfd (OstreeFetcher *self,
+                                    int            dfd);
+
+guint _ostree_fetcher_get_cache_hits (OstreeFetcher *self);
+
+guint _ostree_fetcher_get_cache_misses (OstreeFetcher *self);
+
 guint64 _ostree_fetcher_bytes_transferred (OstreeFetcher       *self);
 
 void _ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
@@ -82,6 +100,18 @@ char *_ostree_fetcher_request_uri_with_partial_finish (OstreeFetcher *self,
                                                        GAsyncResult  *result,
                                                        GError       **error);
 
+void _ostree_fetcher_request_uri_ranges_async (OstreeFetcher         *self,
+                                               SoupURI               *uri,
+                                               const SoupRange       *ranges,
+                                               guint                  n_ranges,
+                                               GCancellable          *cancellable,
+                                               GAsyncReadyCallback    callback,
+                                               gpointer               user_data);
+
+GPtrArray *_ostree_fetcher_request_uri_ranges_finish (OstreeFetcher *self,
+                                                      GAsyncResult  *result,
+                                                      GError       **error);
+
 gboolean _ostree_fetcher_request_uri_to_membuf (OstreeFetcher *fetcher,
                                                 SoupURI        *uri,
                                                 gboolean       add_nul,
@@ -90,6 +120,15 @@ gboolean _ostree_fetcher_request_uri_to_membuf (OstreeFetcher *fetcher,
                                                 guint64        max_size,
                                                 GCancellable   *cancellable,
                                                 GError         **error);
+
+gboolean _ostree_fetcher_request_uri_to_membuf_cached (OstreeFetcher *fetcher,
+                                                       SoupURI        *uri,
+                                                       gboolean       add_nul,
+                                                       gboolean       allow_noent,
+                                                       GBytes         **out_contents,
+                                                       guint64        max_size,
+                                                       GCancellable   *cancellable,
+                                                       GError         **error);
 G_END_DECLS
 
 #endif
@@ -0,0 +1,521 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-object-set.h"
+
+/* Each slot is 33 bytes: the binary checksum followed by the object
+ * type.  Object types start at 1, so a zero type marks an empty
+ * slot.  Collisions are resolved by linear probing, and deletion
+ * shifts later entries of the probe sequence back rather than
+ * leaving tombstones.
+ */
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+} OstreeObjectSetSlot;
+
+G_STATIC_ASSERT (sizeof (OstreeObjectSetSlot) == 33);
+
+#define OBJECT_SET_MIN_SIZE (64)
+
+struct OstreeObjectSet {
+  volatile gint refcount;
+  OstreeObjectSetSlot *slots;
+  gpointer *values;  /* NULL unless created as a map */
+  gsize size;        /* Number of slots, a power of two or 0 */
+  gsize n_entries;
+  gboolean is_map;
+  GDestroyNotify value_destroy;
+};
+
+static OstreeObjectSet *
+object_set_new_internal (gboolean        is_map,
+                         GDestroyNotify  value_destroy)
+{
+  OstreeObjectSet *set = g_new0 (OstreeObjectSet, 1);
+
+  set->refcount = 1;
+  set->is_map = is_map;
+  set->value_destroy = value_destroy;
+  return set;
+}
+
+OstreeObjectSet *
+_ostree_object_set_new (void)
+{
+  return object_set_new_internal (FALSE, NULL);
+}
+
+OstreeObjectSet *
+_ostree_object_map_new (GDestroyNotify value_destroy)
+{
+  return object_set_new_internal (TRUE, value_destroy);
+}
+
+OstreeObjectSet *
+_ostree_object_set_ref (OstreeObjectSet *set)
+{
+  g_atomic_int_inc (&set->refcount);
+  return set;
+}
+
+void
+_ostree_object_set_unref (OstreeObjectSet *set)
+{
+  gsize i;
+
+  if (!g_atomic_int_dec_and_test (&set->refcount))
+    return;
+
+  if (set->value_destroy)
+    {
+      for (i = 0; i < set->size; i++)
+        {
+          if (set->slots[i].objtype != 0 && set->values[i] != NULL)
+            set->value_destroy (set->values[i]);
+        }
+    }
+  g_free (set->slots);
+  g_free (set->values);
+  g_free (set);
+}
+
+/*
+ * _ostree_object_set_copy:
+ *
+ * Returns: A new set with the same entries as @set, which must not
+ * be a map.
+ */
+OstreeObjectSet *
+_ostree_object_set_copy (OstreeObjectSet *set)
+{
+  OstreeObjectSet *ret = _ostree_object_set_new ();
+
+  g_return_val_if_fail (!set->is_map, ret);
+
+  ret->size = set->size;
+  ret->n_entries = set->n_entries;
+  if (set->size > 0)
+    ret->slots = g_memdup (set->slots, set->size * sizeof (OstreeObjectSetSlot));
+  return ret;
+}
+
+guint
+_ostree_object_set_size (OstreeObjectSet *set)
+{
+  return set->n_entries;
+}
+
+/*
+ * _ostree_object_set_get_memory_size:
+ *
+ * Returns: The number of bytes allocated for @set, not counting the
+ * map values themselves.
+ */
+gsize
+_ostree_object_set_get_memory_size (OstreeObjectSet *set)
+{
+  gsize ret = sizeof (OstreeObjectSet) + set->size * sizeof (OstreeObjectSetSlot);
+
+  if (set->is_map)
+    ret += set->size * sizeof (gpointer);
+  return ret;
+}
+
+static inline gsize
+slot_hash (const guchar     *csum,
+           OstreeObjectType  objtype)
+{
+  guint64 v;
+
+  /* Checksums are already uniformly distributed */
+  memcpy (&v, csum, sizeof (v));
+  return (gsize)(v ^ ((guint64)objtype * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)));
+}
+
+static inline gboolean
+slot_equal (const OstreeObjectSetSlot *slot,
+            const guchar              *csum,
+            OstreeObjectType           objtype)
+{
+  return slot->objtype == (guint8)objtype && memcmp (slot->csum, csum, 32) == 0;
+}
+
+/* Returns the index of the slot holding the object, or of the empty
+ * slot where it would be inserted.  The table must not be full.
+ */
+static gsize
+find_slot (OstreeObjectSet  *set,
+           const guchar     *csum,
+           OstreeObjectType  objtype)
+{
+  gsize mask = set->size - 1;
+  gsize i = slot_hash (csum, objtype) & mask;
+
+  while (set->slots[i].objtype != 0 && !slot_equal (&set->slots[i], csum, objtype))
+    i = (i + 1) & mask;
+
+  return i;
+}
+
+static void
+resize (OstreeObjectSet *set,
+        gsize            new_size)
+{
+  OstreeObjectSetSlot *old_slots = set->slots;
+  gpointer *old_values = set->values;
+  gsize old_size = set->size;
+  gsize i;
+
+  set->size = new_size;
+  set->slots = g_new0 (OstreeObjectSetSlot, new_size);
+  set->values = set->is_map ? g_new0 (gpointer, new_size) : NULL;
+
+  for (i = 0; i < old_size; i++)
+    {
+      gsize j;
+
+      if (old_slots[i].objtype == 0)
+        continue;
+
+      j = find_slot (set, old_slots[i].csum, old_slots[i].objtype);
+      set->slots[j] = old_slots[i];
+      if (set->is_map)
+        set->values[j] = old_values[i];
+    }
+
+  g_free (old_slots);
+  g_free (old_values);
+}
+
+/* Keep the load factor at or below 3/4 */
+static void
+maybe_grow (OstreeObjectSet *set)
+{
+  if (set->size == 0)
+    resize (set, OBJECT_SET_MIN_SIZE);
+  else if ((set->n_entries + 1) * 4 > set->size * 3)
+    resize (set, set->size * 2);
+}
+
+static gboolean
+insert_internal (OstreeObjectSet   *set,
+                 const guchar      *csum,
+                 OstreeObjectType   objtype,
+                 gpointer           value)
+{
+  gsize i;
+
+  g_return_val_if_fail (objtype >= OSTREE_OBJECT_TYPE_FILE &&
+                        objtype <= OSTREE_OBJECT_TYPE_LAST, FALSE);
+
+  maybe_grow (set);
+
+  i = find_slot (set, csum, objtype);
+  if (set->slots[i].objtype != 0)
+    {
+      if (set->is_map)
+        {
+          if (set->value_destroy && set->values[i] != NULL)
+            set->value_destroy (set->values[i]);
+          set->values[i] = value;
+        }
+      return FALSE;
+    }
+
+  memcpy (set->slots[i].csum, csum, 32);
+  set->slots[i].objtype = objtype;
+  if (set->is_map)
+    set->values[i] = value;
+  set->n_entries++;
+  return TRUE;
+}
+
+/*
+ * _ostree_object_set_add:
+ *
+ * Returns: %TRUE if the object was not already in @set
+ */
+gboolean
+_ostree_object_set_add (OstreeObjectSet   *set,
+                        const guchar      *csum,
+                        OstreeObjectType   objtype)
+{
+  return insert_internal (set, csum, objtype, NULL);
+}
+
+gboolean
+_ostree_object_set_add_checksum (OstreeObjectSet   *set,
+                                 const char        *checksum,
+                                 OstreeObjectType   objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return _ostree_object_set_add (set, csum, objtype);
+}
+
+gboolean
+_ostree_object_set_contains (OstreeObjectSet   *set,
+                             const guchar      *csum,
+                             OstreeObjectType   objtype)
+{
+  if (set->n_entries == 0)
+    return FALSE;
+
+  return set->slots[find_slot (set, csum, objtype)].objtype != 0;
+}
+
+gboolean
+_ostree_object_set_contains_checksum (OstreeObjectSet   *set,
+                                      const char        *checksum,
+                                      OstreeObjectType   objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return _ostree_object_set_contains (set, csum, objtype);
+}
+
+gboolean
+_ostree_object_set_remove (OstreeObjectSet   *set,
+                           const guchar      *csum,
+                           OstreeObjectType   objtype)
+{
+  gsize mask = set->size - 1;
+  gsize i, j;
+
+  if (set->n_entries == 0)
+    return FALSE;
+
+  i = find_slot (set, csum, objtype);
+  if (set->slots[i].objtype == 0)
+    return FALSE;
+
+  if (set->is_map && set->value_destroy && set->values[i] != NULL)
+    set->value_destroy (set->values[i]);
+
+  /* Move back any following entry whose probe sequence passes
+   * through the hole, so lookups never stop early.
+   */
+  j = i;
+  while (TRUE)
+    {
+      gsize home;
+
+      j = (j + 1) & mask;
+      if (set->slots[j].objtype == 0)
+        break;
+
+      home = slot_hash (set->slots[j].csum, set->slots[j].objtype) & mask;
+      if (((j - home) & mask) < ((j - i) & mask))
+        continue;
+
+      set->slots[i] = set->slots[j];
+      if (set->is_map)
+        set->values[i] = set->values[j];
+      i = j;
+    }
+
+  set->slots[i].objtype = 0;
+  if (set->is_map)
+    set->values[i] = NULL;
+  set->n_entries--;
+  return TRUE;
+}
+
+gboolean
+_ostree_object_set_remove_checksum (OstreeObjectSet   *set,
+                                    const char        *checksum,
+                                    OstreeObjectType   objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return _ostree_object_set_remove (set, csum, objtype);
+}
+
+/*
+ * _ostree_object_map_insert:
+ *
+ * Add the object to @set, which must be a map, replacing any previous
+ * value.
+ */
+void
+_ostree_object_map_insert (OstreeObjectSet   *set,
+                           const guchar      *csum,
+                           OstreeObjectType   objtype,
+                           gpointer           value)
+{
+  g_return_if_fail (set->is_map);
+
+  (void) insert_internal (set, csum, objtype, value);
+}
+
+gpointer
+_ostree_object_map_lookup (OstreeObjectSet   *set,
+                           const guchar      *csum,
+                           OstreeObjectType   objtype)
+{
+  gsize i;
+
+  g_return_val_if_fail (set->is_map, NULL);
+
+  if (set->n_entries == 0)
+    return NULL;
+
+  i = find_slot (set, csum, objtype);
+  if (set->slots[i].objtype == 0)
+    return NULL;
+  return set->values[i];
+}
+
+/*
+ * _ostree_object_set_union:
+ *
+ * Add all objects of @other to @set.  Map values are not copied.
+ */
+void
+_ostree_object_set_union (OstreeObjectSet *set,
+                          OstreeObjectSet *other)
+{
+  gsize i;
+
+  for (i = 0; i < other->size; i++)
+    {
+      if (other->slots[i].objtype != 0)
+        (void) _ostree_object_set_add (set, other->slots[i].csum, other->slots[i].objtype);
+    }
+}
+
+/*
+ * _ostree_object_set_subtract:
+ *
+ * Remove all objects of @other from @set.
+ */
+void
+_ostree_object_set_subtract (OstreeObjectSet *set,
+                             OstreeObjectSet *other)
+{
+  gsize i;
+
+  for (i = 0; i < other->size && set->n_entries > 0; i++)
+    {
+      if (other->slots[i].objtype != 0)
+        (void) _ostree_object_set_remove (set, other->slots[i].csum, other->slots[i].objtype);
+    }
+}
+
+void
+_ostree_object_set_iter_init (OstreeObjectSetIter *iter,
+                              OstreeObjectSet     *set)
+{
+  iter->set = set;
+  iter->idx = 0;
+}
+
+/*
+ * _ostree_object_set_iter_next:
+ * @out_csum: (out) (allow-none): Binary checksum, valid until @set is modified
+ * @out_objtype: (out) (allow-none): Object type
+ * @out_value: (out) (allow-none): Map value
+ *
+ * Returns: %FALSE when there are no more objects
+ */
+gboolean
+_ostree_object_set_iter_next (OstreeObjectSetIter  *iter,
+                              const guchar        **out_csum,
+                              OstreeObjectType     *out_objtype,
+                              gpointer             *out_value)
+{
+  OstreeObjectSet *set = iter->set;
+
+  while (iter->idx < set->size)
+    {
+      gsize i = iter->idx++;
+
+      if (set->slots[i].objtype == 0)
+        continue;
+
+      if (out_csum)
+        *out_csum = set->slots[i].csum;
+      if (out_objtype)
+        *out_objtype = set->slots[i].objtype;
+      if (out_value)
+        *out_value = set->is_map ? set->values[i] : NULL;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * _ostree_object_set_add_from_reachable:
+ * @reachable: A set from ostree_repo_traverse_new_reachable()
+ *
+ * Add the serialized object names in @reachable to @set.
+ */
+void
+_ostree_object_set_add_from_reachable (OstreeObjectSet *set,
+                                       GHashTable      *reachable)
+{
+  GHashTableIter hashiter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&hashiter, reachable);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      (void) _ostree_object_set_add_checksum (set, checksum, objtype);
+    }
+}
+
+/*
+ * _ostree_object_set_add_to_reachable:
+ * @reachable: A set from ostree_repo_traverse_new_reachable()
+ *
+ * Add the objects of @set to @reachable as serialized object names.
+ */
+void
+_ostree_object_set_add_to_reachable (OstreeObjectSet *set,
+                                     GHashTable      *reachable)
+{
+  OstreeObjectSetIter iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+
+  _ostree_object_set_iter_init (&iter, set);
+  while (_ostree_object_set_iter_next (&iter, &csum, &objtype, NULL))
+    {
+      char checksum[65];
+      GVariant *key;
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = ostree_object_name_serialize (checksum, objtype);
+      g_hash_table_replace (reachable, key, key);
+    }
+}
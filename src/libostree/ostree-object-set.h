@@ -0,0 +1,113 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core.h"
+
+G_BEGIN_DECLS
+
+/* A set of object names, stored as binary checksum and object type
+ * in a single open-addressed table, without any per-object
+ * allocation.  This uses a fraction of the memory of a #GHashTable of
+ * serialized object names, which matters for traversals of
+ * repositories with millions of objects.
+ *
+ * A set created with _ostree_object_map_new() additionally maps each
+ * object name to a pointer value.
+ *
+ * Sets are not thread safe, and must not be modified while being
+ * iterated.
+ */
+typedef struct OstreeObjectSet OstreeObjectSet;
+
+typedef struct {
+  OstreeObjectSet *set;
+  gsize            idx;
+} OstreeObjectSetIter;
+
+OstreeObjectSet *_ostree_object_set_new (void);
+
+OstreeObjectSet *_ostree_object_map_new (GDestroyNotify value_destroy);
+
+OstreeObjectSet *_ostree_object_set_ref (OstreeObjectSet *set);
+
+void _ostree_object_set_unref (OstreeObjectSet *set);
+
+OstreeObjectSet *_ostree_object_set_copy (OstreeObjectSet *set);
+
+guint _ostree_object_set_size (OstreeObjectSet *set);
+
+gsize _ostree_object_set_get_memory_size (OstreeObjectSet *set);
+
+gboolean _ostree_object_set_add (OstreeObjectSet   *set,
+                                 const guchar      *csum,
+                                 OstreeObjectType   objtype);
+
+gboolean _ostree_object_set_add_checksum (OstreeObjectSet   *set,
+                                          const char        *checksum,
+                                          OstreeObjectType   objtype);
+
+gboolean _ostree_object_set_contains (OstreeObjectSet   *set,
+                                      const guchar      *csum,
+                                      OstreeObjectType   objtype);
+
+gboolean _ostree_object_set_contains_checksum (OstreeObjectSet   *set,
+                                               const char        *checksum,
+                                               OstreeObjectType   objtype);
+
+gboolean _ostree_object_set_remove (OstreeObjectSet   *set,
+                                    const guchar      *csum,
+                                    OstreeObjectType   objtype);
+
+gboolean _ostree_object_set_remove_checksum (OstreeObjectSet   *set,
+                                             const char        *checksum,
+                                             OstreeObjectType   objtype);
+
+void _ostree_object_map_insert (OstreeObjectSet   *set,
+                                const guchar      *csum,
+                                OstreeObjectType   objtype,
+                                gpointer           value);
+
+gpointer _ostree_object_map_lookup (OstreeObjectSet   *set,
+                                    const guchar      *csum,
+                                    OstreeObjectType   objtype);
+
+void _ostree_object_set_union (OstreeObjectSet *set,
+                               OstreeObjectSet *other);
+
+void _ostree_object_set_subtract (OstreeObjectSet *set,
+                                  OstreeObjectSet *other);
+
+void _ostree_object_set_iter_init (OstreeObjectSetIter *iter,
+                                   OstreeObjectSet     *set);
+
+gboolean _ostree_object_set_iter_next (OstreeObjectSetIter  *iter,
+                                       const guchar        **out_csum,
+                                       OstreeObjectType     *out_objtype,
+                                       gpointer             *out_value);
+
+void _ostree_object_set_add_from_reachable (OstreeObjectSet *set,
+                                            GHashTable      *reachable);
+
+void _ostree_object_set_add_to_reachable (OstreeObjectSet *set,
+                                          GHashTable      *reachable);
+
+G_END_DECLS
@@ -24,6 +24,7 @@
 
 #include <glib-unix.h>
 #include <sys/xattr.h>
+#include <sys/syscall.h>
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gunixoutputstream.h>
 #include "otutil.h"
@@ -35,7 +36,7 @@
 static gboolean
 checkout_object_for_uncompressed_cache (OstreeRepo      *self,
                                         const char      *loose_path,
-                                        GFileInfo       *src_info,
+                                        guint32          src_mode,
                                         GInputStream    *content,
                                         GCancellable    *cancellable,
                                         GError         **error)
@@ -48,8 +49,7 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
   guint32 file_mode;
 
   /* Don't make setuid files in uncompressed cache */
-  file_mode = g_file_info_get_attribute_uint32 (src_info, "unix::mode");
-  file_mode &= ~(S_ISUID|S_ISGID);
+  file_mode = src_mode & ~(S_ISUID|S_ISGID);
 
   if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, file_mode,
                                   &temp_filename, &temp_out,
@@ -102,9 +102,17 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
   return ret;
 }
 
+/* In parallel mode, everything is flushed by one syncfs() at the end */
+static gboolean
+checkout_fsync_each (OstreeRepo                *self,
+                     OstreeRepoCheckoutOptions *options)
+{
+  return !self->disable_fsync && options->n_workers <= 1;
+}
+
 static gboolean
 write_regular_file_content (OstreeRepo            *self,
-                            OstreeRepoCheckoutMode mode,
+                            OstreeRepoCheckoutOptions *options,
                             GOutputStream         *output,
                             GFileInfo             *file_info,
                             GVariant              *xattrs,
@@ -113,19 +121,33 @@ write_regular_file_content (OstreeRepo            *self,
                             GError               **error)
 {
   gboolean ret = FALSE;
+  gboolean cloned = FALSE;
   int fd;
   int res;
 
-  if (g_output_stream_splice (output, input, 0,
-                              cancellable, error) < 0)
-    goto out;
+  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
 
-  if (!g_output_stream_flush (output, cancellable, error))
-    goto out;
+  /* Objects of bare repositories are plain files; share their data
+   * if the filesystem can.
+   */
+  if (G_IS_FILE_DESCRIPTOR_BASED (input))
+    {
+      if (!ot_regfile_clone (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input),
+                             fd, g_file_info_get_size (file_info), &cloned, error))
+        goto out;
+    }
 
-  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)output);
+  if (!cloned)
+    {
+      if (g_output_stream_splice (output, input, 0,
+                                  cancellable, error) < 0)
+        goto out;
+
+      if (!g_output_stream_flush (output, cancellable, error))
+        goto out;
+    }
 
-  if (mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+  if (options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
     {
       do
         res = fchown (fd,
@@ -154,7 +176,7 @@ write_regular_file_content (OstreeRepo            *self,
         }
     }
           
-  if (!self->disable_fsync)
+  if (checkout_fsync_each (self, options))
     {
       if (fsync (fd) == -1)
         {
@@ -238,7 +260,7 @@ checkout_file_from_input_at (OstreeRepo     *self,
       temp_out = g_unix_output_stream_new (fd, TRUE);
       fd = -1; /* Transfer ownership */
 
-      if (!write_regular_file_content (self, options->mode, temp_out, file_info, xattrs, input,
+      if (!write_regular_file_content (self, options, temp_out, file_info, xattrs, input,
                                        cancellable, error))
         goto out;
     }
@@ -298,7 +320,7 @@ checkout_file_unioning_from_input_at (OstreeRepo     *repo,
                                       cancellable, error))
         goto out;
 
-      if (!write_regular_file_content (repo, options->mode, temp_out, file_info, xattrs, input,
+      if (!write_regular_file_content (repo, options, temp_out, file_info, xattrs, input,
                                        cancellable, error))
         goto out;
     }
@@ -377,30 +399,28 @@ checkout_file_hardlink (OstreeRepo                          *self,
 static gboolean
 checkout_one_file_at (OstreeRepo                        *repo,
                       OstreeRepoCheckoutOptions         *options,
-                      GFile                             *source,
-                      GFileInfo                         *source_info,
+                      const char                        *checksum,
+                      guint32                            source_mode,
                       int                                destination_dfd,
                       const char                        *destination_name,
                       GCancellable                      *cancellable,
                       GError                           **error)
 {
   gboolean ret = FALSE;
-  const char *checksum;
   gboolean is_symlink;
   gboolean can_cache;
   gboolean did_hardlink = FALSE;
   char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
   g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GFileInfo) source_info = NULL;
   g_autoptr(GVariant) xattrs = NULL;
 
-  is_symlink = g_file_info_get_file_type (source_info) == G_FILE_TYPE_SYMBOLIC_LINK;
-
-  checksum = ostree_repo_file_get_checksum ((OstreeRepoFile*)source);
+  is_symlink = S_ISLNK (source_mode);
 
   /* Try to do a hardlink first, if it's a regular file.  This also
    * traverses all parent repos.
    */
-  if (!is_symlink)
+  if (!is_symlink && !options->force_copy)
     {
       OstreeRepo *current_repo = repo;
 
@@ -412,7 +432,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
                                && options->mode == OSTREE_REPO_CHECKOUT_MODE_USER));
           gboolean current_can_cache = (options->enable_uncompressed_cache
                                         && current_repo->enable_uncompressed_cache);
-          gboolean is_archive_z2_with_cache = (current_repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+          gboolean is_archive_z2_with_cache = (_OSTREE_REPO_MODE_IS_ARCHIVE (current_repo->mode)
                                                && options->mode == OSTREE_REPO_CHECKOUT_MODE_USER
                                                && current_can_cache);
 
@@ -445,7 +465,8 @@ checkout_one_file_at (OstreeRepo                        *repo,
   if (can_cache
       && !is_symlink
       && !did_hardlink
-      && repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+      && !options->force_copy
+      && _OSTREE_REPO_MODE_IS_ARCHIVE (repo->mode)
       && options->mode == OSTREE_REPO_CHECKOUT_MODE_USER)
     {
       if (!ostree_repo_load_file (repo, checksum, &input, NULL, NULL,
@@ -456,7 +477,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
       _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
 
       if (!checkout_object_for_uncompressed_cache (repo, loose_path_buf,
-                                                   source_info, input,
+                                                   source_mode, input,
                                                    cancellable, error))
         {
           g_prefix_error (error, "Unpacking loose object %s: ", checksum);
@@ -500,10 +521,12 @@ checkout_one_file_at (OstreeRepo                        *repo,
         }
     }
 
-  /* Fall back to copy if we couldn't hardlink */
+  /* Fall back to copy if we couldn't hardlink; only now do we need
+   * the full file info.
+   */
   if (!did_hardlink)
     {
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, &xattrs,
+      if (!ostree_repo_load_file (repo, checksum, &input, &source_info, &xattrs,
                                   cancellable, error))
         goto out;
 
@@ -613,8 +636,8 @@ checkout_tree_at (OstreeRepo                        *self,
   if (g_file_info_get_file_type (source_info) != G_FILE_TYPE_DIRECTORY)
     {
       ret = checkout_one_file_at (self, options,
-                                  (GFile *) source,
-                                  source_info,
+                                  ostree_repo_file_get_checksum (source),
+                                  g_file_info_get_attribute_uint32 (source_info, "unix::mode"),
                                   destination_dfd,
                                   g_file_info_get_name (source_info),
                                   cancellable, error);
@@ -653,7 +676,8 @@ checkout_tree_at (OstreeRepo                        *self,
       else
         {
           if (!checkout_one_file_at (self, options,
-                                     src_child, file_info,
+                                     ostree_repo_file_get_checksum ((OstreeRepoFile*)src_child),
+                                     g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
                                      destination_dfd, name,
                                      cancellable, error))
             goto out;
@@ -726,108 +750,1483 @@ checkout_tree_at (OstreeRepo                        *self,
   return ret;
 }
 
-/**
- * ostree_repo_checkout_tree:
- * @self: Repo
- * @mode: Options controlling all files
- * @overwrite_mode: Whether or not to overwrite files
- * @destination: Place tree here
- * @source: Source tree
- * @source_info: Source info
- * @cancellable: Cancellable
- * @error: Error
- *
- * Check out @source into @destination, which must live on the
- * physical filesystem.  @source may be any subdirectory of a given
- * commit.  The @mode and @overwrite_mode allow control over how the
- * files are checked out.
- */
-gboolean
-ostree_repo_checkout_tree (OstreeRepo               *self,
-                           OstreeRepoCheckoutMode    mode,
-                           OstreeRepoCheckoutOverwriteMode    overwrite_mode,
-                           GFile                    *destination,
-                           OstreeRepoFile           *source,
-                           GFileInfo                *source_info,
-                           GCancellable             *cancellable,
-                           GError                  **error)
+/* Load the ownership, mode and extended attributes of a directory */
+static gboolean
+load_dirmeta (OstreeRepo     *self,
+              const char     *metadata_checksum,
+              guint32        *out_uid,
+              guint32        *out_gid,
+              guint32        *out_mode,
+              GVariant      **out_xattrs,
+              GError        **error)
 {
-  OstreeRepoCheckoutOptions options = { 0, };
+  gboolean ret = FALSE;
+  g_autoptr(GVariant) dirmeta = NULL;
+  guint32 uid, gid, mode;
 
-  options.mode = mode;
-  options.overwrite_mode = overwrite_mode;
-  /* Backwards compatibility */
-  options.enable_uncompressed_cache = TRUE;
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_META,
+                                 metadata_checksum, &dirmeta, error))
+    goto out;
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, out_xattrs);
 
-  return checkout_tree_at (self, &options,
-                           AT_FDCWD, gs_file_get_path_cached (destination),
-                           source, source_info,
-                           cancellable, error);
+  ret = TRUE;
+  *out_uid = GUINT32_FROM_BE (uid);
+  *out_gid = GUINT32_FROM_BE (gid);
+  *out_mode = GUINT32_FROM_BE (mode);
+ out:
+  return ret;
 }
 
-/**
- * ostree_repo_checkout_tree_at:
- * @self: Repo
- * @options: (allow-none): Options
- * @destination_dfd: Directory FD for destination
- * @destination_path: Directory for destination
- * @commit: Checksum for commit
- * @cancellable: Cancellable
- * @error: Error
- *
- * Similar to ostree_repo_checkout_tree(), but uses directory-relative
- * paths for the destination, uses a new `OstreeRepoCheckoutOptions`,
- * and takes a commit checksum and optional subpath pair, rather than
- * requiring use of `GFile` APIs for the caller.
+/*
+ * checkout_dirtree_at:
  *
- * Note in addition that unlike ostree_repo_checkout_tree(), the
- * default is not to use the repository-internal uncompressed objects
- * cache.
+ * The same as checkout_tree_at() for a directory, but walking the
+ * dirtree and dirmeta objects directly rather than going through
+ * OstreeRepoFile; this avoids allocating a GFile and a GFileInfo for
+ * every entry, and a lookup per child.
  */
-gboolean
-ostree_repo_checkout_tree_at (OstreeRepo                         *self,
-                              OstreeRepoCheckoutOptions         *options,
-                              int                                destination_dfd,
-                              const char                        *destination_path,
-                              const char                        *commit,
-                              GCancellable                      *cancellable,
-                              GError                           **error)
+static gboolean
+checkout_dirtree_at (OstreeRepo                        *self,
+                     OstreeRepoCheckoutOptions         *options,
+                     int                                destination_parent_fd,
+                     const char                        *destination_name,
+                     const char                        *contents_checksum,
+                     const char                        *metadata_checksum,
+                     GCancellable                      *cancellable,
+                     GError                           **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GFile) commit_root = NULL;
-  g_autoptr(GFile) target_dir = NULL;
-  g_autoptr(GFileInfo) target_info = NULL;
-  OstreeRepoCheckoutOptions default_options = { 0, };
+  gboolean did_exist = FALSE;
+  glnx_fd_close int destination_dfd = -1;
+  int res;
+  guint32 uid, gid, mode;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files_variant = NULL;
+  g_autoptr(GVariant) dirs_variant = NULL;
+  guint i, n;
 
-  if (!options)
+  if (!load_dirmeta (self, metadata_checksum, &uid, &gid, &mode, &xattrs, error))
+    goto out;
+
+  /* Create initially with mode 0700, then chown/chmod only when we're
+   * done.  This avoids anyone else being able to operate on partially
+   * constructed dirs.
+   */
+  do
+    res = mkdirat (destination_parent_fd, destination_name, 0700);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1)
     {
-      default_options.subpath = NULL;
-      options = &default_options;
+      if (errno == EEXIST && options->overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
+        did_exist = TRUE;
+      else
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
     }
 
-  commit_root = (GFile*) _ostree_repo_file_new_for_commit (self, commit, error);
-  if (!commit_root)
+  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
+                               &destination_dfd,
+                               cancellable, error))
     goto out;
 
-  if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile*)commit_root, error))
-    goto out;
+  /* Set the xattrs now, so any derived labeling works */
+  if (!did_exist && options->mode != OSTREE_REPO_CHECKOUT_MODE_USER
+      && g_variant_n_children (xattrs) > 0)
+    {
+      if (!gs_fd_set_all_xattrs (destination_dfd, xattrs, cancellable, error))
+        goto out;
+    }
 
-  if (options->subpath && strcmp (options->subpath, "/") != 0)
-    target_dir = g_file_get_child (commit_root, options->subpath);
-  else
-    target_dir = g_object_ref (commit_root);
-  target_info = g_file_query_info (target_dir, OSTREE_GIO_FAST_QUERYINFO,
-                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                   cancellable, error);
-  if (!target_info)
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 contents_checksum, &dirtree, error))
     goto out;
 
-  if (!checkout_tree_at (self, options,
-                         destination_dfd,
-                         destination_path,
-                         (OstreeRepoFile*)target_dir, target_info,
-                         cancellable, error))
-    goto out;
+  files_variant = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      guint32 mode;
+      char checksum[65];
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &csum_v);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), checksum);
+
+      if (!_ostree_repo_load_file_mode (self, checksum, &mode,
+                                        cancellable, error))
+        goto out;
+
+      if (!checkout_one_file_at (self, options, checksum, mode,
+                                 destination_dfd, name,
+                                 cancellable, error))
+        goto out;
+    }
+
+  dirs_variant = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) contents_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      char child_contents_checksum[65];
+      char child_meta_checksum[65];
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &contents_csum_v, &meta_csum_v);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_v),
+                                          child_contents_checksum);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (meta_csum_v),
+                                          child_meta_checksum);
+
+      if (!checkout_dirtree_at (self, options, destination_dfd, name,
+                                child_contents_checksum, child_meta_checksum,
+                                cancellable, error))
+        goto out;
+    }
+
+  /* We do fchmod/fchown last so that no one else could access the
+   * partially created directory and change content we're laying out.
+   */
+  if (!did_exist)
+    {
+      do
+        res = fchmod (destination_dfd, mode);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  if (!did_exist && options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      do
+        res = fchown (destination_dfd, uid, gid);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  /* Set directory mtime to 0, so that it is constant for all checkouts.
+   * Must be done after setting permissions and creating all children.
+   */
+  if (!did_exist)
+    {
+      const struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, } };
+      do
+        res = futimens (destination_dfd, times);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  if (!self->disable_fsync)
+    {
+      if (fsync (destination_dfd) == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Find @name in the sorted dirtree entries @entries */
+static gboolean
+dirtree_entries_lookup (GVariant    *entries,
+                        const char  *name,
+                        gsize       *out_index)
+{
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (entries);
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      g_autoptr(GVariant) entry = g_variant_get_child_value (entries, mid);
+      const char *cur;
+      int c;
+
+      g_variant_get_child (entry, 0, "&s", &cur);
+      c = strcmp (name, cur);
+      if (c == 0)
+        {
+          if (out_index)
+            *out_index = mid;
+          return TRUE;
+        }
+      else if (c < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return FALSE;
+}
+
+/* Whether the dirtree subdirectory entries @a and @b have the same
+ * names, whatever their checksums.
+ */
+static gboolean
+dirtree_dir_names_equal (GVariant *a,
+                         GVariant *b)
+{
+  gsize i, n = g_variant_n_children (a);
+
+  if (n != g_variant_n_children (b))
+    return FALSE;
+
+  for (i = 0; i < n; i++)
+    {
+      const char *name_a;
+      const char *name_b;
+
+      g_variant_get_child (a, i, "(&s@ay@ay)", &name_a, NULL, NULL);
+      g_variant_get_child (b, i, "(&s@ay@ay)", &name_b, NULL, NULL);
+      if (strcmp (name_a, name_b) != 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+static int
+renameat_exchange (int          dfd,
+                   const char  *a,
+                   const char  *b)
+{
+#ifdef SYS_renameat2
+  return syscall (SYS_renameat2, dfd, a, dfd, b, RENAME_EXCHANGE);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Give the owner full access to @name, a directory in @dfd; in user
+ * mode we can't otherwise add, remove or move entries of a read-only
+ * directory, nor move it to another parent.  @out_old_mode is set to
+ * the previous mode, if it was changed, and 0 otherwise.
+ */
+static gboolean
+ensure_dir_writable_at (int           dfd,
+                        const char   *name,
+                        guint32      *out_old_mode,
+                        GError      **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  int res;
+
+  *out_old_mode = 0;
+
+  if (fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if ((stbuf.st_mode & S_IRWXU) != S_IRWXU)
+    {
+      do
+        res = fchmodat (dfd, name, (stbuf.st_mode & 07777) | S_IRWXU, 0);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+      *out_old_mode = stbuf.st_mode & 07777;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Make every directory of the tree at @name writable, so that deleting
+ * a user mode checkout with read-only directories doesn't fail partway
+ * through.
+ */
+static gboolean
+ensure_tree_writable_at (int            dfd,
+                         const char    *name,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  gboolean ret = FALSE;
+  guint32 old_mode;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+
+  if (!ensure_dir_writable_at (dfd, name, &old_mode, error))
+    goto out;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &dfd_iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        goto out;
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_UNKNOWN)
+        {
+          if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+          if (!S_ISDIR (stbuf.st_mode))
+            continue;
+        }
+      else if (dent->d_type != DT_DIR)
+        continue;
+
+      if (!ensure_tree_writable_at (dfd_iter.fd, dent->d_name, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+rm_rf_checkout_at (OstreeRepoCheckoutOptions         *options,
+                   int                                dfd,
+                   const char                        *name,
+                   GCancellable                      *cancellable,
+                   GError                           **error)
+{
+  gboolean ret = FALSE;
+
+  if (options->mode == OSTREE_REPO_CHECKOUT_MODE_USER
+      && !ensure_tree_writable_at (dfd, name, cancellable, error))
+    goto out;
+
+  if (!gs_shutil_rm_rf_at (dfd, name, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+checkout_file_csum_at (OstreeRepo                        *self,
+                       OstreeRepoCheckoutOptions         *options,
+                       GVariant                          *csum_v,
+                       int                                destination_dfd,
+                       const char                        *name,
+                       GCancellable                      *cancellable,
+                       GError                           **error)
+{
+  gboolean ret = FALSE;
+  guint32 mode;
+  char checksum[65];
+
+  ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), checksum);
+
+  if (!_ostree_repo_load_file_mode (self, checksum, &mode,
+                                    cancellable, error))
+    goto out;
+
+  if (!checkout_one_file_at (self, options, checksum, mode,
+                             destination_dfd, name,
+                             cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Reuse the unchanged file @name of the old directory @old_dfd by
+ * hardlinking it into @new_dfd, or check it out again if that's not
+ * possible.
+ */
+static gboolean
+link_unchanged_file_at (OstreeRepo                        *self,
+                        OstreeRepoCheckoutOptions         *options,
+                        GVariant                          *csum_v,
+                        int                                old_dfd,
+                        int                                new_dfd,
+                        const char                        *name,
+                        GCancellable                      *cancellable,
+                        GError                           **error)
+{
+  if (linkat (old_dfd, name, new_dfd, name, 0) == 0)
+    return TRUE;
+
+  switch (errno)
+    {
+    case EMLINK:
+    case EPERM:
+    case ENOENT:
+      return checkout_file_csum_at (self, options, csum_v, new_dfd, name,
+                                    cancellable, error);
+    default:
+      gs_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+}
+
+/* Put the directory @tmpname in place of @name, both in @parent_dfd,
+ * and set @out_old_name to where the old @name is now.  With
+ * renameat2(RENAME_EXCHANGE) this is a single step; otherwise there is
+ * a short window where @name doesn't exist.
+ */
+static gboolean
+swap_dir_into_place (int                                parent_dfd,
+                     const char                        *tmpname,
+                     const char                        *name,
+                     char                             **out_old_name,
+                     GError                           **error)
+{
+  gboolean ret = FALSE;
+  g_autofree char *old_name = NULL;
+
+  if (renameat_exchange (parent_dfd, tmpname, name) == 0)
+    {
+      old_name = g_strdup (tmpname);
+    }
+  else if (errno == ENOSYS || errno == EINVAL)
+    {
+      old_name = gs_fileutil_gen_tmp_name (".ostree-checkout-", NULL);
+      if (renameat (parent_dfd, name, parent_dfd, old_name) == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+      if (renameat (parent_dfd, tmpname, parent_dfd, name) == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          (void) renameat (parent_dfd, old_name, parent_dfd, name);
+          goto out;
+        }
+    }
+  else
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_old_name, &old_name);
+ out:
+  return ret;
+}
+
+/* Set the metadata of the checked out directory @dfd from its dirmeta,
+ * as checkout_dirtree_at() does once the directory is complete.
+ */
+static gboolean
+set_dir_metadata (OstreeRepo                        *self,
+                  OstreeRepoCheckoutOptions         *options,
+                  int                                dfd,
+                  guint32                            uid,
+                  guint32                            gid,
+                  guint32                            mode,
+                  GVariant                          *xattrs,
+                  GCancellable                      *cancellable,
+                  GError                           **error)
+{
+  gboolean ret = FALSE;
+  int res;
+
+  if (options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      if (g_variant_n_children (xattrs) > 0
+          && !gs_fd_set_all_xattrs (dfd, xattrs, cancellable, error))
+        goto out;
+
+      do
+        res = fchown (dfd, uid, gid);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  do
+    res = fchmod (dfd, mode);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (G_UNLIKELY (res == -1))
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  {
+    const struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, } };
+    do
+      res = futimens (dfd, times);
+    while (G_UNLIKELY (res == -1 && errno == EINTR));
+    if (G_UNLIKELY (res == -1))
+      {
+        gs_set_error_from_errno (error, errno);
+        goto out;
+      }
+  }
+
+  if (!self->disable_fsync)
+    {
+      if (fsync (dfd) == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Move the up to date subdirectory @name from @old_dfd to @new_dfd.
+ * Moving a directory to another parent needs write access to it, so in
+ * user mode it may have to be made writable for the move.  Its mtime
+ * is reset, in case the filesystem counts the new ".." as a change.
+ */
+static gboolean
+move_unchanged_dir_at (OstreeRepoCheckoutOptions         *options,
+                       int                                old_dfd,
+                       int                                new_dfd,
+                       const char                        *name,
+                       GError                           **error)
+{
+  gboolean ret = FALSE;
+  guint32 old_mode = 0;
+  int res;
+
+  if (options->mode == OSTREE_REPO_CHECKOUT_MODE_USER
+      && !ensure_dir_writable_at (old_dfd, name, &old_mode, error))
+    goto out;
+
+  if (renameat (old_dfd, name, new_dfd, name) == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (old_mode != 0)
+    {
+      do
+        res = fchmodat (new_dfd, name, old_mode, 0);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  {
+    const struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, } };
+    if (utimensat (new_dfd, name, times, AT_SYMLINK_NOFOLLOW) == -1)
+      {
+        gs_set_error_from_errno (error, errno);
+        goto out;
+      }
+  }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * update_dirtree_at:
+ *
+ * Turn the existing checkout of the directory described by
+ * @old_contents_checksum and @old_metadata_checksum at
+ * @destination_name into a checkout of the new checksums, as
+ * checkout_dirtree_at() would have made it.  Unchanged subdirectories
+ * are skipped without being looked at, so the work done is
+ * proportional to the size of the difference.
+ *
+ * A directory whose own entries (its files, and the names of its
+ * subdirectories) are unchanged is updated in place, by recursing
+ * into its subdirectories.  Only a directory whose entries change is
+ * replaced: its kept subdirectories are updated first, then a new copy
+ * of it is built next to the old one, with unchanged files hardlinked
+ * and new ones checked out, the kept subdirectories are moved over
+ * right before the new copy is swapped in with
+ * renameat2(RENAME_EXCHANGE).
+ */
+static gboolean
+update_dirtree_at (OstreeRepo                        *self,
+                   OstreeRepoCheckoutOptions         *options,
+                   int                                destination_parent_fd,
+                   const char                        *destination_name,
+                   const char                        *old_contents_checksum,
+                   const char                        *old_metadata_checksum,
+                   const char                        *new_contents_checksum,
+                   const char                        *new_metadata_checksum,
+                   GCancellable                      *cancellable,
+                   GError                           **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int old_dfd = -1;
+  glnx_fd_close int new_dfd = -1;
+  g_autofree char *tmpname = NULL;
+  g_autofree char *old_name = NULL;
+  g_autoptr(GVariant) old_dirtree = NULL;
+  g_autoptr(GVariant) new_dirtree = NULL;
+  g_autoptr(GVariant) old_files = NULL;
+  g_autoptr(GVariant) new_files = NULL;
+  g_autoptr(GVariant) old_dirs = NULL;
+  g_autoptr(GVariant) new_dirs = NULL;
+  g_autoptr(GPtrArray) unchanged_dirs = g_ptr_array_new ();
+  guint moved = 0;
+  gboolean entries_changed;
+  gsize i, n;
+  guint32 uid, gid, mode, old_mode;
+  g_autoptr(GVariant) xattrs = NULL;
+
+  if (strcmp (old_contents_checksum, new_contents_checksum) == 0
+      && strcmp (old_metadata_checksum, new_metadata_checksum) == 0)
+    return TRUE;
+
+  if (!load_dirmeta (self, new_metadata_checksum, &uid, &gid, &mode, &xattrs, error))
+    goto out;
+
+  /* Only the metadata changed; that can be done in place */
+  if (strcmp (old_contents_checksum, new_contents_checksum) == 0)
+    {
+      if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
+                                   &old_dfd, cancellable, error))
+        goto out;
+      if (!set_dir_metadata (self, options, old_dfd, uid, gid, mode, xattrs,
+                             cancellable, error))
+        goto out;
+      ret = TRUE;
+      goto out;
+    }
+
+  if (options->mode == OSTREE_REPO_CHECKOUT_MODE_USER
+      && !ensure_dir_writable_at (destination_parent_fd, destination_name,
+                                  &old_mode, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
+                               &old_dfd, cancellable, error))
+    goto out;
+
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 old_contents_checksum, &old_dirtree, error))
+    goto out;
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 new_contents_checksum, &new_dirtree, error))
+    goto out;
+
+  old_files = g_variant_get_child_value (old_dirtree, 0);
+  new_files = g_variant_get_child_value (new_dirtree, 0);
+  old_dirs = g_variant_get_child_value (old_dirtree, 1);
+  new_dirs = g_variant_get_child_value (new_dirtree, 1);
+
+  entries_changed = !g_variant_equal (old_files, new_files)
+    || !dirtree_dir_names_equal (old_dirs, new_dirs);
+
+  /* First bring the subdirectories we keep up to date, each in place
+   * or swapped in on its own.
+   */
+  n = g_variant_n_children (new_dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      gsize k;
+      g_autoptr(GVariant) old_contents_v = NULL;
+      g_autoptr(GVariant) old_meta_v = NULL;
+      g_autoptr(GVariant) new_contents_v = NULL;
+      g_autoptr(GVariant) new_meta_v = NULL;
+      char old_child_contents[65];
+      char old_child_meta[65];
+      char new_child_contents[65];
+      char new_child_meta[65];
+
+      g_variant_get_child (new_dirs, i, "(&s@ay@ay)", &name, &new_contents_v, &new_meta_v);
+      if (!dirtree_entries_lookup (old_dirs, name, &k))
+        continue;
+      g_variant_get_child (old_dirs, k, "(&s@ay@ay)", NULL, &old_contents_v, &old_meta_v);
+
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (old_contents_v),
+                                          old_child_contents);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (old_meta_v),
+                                          old_child_meta);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (new_contents_v),
+                                          new_child_contents);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (new_meta_v),
+                                          new_child_meta);
+
+      if (!update_dirtree_at (self, options, old_dfd, name,
+                              old_child_contents, old_child_meta,
+                              new_child_contents, new_child_meta,
+                              cancellable, error))
+        goto out;
+
+      g_ptr_array_add (unchanged_dirs, (char*)name);
+    }
+
+  /* Nothing else here changes; leave this directory where it is */
+  if (!entries_changed)
+    {
+      if (!set_dir_metadata (self, options, old_dfd, uid, gid, mode, xattrs,
+                             cancellable, error))
+        goto out;
+      ret = TRUE;
+      goto out;
+    }
+
+  /* Create initially with mode 0700, as checkout_dirtree_at() does */
+  tmpname = gs_fileutil_gen_tmp_name (".ostree-checkout-", NULL);
+  if (mkdirat (destination_parent_fd, tmpname, 0700) == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      g_clear_pointer (&tmpname, g_free);
+      goto out;
+    }
+
+  if (!gs_file_open_dir_fd_at (destination_parent_fd, tmpname,
+                               &new_dfd, cancellable, error))
+    goto out;
+
+  /* Set the xattrs now, so any derived labeling works */
+  if (options->mode != OSTREE_REPO_CHECKOUT_MODE_USER
+      && g_variant_n_children (xattrs) > 0)
+    {
+      if (!gs_fd_set_all_xattrs (new_dfd, xattrs, cancellable, error))
+        goto out;
+    }
+
+  n = g_variant_n_children (new_files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      gsize k;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autoptr(GVariant) old_csum_v = NULL;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      g_variant_get_child (new_files, i, "(&s@ay)", &name, &csum_v);
+
+      if (dirtree_entries_lookup (old_files, name, &k))
+        g_variant_get_child (old_files, k, "(&s@ay)", NULL, &old_csum_v);
+
+      if (old_csum_v && memcmp (ostree_checksum_bytes_peek (old_csum_v),
+                                ostree_checksum_bytes_peek (csum_v), 32) == 0)
+        {
+          if (!link_unchanged_file_at (self, options, csum_v, old_dfd, new_dfd, name,
+                                       cancellable, error))
+            goto out;
+        }
+      else
+        {
+          if (!checkout_file_csum_at (self, options, csum_v, new_dfd, name,
+                                      cancellable, error))
+            goto out;
+        }
+    }
+
+  n = g_variant_n_children (new_dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) contents_v = NULL;
+      g_autoptr(GVariant) meta_v = NULL;
+      char child_contents[65];
+      char child_meta[65];
+
+      g_variant_get_child (new_dirs, i, "(&s@ay@ay)", &name, &contents_v, &meta_v);
+      if (dirtree_entries_lookup (old_dirs, name, NULL))
+        continue;
+
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_v),
+                                          child_contents);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (meta_v),
+                                          child_meta);
+
+      if (!checkout_dirtree_at (self, options, new_dfd, name,
+                                child_contents, child_meta,
+                                cancellable, error))
+        goto out;
+    }
+
+  /* Moving the kept subdirectories takes them out of the old copy, so
+   * do it last, right before the swap.
+   */
+  for (moved = 0; moved < unchanged_dirs->len; moved++)
+    {
+      if (!move_unchanged_dir_at (options, old_dfd, new_dfd,
+                                  unchanged_dirs->pdata[moved], error))
+        goto out;
+    }
+
+  if (!set_dir_metadata (self, options, new_dfd, uid, gid, mode, xattrs,
+                         cancellable, error))
+    goto out;
+
+  if (!swap_dir_into_place (destination_parent_fd, tmpname, destination_name,
+                            &old_name, error))
+    goto out;
+  g_clear_pointer (&tmpname, g_free);
+
+  if (!self->disable_fsync)
+    {
+      if (fsync (destination_parent_fd) == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  if (!rm_rf_checkout_at (options, destination_parent_fd, old_name,
+                          cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (tmpname)
+    {
+      /* Put back what we took from the old copy */
+      for (i = 0; i < moved; i++)
+        {
+          const char *name = unchanged_dirs->pdata[i];
+          (void) renameat (new_dfd, name, old_dfd, name);
+        }
+      (void) rm_rf_checkout_at (options, destination_parent_fd, tmpname, NULL, NULL);
+    }
+  return ret;
+}
+
+/* State shared by all workers of a parallel checkout */
+typedef struct {
+  OstreeRepo                *repo;
+  OstreeRepoCheckoutOptions *options;
+  int                        root_dfd;
+  GThreadPool               *pool;
+  GCancellable              *cancellable;
+
+  GMutex                     lock;
+  GCond                      cond;
+  guint                      n_outstanding;
+  GError                    *error;
+} CheckoutParallelData;
+
+typedef struct CheckoutDirTask CheckoutDirTask;
+
+/* One directory in a parallel checkout.  @n_pending counts the
+ * directory's own entries (one unit) plus each subdirectory which has
+ * not yet been finished; the directory is finished (mode, ownership,
+ * mtime) when it drops to zero, exactly as the serial path does after
+ * the recursion returns.  @dfd stays open only while the directory is
+ * likely to be finished by the worker which filled it, so the number
+ * of open descriptors is bounded by the number of workers.
+ */
+struct CheckoutDirTask {
+  CheckoutParallelData *data;
+  CheckoutDirTask      *parent;
+  volatile gint         n_pending;
+
+  char                 *relpath; /* Relative to root_dfd */
+  char                 *contents_checksum;
+  char                 *metadata_checksum;
+  int                   dfd;
+
+  gboolean              did_exist;
+  guint32               uid;
+  guint32               gid;
+  guint32               mode;
+};
+
+static void
+checkout_dir_task_free (CheckoutDirTask *task)
+{
+  g_free (task->relpath);
+  g_free (task->contents_checksum);
+  g_free (task->metadata_checksum);
+  if (task->dfd != -1)
+    (void) close (task->dfd);
+  g_free (task);
+}
+
+static gboolean
+checkout_parallel_failed (CheckoutParallelData *data)
+{
+  gboolean ret;
+
+  g_mutex_lock (&data->lock);
+  ret = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  return ret || g_cancellable_is_cancelled (data->cancellable);
+}
+
+static void
+checkout_parallel_take_error (CheckoutParallelData *data,
+                              GError               *error)
+{
+  g_mutex_lock (&data->lock);
+  if (data->error == NULL)
+    data->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&data->lock);
+}
+
+static void
+checkout_dir_task_push (CheckoutParallelData *data,
+                        CheckoutDirTask      *parent,
+                        const char           *relpath,
+                        const char           *contents_checksum,
+                        const char           *metadata_checksum)
+{
+  CheckoutDirTask *task = g_new0 (CheckoutDirTask, 1);
+
+  task->data = data;
+  task->parent = parent;
+  task->n_pending = 1;
+  task->relpath = g_strdup (relpath);
+  task->contents_checksum = g_strdup (contents_checksum);
+  task->metadata_checksum = g_strdup (metadata_checksum);
+  task->dfd = -1;
+
+  if (parent)
+    g_atomic_int_inc (&parent->n_pending);
+
+  g_mutex_lock (&data->lock);
+  data->n_outstanding++;
+  g_mutex_unlock (&data->lock);
+
+  g_thread_pool_push (data->pool, task, NULL);
+}
+
+static gboolean
+finish_directory_at (CheckoutParallelData *data,
+                     CheckoutDirTask      *task,
+                     GError              **error)
+{
+  gboolean ret = FALSE;
+  const struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, } };
+  int res;
+
+  if (task->did_exist)
+    return TRUE;
+
+  if (task->dfd == -1
+      && !glnx_opendirat (data->root_dfd, task->relpath, FALSE, &task->dfd, error))
+    goto out;
+
+  do
+    res = fchmod (task->dfd, task->mode);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (G_UNLIKELY (res == -1))
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  if (data->options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      do
+        res = fchown (task->dfd, task->uid, task->gid);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (G_UNLIKELY (res == -1))
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+
+  do
+    res = futimens (task->dfd, times);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (G_UNLIKELY (res == -1))
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Finishing directory %s: ", task->relpath);
+  return ret;
+}
+
+/* Drop one pending unit from @task; finishing a directory in turn
+ * releases its parent.
+ */
+static void
+checkout_dir_task_complete (CheckoutDirTask *task)
+{
+  while (task && g_atomic_int_dec_and_test (&task->n_pending))
+    {
+      CheckoutDirTask *parent = task->parent;
+      CheckoutParallelData *data = task->data;
+      GError *local_error = NULL;
+
+      if (!checkout_parallel_failed (data)
+          && !finish_directory_at (data, task, &local_error))
+        checkout_parallel_take_error (data, local_error);
+
+      checkout_dir_task_free (task);
+
+      g_mutex_lock (&data->lock);
+      if (--data->n_outstanding == 0)
+        g_cond_signal (&data->cond);
+      g_mutex_unlock (&data->lock);
+
+      task = parent;
+    }
+}
+
+static gboolean
+checkout_dir_task_run (CheckoutParallelData *data,
+                       CheckoutDirTask      *task,
+                       GError              **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepo *repo = data->repo;
+  OstreeRepoCheckoutOptions *options = data->options;
+  GCancellable *cancellable = data->cancellable;
+  glnx_fd_close int dfd = -1;
+  int res;
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GVariant) files_variant = NULL;
+  g_autoptr(GVariant) dirs_variant = NULL;
+  guint i, n;
+
+  if (!load_dirmeta (repo, task->metadata_checksum,
+                     &task->uid, &task->gid, &task->mode, &xattrs, error))
+    goto out;
+
+  do
+    res = mkdirat (data->root_dfd, task->relpath, 0700);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1)
+    {
+      if (errno == EEXIST && options->overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
+        task->did_exist = TRUE;
+      else
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+
+  if (!gs_file_open_dir_fd_at (data->root_dfd, task->relpath, &dfd,
+                               cancellable, error))
+    goto out;
+
+  if (!task->did_exist && options->mode != OSTREE_REPO_CHECKOUT_MODE_USER
+      && g_variant_n_children (xattrs) > 0)
+    {
+      if (!gs_fd_set_all_xattrs (dfd, xattrs, cancellable, error))
+        goto out;
+    }
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 task->contents_checksum, &dirtree, error))
+    goto out;
+
+  /* Hand out subdirectories first, so idle workers can pick them up
+   * while we're busy with this directory's files.
+   */
+  dirs_variant = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) contents_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *relpath = NULL;
+      char contents_checksum[65];
+      char meta_checksum[65];
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &contents_csum_v, &meta_csum_v);
+
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_v),
+                                          contents_checksum);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (meta_csum_v),
+                                          meta_checksum);
+      relpath = g_build_filename (task->relpath, name, NULL);
+
+      checkout_dir_task_push (data, task, relpath, contents_checksum, meta_checksum);
+    }
+
+  files_variant = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      guint32 mode;
+      char checksum[65];
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &csum_v);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), checksum);
+
+      if (!_ostree_repo_load_file_mode (repo, checksum, &mode,
+                                        cancellable, error))
+        goto out;
+
+      if (!checkout_one_file_at (repo, options, checksum, mode,
+                                 dfd, name, cancellable, error))
+        goto out;
+    }
+
+  /* Keep the descriptor for finish_directory_at() */
+  task->dfd = dfd;
+  dfd = -1;
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Checking out %s: ", task->relpath);
+  return ret;
+}
+
+static void
+checkout_parallel_worker (gpointer datap,
+                          gpointer user_data)
+{
+  CheckoutDirTask *task = datap;
+  CheckoutParallelData *data = user_data;
+  GError *local_error = NULL;
+
+  if (!checkout_parallel_failed (data)
+      && !checkout_dir_task_run (data, task, &local_error))
+    checkout_parallel_take_error (data, local_error);
+
+  /* If subdirectories are still pending, whichever worker finishes
+   * the last of them finishes this directory too; it reopens it then,
+   * rather than us holding a descriptor until that happens.
+   */
+  if (task->dfd != -1 && g_atomic_int_get (&task->n_pending) > 1)
+    {
+      (void) close (task->dfd);
+      task->dfd = -1;
+    }
+
+  checkout_dir_task_complete (task);
+}
+
+/*
+ * checkout_tree_at_parallel:
+ *
+ * Check out the directory @source using a pool of
+ * options->n_workers threads.  Each directory is a unit of work, and
+ * every subdirectory found is queued back to the pool, so whichever
+ * worker is idle picks up the next pending subtree.  The resulting
+ * tree is identical to checkout_tree_at(); rather than fsync()ing
+ * every file and directory, the destination filesystem is synced once
+ * at the end.
+ */
+static gboolean
+checkout_tree_at_parallel (OstreeRepo                        *self,
+                           OstreeRepoCheckoutOptions         *options,
+                           int                                destination_parent_fd,
+                           const char                        *destination_name,
+                           OstreeRepoFile                    *source,
+                           GCancellable                      *cancellable,
+                           GError                           **error)
+{
+  gboolean ret = FALSE;
+  CheckoutParallelData data = { 0, };
+  GError *local_error = NULL;
+
+  data.repo = self;
+  data.options = options;
+  data.root_dfd = destination_parent_fd;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  data.pool = g_thread_pool_new (checkout_parallel_worker, &data,
+                                 options->n_workers, FALSE, &local_error);
+  g_assert_no_error (local_error);
+
+  checkout_dir_task_push (&data, NULL, destination_name,
+                          ostree_repo_file_tree_get_contents_checksum (source),
+                          ostree_repo_file_tree_get_metadata_checksum (source));
+
+  g_mutex_lock (&data.lock);
+  while (data.n_outstanding > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      data.error = NULL;
+      goto out;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (!self->disable_fsync)
+    {
+      glnx_fd_close int dfd = -1;
+
+      if (!glnx_opendirat (destination_parent_fd, destination_name, TRUE, &dfd, error))
+        goto out;
+
+      if (syncfs (dfd) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+  return ret;
+}
+
+/**
+ * ostree_repo_checkout_tree:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @destination: Place tree here
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Check out @source into @destination, which must live on the
+ * physical filesystem.  @source may be any subdirectory of a given
+ * commit.  The @mode and @overwrite_mode allow control over how the
+ * files are checked out.
+ */
+gboolean
+ostree_repo_checkout_tree (OstreeRepo               *self,
+                           OstreeRepoCheckoutMode    mode,
+                           OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                           GFile                    *destination,
+                           OstreeRepoFile           *source,
+                           GFileInfo                *source_info,
+                           GCancellable             *cancellable,
+                           GError                  **error)
+{
+  OstreeRepoCheckoutOptions options = { 0, };
+
+  options.mode = mode;
+  options.overwrite_mode = overwrite_mode;
+  /* Backwards compatibility */
+  options.enable_uncompressed_cache = TRUE;
+
+  return checkout_tree_at (self, &options,
+                           AT_FDCWD, gs_file_get_path_cached (destination),
+                           source, source_info,
+                           cancellable, error);
+}
+
+/**
+ * ostree_repo_checkout_tree_at:
+ * @self: Repo
+ * @options: (allow-none): Options
+ * @destination_dfd: Directory FD for destination
+ * @destination_path: Directory for destination
+ * @commit: Checksum for commit
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Similar to ostree_repo_checkout_tree(), but uses directory-relative
+ * paths for the destination, uses a new `OstreeRepoCheckoutOptions`,
+ * and takes a commit checksum and optional subpath pair, rather than
+ * requiring use of `GFile` APIs for the caller.
+ *
+ * Note in addition that unlike ostree_repo_checkout_tree(), the
+ * default is not to use the repository-internal uncompressed objects
+ * cache.
+ *
+ * If @options has n_workers greater than one, directories are checked
+ * out concurrently by that many threads, and a single syncfs() of the
+ * destination replaces the per-file and per-directory fsync() calls.
+ * The resulting tree is the same either way.
+ *
+ * If @options has from_commit set, @destination_path must hold an
+ * unmodified checkout of that commit, made with the same subpath and
+ * mode.  It is updated to @commit in place: subdirectories whose
+ * content and metadata are unchanged are skipped, so the cost scales
+ * with the size of the difference.  Each directory whose entries change
+ * is rebuilt next to the old one, reusing unchanged files and
+ * subdirectories, and swapped in with a single rename; directories
+ * whose own entries are unchanged are updated in place and never
+ * moved.  The update is always done by the calling thread.
+ */
+gboolean
+ostree_repo_checkout_tree_at (OstreeRepo                         *self,
+                              OstreeRepoCheckoutOptions         *options,
+                              int                                destination_dfd,
+                              const char                        *destination_path,
+                              const char                        *commit,
+                              GCancellable                      *cancellable,
+                              GError                           **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) commit_root = NULL;
+  g_autoptr(GFile) target_dir = NULL;
+  g_autoptr(GFileInfo) target_info = NULL;
+  OstreeRepoCheckoutOptions default_options = { 0, };
+
+  if (!options)
+    {
+      default_options.subpath = NULL;
+      options = &default_options;
+    }
+
+  commit_root = (GFile*) _ostree_repo_file_new_for_commit (self, commit, error);
+  if (!commit_root)
+    goto out;
+
+  if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile*)commit_root, error))
+    goto out;
+
+  if (options->subpath && strcmp (options->subpath, "/") != 0)
+    target_dir = g_file_get_child (commit_root, options->subpath);
+  else
+    target_dir = g_object_ref (commit_root);
+  target_info = g_file_query_info (target_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                   cancellable, error);
+  if (!target_info)
+    goto out;
+
+  if (options->from_commit)
+    {
+      g_autoptr(GFile) from_root = NULL;
+      g_autoptr(GFile) from_dir = NULL;
+      g_autoptr(GFileInfo) from_info = NULL;
+      g_autofree char *destination_dir = NULL;
+      g_autofree char *destination_base = NULL;
+      glnx_fd_close int destination_parent_dfd = -1;
+      OstreeRepoCheckoutOptions update_options = *options;
+
+      /* Updates are serial, so files are synced one by one */
+      update_options.n_workers = 0;
+
+      from_root = (GFile*) _ostree_repo_file_new_for_commit (self, options->from_commit, error);
+      if (!from_root)
+        goto out;
+
+      if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile*)from_root, error))
+        goto out;
+
+      if (options->subpath && strcmp (options->subpath, "/") != 0)
+        from_dir = g_file_get_child (from_root, options->subpath);
+      else
+        from_dir = g_object_ref (from_root);
+      from_info = g_file_query_info (from_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                     G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                     cancellable, error);
+      if (!from_info)
+        goto out;
+
+      if (g_file_info_get_file_type (target_info) != G_FILE_TYPE_DIRECTORY
+          || g_file_info_get_file_type (from_info) != G_FILE_TYPE_DIRECTORY)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                       "Updating a checkout from another commit requires a directory");
+          goto out;
+        }
+
+      /* The top directory is swapped like any other, so we need its parent */
+      destination_dir = g_path_get_dirname (destination_path);
+      destination_base = g_path_get_basename (destination_path);
+      if (strcmp (destination_base, ".") == 0 || strcmp (destination_base, "/") == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Updating a checkout requires a named destination directory");
+          goto out;
+        }
+
+      if (!glnx_opendirat (destination_dfd, destination_dir, TRUE,
+                           &destination_parent_dfd, error))
+        goto out;
+
+      if (!update_dirtree_at (self, &update_options,
+                              destination_parent_dfd,
+                              destination_base,
+                              ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)from_dir),
+                              ostree_repo_file_tree_get_metadata_checksum ((OstreeRepoFile*)from_dir),
+                              ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)target_dir),
+                              ostree_repo_file_tree_get_metadata_checksum ((OstreeRepoFile*)target_dir),
+                              cancellable, error))
+        goto out;
+    }
+  else if (options->n_workers > 1
+           && g_file_info_get_file_type (target_info) == G_FILE_TYPE_DIRECTORY)
+    {
+      if (!checkout_tree_at_parallel (self, options,
+                                      destination_dfd,
+                                      destination_path,
+                                      (OstreeRepoFile*)target_dir,
+                                      cancellable, error))
+        goto out;
+    }
+  else if (g_file_info_get_file_type (target_info) == G_FILE_TYPE_DIRECTORY)
+    {
+      if (!checkout_dirtree_at (self, options,
+                                destination_dfd,
+                                destination_path,
+                                ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)target_dir),
+                                ostree_repo_file_tree_get_metadata_checksum ((OstreeRepoFile*)target_dir),
+                                cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!checkout_tree_at (self, options,
+                             destination_dfd,
+                             destination_path,
+                             (OstreeRepoFile*)target_dir, target_info,
+                             cancellable, error))
+        goto out;
+    }
 
   ret = TRUE;
  out:
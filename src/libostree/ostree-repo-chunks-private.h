@@ -0,0 +1,223 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-repo-private.h"
+
+G_BEGIN_DECLS
+
+/* Large regular files in archive repositories may be stored as a list
+ * of chunks rather than as a single .filez; see
+ * core.chunked-content-threshold.  Chunk boundaries are chosen with
+ * the bup rolling checksum, so an edit in the middle of a file only
+ * changes the chunks around it, and the rest are shared between
+ * versions.
+ *
+ * The object keeps its checksum.  Next to objects/xx/yyy.filez there
+ * is a manifest objects/xx/yyy.filechunks of type
+ * %_OSTREE_FILE_CHUNKS_GVARIANT_FORMAT:
+ *
+ * a{sv} - Metadata, currently unused
+ * (tuuuusa(ayay)) - The .filez header, see %_OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT
+ * a(ayt) - The chunks in order: SHA256 of the chunk data, and its size
+ *
+ * Each chunk is stored as objects/xx/yyy.chunk, named by the SHA256
+ * of its uncompressed data, and holds the data compressed the same
+ * way as a .filez payload.
+ *
+ * Chunks are not objects: they are not listed, and are only deleted
+ * by ostree_repo_prune() once no manifest refers to them.
+ *
+ * The .filez is kept as well, so that clients which don't know about
+ * chunks can still pull the file.  Clients only know to fetch the
+ * manifest instead from %OSTREE_SUMMARY_CHUNKED_CONTENT.
+ *
+ * Bare repositories never store chunks, but a pull may keep the
+ * manifest of a file it fetched in chunks, in
+ * %_OSTREE_BARE_FILE_CHUNKS_DIR.  Later pulls then read chunks that
+ * are already present out of the bare objects; see
+ * _ostree_repo_load_chunk_index().
+ */
+#define _OSTREE_FILE_CHUNKS_GVARIANT_FORMAT G_VARIANT_TYPE ("(a{sv}(tuuuusa(ayay))a(ayt))")
+
+#define _OSTREE_FILE_CHUNKS_SUFFIX "filechunks"
+#define _OSTREE_CHUNK_SUFFIX "chunk"
+
+/* Where bare repositories keep manifests, relative to the repository,
+ * as $checksum.filechunks; having them all in one place means finding
+ * them doesn't require reading every object directory.
+ */
+#define _OSTREE_BARE_FILE_CHUNKS_DIR "state/file-chunks"
+
+/* Archive repositories list the content objects which have a
+ * manifest in this file, as their binary checksums concatenated in
+ * sorted order, so that writing the summary doesn't have to read
+ * every object directory.  Manifests written in a transaction are
+ * added when it is committed, and ostree_repo_prune() rewrites the
+ * list from the manifests it finds.
+ */
+#define _OSTREE_CHUNKED_CONTENT_LIST "state/chunked-content"
+#define _OSTREE_CHUNKED_CONTENT_LIST_LOCK "state/chunked-content.lock"
+
+/* The list is published as objects/chunked-content/$checksum.index,
+ * named by its SHA256, when the summary is written.
+ */
+#define _OSTREE_CHUNKED_CONTENT_DIR "chunked-content"
+
+/* Summary metadata key holding the checksum of the published list of
+ * content objects which have a manifest; type ay.
+ */
+#define OSTREE_SUMMARY_CHUNKED_CONTENT "ostree.chunked-content"
+
+/* A boundary is only taken where the rollsum has at least this many
+ * low bits set, for an average chunk size of about 1 MiB.
+ */
+#define _OSTREE_CHUNK_SPLIT_BITS (20)
+#define _OSTREE_CHUNK_MIN_SIZE (256 * 1024)
+#define _OSTREE_CHUNK_MAX_SIZE (4 * 1024 * 1024)
+
+/* The location of a chunk inside a bare file object */
+typedef struct {
+  char    file_checksum[65];
+  guint64 offset;
+  guint64 size;
+} OstreeChunkLocation;
+
+/* Where chunks may be read from besides the chunk store */
+typedef struct {
+  int         fetched_dfd;
+  GHashTable *fetched;  /* checksum -> name of a compressed chunk in fetched_dfd */
+  GHashTable *index;    /* checksum -> OstreeChunkLocation */
+} OstreeChunkSources;
+
+void
+_ostree_file_chunks_path (char        *buf,
+                          const char  *checksum);
+
+void
+_ostree_chunk_path (char        *buf,
+                    const char  *checksum);
+
+gsize
+_ostree_chunk_find_split (const guint8  *buf,
+                          gsize          len);
+
+gboolean
+_ostree_file_chunks_validate (GVariant   *file_chunks,
+                              GError    **error);
+
+gboolean
+_ostree_repo_has_chunk (OstreeRepo     *self,
+                        const char     *checksum,
+                        gboolean       *out_have_chunk,
+                        GCancellable   *cancellable,
+                        GError        **error);
+
+gboolean
+_ostree_repo_write_chunk (OstreeRepo     *self,
+                          const char     *checksum,
+                          const guint8   *buf,
+                          gsize           len,
+                          GCancellable   *cancellable,
+                          GError        **error);
+
+gboolean
+_ostree_chunk_read_at (int             dfd,
+                       const char     *path,
+                       const char     *expected_checksum,
+                       guint64         size,
+                       GBytes        **out_data,
+                       GCancellable   *cancellable,
+                       GError        **error);
+
+gboolean
+_ostree_repo_write_content_chunks (OstreeRepo     *self,
+                                   GVariant       *file_header,
+                                   GInputStream   *input,
+                                   GOutputStream  *copy_out,
+                                   GVariant      **out_file_chunks,
+                                   guint64        *out_unpacked_size,
+                                   GCancellable   *cancellable,
+                                   GError        **error);
+
+gboolean
+_ostree_repo_load_file_chunks (OstreeRepo     *self,
+                               const char     *checksum,
+                               GVariant      **out_file_chunks,
+                               GCancellable   *cancellable,
+                               GError        **error);
+
+gboolean
+_ostree_repo_write_file_chunks (OstreeRepo     *self,
+                                const char     *checksum,
+                                GVariant       *file_chunks,
+                                GCancellable   *cancellable,
+                                GError        **error);
+
+gboolean
+_ostree_repo_delete_file_chunks (OstreeRepo     *self,
+                                 const char     *checksum,
+                                 GError        **error);
+
+gboolean
+_ostree_repo_open_chunked_file (OstreeRepo          *self,
+                                GVariant            *file_chunks,
+                                OstreeChunkSources  *sources,
+                                GInputStream       **out_input,
+                                GFileInfo          **out_file_info,
+                                GVariant           **out_xattrs,
+                                GCancellable        *cancellable,
+                                GError             **error);
+
+gboolean
+_ostree_repo_load_chunk_index (OstreeRepo     *self,
+                               GHashTable    **out_index,
+                               GCancellable   *cancellable,
+                               GError        **error);
+
+char *
+_ostree_get_relative_chunked_content_path (const char *checksum);
+
+gboolean
+_ostree_chunked_content_parse (GBytes      *data,
+                               const char  *expected_checksum,
+                               GHashTable  *checksums,
+                               GError     **error);
+
+gboolean
+_ostree_repo_flush_chunked_content (OstreeRepo     *self,
+                                    GCancellable   *cancellable,
+                                    GError        **error);
+
+gboolean
+_ostree_repo_get_chunked_content_summary (OstreeRepo     *self,
+                                          GVariant      **out_chunked_content,
+                                          GCancellable   *cancellable,
+                                          GError        **error);
+
+gboolean
+_ostree_repo_prune_chunks (OstreeRepo     *self,
+                           guint          *out_n_pruned,
+                           guint64        *out_freed_bytes,
+                           GCancellable   *cancellable,
+                           GError        **error);
+
+G_END_DECLS
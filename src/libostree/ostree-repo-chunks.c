@@ -0,0 +1,1496 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <gio/gunixinputstream.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-repo-chunks-private.h"
+#include "bupsplit.h"
+#include "otutil.h"
+
+void
+_ostree_file_chunks_path (char        *buf,
+                          const char  *checksum)
+{
+  g_snprintf (buf, _OSTREE_LOOSE_PATH_MAX, "%.2s/%s." _OSTREE_FILE_CHUNKS_SUFFIX,
+              checksum, checksum + 2);
+}
+
+void
+_ostree_chunk_path (char        *buf,
+                    const char  *checksum)
+{
+  g_snprintf (buf, _OSTREE_LOOSE_PATH_MAX, "%.2s/%s." _OSTREE_CHUNK_SUFFIX,
+              checksum, checksum + 2);
+}
+
+/* Relative to the repository directory */
+static void
+bare_file_chunks_path (char        *buf,
+                       const char  *checksum)
+{
+  g_snprintf (buf, _OSTREE_LOOSE_PATH_MAX, _OSTREE_BARE_FILE_CHUNKS_DIR "/%s." _OSTREE_FILE_CHUNKS_SUFFIX,
+              checksum);
+}
+
+/*
+ * _ostree_chunk_find_split:
+ * @buf: Data
+ * @len: Length of @buf; this must be at least %_OSTREE_CHUNK_MAX_SIZE
+ *   unless @buf holds the end of the file
+ *
+ * Returns: The size of the chunk starting at @buf
+ */
+gsize
+_ostree_chunk_find_split (const guint8  *buf,
+                          gsize          len)
+{
+  gsize start = _OSTREE_CHUNK_MIN_SIZE;
+
+  len = MIN (len, _OSTREE_CHUNK_MAX_SIZE);
+
+  while (start < len)
+    {
+      int bits = 0;
+      int ofs = bupsplit_find_ofs (buf + start, len - start, &bits);
+
+      if (ofs == 0)
+        break;
+      start += ofs;
+      if (bits >= _OSTREE_CHUNK_SPLIT_BITS)
+        return start;
+    }
+
+  return len;
+}
+
+gboolean
+_ostree_file_chunks_validate (GVariant   *file_chunks,
+                              GError    **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GVariant) chunks = NULL;
+  guint64 file_size;
+  guint64 total = 0;
+  guint32 mode;
+  gsize i, n;
+
+  if (!g_variant_is_of_type (file_chunks, _OSTREE_FILE_CHUNKS_GVARIANT_FORMAT))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid chunked file manifest type %s",
+                   g_variant_get_type_string (file_chunks));
+      goto out;
+    }
+
+  header = g_variant_get_child_value (file_chunks, 1);
+  chunks = g_variant_get_child_value (file_chunks, 2);
+
+  g_variant_get_child (header, 0, "t", &file_size);
+  g_variant_get_child (header, 3, "u", &mode);
+  if (!S_ISREG (GUINT32_FROM_BE (mode)))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Chunked file is not a regular file");
+      goto out;
+    }
+
+  n = g_variant_n_children (chunks);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      guint64 size;
+
+      g_variant_get_child (chunks, i, "(@ayt)", &csum_v, &size);
+      if (!ostree_validate_structureof_csum_v (csum_v, error))
+        goto out;
+
+      size = GUINT64_FROM_BE (size);
+      if (size == 0 || size > _OSTREE_CHUNK_MAX_SIZE)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid chunk size %" G_GUINT64_FORMAT, size);
+          goto out;
+        }
+      total += size;
+    }
+
+  if (total != GUINT64_FROM_BE (file_size))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Chunks add up to %" G_GUINT64_FORMAT " bytes, expected %" G_GUINT64_FORMAT,
+                   total, GUINT64_FROM_BE (file_size));
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Like _ostree_repo_has_loose_object(), look in the staging directory
+ * of the current transaction, then in the objects directory.
+ * @out_dfd is set to the directory holding @path, or -1.
+ */
+static gboolean
+find_in_repo (OstreeRepo    *self,
+              const char    *path,
+              int           *out_dfd,
+              GError       **error)
+{
+  int dfds[] = { self->commit_stagedir_fd, self->objects_dir_fd };
+  struct stat stbuf;
+  guint i;
+
+  *out_dfd = -1;
+
+  for (i = 0; i < G_N_ELEMENTS (dfds); i++)
+    {
+      int res;
+
+      if (dfds[i] == -1)
+        continue;
+
+      do
+        res = fstatat (dfds[i], path, &stbuf, AT_SYMLINK_NOFOLLOW);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (res == 0)
+        {
+          *out_dfd = dfds[i];
+          break;
+        }
+      else if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          g_prefix_error (error, "Stat of %s: ", path);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Find the manifest of @checksum: archive repositories keep it next
+ * to the object, bare ones in %_OSTREE_BARE_FILE_CHUNKS_DIR.  @path is
+ * set to its path relative to @out_dfd, which is -1 if there is none.
+ */
+static gboolean
+find_file_chunks (OstreeRepo    *self,
+                  const char    *checksum,
+                  char          *path,
+                  int           *out_dfd,
+                  GError       **error)
+{
+  struct stat stbuf;
+  int res;
+
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
+    {
+      _ostree_file_chunks_path (path, checksum);
+      return find_in_repo (self, path, out_dfd, error);
+    }
+
+  *out_dfd = -1;
+  bare_file_chunks_path (path, checksum);
+  do
+    res = fstatat (self->repo_dir_fd, path, &stbuf, AT_SYMLINK_NOFOLLOW);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == 0)
+    *out_dfd = self->repo_dir_fd;
+  else if (errno != ENOENT)
+    {
+      glnx_set_error_from_errno (error);
+      g_prefix_error (error, "Stat of %s: ", path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Write @buf to @path, in the staging directory if there is a
+ * transaction.
+ */
+static gboolean
+write_to_repo (OstreeRepo     *self,
+               const char     *path,
+               const guint8   *buf,
+               gsize           len,
+               GCancellable   *cancellable,
+               GError        **error)
+{
+  int dest_dfd;
+
+  if (self->in_transaction)
+    {
+      dest_dfd = self->commit_stagedir_fd;
+      if (!_ostree_repo_ensure_staged_objdir (self, path, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      dest_dfd = self->objects_dir_fd;
+      if (!_ostree_repo_ensure_loose_objdir_at (dest_dfd, path,
+                                                cancellable, error))
+        return FALSE;
+    }
+
+  return _ostree_repo_file_replace_contents (self, dest_dfd, path, buf, len,
+                                             cancellable, error);
+}
+
+gboolean
+_ostree_repo_has_chunk (OstreeRepo     *self,
+                        const char     *checksum,
+                        gboolean       *out_have_chunk,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  int dfd;
+
+  _ostree_chunk_path (path, checksum);
+  if (!find_in_repo (self, path, &dfd, error))
+    return FALSE;
+
+  *out_have_chunk = (dfd != -1);
+  return TRUE;
+}
+
+gboolean
+_ostree_repo_write_chunk (OstreeRepo     *self,
+                          const char     *checksum,
+                          const guint8   *buf,
+                          gsize           len,
+                          GCancellable   *cancellable,
+                          GError        **error)
+{
+  gboolean ret = FALSE;
+  gboolean have_chunk;
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  g_autoptr(GConverter) compressor = NULL;
+  g_autoptr(GOutputStream) mem_out = NULL;
+  g_autoptr(GOutputStream) compressed_out = NULL;
+  gsize bytes_written;
+
+  if (!_ostree_repo_has_chunk (self, checksum, &have_chunk, cancellable, error))
+    goto out;
+  if (have_chunk)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  compressor = _ostree_repo_new_content_compressor (self);
+  mem_out = g_memory_output_stream_new_resizable ();
+  compressed_out = g_converter_output_stream_new (mem_out, compressor);
+
+  if (!g_output_stream_write_all (compressed_out, buf, len, &bytes_written,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_close (compressed_out, cancellable, error))
+    goto out;
+
+  _ostree_chunk_path (path, checksum);
+  if (!write_to_repo (self, path,
+                      g_memory_output_stream_get_data ((GMemoryOutputStream*)mem_out),
+                      g_memory_output_stream_get_data_size ((GMemoryOutputStream*)mem_out),
+                      cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_chunk_read_at:
+ * @expected_checksum: (allow-none): If set, verify the data
+ * @size: Expected uncompressed size
+ *
+ * Read and decompress a stored chunk.
+ */
+gboolean
+_ostree_chunk_read_at (int             dfd,
+                       const char     *path,
+                       const char     *expected_checksum,
+                       guint64         size,
+                       GBytes        **out_data,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  g_autoptr(GInputStream) file_in = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autofree guint8 *buf = NULL;
+  gsize bytes_read;
+
+  g_assert (size <= _OSTREE_CHUNK_MAX_SIZE);
+
+  if (!gs_file_openat_noatime (dfd, path, &fd, cancellable, error))
+    goto out;
+  file_in = g_unix_input_stream_new (fd, TRUE);
+
+  if (!_ostree_open_compressed_content (file_in, &in, cancellable, error))
+    goto out;
+
+  /* Read one more byte than expected to catch overlong chunks */
+  buf = g_malloc (size + 1);
+  if (!g_input_stream_read_all (in, buf, size + 1, &bytes_read,
+                                cancellable, error))
+    goto out;
+  if (bytes_read != size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Chunk %s has the wrong size", path);
+      goto out;
+    }
+
+  if (expected_checksum)
+    {
+      OtSha256 *checksum = ot_sha256_new ();
+      gboolean valid;
+
+      ot_sha256_update (checksum, buf, size);
+      valid = strcmp (ot_sha256_get_string (checksum), expected_checksum) == 0;
+      ot_sha256_free (checksum);
+      if (!valid)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted chunk %s", expected_checksum);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  *out_data = g_bytes_new_take (buf, size);
+  buf = NULL;
+ out:
+  return ret;
+}
+
+/* Read a chunk out of a bare file object; its data is checked, as the
+ * file may have been modified through a hardlinked checkout.
+ */
+static gboolean
+read_chunk_from_file_object (OstreeRepo            *self,
+                             const char            *checksum,
+                             OstreeChunkLocation   *location,
+                             GBytes               **out_data,
+                             GCancellable          *cancellable,
+                             GError               **error)
+{
+  gboolean ret = FALSE;
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  glnx_fd_close int fd = -1;
+  g_autofree guint8 *buf = NULL;
+  OtSha256 *chunk_checksum = NULL;
+  gsize done = 0;
+  int dfd;
+
+  _ostree_loose_path (path, location->file_checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+  if (!find_in_repo (self, path, &dfd, error))
+    goto out;
+  if (dfd == -1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Missing chunk %s", checksum);
+      goto out;
+    }
+
+  if (!gs_file_openat_noatime (dfd, path, &fd, cancellable, error))
+    goto out;
+
+  buf = g_malloc (location->size);
+  while (done < location->size)
+    {
+      gssize n;
+
+      do
+        n = pread (fd, buf + done, location->size - done, location->offset + done);
+      while (G_UNLIKELY (n == -1 && errno == EINTR));
+      if (n == -1)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+      if (n == 0)
+        break;
+      done += n;
+    }
+
+  chunk_checksum = ot_sha256_new ();
+  ot_sha256_update (chunk_checksum, buf, done);
+  if (done != location->size
+      || strcmp (ot_sha256_get_string (chunk_checksum), checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Chunk %s in file object %s is corrupted",
+                   checksum, location->file_checksum);
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_data = g_bytes_new_take (buf, location->size);
+  buf = NULL;
+ out:
+  g_clear_pointer (&chunk_checksum, (GDestroyNotify) ot_sha256_free);
+  return ret;
+}
+
+static gboolean
+load_chunk (OstreeRepo          *self,
+            OstreeChunkSources  *sources,
+            GVariant            *chunk,
+            GBytes             **out_data,
+            GCancellable        *cancellable,
+            GError             **error)
+{
+  g_autoptr(GVariant) csum_v = NULL;
+  g_autofree char *checksum = NULL;
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  const char *fetched_name = NULL;
+  OstreeChunkLocation *location = NULL;
+  guint64 size;
+  int dfd;
+
+  g_variant_get (chunk, "(@ayt)", &csum_v, &size);
+  checksum = ostree_checksum_from_bytes_v (csum_v);
+  size = GUINT64_FROM_BE (size);
+
+  /* Fetched chunks are verified when they are downloaded */
+  if (sources->fetched)
+    fetched_name = g_hash_table_lookup (sources->fetched, checksum);
+  if (fetched_name)
+    return _ostree_chunk_read_at (sources->fetched_dfd, fetched_name, NULL, size,
+                                  out_data, cancellable, error);
+
+  _ostree_chunk_path (path, checksum);
+  if (!find_in_repo (self, path, &dfd, error))
+    return FALSE;
+  if (dfd != -1)
+    return _ostree_chunk_read_at (dfd, path, NULL, size,
+                                  out_data, cancellable, error);
+
+  if (sources->index)
+    location = g_hash_table_lookup (sources->index, checksum);
+  if (location && location->size == size)
+    return read_chunk_from_file_object (self, checksum, location, out_data,
+                                        cancellable, error);
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+               "Missing chunk %s", checksum);
+  return FALSE;
+}
+
+/* Reads the chunks of a file one after another; only the current
+ * chunk is held in memory.
+ */
+typedef struct {
+  GInputStream parent_instance;
+
+  OstreeRepo *repo;
+  GVariant *chunks;
+  OstreeChunkSources sources;
+  gsize next_chunk;
+  GBytes *current;
+  gsize current_offset;
+} OstreeChunkedInputStream;
+
+typedef struct {
+  GInputStreamClass parent_class;
+} OstreeChunkedInputStreamClass;
+
+GType _ostree_chunked_input_stream_get_type (void);
+
+G_DEFINE_TYPE (OstreeChunkedInputStream, _ostree_chunked_input_stream, G_TYPE_INPUT_STREAM)
+
+static void
+_ostree_chunked_input_stream_finalize (GObject *object)
+{
+  OstreeChunkedInputStream *self = (OstreeChunkedInputStream*)object;
+
+  g_clear_object (&self->repo);
+  g_clear_pointer (&self->chunks, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&self->sources.fetched, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&self->sources.index, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&self->current, (GDestroyNotify) g_bytes_unref);
+
+  G_OBJECT_CLASS (_ostree_chunked_input_stream_parent_class)->finalize (object);
+}
+
+static gssize
+_ostree_chunked_input_stream_read (GInputStream  *stream,
+                                   void          *buffer,
+                                   gsize          count,
+                                   GCancellable  *cancellable,
+                                   GError       **error)
+{
+  OstreeChunkedInputStream *self = (OstreeChunkedInputStream*)stream;
+  const guint8 *data;
+  gsize len = self->current ? g_bytes_get_size (self->current) : 0;
+  gsize n;
+
+  while (self->current == NULL || self->current_offset == len)
+    {
+      g_autoptr(GVariant) chunk = NULL;
+
+      if (self->next_chunk == g_variant_n_children (self->chunks))
+        return 0;
+
+      g_clear_pointer (&self->current, (GDestroyNotify) g_bytes_unref);
+      chunk = g_variant_get_child_value (self->chunks, self->next_chunk);
+      if (!load_chunk (self->repo, &self->sources, chunk, &self->current,
+                       cancellable, error))
+        return -1;
+
+      self->next_chunk++;
+      self->current_offset = 0;
+      len = g_bytes_get_size (self->current);
+    }
+
+  data = g_bytes_get_data (self->current, &len);
+  n = MIN (count, len - self->current_offset);
+  memcpy (buffer, data + self->current_offset, n);
+  self->current_offset += n;
+
+  return n;
+}
+
+static gboolean
+_ostree_chunked_input_stream_close (GInputStream  *stream,
+                                    GCancellable  *cancellable,
+                                    GError       **error)
+{
+  OstreeChunkedInputStream *self = (OstreeChunkedInputStream*)stream;
+
+  g_clear_pointer (&self->current, (GDestroyNotify) g_bytes_unref);
+  return TRUE;
+}
+
+static void
+_ostree_chunked_input_stream_class_init (OstreeChunkedInputStreamClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  gobject_class->finalize = _ostree_chunked_input_stream_finalize;
+  stream_class->read_fn = _ostree_chunked_input_stream_read;
+  stream_class->close_fn = _ostree_chunked_input_stream_close;
+}
+
+static void
+_ostree_chunked_input_stream_init (OstreeChunkedInputStream *self)
+{
+  self->sources.fetched_dfd = -1;
+}
+
+/*
+ * _ostree_repo_write_content_chunks:
+ * @file_header: Header as made by _ostree_zlib_file_header_new()
+ * @input: Content of a regular file
+ * @copy_out: (allow-none): Also write all of @input here
+ * @out_file_chunks: (out): Manifest, to be written with _ostree_repo_write_file_chunks()
+ *
+ * Split @input into chunks and add those to the chunk store.
+ */
+gboolean
+_ostree_repo_write_content_chunks (OstreeRepo     *self,
+                                   GVariant       *file_header,
+                                   GInputStream   *input,
+                                   GOutputStream  *copy_out,
+                                   GVariant      **out_file_chunks,
+                                   guint64        *out_unpacked_size,
+                                   GCancellable   *cancellable,
+                                   GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autofree guint8 *buf = g_malloc (_OSTREE_CHUNK_MAX_SIZE);
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayt)"));
+  g_autoptr(GVariant) ret_file_chunks = NULL;
+  gsize fill = 0;
+  gboolean eof = FALSE;
+  guint64 total = 0;
+
+  while (TRUE)
+    {
+      OtSha256 *checksum;
+      guint8 digest[32];
+      gsize split;
+      gboolean success;
+
+      if (!eof)
+        {
+          gsize bytes_read;
+
+          if (!g_input_stream_read_all (input, buf + fill, _OSTREE_CHUNK_MAX_SIZE - fill,
+                                        &bytes_read, cancellable, error))
+            goto out;
+          if (bytes_read < _OSTREE_CHUNK_MAX_SIZE - fill)
+            eof = TRUE;
+          if (copy_out && bytes_read > 0
+              && !g_output_stream_write_all (copy_out, buf + fill, bytes_read, NULL,
+                                             cancellable, error))
+            goto out;
+          fill += bytes_read;
+        }
+
+      if (fill == 0)
+        break;
+
+      split = _ostree_chunk_find_split (buf, fill);
+
+      checksum = ot_sha256_new ();
+      ot_sha256_update (checksum, buf, split);
+      ot_sha256_get_digest (checksum, digest);
+      success = _ostree_repo_write_chunk (self, ot_sha256_get_string (checksum),
+                                          buf, split, cancellable, error);
+      ot_sha256_free (checksum);
+      if (!success)
+        goto out;
+
+      g_variant_builder_add (builder, "(@ayt)",
+                             ot_gvariant_new_bytearray (digest, 32),
+                             GUINT64_TO_BE ((guint64) split));
+      total += split;
+
+      memmove (buf, buf + split, fill - split);
+      fill -= split;
+    }
+
+  ret_file_chunks = g_variant_new ("(@a{sv}@(tuuuusa(ayay))@a(ayt))",
+                                   ot_gvariant_new_empty_string_dict (),
+                                   file_header,
+                                   g_variant_builder_end (builder));
+  g_variant_ref_sink (ret_file_chunks);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_file_chunks, &ret_file_chunks);
+  if (out_unpacked_size)
+    *out_unpacked_size = total;
+ out:
+  return ret;
+}
+
+static int
+compare_checksums (gconstpointer  a_pp,
+                   gconstpointer  b_pp)
+{
+  return strcmp (*((char**)a_pp), *((char**)b_pp));
+}
+
+char *
+_ostree_get_relative_chunked_content_path (const char *checksum)
+{
+  return g_strconcat (_OSTREE_CHUNKED_CONTENT_DIR "/", checksum, ".index", NULL);
+}
+
+/*
+ * _ostree_chunked_content_parse:
+ * @data: A list of chunked content, as in %_OSTREE_CHUNKED_CONTENT_LIST
+ * @expected_checksum: (allow-none): Checksum @data must have
+ * @checksums: Set of checksum strings to add the listed objects to
+ */
+gboolean
+_ostree_chunked_content_parse (GBytes      *data,
+                               const char  *expected_checksum,
+                               GHashTable  *checksums,
+                               GError     **error)
+{
+  const guint8 *csums;
+  gsize i, n;
+
+  if (expected_checksum)
+    {
+      g_autofree char *actual_checksum =
+        g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, data);
+
+      if (strcmp (actual_checksum, expected_checksum) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted chunked content list; checksum expected='%s' actual='%s'",
+                       expected_checksum, actual_checksum);
+          return FALSE;
+        }
+    }
+
+  csums = g_bytes_get_data (data, &n);
+  if (n % 32 != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid chunked content list of %" G_GSIZE_FORMAT " bytes", n);
+      return FALSE;
+    }
+
+  for (i = 0; i < n; i += 32)
+    g_hash_table_add (checksums, ostree_checksum_from_bytes (csums + i));
+
+  return TRUE;
+}
+
+static gboolean
+load_chunked_content_list (OstreeRepo     *self,
+                           GHashTable     *checksums,
+                           GError        **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  GMappedFile *mfile = NULL;
+  g_autoptr(GBytes) data = NULL;
+
+  fd = openat (self->repo_dir_fd, _OSTREE_CHUNKED_CONTENT_LIST, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+      ret = TRUE;
+      goto out;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+  data = g_mapped_file_get_bytes (mfile);
+
+  if (!_ostree_chunked_content_parse (data, NULL, checksums, error))
+    {
+      g_prefix_error (error, "Loading %s: ", _OSTREE_CHUNKED_CONTENT_LIST);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_clear_pointer (&mfile, (GDestroyNotify) g_mapped_file_unref);
+  return ret;
+}
+
+static gboolean
+write_chunked_content_list (OstreeRepo     *self,
+                            GHashTable     *checksums,
+                            GCancellable   *cancellable,
+                            GError        **error)
+{
+  g_autoptr(GPtrArray) sorted = g_ptr_array_new ();
+  g_autoptr(GByteArray) csums = g_byte_array_sized_new (g_hash_table_size (checksums) * 32);
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  g_hash_table_iter_init (&iter, checksums);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (sorted, key);
+  g_ptr_array_sort (sorted, compare_checksums);
+
+  for (i = 0; i < sorted->len; i++)
+    {
+      guint8 csum[32];
+
+      ostree_checksum_inplace_to_bytes (sorted->pdata[i], csum);
+      g_byte_array_append (csums, csum, 32);
+    }
+
+  return _ostree_repo_file_replace_contents (self, self->repo_dir_fd,
+                                             _OSTREE_CHUNKED_CONTENT_LIST,
+                                             csums->data, csums->len,
+                                             cancellable, error);
+}
+
+/* Add @added to and remove @removed from the list of chunked content,
+ * or if @replace is set, make it exactly @added.
+ */
+static gboolean
+update_chunked_content_list (OstreeRepo     *self,
+                             GHashTable     *added,
+                             const char     *removed,
+                             gboolean        replace,
+                             GCancellable   *cancellable,
+                             GError        **error)
+{
+  gboolean ret = FALSE;
+  GLnxLockFile lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(GHashTable) checksums =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  gboolean changed = replace;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, "state", 0777,
+                               cancellable, error))
+    goto out;
+
+  if (!glnx_make_lock_file (self->repo_dir_fd, _OSTREE_CHUNKED_CONTENT_LIST_LOCK, LOCK_EX,
+                            &lock, error))
+    goto out;
+
+  if (!replace && !load_chunked_content_list (self, checksums, error))
+    goto out;
+
+  if (added)
+    {
+      g_hash_table_iter_init (&iter, added);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          if (g_hash_table_add (checksums, g_strdup (key)))
+            changed = TRUE;
+        }
+    }
+
+  if (removed && g_hash_table_remove (checksums, removed))
+    changed = TRUE;
+
+  if (changed && !write_chunked_content_list (self, checksums, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  glnx_release_lock_file (&lock);
+  return ret;
+}
+
+/*
+ * _ostree_repo_load_file_chunks:
+ * @out_file_chunks: (out): Validated manifest, or %NULL if the file is
+ *   not stored in chunks
+ */
+gboolean
+_ostree_repo_load_file_chunks (OstreeRepo     *self,
+                               const char     *checksum,
+                               GVariant      **out_file_chunks,
+                               GCancellable   *cancellable,
+                               GError        **error)
+{
+  gboolean ret = FALSE;
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  glnx_fd_close int fd = -1;
+  g_autoptr(GVariant) ret_file_chunks = NULL;
+  int dfd;
+
+  if (!find_file_chunks (self, checksum, path, &dfd, error))
+    goto out;
+
+  if (dfd != -1)
+    {
+      if (!gs_file_openat_noatime (dfd, path, &fd, cancellable, error))
+        goto out;
+      if (!ot_util_variant_map_fd (fd, 0, _OSTREE_FILE_CHUNKS_GVARIANT_FORMAT, FALSE,
+                                   &ret_file_chunks, error))
+        goto out;
+      if (!_ostree_file_chunks_validate (ret_file_chunks, error))
+        {
+          g_prefix_error (error, "Loading %s: ", path);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_file_chunks, &ret_file_chunks);
+ out:
+  return ret;
+}
+
+gboolean
+_ostree_repo_write_file_chunks (OstreeRepo     *self,
+                                const char     *checksum,
+                                GVariant       *file_chunks,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  g_autoptr(GVariant) normalized = g_variant_get_normal_form (file_chunks);
+
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
+    {
+      _ostree_file_chunks_path (path, checksum);
+      if (!write_to_repo (self, path,
+                          g_variant_get_data (normalized),
+                          g_variant_get_size (normalized),
+                          cancellable, error))
+        return FALSE;
+
+      if (self->in_transaction)
+        {
+          g_mutex_lock (&self->txn_stats_lock);
+          if (!self->txn_file_chunks)
+            self->txn_file_chunks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, NULL);
+          g_hash_table_add (self->txn_file_chunks, g_strdup (checksum));
+          g_mutex_unlock (&self->txn_stats_lock);
+          return TRUE;
+        }
+      else
+        {
+          g_autoptr(GHashTable) added =
+            g_hash_table_new (g_str_hash, g_str_equal);
+
+          g_hash_table_add (added, (char*) checksum);
+          return update_chunked_content_list (self, added, NULL, FALSE,
+                                              cancellable, error);
+        }
+    }
+
+  /* Not staged; a manifest whose object was never committed is
+   * ignored by _ostree_repo_load_chunk_index().
+   */
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, _OSTREE_BARE_FILE_CHUNKS_DIR, 0777,
+                               cancellable, error))
+    return FALSE;
+
+  bare_file_chunks_path (path, checksum);
+  return _ostree_repo_file_replace_contents (self, self->repo_dir_fd, path,
+                                             g_variant_get_data (normalized),
+                                             g_variant_get_size (normalized),
+                                             cancellable, error);
+}
+
+/*
+ * _ostree_repo_delete_file_chunks:
+ *
+ * Delete the manifest of the content object @checksum, if any.
+ */
+gboolean
+_ostree_repo_delete_file_chunks (OstreeRepo     *self,
+                                 const char     *checksum,
+                                 GError        **error)
+{
+  char path[_OSTREE_LOOSE_PATH_MAX];
+  int dfd;
+  int res;
+
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
+    {
+      _ostree_file_chunks_path (path, checksum);
+      dfd = self->objects_dir_fd;
+    }
+  else
+    {
+      bare_file_chunks_path (path, checksum);
+      dfd = self->repo_dir_fd;
+    }
+
+  do
+    res = unlinkat (dfd, path, 0);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1 && errno != ENOENT)
+    {
+      glnx_set_error_from_errno (error);
+      g_prefix_error (error, "Deleting %s: ", path);
+      return FALSE;
+    }
+
+  if (res == 0 && _OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
+    {
+      if (!update_chunked_content_list (self, NULL, checksum, FALSE, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_open_chunked_file:
+ * @file_chunks: Validated manifest
+ * @sources: (allow-none): Where else to look for chunks
+ *
+ * Like ostree_repo_load_file(), for a file stored in chunks.  Missing
+ * chunks are only noticed when reading the stream.
+ */
+gboolean
+_ostree_repo_open_chunked_file (OstreeRepo          *self,
+                                GVariant            *file_chunks,
+                                OstreeChunkSources  *sources,
+                                GInputStream       **out_input,
+                                GFileInfo          **out_file_info,
+                                GVariant           **out_xattrs,
+                                GCancellable        *cancellable,
+                                GError             **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GFileInfo) ret_file_info = NULL;
+  g_autoptr(GVariant) ret_xattrs = NULL;
+  g_autoptr(GInputStream) ret_input = NULL;
+
+  header = g_variant_get_child_value (file_chunks, 1);
+  if (!_ostree_zlib_file_header_parse (header, &ret_file_info,
+                                       out_xattrs ? &ret_xattrs : NULL,
+                                       error))
+    goto out;
+
+  if (out_input)
+    {
+      OstreeChunkedInputStream *stream;
+
+      stream = g_object_new (_ostree_chunked_input_stream_get_type (), NULL);
+      stream->repo = g_object_ref (self);
+      stream->chunks = g_variant_get_child_value (file_chunks, 2);
+      if (sources)
+        {
+          stream->sources.fetched_dfd = sources->fetched_dfd;
+          if (sources->fetched)
+            stream->sources.fetched = g_hash_table_ref (sources->fetched);
+          if (sources->index)
+            stream->sources.index = g_hash_table_ref (sources->index);
+        }
+      ret_input = (GInputStream*)stream;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_input, &ret_input);
+  ot_transfer_out_value (out_file_info, &ret_file_info);
+  ot_transfer_out_value (out_xattrs, &ret_xattrs);
+ out:
+  return ret;
+}
+
+/* Add the checksums of all files in the objects directory with the
+ * given suffix to @checksums.
+ */
+static gboolean
+list_by_suffix (OstreeRepo     *self,
+                const char     *suffix,
+                GPtrArray      *checksums,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  static const gchar hexchars[] = "0123456789abcdef";
+  gsize suffix_len = strlen (suffix);
+  guint c;
+
+  for (c = 0; c < 256; c++)
+    {
+      char prefix[3];
+      DIR *d;
+      struct dirent *dent;
+      int dfd;
+
+      prefix[0] = hexchars[c >> 4];
+      prefix[1] = hexchars[c & 0xF];
+      prefix[2] = '\0';
+
+      dfd = ot_opendirat (self->objects_dir_fd, prefix, FALSE);
+      if (dfd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          glnx_set_error_from_errno (error);
+          (void) close (dfd);
+          return FALSE;
+        }
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          const char *name = dent->d_name;
+
+          if (strlen (name) == 62 + 1 + suffix_len
+              && name[62] == '.'
+              && strcmp (name + 63, suffix) == 0)
+            g_ptr_array_add (checksums, g_strdup_printf ("%s%.62s", prefix, name));
+        }
+      (void) closedir (d);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Add the checksums of the manifests kept by a bare repository to
+ * @checksums.  They are all in one directory, so unlike
+ * list_by_suffix() this doesn't have to read every object directory.
+ */
+static gboolean
+list_bare_file_chunks (OstreeRepo     *self,
+                       GPtrArray      *checksums,
+                       GError        **error)
+{
+  gsize suffix_len = strlen (_OSTREE_FILE_CHUNKS_SUFFIX);
+  DIR *d;
+  struct dirent *dent;
+  int dfd;
+
+  dfd = ot_opendirat (self->repo_dir_fd, _OSTREE_BARE_FILE_CHUNKS_DIR, FALSE);
+  if (dfd == -1)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      glnx_set_error_from_errno (error);
+      (void) close (dfd);
+      return FALSE;
+    }
+
+  while ((dent = readdir (d)) != NULL)
+    {
+      const char *name = dent->d_name;
+
+      if (strlen (name) == 64 + 1 + suffix_len
+          && name[64] == '.'
+          && strcmp (name + 65, _OSTREE_FILE_CHUNKS_SUFFIX) == 0)
+        g_ptr_array_add (checksums, g_strndup (name, 64));
+    }
+  (void) closedir (d);
+
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_load_chunk_index:
+ * @out_index: (out): Chunk checksum to #OstreeChunkLocation
+ *
+ * Find the chunks of bare file objects that were fetched in chunks,
+ * from the manifests in %_OSTREE_BARE_FILE_CHUNKS_DIR.  This is always
+ * empty in archive repositories, which keep chunks in the chunk store.
+ */
+gboolean
+_ostree_repo_load_chunk_index (OstreeRepo     *self,
+                               GHashTable    **out_index,
+                               GCancellable   *cancellable,
+                               GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) ret_index =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GPtrArray) file_checksums = g_ptr_array_new_with_free_func (g_free);
+  guint i;
+
+  if (!_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
+    {
+      if (!list_bare_file_chunks (self, file_checksums, error))
+        goto out;
+    }
+
+  for (i = 0; i < file_checksums->len; i++)
+    {
+      const char *file_checksum = file_checksums->pdata[i];
+      g_autoptr(GVariant) file_chunks = NULL;
+      g_autoptr(GVariant) chunks = NULL;
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      struct stat stbuf;
+      guint64 offset = 0;
+      gsize j, n;
+
+      /* Skip manifests left by a transaction that was not committed */
+      _ostree_loose_path (loose_path, file_checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+      if (fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+
+      if (!_ostree_repo_load_file_chunks (self, file_checksum, &file_chunks,
+                                          cancellable, error))
+        goto out;
+      if (!file_chunks)
+        continue;
+
+      chunks = g_variant_get_child_value (file_chunks, 2);
+      n = g_variant_n_children (chunks);
+      for (j = 0; j < n; j++)
+        {
+          g_autoptr(GVariant) csum_v = NULL;
+          g_autofree char *checksum = NULL;
+          guint64 size;
+
+          g_variant_get_child (chunks, j, "(@ayt)", &csum_v, &size);
+          size = GUINT64_FROM_BE (size);
+          checksum = ostree_checksum_from_bytes_v (csum_v);
+
+          if (!g_hash_table_contains (ret_index, checksum))
+            {
+              OstreeChunkLocation *location = g_new (OstreeChunkLocation, 1);
+
+              strcpy (location->file_checksum, file_checksum);
+              location->offset = offset;
+              location->size = size;
+              g_hash_table_insert (ret_index, g_steal_pointer (&checksum), location);
+            }
+          offset += size;
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_index, &ret_index);
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_flush_chunked_content:
+ *
+ * Add the manifests written in the transaction, which must now be in
+ * place, to the list of chunked content.
+ */
+gboolean
+_ostree_repo_flush_chunked_content (OstreeRepo     *self,
+                                    GCancellable   *cancellable,
+                                    GError        **error)
+{
+  g_autoptr(GHashTable) added = NULL;
+
+  g_mutex_lock (&self->txn_stats_lock);
+  added = self->txn_file_chunks;
+  self->txn_file_chunks = NULL;
+  g_mutex_unlock (&self->txn_stats_lock);
+
+  if (!added)
+    return TRUE;
+
+  return update_chunked_content_list (self, added, NULL, FALSE, cancellable, error);
+}
+
+/*
+ * _ostree_repo_get_chunked_content_summary:
+ * @out_chunked_content: (out): Value of %OSTREE_SUMMARY_CHUNKED_CONTENT,
+ *   or %NULL if it should not be set
+ *
+ * Publish the list of content objects of an archive repository which
+ * can be fetched in chunks, and return its checksum.  This is only
+ * done if the repository is configured to store chunks.  Lists
+ * published earlier are deleted; a client which still has a summary
+ * naming one just fetches files whole.
+ */
+gboolean
+_ostree_repo_get_chunked_content_summary (OstreeRepo     *self,
+                                          GVariant      **out_chunked_content,
+                                          GCancellable   *cancellable,
+                                          GError        **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  GMappedFile *mfile = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autofree char *checksum = NULL;
+  g_autofree char *index_path = NULL;
+  g_autofree char *index_name = NULL;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GVariant) ret_chunked_content = NULL;
+  guint8 csum[32];
+
+  if (!(_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode)
+        && self->chunked_content_threshold > 0))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  fd = openat (self->repo_dir_fd, _OSTREE_CHUNKED_CONTENT_LIST, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+  else
+    {
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+      if (!mfile)
+        goto out;
+      data = g_mapped_file_get_bytes (mfile);
+    }
+
+  if (!glnx_shutil_mkdir_p_at (self->objects_dir_fd, _OSTREE_CHUNKED_CONTENT_DIR, 0777,
+                               cancellable, error))
+    goto out;
+
+  if (data && g_bytes_get_size (data) > 0)
+    {
+      struct stat stbuf;
+
+      checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, data);
+      index_path = _ostree_get_relative_chunked_content_path (checksum);
+      index_name = g_path_get_basename (index_path);
+
+      if (fstatat (self->objects_dir_fd, index_path, &stbuf, 0) != 0)
+        {
+          if (errno != ENOENT)
+            {
+              glnx_set_error_from_errno (error);
+              goto out;
+            }
+          if (!_ostree_repo_file_replace_contents (self, self->objects_dir_fd, index_path,
+                                                   g_bytes_get_data (data, NULL),
+                                                   g_bytes_get_size (data),
+                                                   cancellable, error))
+            goto out;
+        }
+
+      ostree_checksum_inplace_to_bytes (checksum, csum);
+      ret_chunked_content = ot_gvariant_new_bytearray (csum, 32);
+      g_variant_ref_sink (ret_chunked_content);
+    }
+
+  if (!glnx_dirfd_iterator_init_at (self->objects_dir_fd, _OSTREE_CHUNKED_CONTENT_DIR, FALSE,
+                                    &dfd_iter, error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        goto out;
+      if (dent == NULL)
+        break;
+
+      if (index_name && strcmp (dent->d_name, index_name) == 0)
+        continue;
+
+      if (unlinkat (dfd_iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_chunked_content, &ret_chunked_content);
+ out:
+  g_clear_pointer (&mfile, (GDestroyNotify) g_mapped_file_unref);
+  return ret;
+}
+
+/*
+ * _ostree_repo_prune_chunks:
+ *
+ * Delete the chunks that no manifest refers to.  This must run after
+ * unreachable content objects have been deleted.
+ */
+gboolean
+_ostree_repo_prune_chunks (OstreeRepo     *self,
+                           guint          *out_n_pruned,
+                           guint64        *out_freed_bytes,
+                           GCancellable   *cancellable,
+                           GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) referenced =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) file_checksums = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) chunk_checksums = g_ptr_array_new_with_free_func (g_free);
+  guint n_pruned = 0;
+  guint64 freed_bytes = 0;
+  guint i;
+
+  if (!_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!list_by_suffix (self, _OSTREE_FILE_CHUNKS_SUFFIX, file_checksums,
+                       cancellable, error))
+    goto out;
+  if (!list_by_suffix (self, _OSTREE_CHUNK_SUFFIX, chunk_checksums,
+                       cancellable, error))
+    goto out;
+
+  {
+    g_autoptr(GHashTable) manifests = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < file_checksums->len; i++)
+      g_hash_table_add (manifests, file_checksums->pdata[i]);
+    if (!update_chunked_content_list (self, manifests, NULL, TRUE,
+                                      cancellable, error))
+      goto out;
+  }
+
+  for (i = 0; i < file_checksums->len; i++)
+    {
+      g_autoptr(GVariant) file_chunks = NULL;
+      g_autoptr(GVariant) chunks = NULL;
+      gsize j, n;
+
+      if (!_ostree_repo_load_file_chunks (self, file_checksums->pdata[i], &file_chunks,
+                                          cancellable, error))
+        goto out;
+      if (!file_chunks)
+        continue;
+
+      chunks = g_variant_get_child_value (file_chunks, 2);
+      n = g_variant_n_children (chunks);
+      for (j = 0; j < n; j++)
+        {
+          g_autoptr(GVariant) csum_v = NULL;
+
+          g_variant_get_child (chunks, j, "(@ayt)", &csum_v, NULL);
+          g_hash_table_add (referenced, ostree_checksum_from_bytes_v (csum_v));
+        }
+    }
+
+  for (i = 0; i < chunk_checksums->len; i++)
+    {
+      const char *checksum = chunk_checksums->pdata[i];
+      char path[_OSTREE_LOOSE_PATH_MAX];
+      struct stat stbuf;
+
+      if (g_hash_table_contains (referenced, checksum))
+        continue;
+
+      _ostree_chunk_path (path, checksum);
+      if (fstatat (self->objects_dir_fd, path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0
+          || unlinkat (self->objects_dir_fd, path, 0) != 0)
+        {
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          g_prefix_error (error, "Deleting chunk %s: ", checksum);
+          goto out;
+        }
+
+      n_pruned++;
+      freed_bytes += stbuf.st_size;
+    }
+
+  ret = TRUE;
+ out:
+  if (out_n_pruned)
+    *out_n_pruned = n_pruned;
+  if (out_freed_bytes)
+    *out_freed_bytes = freed_bytes;
+  return ret;
+}
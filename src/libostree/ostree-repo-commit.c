@@ -25,14 +25,20 @@
 #include <glib-unix.h>
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include "otutil.h"
 
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-repo-chunks-private.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-checksum-input-stream.h"
 #include "ostree-mutable-tree.h"
 #include "ostree-varint.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-compressor.h"
+#endif
 #include <sys/xattr.h>
 #include <glib/gprintf.h>
 
@@ -59,6 +65,32 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
   return TRUE;
 }
 
+/* Like _ostree_repo_ensure_loose_objdir_at() for the transaction's
+ * staging directory, but each fan-out directory is only created the
+ * first time an object with that prefix is staged.  Writers may race
+ * here; the loser just gets EEXIST.
+ */
+gboolean
+_ostree_repo_ensure_staged_objdir (OstreeRepo     *self,
+                                   const char     *loose_path,
+                                   GCancellable   *cancellable,
+                                   GError        **error)
+{
+  guint prefix = (g_ascii_xdigit_value (loose_path[0]) << 4) | g_ascii_xdigit_value (loose_path[1]);
+  volatile guint *word = &self->commit_stagedir_objdirs[prefix / 32];
+  guint bit = 1U << (prefix % 32);
+
+  if (g_atomic_int_get (word) & bit)
+    return TRUE;
+
+  if (!_ostree_repo_ensure_loose_objdir_at (self->commit_stagedir_fd, loose_path,
+                                            cancellable, error))
+    return FALSE;
+
+  g_atomic_int_or (word, bit);
+  return TRUE;
+}
+
 static GVariant *
 create_file_metadata (guint32       uid,
                       guint32       gid,
@@ -125,13 +157,18 @@ _ostree_repo_commit_loose_final (OstreeRepo        *self,
   _ostree_loose_path (tmpbuf, checksum, objtype, self->mode);
 
   if (self->in_transaction)
-    dest_dfd = self->commit_stagedir_fd;
+    {
+      dest_dfd = self->commit_stagedir_fd;
+      if (!_ostree_repo_ensure_staged_objdir (self, tmpbuf, cancellable, error))
+        goto out;
+    }
   else
-    dest_dfd = self->objects_dir_fd;
-
-  if (!_ostree_repo_ensure_loose_objdir_at (dest_dfd, tmpbuf,
-                                            cancellable, error))
-    goto out;
+    {
+      dest_dfd = self->objects_dir_fd;
+      if (!_ostree_repo_ensure_loose_objdir_at (dest_dfd, tmpbuf,
+                                                cancellable, error))
+        goto out;
+    }
 
   if (G_UNLIKELY (renameat (temp_dfd, temp_filename,
                             dest_dfd, tmpbuf) == -1))
@@ -151,6 +188,122 @@ _ostree_repo_commit_loose_final (OstreeRepo        *self,
   return ret;
 }
 
+/* Like _ostree_repo_commit_loose_final(), but for an anonymous
+ * O_TMPFILE file, which is given a name with linkat().
+ */
+static gboolean
+commit_loose_final_tmpfile (OstreeRepo        *self,
+                            const char        *checksum,
+                            OstreeObjectType   objtype,
+                            int                tmpfile_fd,
+                            GCancellable      *cancellable,
+                            GError           **error)
+{
+  gboolean ret = FALSE;
+  int dest_dfd;
+  char tmpbuf[_OSTREE_LOOSE_PATH_MAX];
+  char proc_fd_path[sizeof ("/proc/self/fd/") + (sizeof (int) * 3)];
+
+  _ostree_loose_path (tmpbuf, checksum, objtype, self->mode);
+
+  if (self->in_transaction)
+    {
+      dest_dfd = self->commit_stagedir_fd;
+      if (!_ostree_repo_ensure_staged_objdir (self, tmpbuf, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      dest_dfd = self->objects_dir_fd;
+      if (!_ostree_repo_ensure_loose_objdir_at (dest_dfd, tmpbuf,
+                                                cancellable, error))
+        goto out;
+    }
+
+  g_snprintf (proc_fd_path, sizeof (proc_fd_path), "/proc/self/fd/%d", tmpfile_fd);
+  if (G_UNLIKELY (linkat (AT_FDCWD, proc_fd_path, dest_dfd, tmpbuf,
+                          AT_SYMLINK_FOLLOW) == -1))
+    {
+      if (errno != EEXIST)
+        {
+          glnx_set_error_from_errno (error);
+          g_prefix_error (error, "Storing object %s: ", checksum);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Open a temporary file in the repository's tmp directory.  If the
+ * filesystem supports it (see probe_tmpfile()), this is an anonymous
+ * O_TMPFILE file and @out_temp_filename is set to %NULL; it never needs
+ * to be renamed or cleaned up.
+ */
+static gboolean
+open_temporary_file (OstreeRepo     *self,
+                     char          **out_temp_filename,
+                     GOutputStream **out_temp_out,
+                     GCancellable   *cancellable,
+                     GError        **error)
+{
+#ifdef O_TMPFILE
+  if (self->tmpfile_supported)
+    {
+      int fd;
+
+      do
+        fd = openat (self->tmp_dir_fd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+      while (G_UNLIKELY (fd == -1 && errno == EINTR));
+      if (fd == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      *out_temp_filename = NULL;
+      *out_temp_out = g_unix_output_stream_new (fd, TRUE);
+      return TRUE;
+    }
+#endif
+
+  return gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                    out_temp_filename, out_temp_out,
+                                    cancellable, error);
+}
+
+/* Check whether O_TMPFILE works in the repository's tmp directory, and
+ * whether such files can be linked into place via /proc.
+ */
+static void
+probe_tmpfile (OstreeRepo *self)
+{
+#ifdef O_TMPFILE
+  glnx_fd_close int fd = -1;
+  g_autofree char *probe_name = NULL;
+  char proc_fd_path[sizeof ("/proc/self/fd/") + (sizeof (int) * 3)];
+
+  if (self->tmpfile_probed)
+    return;
+  self->tmpfile_probed = TRUE;
+
+  fd = openat (self->tmp_dir_fd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return;
+
+  probe_name = g_strdup_printf ("tmpfile-probe-%u", g_random_int ());
+  g_snprintf (proc_fd_path, sizeof (proc_fd_path), "/proc/self/fd/%d", fd);
+  if (linkat (AT_FDCWD, proc_fd_path, self->tmp_dir_fd, probe_name,
+              AT_SYMLINK_FOLLOW) == -1)
+    return;
+
+  (void) unlinkat (self->tmp_dir_fd, probe_name, 0);
+  self->tmpfile_supported = TRUE;
+#endif
+}
+
 static gboolean
 commit_loose_object_trusted (OstreeRepo        *self,
                              const char        *checksum,
@@ -170,13 +323,19 @@ commit_loose_object_trusted (OstreeRepo        *self,
   /* We may be writing as root to a non-root-owned repository; if so,
    * automatically inherit the non-root ownership.
    */
-  if (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode)
       && self->target_owner_uid != -1) 
     {
-      if (G_UNLIKELY (fchownat (self->tmp_dir_fd, temp_filename,
-                                self->target_owner_uid,
-                                self->target_owner_gid,
-                                AT_SYMLINK_NOFOLLOW) == -1))
+      int res;
+
+      if (temp_filename)
+        res = fchownat (self->tmp_dir_fd, temp_filename,
+                        self->target_owner_uid,
+                        self->target_owner_gid,
+                        AT_SYMLINK_NOFOLLOW);
+      else
+        res = fchown (fd, self->target_owner_uid, self->target_owner_gid);
+      if (G_UNLIKELY (res == -1))
         {
           gs_set_error_from_errno (error, errno);
           goto out;
@@ -295,10 +454,19 @@ commit_loose_object_trusted (OstreeRepo        *self,
         }
     }
 
-  if (!_ostree_repo_commit_loose_final (self, checksum, objtype,
-                                        self->tmp_dir_fd, temp_filename,
-                                        cancellable, error))
-    goto out;
+  if (temp_filename)
+    {
+      if (!_ostree_repo_commit_loose_final (self, checksum, objtype,
+                                            self->tmp_dir_fd, temp_filename,
+                                            cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!commit_loose_final_tmpfile (self, checksum, objtype, fd,
+                                       cancellable, error))
+        goto out;
+    }
   
   ret = TRUE;
  out:
@@ -336,6 +504,8 @@ repo_store_size_entry (OstreeRepo       *self,
                        gsize             unpacked,
                        gsize             archived)
 {
+  /* Content may be written from several threads at once */
+  g_mutex_lock (&self->txn_stats_lock);
   if (G_UNLIKELY (self->object_sizes == NULL))
     self->object_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, content_size_cache_entry_free);
@@ -343,6 +513,7 @@ repo_store_size_entry (OstreeRepo       *self,
   g_hash_table_replace (self->object_sizes,
                         g_strdup (checksum),
                         content_size_cache_entry_new (unpacked, archived));
+  g_mutex_unlock (&self->txn_stats_lock);
 }
 
 static int
@@ -521,12 +692,92 @@ _ostree_repo_commit_trusted_content_bare (OstreeRepo          *self,
   return ret;
 }
 
+/* The compressor for the payload of new content objects in archive
+ * modes; readers detect the format from the data.
+ */
+GConverter *
+_ostree_repo_new_content_compressor (OstreeRepo *self)
+{
+#ifdef HAVE_ZSTD
+  if (self->mode == OSTREE_REPO_MODE_ARCHIVE_ZSTD)
+    return (GConverter*)_ostree_zstd_compressor_new (self->compression_level);
+#endif
+  g_assert (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2);
+  return (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, self->compression_level);
+}
+
+/* Feed the @size bytes cloned into @fd to @checksum.  The clone is
+ * what gets stored, so it is what must match the object name; reading
+ * the source again could see different data.
+ */
+static gboolean
+checksum_cloned_fd (int            fd,
+                    guint64        size,
+                    OtSha256      *checksum,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gboolean ret = FALSE;
+  char buf[16384];
+  guint64 offset = 0;
+  struct stat stbuf;
+
+  if (fstat (fd, &stbuf) != 0)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+  if ((guint64) stbuf.st_size != size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "File changed while cloning: expected %" G_GUINT64_FORMAT " bytes, got %" G_GUINT64_FORMAT,
+                   size, (guint64) stbuf.st_size);
+      goto out;
+    }
+
+  while (checksum && offset < size)
+    {
+      gssize n_read;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      do
+        n_read = pread (fd, buf, MIN (sizeof (buf), size - offset), offset);
+      while (G_UNLIKELY (n_read == -1 && errno == EINTR));
+      if (n_read == -1)
+        {
+          gs_set_error_from_errno (error, errno);
+          goto out;
+        }
+      if (n_read == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "File changed while cloning: unexpected end of file");
+          goto out;
+        }
+
+      ot_sha256_update (checksum, buf, n_read);
+      offset += n_read;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * If @content_fd is not -1, it is a regular file holding the same
+ * data as the content object in @input; bare repositories then try
+ * to clone it rather than copying the data.
+ */
 static gboolean
 write_object (OstreeRepo         *self,
               OstreeObjectType    objtype,
               const char         *expected_checksum,
               GInputStream       *input,
               guint64             file_object_length,
+              int                 content_fd,
               guchar            **out_csum,
               GCancellable       *cancellable,
               GError            **error)
@@ -544,13 +795,15 @@ write_object (OstreeRepo         *self,
   g_autoptr(GVariant) xattrs = NULL;
   g_autoptr(GOutputStream) temp_out = NULL;
   gboolean have_obj;
-  GChecksum *checksum = NULL;
+  OtSha256 *checksum = NULL;
   gboolean temp_file_is_regular;
   gboolean temp_file_is_symlink;
   gboolean object_is_symlink = FALSE;
   char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
   gssize unpacked_size = 0;
   gboolean indexable = FALSE;
+  g_autoptr(GVariant) file_chunks = NULL;
+  guint64 cloned_size = 0;
 
   g_return_val_if_fail (expected_checksum || out_csum, FALSE);
 
@@ -563,6 +816,9 @@ write_object (OstreeRepo         *self,
                                           &have_obj, loose_objpath,
                                           NULL, cancellable, error))
         goto out;
+      if (!have_obj)
+        have_obj = _ostree_repo_find_packed_object (self, objtype, expected_checksum,
+                                                    NULL, NULL);
       if (have_obj)
         {
           if (out_csum)
@@ -574,11 +830,14 @@ write_object (OstreeRepo         *self,
 
   repo_mode = ostree_repo_get_mode (self);
 
-  if (out_csum)
+  /* Cloned data is always checksummed, since it can differ from what
+   * the caller read (see checksum_cloned_fd()).
+   */
+  if (out_csum || (content_fd != -1 && !_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode)))
     {
-      checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      checksum = ot_sha256_new ();
       if (input)
-        checksum_input = ostree_checksum_input_stream_new (input, checksum);
+        checksum_input = _ostree_checksum_input_stream_new_sha256 (input, checksum);
     }
 
   if (objtype == OSTREE_OBJECT_TYPE_FILE)
@@ -627,18 +886,42 @@ write_object (OstreeRepo         *self,
       if ((repo_mode == OSTREE_REPO_MODE_BARE || repo_mode == OSTREE_REPO_MODE_BARE_USER) && temp_file_is_regular)
         {
           guint64 size = g_file_info_get_size (file_info);
+          gboolean cloned = FALSE;
 
-          if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
-                                          cancellable, error))
+          if (!open_temporary_file (self, &temp_filename, &temp_out,
+                                    cancellable, error))
             goto out;
 
-          if (!fallocate_stream ((GFileDescriptorBased*)temp_out, size,
-                                 cancellable, error))
-            goto out;
+          if (content_fd != -1 && !object_is_symlink)
+            {
+              if (!ot_regfile_clone (content_fd,
+                                     g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out),
+                                     size, &cloned, error))
+                goto out;
+            }
 
-          if (g_output_stream_splice (temp_out, file_input, 0,
-                                      cancellable, error) < 0)
-            goto out;
+          if (cloned)
+            {
+              /* The header was checksummed as it was parsed; the data
+               * is checksummed from the clone rather than from
+               * @file_input, so a source changing under us is caught
+               * below as a checksum mismatch.
+               */
+              if (!checksum_cloned_fd (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out),
+                                       size, checksum, cancellable, error))
+                goto out;
+              cloned_size = size;
+            }
+          else
+            {
+              if (!fallocate_stream ((GFileDescriptorBased*)temp_out, size,
+                                     cancellable, error))
+                goto out;
+
+              if (g_output_stream_splice (temp_out, file_input, 0,
+                                          cancellable, error) < 0)
+                goto out;
+            }
         }
       else if (repo_mode == OSTREE_REPO_MODE_BARE && temp_file_is_symlink)
         {
@@ -648,18 +931,17 @@ write_object (OstreeRepo         *self,
                                                   cancellable, error))
             goto out;
         }
-      else if (repo_mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+      else if (_OSTREE_REPO_MODE_IS_ARCHIVE (repo_mode))
         {
           g_autoptr(GVariant) file_meta = NULL;
-          g_autoptr(GConverter) zlib_compressor = NULL;
+          g_autoptr(GConverter) compressor = NULL;
           g_autoptr(GOutputStream) compressed_out_stream = NULL;
 
           if (self->generate_sizes)
             indexable = TRUE;
 
-          if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
-                                          &temp_filename, &temp_out,
-                                          cancellable, error))
+          if (!open_temporary_file (self, &temp_filename, &temp_out,
+                                    cancellable, error))
             goto out;
           temp_file_is_regular = TRUE;
 
@@ -671,15 +953,35 @@ write_object (OstreeRepo         *self,
 
           if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
             {
-              zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
-              compressed_out_stream = g_converter_output_stream_new (temp_out, zlib_compressor);
+              compressor = _ostree_repo_new_content_compressor (self);
+              compressed_out_stream = g_converter_output_stream_new (temp_out, compressor);
               /* Don't close the base; we'll do that later */
               g_filter_output_stream_set_close_base_stream ((GFilterOutputStream*)compressed_out_stream, FALSE);
               
-              unpacked_size = g_output_stream_splice (compressed_out_stream, file_input,
-                                                      0, cancellable, error);
-              if (unpacked_size < 0)
-                goto out;
+              if (self->chunked_content_threshold > 0
+                  && g_file_info_get_size (file_info) >= self->chunked_content_threshold)
+                {
+                  guint64 chunked_size;
+
+                  /* The .filez is still written for clients which
+                   * can't fetch chunks.  The chunks are written as we
+                   * go; the manifest is written once the checksum is
+                   * known.
+                   */
+                  if (!_ostree_repo_write_content_chunks (self, file_meta, file_input,
+                                                          compressed_out_stream,
+                                                          &file_chunks, &chunked_size,
+                                                          cancellable, error))
+                    goto out;
+                  unpacked_size = chunked_size;
+                }
+              else
+                {
+                  unpacked_size = g_output_stream_splice (compressed_out_stream, file_input,
+                                                          0, cancellable, error);
+                  if (unpacked_size < 0)
+                    goto out;
+                }
             }
         }
       else
@@ -687,8 +989,8 @@ write_object (OstreeRepo         *self,
     }
   else
     {
-      if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
-                                      cancellable, error))
+      if (!open_temporary_file (self, &temp_filename, &temp_out,
+                                cancellable, error))
         goto out;
 
       if (!fallocate_stream ((GFileDescriptorBased*)temp_out, file_object_length,
@@ -712,7 +1014,7 @@ write_object (OstreeRepo         *self,
     actual_checksum = expected_checksum;
   else
     {
-      actual_checksum = g_checksum_get_string (checksum);
+      actual_checksum = ot_sha256_get_string (checksum);
       if (expected_checksum && strcmp (actual_checksum, expected_checksum) != 0)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -728,8 +1030,13 @@ write_object (OstreeRepo         *self,
   if (indexable && temp_file_is_regular)
     {
       struct stat stbuf;
+      int res;
 
-      if (fstatat (self->tmp_dir_fd, temp_filename, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+      if (temp_filename)
+        res = fstatat (self->tmp_dir_fd, temp_filename, &stbuf, AT_SYMLINK_NOFOLLOW);
+      else
+        res = fstat (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out), &stbuf);
+      if (res == -1)
         {
           gs_set_error_from_errno (error, errno);
           goto out;
@@ -742,6 +1049,9 @@ write_object (OstreeRepo         *self,
                                       &have_obj, loose_objpath, NULL,
                                       cancellable, error))
     goto out;
+  if (!have_obj)
+    have_obj = _ostree_repo_find_packed_object (self, objtype, actual_checksum,
+                                                NULL, NULL);
           
   do_commit = !have_obj;
 
@@ -770,6 +1080,13 @@ write_object (OstreeRepo         *self,
                                         cancellable, error))
         goto out;
 
+      if (file_chunks)
+        {
+          if (!_ostree_repo_write_file_chunks (self, actual_checksum, file_chunks,
+                                               cancellable, error))
+            goto out;
+        }
+
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
         {
           if (G_UNLIKELY (file_object_length > OSTREE_MAX_METADATA_WARN_SIZE))
@@ -798,6 +1115,7 @@ write_object (OstreeRepo         *self,
         {
           self->txn_stats.content_objects_written++;
           self->txn_stats.content_bytes_written += file_object_length;
+          self->txn_stats.content_bytes_cloned += cloned_size;
         }
     }
   if (OSTREE_OBJECT_TYPE_IS_META (objtype))
@@ -807,14 +1125,17 @@ write_object (OstreeRepo         *self,
   g_mutex_unlock (&self->txn_stats_lock);
       
   if (checksum)
-    ret_csum = ot_csum_from_gchecksum (checksum);
+    {
+      ret_csum = g_malloc (32);
+      ot_sha256_get_digest (checksum, ret_csum);
+    }
 
   ret = TRUE;
   ot_transfer_out_value(out_csum, &ret_csum);
  out:
   if (temp_filename)
     (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify) ot_sha256_free);
   return ret;
 }
 
@@ -895,6 +1216,7 @@ scan_one_loose_devino (OstreeRepo                     *self,
           switch (self->mode)
             {
             case OSTREE_REPO_MODE_ARCHIVE_Z2:
+            case OSTREE_REPO_MODE_ARCHIVE_ZSTD:
             case OSTREE_REPO_MODE_BARE:
             case OSTREE_REPO_MODE_BARE_USER:
               skip = !g_str_has_suffix (name, ".file");
@@ -951,7 +1273,7 @@ scan_loose_devino (OstreeRepo                     *self,
         goto out;
     }
 
-  if (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode))
     {
       if (!scan_one_loose_devino (self, self->uncompressed_objects_dir_fd, devino_cache,
                                   cancellable, error))
@@ -1083,6 +1405,9 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
   if (!gs_opendirat (self->tmp_dir_fd, self->commit_stagedir_name, FALSE,
                      &self->commit_stagedir_fd, error))
     goto out;
+  memset (self->commit_stagedir_objdirs, 0, sizeof (self->commit_stagedir_objdirs));
+
+  probe_tmpfile (self);
   
   ret = TRUE;
   if (out_transaction_resume)
@@ -1107,8 +1432,7 @@ rename_pending_loose_objects (OstreeRepo        *self,
     {
       struct dirent *dent;
       gs_dirfd_iterator_cleanup GSDirFdIterator child_dfd_iter = { 0, };
-      struct stat stbuf;
-      int res;
+      glnx_fd_close int target_dfd = -1;
 
       if (!gs_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
         goto out;
@@ -1116,31 +1440,23 @@ rename_pending_loose_objects (OstreeRepo        *self,
       if (dent == NULL)
         break;
 
-      do
-        res = fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW);
-      while (G_UNLIKELY (res == -1 && errno == EINTR));
-      if (res == -1)
-        {
-          gs_set_error_from_errno (error, errno);
-          goto out;
-        }
-
-      if (!S_ISDIR (stbuf.st_mode))
-        continue;
-
       /* All object directories only have two character entries */
       if (strlen (dent->d_name) != 2)
         continue;
 
+      if (dent->d_type != DT_DIR && dent->d_type != DT_UNKNOWN)
+        continue;
+
       if (!gs_dirfd_iterator_init_at (dfd_iter.fd, dent->d_name, FALSE,
                                       &child_dfd_iter, error))
         goto out;
 
-      /* Iterate over inner checksum dir */
+      /* Iterate over inner checksum dir; all objects in it go to the
+       * same target directory, which is only looked up once.
+       */
       while (TRUE)
         {
           struct dirent *child_dent;
-          char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
 
           if (!gs_dirfd_iterator_next_dent (&child_dfd_iter, &child_dent, cancellable, error))
             goto out;
@@ -1148,18 +1464,18 @@ rename_pending_loose_objects (OstreeRepo        *self,
           if (child_dent == NULL)
             break;
 
-          loose_objpath[0] = dent->d_name[0];
-          loose_objpath[1] = dent->d_name[1];
-          loose_objpath[2] = '/';
-
-          g_strlcpy (loose_objpath + 3, child_dent->d_name, sizeof (loose_objpath)-3);
-
-          if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_objpath,
-                                                    cancellable, error))
-            goto out;
+          if (target_dfd == -1)
+            {
+              if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, dent->d_name,
+                                                        cancellable, error))
+                goto out;
+              if (!gs_opendirat (self->objects_dir_fd, dent->d_name, FALSE,
+                                 &target_dfd, error))
+                goto out;
+            }
 
-          if (G_UNLIKELY (renameat (child_dfd_iter.fd, loose_objpath + 3,
-                                    self->objects_dir_fd, loose_objpath) < 0))
+          if (G_UNLIKELY (renameat (child_dfd_iter.fd, child_dent->d_name,
+                                    target_dfd, child_dent->d_name) < 0))
             {
               gs_set_error_from_errno (error, errno);
               goto out;
@@ -1321,6 +1637,13 @@ ostree_repo_set_ref_immediate (OstreeRepo *self,
                                  cancellable, error);
 }
 
+static guint32
+elapsed_usec_since (gint64 start)
+{
+  gint64 elapsed = g_get_monotonic_time () - start;
+  return (guint32) CLAMP (elapsed, 0, G_MAXUINT32);
+}
+
 /**
  * ostree_repo_commit_transaction:
  * @self: An #OstreeRepo
@@ -1340,17 +1663,22 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
                                 GError                     **error)
 {
   gboolean ret = FALSE;
+  gint64 phase_start;
 
   g_return_val_if_fail (self->in_transaction == TRUE, FALSE);
 
+  phase_start = g_get_monotonic_time ();
   if (syncfs (self->tmp_dir_fd) < 0)
     {
       gs_set_error_from_errno (error, errno);
       goto out;
     }
+  self->txn_stats.fsync_usec = elapsed_usec_since (phase_start);
 
+  phase_start = g_get_monotonic_time ();
   if (!rename_pending_loose_objects (self, cancellable, error))
     goto out;
+  self->txn_stats.rename_usec = elapsed_usec_since (phase_start);
 
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
@@ -1358,10 +1686,18 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   if (self->loose_object_devino_hash)
     g_hash_table_remove_all (self->loose_object_devino_hash);
 
+  /* Only now are all the objects it refers to in place */
+  if (!_ostree_repo_stat_cache_flush (self, cancellable, error))
+    goto out;
+  if (!_ostree_repo_flush_chunked_content (self, cancellable, error))
+    goto out;
+
+  phase_start = g_get_monotonic_time ();
   if (self->txn_refs)
     if (!_ostree_repo_update_refs (self, self->txn_refs, cancellable, error))
       goto out;
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
+  self->txn_stats.ref_update_usec = elapsed_usec_since (phase_start);
 
   if (self->commit_stagedir_fd != -1)
     {
@@ -1400,6 +1736,9 @@ ostree_repo_abort_transaction (OstreeRepo     *self,
   if (self->loose_object_devino_hash)
     g_hash_table_remove_all (self->loose_object_devino_hash);
 
+  _ostree_repo_stat_cache_clear (self);
+  g_clear_pointer (&self->txn_file_chunks, g_hash_table_unref);
+
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
   
   if (self->commit_stagedir_fd != -1)
@@ -1462,7 +1801,7 @@ ostree_repo_write_metadata (OstreeRepo         *self,
   input = ot_variant_read (normalized);
 
   if (!write_object (self, objtype, expected_checksum,
-                     input, g_variant_get_size (normalized),
+                     input, g_variant_get_size (normalized), -1,
                      out_csum,
                      cancellable, error))
     goto out;
@@ -1494,7 +1833,7 @@ ostree_repo_write_metadata_stream_trusted (OstreeRepo        *self,
                                            GCancellable      *cancellable,
                                            GError           **error)
 {
-  return write_object (self, objtype, checksum, object_input, length, NULL,
+  return write_object (self, objtype, checksum, object_input, length, -1, NULL,
                        cancellable, error);
 }
 
@@ -1525,7 +1864,7 @@ ostree_repo_write_metadata_trusted (OstreeRepo         *self,
   input = ot_variant_read (normalized);
 
   return write_object (self, type, checksum,
-                       input, g_variant_get_size (normalized),
+                       input, g_variant_get_size (normalized), -1,
                        NULL,
                        cancellable, error);
 }
@@ -1675,7 +2014,7 @@ ostree_repo_write_content_trusted (OstreeRepo       *self,
                                    GError          **error)
 {
   return write_object (self, OSTREE_OBJECT_TYPE_FILE, checksum,
-                       object_input, length, NULL,
+                       object_input, length, -1, NULL,
                        cancellable, error);
 }
 
@@ -1703,7 +2042,29 @@ ostree_repo_write_content (OstreeRepo       *self,
                            GError          **error)
 {
   return write_object (self, OSTREE_OBJECT_TYPE_FILE, expected_checksum,
-                       object_input, length, out_csum,
+                       object_input, length, -1, out_csum,
+                       cancellable, error);
+}
+
+/*
+ * Like ostree_repo_write_content(), but @content_fd (or -1) is a
+ * regular file holding the same data as the content object, which
+ * bare repositories clone when the filesystem supports it.  If
+ * @out_csum is %NULL, @expected_checksum is trusted, as with
+ * ostree_repo_write_content_trusted().
+ */
+gboolean
+_ostree_repo_write_content_from_fd (OstreeRepo       *self,
+                                    const char       *expected_checksum,
+                                    GInputStream     *object_input,
+                                    guint64           length,
+                                    int               content_fd,
+                                    guchar          **out_csum,
+                                    GCancellable     *cancellable,
+                                    GError          **error)
+{
+  return write_object (self, OSTREE_OBJECT_TYPE_FILE, expected_checksum,
+                       object_input, length, content_fd, out_csum,
                        cancellable, error);
 }
 
@@ -2245,6 +2606,273 @@ get_modified_xattrs (OstreeRepo                       *self,
   return ret;
 }
 
+/* When committing from a directory file descriptor, the scan itself
+ * (readdir, stat, filters, xattrs and SELinux labeling) stays on the
+ * calling thread, but checksumming and (for archive-z2) compression
+ * of each file is handed to a pool of worker threads.  The resulting
+ * checksums are recorded in the mutable tree in scan order once all
+ * workers are done, so the tree is exactly what the serial path would
+ * have produced.  The first COMMIT_CONTENT_QUEUE_THRESHOLD files still
+ * take the serial path, so that small commits don't pay for starting
+ * the threads.
+ */
+#define COMMIT_CONTENT_QUEUE_THRESHOLD 128
+
+typedef struct {
+  OstreeRepo   *repo;
+  GThreadPool  *pool;  /* Created once the threshold is reached */
+  guint         n_serial;
+  GCancellable *cancellable;
+  GPtrArray    *jobs;  /* Owned CommitContentJob, in scan order */
+  guint         max_pending;
+
+  GMutex        lock;
+  GCond         cond;
+  guint         n_pending;
+  GError       *error;
+} CommitContentQueue;
+
+typedef struct {
+  CommitContentQueue *queue;
+  OstreeMutableTree  *mtree;
+  char               *name;
+  GInputStream       *file_input;
+  GFileInfo          *file_info;
+  GVariant           *xattrs;
+  gboolean            have_stbuf;
+  struct stat         stbuf;
+  char               *checksum;
+} CommitContentJob;
+
+static void
+commit_content_job_free (CommitContentJob *job)
+{
+  g_clear_object (&job->mtree);
+  g_free (job->name);
+  g_clear_object (&job->file_input);
+  g_clear_object (&job->file_info);
+  g_clear_pointer (&job->xattrs, (GDestroyNotify) g_variant_unref);
+  g_free (job->checksum);
+  g_free (job);
+}
+
+/* The descriptor behind a local file's stream, so its data can be cloned */
+static int
+input_stream_get_fd (GInputStream *input)
+{
+  if (input && G_IS_FILE_DESCRIPTOR_BASED (input))
+    return g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input);
+  return -1;
+}
+
+static gboolean
+commit_content_job_run (CommitContentJob  *job,
+                        GError           **error)
+{
+  gboolean ret = FALSE;
+  CommitContentQueue *queue = job->queue;
+  guint64 file_obj_length;
+  g_autoptr(GInputStream) file_object_input = NULL;
+  g_autofree guchar *child_file_csum = NULL;
+
+  if (!ostree_raw_file_to_content_stream (job->file_input,
+                                          job->file_info, job->xattrs,
+                                          &file_object_input, &file_obj_length,
+                                          queue->cancellable, error))
+    goto out;
+  if (!_ostree_repo_write_content_from_fd (queue->repo, NULL, file_object_input, file_obj_length,
+                                           input_stream_get_fd (job->file_input),
+                                           &child_file_csum, queue->cancellable, error))
+    goto out;
+
+  job->checksum = ostree_checksum_from_bytes (child_file_csum);
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Writing content object for %s: ", job->name);
+  return ret;
+}
+
+static void
+commit_content_queue_worker (gpointer datap,
+                             gpointer user_data)
+{
+  CommitContentJob *job = datap;
+  CommitContentQueue *queue = user_data;
+  gboolean failed;
+  GError *local_error = NULL;
+
+  g_mutex_lock (&queue->lock);
+  failed = queue->error != NULL;
+  g_mutex_unlock (&queue->lock);
+
+  if (!failed && !commit_content_job_run (job, &local_error))
+    failed = TRUE;
+
+  /* The stream holds a file descriptor; don't keep it past the write */
+  g_clear_object (&job->file_input);
+
+  g_mutex_lock (&queue->lock);
+  if (local_error)
+    {
+      if (queue->error == NULL)
+        queue->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  queue->n_pending--;
+  g_cond_signal (&queue->cond);
+  g_mutex_unlock (&queue->lock);
+}
+
+static CommitContentQueue *
+commit_content_queue_new (OstreeRepo   *repo,
+                          GCancellable *cancellable)
+{
+  CommitContentQueue *queue = g_new0 (CommitContentQueue, 1);
+
+  queue->repo = repo;
+  queue->cancellable = cancellable;
+  queue->jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) commit_content_job_free);
+  g_mutex_init (&queue->lock);
+  g_cond_init (&queue->cond);
+
+  return queue;
+}
+
+/* Returns: %TRUE if the next file should be pushed to @queue, %FALSE
+ * if it should be written on the serial path.
+ */
+static gboolean
+commit_content_queue_accepts (CommitContentQueue *queue)
+{
+  if (queue->n_serial < COMMIT_CONTENT_QUEUE_THRESHOLD)
+    {
+      queue->n_serial++;
+      return FALSE;
+    }
+
+  if (queue->pool == NULL)
+    {
+      queue->pool = ot_thread_pool_new_nproc (commit_content_queue_worker, queue);
+      /* Bound the number of open files and buffered xattrs */
+      queue->max_pending = 4 * g_thread_pool_get_max_threads (queue->pool);
+    }
+
+  return TRUE;
+}
+
+/* Wait until at most @max_pending jobs are outstanding, and return the
+ * first worker error, if any.
+ */
+static gboolean
+commit_content_queue_wait (CommitContentQueue *queue,
+                           guint               max_pending,
+                           GError            **error)
+{
+  gboolean ret = FALSE;
+
+  g_mutex_lock (&queue->lock);
+  while (queue->n_pending > max_pending)
+    g_cond_wait (&queue->cond, &queue->lock);
+  if (queue->error)
+    {
+      g_propagate_error (error, queue->error);
+      queue->error = NULL;
+    }
+  else
+    ret = TRUE;
+  g_mutex_unlock (&queue->lock);
+
+  return ret;
+}
+
+static gboolean
+commit_content_queue_push (CommitContentQueue *queue,
+                           OstreeMutableTree  *mtree,
+                           const char         *name,
+                           GInputStream       *file_input,
+                           GFileInfo          *file_info,
+                           GVariant           *xattrs,
+                           const struct stat  *stbuf,
+                           GError            **error)
+{
+  CommitContentJob *job;
+
+  if (!commit_content_queue_wait (queue, queue->max_pending, error))
+    return FALSE;
+
+  job = g_new0 (CommitContentJob, 1);
+  job->queue = queue;
+  job->mtree = g_object_ref (mtree);
+  job->name = g_strdup (name);
+  job->file_input = file_input ? g_object_ref (file_input) : NULL;
+  job->file_info = g_object_ref (file_info);
+  job->xattrs = xattrs ? g_variant_ref (xattrs) : NULL;
+  if (stbuf)
+    {
+      job->have_stbuf = TRUE;
+      job->stbuf = *stbuf;
+    }
+  g_ptr_array_add (queue->jobs, job);
+
+  g_mutex_lock (&queue->lock);
+  queue->n_pending++;
+  g_mutex_unlock (&queue->lock);
+
+  g_thread_pool_push (queue->pool, job, NULL);
+
+  return TRUE;
+}
+
+/* Wait for all outstanding jobs, then add their results to the
+ * mutable trees in the order they were queued.
+ */
+static gboolean
+commit_content_queue_finish (CommitContentQueue *queue,
+                             GError            **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  if (!commit_content_queue_wait (queue, 0, error))
+    goto out;
+
+  for (i = 0; i < queue->jobs->len; i++)
+    {
+      CommitContentJob *job = queue->jobs->pdata[i];
+
+      if (!ostree_mutable_tree_replace_file (job->mtree, job->name, job->checksum,
+                                             error))
+        goto out;
+
+      if (job->have_stbuf && queue->repo->stat_cache)
+        _ostree_repo_stat_cache_store (queue->repo, &job->stbuf, job->file_info,
+                                       job->xattrs, job->checksum);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+commit_content_queue_free (CommitContentQueue *queue)
+{
+  GError *local_error = NULL;
+
+  /* Drain any jobs still running after an error */
+  if (!commit_content_queue_wait (queue, 0, &local_error))
+    g_clear_error (&local_error);
+  if (queue->pool)
+    g_thread_pool_free (queue->pool, FALSE, TRUE);
+  g_ptr_array_unref (queue->jobs);
+  g_mutex_clear (&queue->lock);
+  g_cond_clear (&queue->cond);
+  g_free (queue);
+}
+
 static gboolean
 write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
@@ -2259,6 +2887,7 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
                                   OstreeMutableTree           *mtree,
                                   OstreeRepoCommitModifier    *modifier,
                                   GPtrArray                   *path,
+                                  CommitContentQueue          *queue,
                                   GCancellable                *cancellable,
                                   GError                     **error);
 
@@ -2268,9 +2897,11 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
                                            GFileEnumerator             *dir_enum,
                                            GSDirFdIterator             *dfd_iter,
                                            GFileInfo                   *child_info,
+                                           const struct stat           *stbuf,
                                            OstreeMutableTree           *mtree,
                                            OstreeRepoCommitModifier    *modifier,
                                            GPtrArray                   *path,
+                                           CommitContentQueue          *queue,
                                            GCancellable                *cancellable,
                                            GError                     **error)
 {
@@ -2337,7 +2968,7 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
             goto out;
 
           if (!write_dfd_iter_to_mtree_internal (self, &child_dfd_iter, child_mtree,
-                                                 modifier, path,
+                                                 modifier, path, queue,
                                                  cancellable, error))
             goto out;
         }
@@ -2373,7 +3004,21 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
         }
       else
         {
-          if (g_file_info_get_file_type (modified_info) == G_FILE_TYPE_REGULAR)
+          if (!get_modified_xattrs (self, modifier,
+                                    child_relpath, child_info, child, dfd_iter->fd, name,
+                                    &xattrs,
+                                    cancellable, error))
+            goto out;
+
+          if (stbuf && self->stat_cache)
+            {
+              if (!_ostree_repo_stat_cache_lookup (self, stbuf, modified_info, xattrs,
+                                                   &tmp_checksum, cancellable, error))
+                goto out;
+            }
+
+          if (g_file_info_get_file_type (modified_info) == G_FILE_TYPE_REGULAR
+              && tmp_checksum == NULL)
             {
               if (child != NULL)
                 {
@@ -2389,26 +3034,39 @@ write_directory_content_to_mtree_internal (OstreeRepo                  *self,
                 }
             }
 
-          if (!get_modified_xattrs (self, modifier,
-                                    child_relpath, child_info, child, dfd_iter->fd, name,
-                                    &xattrs,
-                                    cancellable, error))
-            goto out;
+          if (tmp_checksum)
+            {
+              if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
+                                                     error))
+                goto out;
+            }
+          else if (queue && commit_content_queue_accepts (queue))
+            {
+              if (!commit_content_queue_push (queue, mtree, name, file_input,
+                                              modified_info, xattrs, stbuf, error))
+                goto out;
+            }
+          else
+            {
+              if (!ostree_raw_file_to_content_stream (file_input,
+                                                      modified_info, xattrs,
+                                                      &file_object_input, &file_obj_length,
+                                                      cancellable, error))
+                goto out;
+              if (!_ostree_repo_write_content_from_fd (self, NULL, file_object_input, file_obj_length,
+                                                       input_stream_get_fd (file_input),
+                                                       &child_file_csum, cancellable, error))
+                goto out;
 
-          if (!ostree_raw_file_to_content_stream (file_input,
-                                                  modified_info, xattrs,
-                                                  &file_object_input, &file_obj_length,
-                                                  cancellable, error))
-            goto out;
-          if (!ostree_repo_write_content (self, NULL, file_object_input, file_obj_length,
-                                          &child_file_csum, cancellable, error))
-            goto out;
+              tmp_checksum = ostree_checksum_from_bytes (child_file_csum);
+              if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
+                                                     error))
+                goto out;
 
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes (child_file_csum);
-          if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
-                                                 error))
-            goto out;
+              if (stbuf && self->stat_cache)
+                _ostree_repo_stat_cache_store (self, stbuf, modified_info, xattrs,
+                                               tmp_checksum);
+            }
         }
     }
 
@@ -2522,8 +3180,8 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
             break;
 
           if (!write_directory_content_to_mtree_internal (self, repo_dir, dir_enum, NULL,
-                                                          child_info,
-                                                          mtree, modifier, path,
+                                                          child_info, NULL,
+                                                          mtree, modifier, path, NULL,
                                                           cancellable, error))
             goto out;
         }
@@ -2540,6 +3198,7 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
                                   OstreeMutableTree           *mtree,
                                   OstreeRepoCommitModifier    *modifier,
                                   GPtrArray                   *path,
+                                  CommitContentQueue          *queue,
                                   GCancellable                *cancellable,
                                   GError                     **error)
 {
@@ -2649,8 +3308,8 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
         }
 
       if (!write_directory_content_to_mtree_internal (self, NULL, NULL, src_dfd_iter,
-                                                      child_info,
-                                                      mtree, modifier, path,
+                                                      child_info, &stbuf,
+                                                      mtree, modifier, path, queue,
                                                       cancellable, error))
         goto out;
     }
@@ -2671,6 +3330,10 @@ write_dfd_iter_to_mtree_internal (OstreeRepo                  *self,
  *
  * Store objects for @dir and all children into the repository @self,
  * overlaying the resulting filesystem hierarchy into @mtree.
+ *
+ * For a local @dir with more than a few files, file content is
+ * checksummed and compressed by a pool of threads; the resulting
+ * @mtree is the same as if the files were processed one at a time.
  */
 gboolean
 ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
@@ -2682,12 +3345,19 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
 {
   gboolean ret = FALSE;
   GPtrArray *path = NULL;
+  CommitContentQueue *queue = NULL;
 
   if (modifier && modifier->flags & OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES)
     {
       self->generate_sizes = TRUE;
     }
 
+  if (modifier && modifier->flags & OSTREE_REPO_COMMIT_MODIFIER_FLAGS_STAT_CACHE)
+    {
+      if (!_ostree_repo_stat_cache_ensure_loaded (self, cancellable, error))
+        goto out;
+    }
+
   path = g_ptr_array_new ();
   if (g_file_is_native (dir))
     {
@@ -2697,8 +3367,13 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
                                       &dfd_iter, error))
         goto out;
 
+      queue = commit_content_queue_new (self, cancellable);
+
       if (!write_dfd_iter_to_mtree_internal (self, &dfd_iter, mtree, modifier, path,
-                                             cancellable, error))
+                                             queue, cancellable, error))
+        goto out;
+
+      if (!commit_content_queue_finish (queue, error))
         goto out;
     }
   else
@@ -2710,6 +3385,8 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
 
   ret = TRUE;
  out:
+  if (queue)
+    commit_content_queue_free (queue);
   if (path)
     g_ptr_array_free (path, TRUE);
   return ret;
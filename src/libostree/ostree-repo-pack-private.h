@@ -0,0 +1,149 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-repo-private.h"
+
+G_BEGIN_DECLS
+
+/* Version 1 aligns objects in the data file; version 0 packs, which
+ * did not, are rejected.
+ */
+#define _OSTREE_PACK_VERSION (1)
+
+/* Relative to the objects/ directory */
+#define _OSTREE_PACK_DIR "pack"
+#define _OSTREE_PACK_META_PREFIX "ostmetapack-"
+#define _OSTREE_PACK_CONTENT_PREFIX "ostdatapack-"
+
+/* Summary metadata key listing the packs of a repository, of type
+ * a(bay): whether the pack holds metadata, and its checksum.  This
+ * lets clients fetch objects from the pack data files via HTTP range
+ * requests.
+ */
+#define OSTREE_SUMMARY_PACKS "ostree.packs"
+
+/* A pack data file (objects/pack/ost{meta,data}pack-$checksum.data)
+ * is a custom binary format:
+ *
+ *   8 bytes magic "OSTPKDAT"
+ *   guint32 (BE) version
+ *   guint32 (BE) reserved, must be 0
+ *   ---
+ *   object data, each object padded to start at a multiple of
+ *   _OSTREE_PACK_ALIGNMENT bytes
+ *
+ * Each object is stored byte-for-byte as its loose representation
+ * would be; for metadata this is the serialized GVariant, for content
+ * in archive-z2 repositories it is the .filez format.  Pack files are
+ * never modified after creation; `ostree repack` writes new packs and
+ * then deletes the old ones.
+ */
+#define _OSTREE_PACK_DATA_MAGIC "OSTPKDAT"
+#define _OSTREE_PACK_DATA_HEADER_LEN (16)
+#define _OSTREE_PACK_ALIGNMENT (8)
+
+/* The index (objects/pack/ost{meta,data}pack-$checksum.index) is
+ * designed to be mmap()ed and searched in place:
+ *
+ *   8 bytes magic "OSTPKIDX"
+ *   guint32 (BE) version
+ *   guint32 (BE) number of entries
+ *   guint32 (BE) fanout[256]: number of entries whose first checksum
+ *                byte is less than or equal to the index
+ *   ---
+ *   ARRAY[entry], sorted by (checksum, objtype)
+ *
+ * The $checksum in the pack name is the SHA256 of the index file.
+ */
+#define _OSTREE_PACK_INDEX_MAGIC "OSTPKIDX"
+#define _OSTREE_PACK_INDEX_HEADER_LEN (16 + 256 * 4)
+
+typedef struct {
+  guint8  csum[32];
+  guint8  objtype;
+  guint8  reserved[7];
+  guint64 offset;     /* BE, relative to the start of the data file */
+  guint64 size;       /* BE */
+} OstreePackIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreePackIndexEntry) == 56);
+
+typedef struct OstreeRepoPack OstreeRepoPack;
+
+void _ostree_repo_pack_free (OstreeRepoPack *pack);
+
+char *
+_ostree_get_relative_pack_path (gboolean     is_meta,
+                                const char  *pack_checksum,
+                                const char  *suffix);
+
+OstreeRepoPack *
+_ostree_repo_pack_new_from_index (gboolean     is_meta,
+                                  const char  *pack_checksum,
+                                  GBytes      *index,
+                                  GError     **error);
+
+gboolean
+_ostree_repo_pack_lookup (OstreeRepoPack    *pack,
+                          OstreeObjectType   objtype,
+                          const char        *checksum,
+                          guint64           *out_offset,
+                          guint64           *out_size);
+
+gboolean
+_ostree_repo_load_packs (OstreeRepo     *self,
+                         GCancellable   *cancellable,
+                         GError        **error);
+
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo        *self,
+                                 OstreeObjectType   objtype,
+                                 const char        *checksum,
+                                 GBytes           **out_data,
+                                 char             **out_data_path);
+
+void
+_ostree_repo_fsck_packs (OstreeRepo   *self,
+                         GPtrArray    *out_messages);
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo     *self,
+                                  GHashTable     *inout_objects,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
+void
+_ostree_repo_list_packed_objects_set (OstreeRepo      *self,
+                                      OstreeObjectSet *inout_objects);
+
+GVariant *
+_ostree_repo_get_packs_summary (OstreeRepo *self);
+
+gboolean
+_ostree_repo_prune_packs (OstreeRepo       *self,
+                          OstreeObjectSet  *reachable,
+                          guint            *out_n_pruned,
+                          guint64          *out_freed_bytes,
+                          GCancellable     *cancellable,
+                          GError          **error);
+
+G_END_DECLS
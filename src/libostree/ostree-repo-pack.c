@@ -0,0 +1,1300 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <gio/gfiledescriptorbased.h>
+#include <gio/gunixinputstream.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "ostree-repo-pack-private.h"
+#include "otutil.h"
+
+struct OstreeRepoPack {
+  char *checksum;
+  gboolean is_meta;
+  GBytes *index;
+  GBytes *data;
+
+  guint32 n_entries;
+  const guint32 *fanout;
+  const OstreePackIndexEntry *entries;
+};
+
+void
+_ostree_repo_pack_free (OstreeRepoPack *pack)
+{
+  g_free (pack->checksum);
+  g_clear_pointer (&pack->index, (GDestroyNotify) g_bytes_unref);
+  g_clear_pointer (&pack->data, (GDestroyNotify) g_bytes_unref);
+  g_free (pack);
+}
+
+char *
+_ostree_get_relative_pack_path (gboolean     is_meta,
+                                const char  *pack_checksum,
+                                const char  *suffix)
+{
+  return g_strconcat (_OSTREE_PACK_DIR "/",
+                      is_meta ? _OSTREE_PACK_META_PREFIX : _OSTREE_PACK_CONTENT_PREFIX,
+                      pack_checksum, ".", suffix, NULL);
+}
+
+static GMappedFile *
+map_pack_file_at (int            dfd,
+                  const char    *path,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  GMappedFile *ret = NULL;
+  glnx_fd_close int fd = -1;
+
+  if (!gs_file_openat_noatime (dfd, path, &fd, cancellable, error))
+    goto out;
+
+  ret = g_mapped_file_new_from_fd (fd, FALSE, error);
+ out:
+  return ret;
+}
+
+/* Validate the header of @pack->index and point the fanout table and
+ * entries into it.  @name is only used for error messages.
+ */
+static gboolean
+parse_pack_index (OstreeRepoPack  *pack,
+                  const char      *name,
+                  GError         **error)
+{
+  gboolean ret = FALSE;
+  const guint8 *index_buf;
+  gsize index_len;
+  guint32 version;
+  guint32 prev;
+  guint i;
+
+  index_buf = g_bytes_get_data (pack->index, &index_len);
+
+  if (index_len < _OSTREE_PACK_INDEX_HEADER_LEN
+      || memcmp (index_buf, _OSTREE_PACK_INDEX_MAGIC, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack index %s", name);
+      goto out;
+    }
+
+  version = GUINT32_FROM_BE (*(guint32*)(index_buf + 8));
+  if (version != _OSTREE_PACK_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported pack index version %u in %s", version, name);
+      goto out;
+    }
+
+  pack->n_entries = GUINT32_FROM_BE (*(guint32*)(index_buf + 12));
+  pack->fanout = (const guint32*)(index_buf + 16);
+  pack->entries = (const OstreePackIndexEntry*)(index_buf + _OSTREE_PACK_INDEX_HEADER_LEN);
+
+  /* Indexes may come from a remote, so everything pack_lookup()
+   * relies on is checked here: the entry table must exactly fill the
+   * rest of the file, and the fanout table must never decrease and end
+   * at the number of entries, so that every bisection stays in bounds.
+   */
+  if ((index_len - _OSTREE_PACK_INDEX_HEADER_LEN) % sizeof (OstreePackIndexEntry) != 0
+      || (index_len - _OSTREE_PACK_INDEX_HEADER_LEN) / sizeof (OstreePackIndexEntry) != pack->n_entries
+      || GUINT32_FROM_BE (pack->fanout[255]) != pack->n_entries)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted pack index %s", name);
+      goto out;
+    }
+
+  prev = 0;
+  for (i = 0; i < 256; i++)
+    {
+      guint32 count = GUINT32_FROM_BE (pack->fanout[i]);
+
+      if (count < prev)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted pack index %s: fanout entry %u decreases", name, i);
+          goto out;
+        }
+      prev = count;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Whether the object of @entry starts after the data file header, is
+ * aligned, and ends within the data file; the data file of a remote
+ * pack isn't available to check against.
+ */
+static gboolean
+pack_entry_is_valid (OstreeRepoPack              *pack,
+                     const OstreePackIndexEntry  *entry)
+{
+  guint64 offset = GUINT64_FROM_BE (entry->offset);
+  guint64 size = GUINT64_FROM_BE (entry->size);
+
+  if (offset < _OSTREE_PACK_DATA_HEADER_LEN
+      || offset % _OSTREE_PACK_ALIGNMENT != 0)
+    return FALSE;
+
+  if (pack->data
+      && (offset > g_bytes_get_size (pack->data)
+          || size > g_bytes_get_size (pack->data) - offset))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+load_one_pack (OstreeRepo       *self,
+               gboolean          is_meta,
+               const char       *pack_checksum,
+               OstreeRepoPack  **out_pack,
+               GCancellable     *cancellable,
+               GError          **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoPack *pack = NULL;
+  g_autofree char *index_path = NULL;
+  g_autofree char *data_path = NULL;
+  GMappedFile *index_mfile = NULL;
+  GMappedFile *data_mfile = NULL;
+  const guint8 *data_buf;
+
+  index_path = _ostree_get_relative_pack_path (is_meta, pack_checksum, "index");
+  data_path = _ostree_get_relative_pack_path (is_meta, pack_checksum, "data");
+
+  pack = g_new0 (OstreeRepoPack, 1);
+  pack->checksum = g_strdup (pack_checksum);
+  pack->is_meta = is_meta;
+
+  index_mfile = map_pack_file_at (self->objects_dir_fd, index_path,
+                                  cancellable, error);
+  if (!index_mfile)
+    goto out;
+  pack->index = g_mapped_file_get_bytes (index_mfile);
+
+  if (!parse_pack_index (pack, index_path, error))
+    goto out;
+
+  data_mfile = map_pack_file_at (self->objects_dir_fd, data_path,
+                                 cancellable, error);
+  if (!data_mfile)
+    goto out;
+  pack->data = g_mapped_file_get_bytes (data_mfile);
+
+  data_buf = g_bytes_get_data (pack->data, NULL);
+  if (g_bytes_get_size (pack->data) < _OSTREE_PACK_DATA_HEADER_LEN
+      || memcmp (data_buf, _OSTREE_PACK_DATA_MAGIC, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack data %s", data_path);
+      goto out;
+    }
+  if (GUINT32_FROM_BE (*(guint32*)(data_buf + 8)) != _OSTREE_PACK_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported pack data version %u in %s",
+                   GUINT32_FROM_BE (*(guint32*)(data_buf + 8)), data_path);
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_pack = pack;
+  pack = NULL;
+ out:
+  if (index_mfile)
+    g_mapped_file_unref (index_mfile);
+  if (data_mfile)
+    g_mapped_file_unref (data_mfile);
+  if (pack)
+    _ostree_repo_pack_free (pack);
+  return ret;
+}
+
+/*
+ * _ostree_repo_pack_new_from_index:
+ * @index: Contents of a pack index, e.g. as downloaded from a remote
+ *
+ * Wrap an index whose data file lives elsewhere, so that objects can
+ * be located with _ostree_repo_pack_lookup().  The index must hash to
+ * @pack_checksum.
+ */
+OstreeRepoPack *
+_ostree_repo_pack_new_from_index (gboolean     is_meta,
+                                  const char  *pack_checksum,
+                                  GBytes      *index,
+                                  GError     **error)
+{
+  OstreeRepoPack *ret = NULL;
+  OstreeRepoPack *pack = NULL;
+  g_autofree char *index_name = NULL;
+  g_autofree char *actual_checksum = NULL;
+  guint i;
+
+  index_name = _ostree_get_relative_pack_path (is_meta, pack_checksum, "index");
+
+  actual_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, index);
+  if (strcmp (actual_checksum, pack_checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted pack index %s; checksum expected='%s' actual='%s'",
+                   index_name, pack_checksum, actual_checksum);
+      goto out;
+    }
+
+  pack = g_new0 (OstreeRepoPack, 1);
+  pack->checksum = g_strdup (pack_checksum);
+  pack->is_meta = is_meta;
+  pack->index = g_bytes_ref (index);
+
+  if (!parse_pack_index (pack, index_name, error))
+    goto out;
+
+  /* A local pack stays usable apart from its bad entries, which fsck
+   * reports; a remote index with any is rejected as a whole.
+   */
+  for (i = 0; i < pack->n_entries; i++)
+    {
+      if (!pack_entry_is_valid (pack, &pack->entries[i]))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted pack index %s: invalid offset of entry %u",
+                       index_name, i);
+          goto out;
+        }
+    }
+
+  ret = pack;
+  pack = NULL;
+ out:
+  if (pack)
+    _ostree_repo_pack_free (pack);
+  return ret;
+}
+
+static gint64
+pack_dir_mtime (const struct stat *stbuf)
+{
+  return (gint64) stbuf->st_mtim.tv_sec * 1000000000 + stbuf->st_mtim.tv_nsec;
+}
+
+/*
+ * _ostree_repo_load_packs:
+ *
+ * (Re)read the set of pack indexes in objects/pack, replacing the
+ * cached set.  A repository without a pack directory simply has no
+ * packs.
+ */
+gboolean
+_ostree_repo_load_packs (OstreeRepo     *self,
+                         GCancellable   *cancellable,
+                         GError        **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  g_autoptr(GPtrArray) meta_packs = NULL;
+  g_autoptr(GPtrArray) content_packs = NULL;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  gint64 dir_mtime = 0;
+
+  meta_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_free);
+  content_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_free);
+
+  if (fstatat (self->objects_dir_fd, _OSTREE_PACK_DIR, &stbuf, 0) != 0)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+  else
+    {
+      dir_mtime = pack_dir_mtime (&stbuf);
+
+      if (!glnx_dirfd_iterator_init_at (self->objects_dir_fd, _OSTREE_PACK_DIR, FALSE,
+                                        &dfd_iter, error))
+        goto out;
+
+      while (TRUE)
+        {
+          struct dirent *dent;
+          const char *name;
+          const char *dot;
+          gboolean is_meta;
+          g_autofree char *pack_checksum = NULL;
+          OstreeRepoPack *pack = NULL;
+
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            goto out;
+
+          if (dent == NULL)
+            break;
+
+          name = dent->d_name;
+
+          if (g_str_has_prefix (name, _OSTREE_PACK_META_PREFIX))
+            {
+              is_meta = TRUE;
+              name += strlen (_OSTREE_PACK_META_PREFIX);
+            }
+          else if (g_str_has_prefix (name, _OSTREE_PACK_CONTENT_PREFIX))
+            {
+              is_meta = FALSE;
+              name += strlen (_OSTREE_PACK_CONTENT_PREFIX);
+            }
+          else
+            continue;
+
+          dot = strrchr (name, '.');
+          if (!dot || strcmp (dot, ".index") != 0)
+            continue;
+
+          pack_checksum = g_strndup (name, dot - name);
+          if (!ostree_validate_checksum_string (pack_checksum, NULL))
+            continue;
+
+          if (!load_one_pack (self, is_meta, pack_checksum, &pack,
+                              cancellable, error))
+            goto out;
+
+          g_ptr_array_add (is_meta ? meta_packs : content_packs, pack);
+        }
+    }
+
+  g_mutex_lock (&self->cache_lock);
+  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  self->cached_meta_indexes = meta_packs;
+  meta_packs = NULL;
+  self->cached_content_indexes = content_packs;
+  content_packs = NULL;
+  self->cached_packs_dir_mtime = dir_mtime;
+  g_mutex_unlock (&self->cache_lock);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static int
+compare_index_entry (const guint8                *csum,
+                     OstreeObjectType             objtype,
+                     const OstreePackIndexEntry  *entry)
+{
+  int c = memcmp (csum, entry->csum, 32);
+  if (c != 0)
+    return c;
+  return (int)objtype - (int)entry->objtype;
+}
+
+static const OstreePackIndexEntry *
+pack_lookup (OstreeRepoPack    *pack,
+             const guint8      *csum,
+             OstreeObjectType   objtype)
+{
+  guint32 lo, hi;
+
+  /* Narrow the search to entries sharing the first checksum byte,
+   * then bisect.
+   */
+  lo = csum[0] == 0 ? 0 : GUINT32_FROM_BE (pack->fanout[csum[0] - 1]);
+  hi = GUINT32_FROM_BE (pack->fanout[csum[0]]);
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      const OstreePackIndexEntry *entry = &pack->entries[mid];
+      int c = compare_index_entry (csum, objtype, entry);
+
+      if (c == 0)
+        return entry;
+      else if (c < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return NULL;
+}
+
+/*
+ * _ostree_repo_pack_lookup:
+ * @out_offset: (out): Offset of the object in the pack data file
+ * @out_size: (out): Size of the object
+ *
+ * Returns: %TRUE if @pack has an entry for the object
+ */
+gboolean
+_ostree_repo_pack_lookup (OstreeRepoPack    *pack,
+                          OstreeObjectType   objtype,
+                          const char        *checksum,
+                          guint64           *out_offset,
+                          guint64           *out_size)
+{
+  guint8 csum[32];
+  const OstreePackIndexEntry *entry;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  entry = pack_lookup (pack, csum, objtype);
+  if (!entry)
+    return FALSE;
+
+  *out_offset = GUINT64_FROM_BE (entry->offset);
+  *out_size = GUINT64_FROM_BE (entry->size);
+  return TRUE;
+}
+
+static gboolean
+find_packed_object_cached (OstreeRepo        *self,
+                           OstreeObjectType   objtype,
+                           const char        *checksum,
+                           GBytes           **out_data,
+                           char             **out_data_path)
+{
+  gboolean found = FALSE;
+  guint8 csum[32];
+  GPtrArray *packs;
+  guint i;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_mutex_lock (&self->cache_lock);
+
+  packs = OSTREE_OBJECT_TYPE_IS_META (objtype) ? self->cached_meta_indexes
+                                               : self->cached_content_indexes;
+
+  for (i = 0; packs && i < packs->len && !found; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+      const OstreePackIndexEntry *entry;
+      guint64 offset, size;
+
+      entry = pack_lookup (pack, csum, objtype);
+      if (!entry)
+        continue;
+
+      offset = GUINT64_FROM_BE (entry->offset);
+      size = GUINT64_FROM_BE (entry->size);
+
+      /* Treat out of bounds or unaligned entries as missing; see
+       * _ostree_repo_fsck_packs()
+       */
+      if (!pack_entry_is_valid (pack, entry))
+        continue;
+
+      found = TRUE;
+      if (out_data)
+        *out_data = g_bytes_new_from_bytes (pack->data, offset, size);
+      if (out_data_path)
+        *out_data_path = _ostree_get_relative_pack_path (pack->is_meta, pack->checksum, "data");
+    }
+
+  g_mutex_unlock (&self->cache_lock);
+
+  return found;
+}
+
+/* Whether objects/pack gained or lost entries since the packs were
+ * last loaded.
+ */
+static gboolean
+packs_changed (OstreeRepo *self)
+{
+  struct stat stbuf;
+  gint64 dir_mtime = 0;
+  gboolean changed;
+
+  if (fstatat (self->objects_dir_fd, _OSTREE_PACK_DIR, &stbuf, 0) == 0)
+    dir_mtime = pack_dir_mtime (&stbuf);
+
+  g_mutex_lock (&self->cache_lock);
+  changed = dir_mtime != self->cached_packs_dir_mtime;
+  g_mutex_unlock (&self->cache_lock);
+
+  return changed;
+}
+
+/*
+ * _ostree_repo_find_packed_object:
+ * @out_data: (out) (allow-none): Loose representation of the object
+ * @out_data_path: (out) (allow-none): Path of the pack data file, relative to objects/
+ *
+ * If the object isn't in the packs loaded so far, but objects/pack
+ * changed since, the packs are reloaded and searched again.  Another
+ * process may have run repack or prune, replacing the packs and loose
+ * objects we knew about; the old packs stay mapped, but objects packed
+ * since can only be found in the new ones.
+ *
+ * Returns: %TRUE if the object was found in one of the packs of @self
+ */
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo        *self,
+                                 OstreeObjectType   objtype,
+                                 const char        *checksum,
+                                 GBytes           **out_data,
+                                 char             **out_data_path)
+{
+  GError *local_error = NULL;
+
+  if (find_packed_object_cached (self, objtype, checksum, out_data, out_data_path))
+    return TRUE;
+
+  if (!packs_changed (self))
+    return FALSE;
+
+  if (!_ostree_repo_load_packs (self, NULL, &local_error))
+    {
+      g_debug ("Reloading packs: %s", local_error->message);
+      g_error_free (local_error);
+      return FALSE;
+    }
+
+  return find_packed_object_cached (self, objtype, checksum, out_data, out_data_path);
+}
+
+static void
+fsck_packs_of_kind (GPtrArray    *packs,
+                    GPtrArray    *out_messages)
+{
+  guint i, j;
+
+  for (i = 0; packs && i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+      g_autofree char *index_name =
+        _ostree_get_relative_pack_path (pack->is_meta, pack->checksum, "index");
+
+      for (j = 0; j < pack->n_entries; j++)
+        {
+          const OstreePackIndexEntry *entry = &pack->entries[j];
+          g_autofree char *checksum = NULL;
+
+          if (pack_entry_is_valid (pack, entry))
+            continue;
+
+          checksum = ostree_checksum_from_bytes (entry->csum);
+          g_ptr_array_add (out_messages,
+                           g_strdup_printf ("Pack index %s: invalid offset %" G_GUINT64_FORMAT
+                                            " of object %s.%s",
+                                            index_name, GUINT64_FROM_BE (entry->offset),
+                                            checksum, ostree_object_type_to_string (entry->objtype)));
+        }
+    }
+}
+
+/*
+ * _ostree_repo_fsck_packs:
+ * @out_messages: (element-type utf8): Descriptions of invalid entries are added here
+ *
+ * Check that each entry of the packs of @self is aligned and lies
+ * within its data file.  Lookups treat the other entries as missing,
+ * so an object that is also loose would otherwise go unnoticed.
+ */
+void
+_ostree_repo_fsck_packs (OstreeRepo   *self,
+                         GPtrArray    *out_messages)
+{
+  g_mutex_lock (&self->cache_lock);
+  fsck_packs_of_kind (self->cached_meta_indexes, out_messages);
+  fsck_packs_of_kind (self->cached_content_indexes, out_messages);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static void
+list_objects_in_packs (GPtrArray    *packs,
+                       GHashTable   *inout_objects)
+{
+  guint i, j;
+
+  for (i = 0; packs && i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+
+      for (j = 0; j < pack->n_entries; j++)
+        {
+          const OstreePackIndexEntry *entry = &pack->entries[j];
+          char checksum[65];
+          gboolean is_loose = FALSE;
+          g_autoptr(GVariant) key = NULL;
+          g_autoptr(GPtrArray) pack_names = g_ptr_array_new ();
+          GVariant *value;
+
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+          key = ostree_object_name_serialize (checksum, entry->objtype);
+          g_variant_ref_sink (key);
+
+          value = g_hash_table_lookup (inout_objects, key);
+          if (value)
+            {
+              g_autofree const char **prev_packs = NULL;
+              const char **iter;
+
+              g_variant_get (value, "(b^a&s)", &is_loose, &prev_packs);
+              for (iter = prev_packs; iter && *iter; iter++)
+                g_ptr_array_add (pack_names, (char*)*iter);
+            }
+          g_ptr_array_add (pack_names, pack->checksum);
+
+          value = g_variant_new ("(b@as)", is_loose,
+                                 g_variant_new_strv ((const char *const*)pack_names->pdata,
+                                                     pack_names->len));
+          g_hash_table_replace (inout_objects, g_variant_ref (key),
+                                g_variant_ref_sink (value));
+        }
+    }
+}
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo     *self,
+                                  GHashTable     *inout_objects,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  g_mutex_lock (&self->cache_lock);
+  list_objects_in_packs (self->cached_meta_indexes, inout_objects);
+  list_objects_in_packs (self->cached_content_indexes, inout_objects);
+  g_mutex_unlock (&self->cache_lock);
+
+  return TRUE;
+}
+
+static void
+add_packed_objects_to_set (GPtrArray       *packs,
+                           OstreeObjectSet *inout_objects)
+{
+  guint i, j;
+
+  for (i = 0; packs && i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+
+      for (j = 0; j < pack->n_entries; j++)
+        (void) _ostree_object_set_add (inout_objects, pack->entries[j].csum,
+                                       pack->entries[j].objtype);
+    }
+}
+
+void
+_ostree_repo_list_packed_objects_set (OstreeRepo      *self,
+                                      OstreeObjectSet *inout_objects)
+{
+  g_mutex_lock (&self->cache_lock);
+  add_packed_objects_to_set (self->cached_meta_indexes, inout_objects);
+  add_packed_objects_to_set (self->cached_content_indexes, inout_objects);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static void
+add_packs_to_summary (GVariantBuilder *builder,
+                      GPtrArray       *packs)
+{
+  guint i;
+
+  for (i = 0; packs && i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+
+      g_variant_builder_add (builder, "(b@ay)", pack->is_meta,
+                             ostree_checksum_to_bytes_v (pack->checksum));
+    }
+}
+
+/*
+ * _ostree_repo_get_packs_summary:
+ *
+ * Returns: (transfer floating): The packs of @self as an array of
+ * (is_meta, checksum), for the %OSTREE_SUMMARY_PACKS summary key
+ */
+GVariant *
+_ostree_repo_get_packs_summary (OstreeRepo *self)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(bay)"));
+
+  g_mutex_lock (&self->cache_lock);
+  add_packs_to_summary (&builder, self->cached_meta_indexes);
+  add_packs_to_summary (&builder, self->cached_content_indexes);
+  g_mutex_unlock (&self->cache_lock);
+
+  return g_variant_builder_end (&builder);
+}
+
+typedef struct {
+  guint8 csum[32];
+  OstreeObjectType objtype;
+  gboolean is_loose;
+  guint64 offset;
+  guint64 size;
+} RepackEntry;
+
+static int
+compare_repack_entries (gconstpointer a,
+                        gconstpointer b)
+{
+  const RepackEntry *entry_a = *((RepackEntry**)a);
+  const RepackEntry *entry_b = *((RepackEntry**)b);
+  int c = memcmp (entry_a->csum, entry_b->csum, 32);
+  if (c != 0)
+    return c;
+  return (int)entry_a->objtype - (int)entry_b->objtype;
+}
+
+static gboolean
+write_pack_object (OstreeRepo      *self,
+                   RepackEntry     *entry,
+                   GOutputStream   *out,
+                   GCancellable    *cancellable,
+                   GError         **error)
+{
+  gboolean ret = FALSE;
+  char checksum[65];
+  gsize bytes_written;
+
+  ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+
+  if (entry->is_loose)
+    {
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+      int fd = -1;
+      g_autoptr(GInputStream) in = NULL;
+      gssize n_spliced;
+
+      _ostree_loose_path (loose_path, checksum, entry->objtype, self->mode);
+      if (!gs_file_openat_noatime (self->objects_dir_fd, loose_path, &fd,
+                                   cancellable, error))
+        goto out;
+      in = g_unix_input_stream_new (fd, TRUE);
+
+      n_spliced = g_output_stream_splice (out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                          cancellable, error);
+      if (n_spliced < 0)
+        goto out;
+      entry->size = n_spliced;
+    }
+  else
+    {
+      g_autoptr(GBytes) data = NULL;
+
+      if (!_ostree_repo_find_packed_object (self, entry->objtype, checksum, &data, NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "Packed object %s.%s disappeared",
+                       checksum, ostree_object_type_to_string (entry->objtype));
+          goto out;
+        }
+
+      if (!g_output_stream_write_all (out, g_bytes_get_data (data, NULL),
+                                      g_bytes_get_size (data), &bytes_written,
+                                      cancellable, error))
+        goto out;
+      entry->size = bytes_written;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static GBytes *
+build_pack_index (GPtrArray *entries)
+{
+  GByteArray *buf = g_byte_array_new ();
+  guint32 fanout[256] = { 0, };
+  guint32 be32;
+  guint i;
+
+  g_byte_array_append (buf, (guint8*)_OSTREE_PACK_INDEX_MAGIC, 8);
+  be32 = GUINT32_TO_BE (_OSTREE_PACK_VERSION);
+  g_byte_array_append (buf, (guint8*)&be32, 4);
+  be32 = GUINT32_TO_BE (entries->len);
+  g_byte_array_append (buf, (guint8*)&be32, 4);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      RepackEntry *entry = entries->pdata[i];
+      fanout[entry->csum[0]]++;
+    }
+  for (i = 1; i < 256; i++)
+    fanout[i] += fanout[i-1];
+  for (i = 0; i < 256; i++)
+    {
+      be32 = GUINT32_TO_BE (fanout[i]);
+      g_byte_array_append (buf, (guint8*)&be32, 4);
+    }
+
+  for (i = 0; i < entries->len; i++)
+    {
+      RepackEntry *entry = entries->pdata[i];
+      OstreePackIndexEntry index_entry = { { 0, }, };
+
+      memcpy (index_entry.csum, entry->csum, 32);
+      index_entry.objtype = entry->objtype;
+      index_entry.offset = GUINT64_TO_BE (entry->offset);
+      index_entry.size = GUINT64_TO_BE (entry->size);
+      g_byte_array_append (buf, (guint8*)&index_entry, sizeof (index_entry));
+    }
+
+  return g_byte_array_free_to_bytes (buf);
+}
+
+static gboolean
+fsync_pack_dir (OstreeRepo    *self,
+                GError       **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int dfd = -1;
+
+  if (self->disable_fsync)
+    return TRUE;
+
+  if (!glnx_opendirat (self->objects_dir_fd, _OSTREE_PACK_DIR, TRUE, &dfd, error))
+    goto out;
+
+  if (fsync (dfd) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Write @entries (sorted) into a new pack, then delete the loose
+ * objects (unless @keep_loose is set) and the @old_packs it
+ * supersedes.  The new pack is fully on disk before anything is
+ * removed, so readers always find every object in at least one place.
+ * If @entries is empty, no pack is written and the old ones are simply
+ * deleted.
+ */
+static gboolean
+write_one_pack (OstreeRepo     *self,
+                gboolean        is_meta,
+                GPtrArray      *entries,
+                GPtrArray      *old_packs,
+                gboolean        keep_loose,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autofree char *temp_filename = NULL;
+  g_autoptr(GOutputStream) temp_out = NULL;
+  g_autoptr(GBytes) index_bytes = NULL;
+  g_autofree char *pack_checksum = NULL;
+  g_autofree char *data_path = NULL;
+  g_autofree char *index_path = NULL;
+  guint8 data_header[_OSTREE_PACK_DATA_HEADER_LEN] = { 0, };
+  guint32 be32;
+  guint64 offset;
+  gsize bytes_written;
+  guint i;
+
+  /* Everything was pruned; just drop the old packs */
+  if (entries->len == 0)
+    goto delete_old;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
+                                  cancellable, error))
+    goto out;
+
+  memcpy (data_header, _OSTREE_PACK_DATA_MAGIC, 8);
+  be32 = GUINT32_TO_BE (_OSTREE_PACK_VERSION);
+  memcpy (data_header + 8, &be32, 4);
+  if (!g_output_stream_write_all (temp_out, data_header, sizeof (data_header),
+                                  &bytes_written, cancellable, error))
+    goto out;
+
+  /* Objects start on 8 byte boundaries, so that metadata can be used
+   * as a GVariant directly from the mapped data file.
+   */
+  offset = _OSTREE_PACK_DATA_HEADER_LEN;
+  for (i = 0; i < entries->len; i++)
+    {
+      RepackEntry *entry = entries->pdata[i];
+      static const guint8 padding[_OSTREE_PACK_ALIGNMENT] = { 0, };
+      gsize padding_len = (_OSTREE_PACK_ALIGNMENT - offset % _OSTREE_PACK_ALIGNMENT) % _OSTREE_PACK_ALIGNMENT;
+
+      if (padding_len > 0)
+        {
+          if (!g_output_stream_write_all (temp_out, padding, padding_len,
+                                          &bytes_written, cancellable, error))
+            goto out;
+          offset += padding_len;
+        }
+
+      entry->offset = offset;
+      if (!write_pack_object (self, entry, temp_out, cancellable, error))
+        goto out;
+      offset += entry->size;
+    }
+
+  if (!g_output_stream_flush (temp_out, cancellable, error))
+    goto out;
+
+  if (!self->disable_fsync)
+    {
+      if (fsync (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out)) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+
+  if (!g_output_stream_close (temp_out, cancellable, error))
+    goto out;
+
+  index_bytes = build_pack_index (entries);
+  pack_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, index_bytes);
+  data_path = _ostree_get_relative_pack_path (is_meta, pack_checksum, "data");
+  index_path = _ostree_get_relative_pack_path (is_meta, pack_checksum, "index");
+
+  if (!glnx_shutil_mkdir_p_at (self->objects_dir_fd, _OSTREE_PACK_DIR, 0777,
+                               cancellable, error))
+    goto out;
+
+  /* The data must be in place before the index makes the pack visible */
+  if (renameat (self->tmp_dir_fd, temp_filename,
+                self->objects_dir_fd, data_path) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+  g_clear_pointer (&temp_filename, g_free);
+
+  if (!_ostree_repo_file_replace_contents (self, self->objects_dir_fd, index_path,
+                                           g_bytes_get_data (index_bytes, NULL),
+                                           g_bytes_get_size (index_bytes),
+                                           cancellable, error))
+    goto out;
+
+  if (!fsync_pack_dir (self, error))
+    goto out;
+
+ delete_old:
+  for (i = 0; old_packs && i < old_packs->len; i++)
+    {
+      OstreeRepoPack *pack = old_packs->pdata[i];
+      g_autofree char *old_index_path = NULL;
+      g_autofree char *old_data_path = NULL;
+
+      /* Repacking identical content yields the same name */
+      if (pack_checksum && strcmp (pack->checksum, pack_checksum) == 0)
+        continue;
+
+      old_index_path = _ostree_get_relative_pack_path (is_meta, pack->checksum, "index");
+      old_data_path = _ostree_get_relative_pack_path (is_meta, pack->checksum, "data");
+
+      if (!ot_ensure_unlinked_at (self->objects_dir_fd, old_index_path, error))
+        goto out;
+      if (!ot_ensure_unlinked_at (self->objects_dir_fd, old_data_path, error))
+        goto out;
+    }
+
+  for (i = 0; !keep_loose && i < entries->len; i++)
+    {
+      RepackEntry *entry = entries->pdata[i];
+      char checksum[65];
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+      if (!entry->is_loose)
+        continue;
+
+      ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+      _ostree_loose_path (loose_path, checksum, entry->objtype, self->mode);
+
+      if (!ot_ensure_unlinked_at (self->objects_dir_fd, loose_path, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
+  return ret;
+}
+
+/**
+ * ostree_repo_repack:
+ * @self: Repo
+ * @flags: Options controlling the repack
+ * @out_n_objects_packed: (out) (allow-none): Number of loose objects moved into packs
+ * @out_n_objects_total: (out) (allow-none): Total number of objects in packs
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Consolidate the loose objects and existing packs of @self into at
+ * most one metadata pack and one content pack.  Each pack consists of
+ * a data file holding the objects and a sorted index, so that object
+ * lookups become a binary search in a single mmap()ed file instead of
+ * a filesystem path lookup.
+ *
+ * Content objects in bare and bare-user repositories are always left
+ * loose, since checkouts hardlink them directly; only archive-z2
+ * repositories pack content.
+ *
+ * The loose copies of packed objects are deleted, unless
+ * %OSTREE_REPO_REPACK_FLAGS_KEEP_LOOSE is given.  Keep them in
+ * repositories served over HTTP to clients which only fetch loose
+ * objects, or through servers without range request support.
+ *
+ * Objects from a parent repository are not packed.
+ */
+gboolean
+ostree_repo_repack (OstreeRepo            *self,
+                    OstreeRepoRepackFlags  flags,
+                    guint                 *out_n_objects_packed,
+                    guint                 *out_n_objects_total,
+                    GCancellable          *cancellable,
+                    GError               **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) objects = NULL;
+  g_autoptr(GPtrArray) meta_entries = NULL;
+  g_autoptr(GPtrArray) content_entries = NULL;
+  g_autoptr(GPtrArray) old_meta_packs = NULL;
+  g_autoptr(GPtrArray) old_content_packs = NULL;
+  gboolean pack_content;
+  gboolean keep_loose = (flags & OSTREE_REPO_REPACK_FLAGS_KEEP_LOOSE) != 0;
+  guint n_meta_loose = 0;
+  guint n_content_loose = 0;
+  GHashTableIter hash_iter;
+  gpointer key, value;
+
+  g_return_val_if_fail (self->inited, FALSE);
+
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
+                                 cancellable, error))
+    goto out;
+
+  pack_content = _OSTREE_REPO_MODE_IS_ARCHIVE (self->mode)
+    && (flags & OSTREE_REPO_REPACK_FLAGS_METADATA_ONLY) == 0;
+
+  meta_entries = g_ptr_array_new_with_free_func (g_free);
+  content_entries = g_ptr_array_new_with_free_func (g_free);
+
+  g_hash_table_iter_init (&hash_iter, objects);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean is_loose;
+      g_autoptr(GVariant) pack_names = NULL;
+      gboolean is_packed;
+      RepackEntry *entry;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      g_variant_get (value, "(b@as)", &is_loose, &pack_names);
+      is_packed = g_variant_n_children (pack_names) > 0;
+
+      if (!OSTREE_OBJECT_TYPE_IS_META (objtype) && !pack_content && !is_packed)
+        continue;
+
+      /* Loose objects which live in a parent repo aren't ours to pack */
+      if (is_loose && !is_packed)
+        {
+          gboolean have_loose;
+          char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+          if (!_ostree_repo_has_loose_object (self, checksum, objtype, &have_loose,
+                                              loose_path, NULL, cancellable, error))
+            goto out;
+          if (!have_loose)
+            continue;
+        }
+
+      entry = g_new0 (RepackEntry, 1);
+      ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+      entry->objtype = objtype;
+      /* Prefer copying from an existing pack; the loose copy (if any) is
+       * then just a duplicate which we clean up.
+       */
+      entry->is_loose = is_loose && !is_packed;
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        {
+          g_ptr_array_add (meta_entries, entry);
+          if (entry->is_loose)
+            n_meta_loose++;
+        }
+      else
+        {
+          g_ptr_array_add (content_entries, entry);
+          if (entry->is_loose)
+            n_content_loose++;
+        }
+    }
+
+  g_ptr_array_sort (meta_entries, compare_repack_entries);
+  g_ptr_array_sort (content_entries, compare_repack_entries);
+
+  /* Hold on to the old packs so the data we copy from stays mapped
+   * while we delete their files.
+   */
+  g_mutex_lock (&self->cache_lock);
+  old_meta_packs = self->cached_meta_indexes ? g_ptr_array_ref (self->cached_meta_indexes) : NULL;
+  old_content_packs = self->cached_content_indexes ? g_ptr_array_ref (self->cached_content_indexes) : NULL;
+  g_mutex_unlock (&self->cache_lock);
+
+  if (n_meta_loose > 0 || (old_meta_packs && old_meta_packs->len > 1))
+    {
+      if (!write_one_pack (self, TRUE, meta_entries, old_meta_packs, keep_loose,
+                           cancellable, error))
+        goto out;
+    }
+
+  if (n_content_loose > 0 || (old_content_packs && old_content_packs->len > 1))
+    {
+      if (!write_one_pack (self, FALSE, content_entries, old_content_packs, keep_loose,
+                           cancellable, error))
+        goto out;
+    }
+
+  if (!_ostree_repo_load_packs (self, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  if (out_n_objects_packed)
+    *out_n_objects_packed = n_meta_loose + n_content_loose;
+  if (out_n_objects_total)
+    *out_n_objects_total = meta_entries->len + content_entries->len;
+ out:
+  return ret;
+}
+
+static gboolean
+prune_packs_of_kind (OstreeRepo       *self,
+                     gboolean          is_meta,
+                     GPtrArray        *packs,
+                     OstreeObjectSet  *reachable,
+                     guint            *out_n_pruned,
+                     guint64          *out_freed_bytes,
+                     GCancellable     *cancellable,
+                     GError          **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func (g_free);
+  OstreeObjectSet *seen = _ostree_object_set_new ();
+  guint n_pruned = 0;
+  guint64 freed_bytes = 0;
+  guint i, j;
+
+  for (i = 0; packs && i < packs->len; i++)
+    {
+      OstreeRepoPack *pack = packs->pdata[i];
+
+      for (j = 0; j < pack->n_entries; j++)
+        {
+          const OstreePackIndexEntry *index_entry = &pack->entries[j];
+          RepackEntry *entry;
+
+          if (!_ostree_object_set_contains (reachable, index_entry->csum,
+                                            index_entry->objtype))
+            {
+              n_pruned++;
+              freed_bytes += GUINT64_FROM_BE (index_entry->size);
+              continue;
+            }
+
+          /* The same object may be in more than one pack */
+          if (!_ostree_object_set_add (seen, index_entry->csum, index_entry->objtype))
+            continue;
+
+          entry = g_new0 (RepackEntry, 1);
+          memcpy (entry->csum, index_entry->csum, 32);
+          entry->objtype = index_entry->objtype;
+          entry->is_loose = FALSE;
+          g_ptr_array_add (entries, entry);
+        }
+    }
+
+  if (n_pruned > 0)
+    {
+      g_ptr_array_sort (entries, compare_repack_entries);
+      if (!write_one_pack (self, is_meta, entries, packs, FALSE, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  *out_n_pruned = n_pruned;
+  *out_freed_bytes = freed_bytes;
+ out:
+  _ostree_object_set_unref (seen);
+  return ret;
+}
+
+/* Rewrite the packs of @self, dropping every object which is not in
+ * @reachable.  Packs without unreachable objects are left alone.
+ */
+gboolean
+_ostree_repo_prune_packs (OstreeRepo       *self,
+                          OstreeObjectSet  *reachable,
+                          guint            *out_n_pruned,
+                          guint64          *out_freed_bytes,
+                          GCancellable     *cancellable,
+                          GError          **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GPtrArray) meta_packs = NULL;
+  g_autoptr(GPtrArray) content_packs = NULL;
+  guint n_meta_pruned = 0;
+  guint n_content_pruned = 0;
+  guint64 meta_freed_bytes = 0;
+  guint64 content_freed_bytes = 0;
+
+  g_mutex_lock (&self->cache_lock);
+  meta_packs = self->cached_meta_indexes ? g_ptr_array_ref (self->cached_meta_indexes) : NULL;
+  content_packs = self->cached_content_indexes ? g_ptr_array_ref (self->cached_content_indexes) : NULL;
+  g_mutex_unlock (&self->cache_lock);
+
+  if (!prune_packs_of_kind (self, TRUE, meta_packs, reachable,
+                            &n_meta_pruned, &meta_freed_bytes,
+                            cancellable, error))
+    goto out;
+
+  if (!prune_packs_of_kind (self, FALSE, content_packs, reachable,
+                            &n_content_pruned, &content_freed_bytes,
+                            cancellable, error))
+    goto out;
+
+  if (n_meta_pruned + n_content_pruned > 0)
+    {
+      if (!_ostree_repo_load_packs (self, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  if (out_n_pruned)
+    *out_n_pruned = n_meta_pruned + n_content_pruned;
+  if (out_freed_bytes)
+    *out_freed_bytes = meta_freed_bytes + content_freed_bytes;
+ out:
+  return ret;
+}
@@ -20,13 +20,28 @@
 
 #pragma once
 
+#include <sys/stat.h>
 #include "ostree-repo.h"
 #include "ostree-fetcher.h"
+#include "ostree-object-set.h"
 
 G_BEGIN_DECLS
 
 #define OSTREE_DELTAPART_VERSION (0)
 
+/* Parts compressed with zstd ('z') are marked with this version, so
+ * that clients which can't decompress them refuse them before
+ * fetching any data.  They are only listed in the separate zstd
+ * superblock, which older clients never request.
+ */
+#define OSTREE_DELTAPART_VERSION_ZSTD (1)
+
+#ifdef HAVE_ZSTD
+#define OSTREE_DELTAPART_MAX_VERSION OSTREE_DELTAPART_VERSION_ZSTD
+#else
+#define OSTREE_DELTAPART_MAX_VERSION OSTREE_DELTAPART_VERSION
+#endif
+
 #define _OSTREE_OBJECT_SIZES_ENTRY_SIGNATURE "ay"
 
 /**
@@ -40,6 +55,7 @@ struct OstreeRepo {
   char *boot_id;
   int commit_stagedir_fd;
   char *commit_stagedir_name;
+  guint commit_stagedir_objdirs[256 / 32]; /* Bitmap of fan-out dirs created */
 
   GFile *repodir;
   int    repo_dir_fd;
@@ -64,13 +80,25 @@ struct OstreeRepo {
   GMutex cache_lock;
   GPtrArray *cached_meta_indexes;
   GPtrArray *cached_content_indexes;
+  gint64 cached_packs_dir_mtime; /* Nanoseconds; 0 if there was no pack dir */
+  GHashTable *metadata_cache; /* OstreeMetadataCacheKey -> entry */
+  GQueue metadata_cache_lru; /* Most recently used first */
+  guint64 metadata_cache_size;
+  guint64 metadata_cache_max_size;
+  guint64 metadata_cache_hits;
+  guint64 metadata_cache_misses;
 
   gboolean inited;
   gboolean writable;
   GError *writable_error;
   gboolean in_transaction;
   gboolean disable_fsync;
+  gboolean tmpfile_probed;
+  gboolean tmpfile_supported;
   GHashTable *loose_object_devino_hash;
+  GHashTable *stat_cache;
+  gint64 stat_cache_start;
+  GHashTable *txn_file_chunks; /* Checksums of manifests written in the transaction */
   GHashTable *updated_uncompressed_dirs;
   GHashTable *object_sizes;
 
@@ -83,6 +111,9 @@ struct OstreeRepo {
   OstreeRepoMode mode;
   gboolean enable_uncompressed_cache;
   gboolean generate_sizes;
+  guint64 static_delta_memory_limit;
+  int compression_level;
+  guint64 chunked_content_threshold;
 
   OstreeRepo *parent_repo;
 };
@@ -93,6 +124,12 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
                                      GCancellable   *cancellable,
                                      GError        **error);
 
+gboolean
+_ostree_repo_ensure_staged_objdir (OstreeRepo     *self,
+                                   const char     *loose_path,
+                                   GCancellable   *cancellable,
+                                   GError        **error);
+
 gboolean
 _ostree_repo_find_object (OstreeRepo           *self,
                           OstreeObjectType      objtype,
@@ -101,10 +138,21 @@ _ostree_repo_find_object (OstreeRepo           *self,
                           GCancellable         *cancellable,
                           GError             **error);
 
+gboolean
+_ostree_repo_stat_object (OstreeRepo           *self,
+                          OstreeObjectType      objtype,
+                          const char           *checksum,
+                          struct stat          *out_stbuf,
+                          GCancellable         *cancellable,
+                          GError              **error);
+
 GFile *
 _ostree_repo_get_commit_metadata_loose_path (OstreeRepo        *self,
                                              const char        *checksum);
 
+GConverter *
+_ostree_repo_new_content_compressor (OstreeRepo *self);
+
 gboolean
 _ostree_repo_has_loose_object (OstreeRepo           *self,
                                const char           *checksum,
@@ -122,6 +170,35 @@ _ostree_repo_write_directory_meta (OstreeRepo   *self,
                                    guchar      **out_csum,
                                    GCancellable *cancellable,
                                    GError      **error);
+gboolean
+_ostree_repo_stat_cache_ensure_loaded (OstreeRepo    *self,
+                                       GCancellable  *cancellable,
+                                       GError       **error);
+
+gboolean
+_ostree_repo_stat_cache_lookup (OstreeRepo         *self,
+                                const struct stat  *stbuf,
+                                GFileInfo          *file_info,
+                                GVariant           *xattrs,
+                                char              **out_checksum,
+                                GCancellable       *cancellable,
+                                GError            **error);
+
+void
+_ostree_repo_stat_cache_store (OstreeRepo         *self,
+                               const struct stat  *stbuf,
+                               GFileInfo          *file_info,
+                               GVariant           *xattrs,
+                               const char         *checksum);
+
+gboolean
+_ostree_repo_stat_cache_flush (OstreeRepo    *self,
+                               GCancellable  *cancellable,
+                               GError       **error);
+
+void
+_ostree_repo_stat_cache_clear (OstreeRepo *self);
+
 gboolean
 _ostree_repo_update_refs (OstreeRepo        *self,
                           GHashTable        *refs,
@@ -137,6 +214,20 @@ _ostree_repo_file_replace_contents (OstreeRepo    *self,
                                     GCancellable  *cancellable,
                                     GError       **error);
 
+gboolean
+_ostree_repo_lookup_ref (OstreeRepo    *self,
+                         const char    *refspec,
+                         char         **out_rev,
+                         GCancellable  *cancellable,
+                         GError       **error);
+
+gboolean
+_ostree_packed_refs_lookup_in_buf (const char    *buf,
+                                   gsize          len,
+                                   const char    *refspec,
+                                   char         **out_rev,
+                                   GError       **error);
+
 gboolean      
 _ostree_repo_write_ref (OstreeRepo    *self,
                         const char    *remote,
@@ -164,6 +255,49 @@ _ostree_repo_traverse_dirtree_internal (OstreeRepo      *repo,
                                         GCancellable    *cancellable,
                                         GError         **error);
 
+typedef void (*OstreeRepoTraverseObjectFunc) (const guchar     *csum,
+                                              OstreeObjectType  objtype,
+                                              gpointer          user_data);
+
+gboolean
+_ostree_repo_traverse_commits_union_full (OstreeRepo                   *repo,
+                                          const char * const           *commits,
+                                          guint                         n_commits,
+                                          int                           maxdepth,
+                                          OstreeObjectSet              *inout_reachable,
+                                          guint                         n_threads,
+                                          OstreeRepoTraverseObjectFunc  func,
+                                          gpointer                      user_data,
+                                          GCancellable                 *cancellable,
+                                          GError                      **error);
+
+gboolean
+_ostree_repo_traverse_commits_union (OstreeRepo         *repo,
+                                     const char * const *commits,
+                                     guint               n_commits,
+                                     int                 maxdepth,
+                                     OstreeObjectSet    *inout_reachable,
+                                     guint               n_threads,
+                                     GCancellable       *cancellable,
+                                     GError            **error);
+
+gboolean
+_ostree_repo_traverse_commits_union_reachable (OstreeRepo         *repo,
+                                               const char * const *commits,
+                                               guint               n_commits,
+                                               int                 maxdepth,
+                                               GHashTable         *inout_reachable,
+                                               guint               n_threads,
+                                               GCancellable       *cancellable,
+                                               GError            **error);
+
+gboolean
+_ostree_repo_list_objects_set (OstreeRepo                  *self,
+                               OstreeRepoListObjectsFlags   flags,
+                               OstreeObjectSet             *inout_objects,
+                               GCancellable                *cancellable,
+                               GError                     **error);
+
 OstreeRepoCommitFilterResult
 _ostree_repo_commit_modifier_apply (OstreeRepo               *self,
                                     OstreeRepoCommitModifier *modifier,
@@ -263,6 +397,16 @@ _ostree_repo_commit_trusted_content_bare (OstreeRepo          *self,
                                           GCancellable        *cancellable,
                                           GError             **error);
 
+gboolean
+_ostree_repo_write_content_from_fd (OstreeRepo       *self,
+                                    const char       *expected_checksum,
+                                    GInputStream     *object_input,
+                                    guint64           length,
+                                    int               content_fd,
+                                    guchar          **out_csum,
+                                    GCancellable     *cancellable,
+                                    GError          **error);
+
 gboolean
 _ostree_repo_read_bare_fd (OstreeRepo           *self,
                            const char           *checksum,
@@ -270,6 +414,13 @@ _ostree_repo_read_bare_fd (OstreeRepo           *self,
                            GCancellable        *cancellable,
                            GError             **error);
 
+gboolean
+_ostree_repo_load_file_mode (OstreeRepo     *self,
+                             const char     *checksum,
+                             guint32        *out_mode,
+                             GCancellable   *cancellable,
+                             GError        **error);
+
 gboolean
 _ostree_repo_update_mtime (OstreeRepo        *self,
                            GError           **error);
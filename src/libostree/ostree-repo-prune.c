@@ -24,11 +24,13 @@
 
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
+#include "ostree-repo-chunks-private.h"
+#include "ostree-repo-pack-private.h"
 #include "otutil.h"
 
 typedef struct {
   OstreeRepo *repo;
-  GHashTable *reachable;
+  OstreeObjectSet *reachable;
   guint n_reachable_meta;
   guint n_reachable_content;
   guint n_unreachable_meta;
@@ -62,17 +64,17 @@ prune_commitpartial_file (OstreeRepo    *repo,
 static gboolean
 maybe_prune_loose_object (OtPruneData        *data,
                           OstreeRepoPruneFlags    flags,
-                          const char         *checksum,
+                          const guchar       *csum,
                           OstreeObjectType    objtype,
                           GCancellable       *cancellable,
                           GError            **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GVariant) key = NULL;
+  char checksum[65];
 
-  key = ostree_object_name_serialize (checksum, objtype);
+  ostree_checksum_inplace_from_bytes (csum, checksum);
 
-  if (!g_hash_table_lookup_extended (data->reachable, key, NULL, NULL))
+  if (!_ostree_object_set_contains (data->reachable, csum, objtype))
     {
       if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
         {
@@ -133,6 +135,8 @@ maybe_prune_loose_object (OtPruneData        *data,
  * when combined with @depth, this is a convenient way to delete
  * history from the repository.
  * 
+ * Packs which contain unreachable objects are rewritten without them.
+ *
  * Use the %OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE to just determine
  * statistics on objects that would be deleted, without actually
  * deleting them.
@@ -150,13 +154,19 @@ ostree_repo_prune (OstreeRepo        *self,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  g_autoptr(GHashTable) objects = NULL;
+  OstreeObjectSetIter set_iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  OstreeObjectSet *loose_objects = _ostree_object_set_new ();
+  OstreeObjectSet *packed_objects = _ostree_object_set_new ();
   g_autoptr(GHashTable) all_refs = NULL;
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
   OtPruneData data = { 0, };
   gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
+  guint n_unreachable_packed = 0;
 
   data.repo = self;
-  data.reachable = ostree_repo_traverse_new_reachable ();
+  data.reachable = _ostree_object_set_new ();
 
   if (refs_only)
     {
@@ -167,57 +177,116 @@ ostree_repo_prune (OstreeRepo        *self,
       g_hash_table_iter_init (&hash_iter, all_refs);
       
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
-        {
-          const char *checksum = value;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                            cancellable, error))
-            goto out;
-        }
+        g_ptr_array_add (commits, g_strdup (value));
     }
 
-  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
-                                 cancellable, error))
+  if (!_ostree_repo_list_objects_set (self, OSTREE_REPO_LIST_OBJECTS_LOOSE, loose_objects,
+                                      cancellable, error))
+    goto out;
+
+  if (!_ostree_repo_list_objects_set (self, OSTREE_REPO_LIST_OBJECTS_PACKED, packed_objects,
+                                      cancellable, error))
     goto out;
 
   if (!refs_only)
     {
-      g_hash_table_iter_init (&hash_iter, objects);
-      while (g_hash_table_iter_next (&hash_iter, &key, &value))
+      OstreeObjectSet *sets[] = { loose_objects, packed_objects };
+      guint i;
+
+      for (i = 0; i < G_N_ELEMENTS (sets); i++)
         {
-          GVariant *serialized_key = key;
-          const char *checksum;
-          OstreeObjectType objtype;
+          _ostree_object_set_iter_init (&set_iter, sets[i]);
+          while (_ostree_object_set_iter_next (&set_iter, &csum, &objtype, NULL))
+            {
+              if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
+                continue;
 
-          ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+              /* Listed both loose and packed */
+              if (i > 0 && _ostree_object_set_contains (loose_objects, csum, objtype))
+                continue;
 
-          if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
-            continue;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                                  cancellable, error))
-            goto out;
+              g_ptr_array_add (commits, ostree_checksum_from_bytes (csum));
+            }
         }
     }
 
-  g_hash_table_iter_init (&hash_iter, objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  /* Traverse all commits at once so that dirtrees from different
+   * histories are loaded in parallel.
+   */
+  if (!_ostree_repo_traverse_commits_union (self, (const char * const *)commits->pdata,
+                                            commits->len, depth, data.reachable, 0,
+                                            cancellable, error))
+    goto out;
+
+  _ostree_object_set_iter_init (&set_iter, loose_objects);
+  while (_ostree_object_set_iter_next (&set_iter, &csum, &objtype, NULL))
     {
-      GVariant *serialized_key = key;
-      GVariant *objdata = value;
-      const char *checksum;
-      OstreeObjectType objtype;
-      gboolean is_loose;
-      
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-      g_variant_get_child (objdata, 0, "b", &is_loose);
+      if (!maybe_prune_loose_object (&data, flags, csum, objtype,
+                                     cancellable, error))
+        goto out;
+    }
+
+  /* Objects which are only in packs can't be deleted one by one; count
+   * them here, and rewrite the packs without them below.
+   */
+  _ostree_object_set_iter_init (&set_iter, packed_objects);
+  while (_ostree_object_set_iter_next (&set_iter, &csum, &objtype, NULL))
+    {
+      gboolean is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
+      gboolean is_reachable = _ostree_object_set_contains (data.reachable, csum, objtype);
+
+      if (!is_reachable)
+        n_unreachable_packed++;
 
-      if (!is_loose)
+      /* Already counted above */
+      if (_ostree_object_set_contains (loose_objects, csum, objtype))
         continue;
 
-      if (!maybe_prune_loose_object (&data, flags, checksum, objtype,
+      if (is_reachable)
+        {
+          if (is_meta)
+            data.n_reachable_meta++;
+          else
+            data.n_reachable_content++;
+          continue;
+        }
+
+      if (is_meta)
+        data.n_unreachable_meta++;
+      else
+        data.n_unreachable_content++;
+
+      if (objtype == OSTREE_OBJECT_TYPE_COMMIT && !(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+        {
+          char checksum[65];
+
+          ostree_checksum_inplace_from_bytes (csum, checksum);
+          if (!prune_commitpartial_file (self, checksum, cancellable, error))
+            goto out;
+        }
+    }
+
+  if (n_unreachable_packed > 0 && !(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      guint64 packs_freed_bytes;
+
+      if (!_ostree_repo_prune_packs (self, data.reachable, NULL, &packs_freed_bytes,
                                      cancellable, error))
         goto out;
+      data.freed_bytes += packs_freed_bytes;
+    }
+
+  /* Now that unreachable chunked files are gone, so can be the chunks
+   * only they used.
+   */
+  if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      guint64 chunks_freed_bytes;
+
+      if (!_ostree_repo_prune_chunks (self, NULL, &chunks_freed_bytes,
+                                      cancellable, error))
+        goto out;
+      data.freed_bytes += chunks_freed_bytes;
     }
 
   { g_autoptr(GPtrArray) deltas = NULL;
@@ -269,6 +338,8 @@ ostree_repo_prune (OstreeRepo        *self,
   *out_pruned_object_size_total = data.freed_bytes;
  out:
   if (data.reachable)
-    g_hash_table_unref (data.reachable);
+    _ostree_object_set_unref (data.reachable);
+  _ostree_object_set_unref (loose_objects);
+  _ostree_object_set_unref (packed_objects);
   return ret;
 }
@@ -26,6 +26,8 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-repo-chunks-private.h"
 #include "ostree-metalink.h"
 #include "otutil.h"
 
@@ -61,14 +63,34 @@ typedef struct {
 
   GBytes           *summary_data;
   GBytes           *summary_data_sig;
+  GBytes           *packed_refs_data;
   GVariant         *summary;
   GHashTable       *summary_deltas_checksums;
+  GHashTable       *summary_zstd_deltas_checksums;
+  GHashTable       *summary_chunked_content; /* Content objects the remote has a manifest of */
+  SoupURI          *chunked_content_uri; /* Of the list behind summary_chunked_content, until loaded */
+  char             *chunked_content_name;
+  char             *chunked_content_checksum;
+  int               chunked_content_cache_dfd; /* -1 if none */
+  gboolean          loading_chunked_content;
+  GPtrArray        *awaiting_chunked_content; /* FetchObjectData */
+  GPtrArray        *remote_packs; /* RemotePack */
+  int               pack_index_cache_dfd; /* -1 if none */
+  gboolean          pack_indexes_requested;
+  guint             n_loading_pack_indexes;
+  GPtrArray        *awaiting_pack_indexes; /* FetchObjectData */
+  GQueue            pending_pack_batches; /* Not yet requested */
+  guint             n_outstanding_pack_batches;
+  GSource          *pack_flush_source;
   GPtrArray        *static_delta_superblocks;
   GHashTable       *expected_commit_sizes; /* Maps commit checksum to known size */
   GHashTable       *commit_to_depth; /* Maps commit checksum maximum depth */
-  GHashTable       *scanned_metadata; /* Maps object name to itself */
-  GHashTable       *requested_metadata; /* Maps object name to itself */
-  GHashTable       *requested_content; /* Maps object name to itself */
+  OstreeObjectSet  *scanned_metadata;
+  OstreeObjectSet  *requested_metadata;
+  OstreeObjectSet  *requested_content;
+  GHashTable       *requested_chunks; /* Checksum -> FetchChunkData */
+  GHashTable       *fetched_chunks; /* Checksum -> temporary file, if not stored */
+  GHashTable       *chunk_index; /* See _ostree_repo_load_chunk_index() */
   guint             n_outstanding_metadata_fetches;
   guint             n_outstanding_metadata_write_requests;
   guint             n_outstanding_content_fetches;
@@ -76,12 +98,18 @@ typedef struct {
   guint             n_outstanding_deltapart_fetches;
   guint             n_outstanding_deltapart_write_requests;
   guint             n_total_deltaparts;
+  GQueue            pending_deltapart_executions; /* Fetched, not yet executing */
+  guint             n_executing_deltaparts;
+  guint             max_executing_deltaparts;
+  guint64           executing_deltapart_usize;
   guint64           total_deltapart_size;
   gint              n_requested_metadata;
   gint              n_requested_content;
   guint             n_fetched_deltaparts;
   guint             n_fetched_metadata;
   guint             n_fetched_content;
+  guint             n_requested_chunks;
+  guint             n_fetched_chunks;
 
   int               maxdepth;
   guint64           start_time;
@@ -109,12 +137,31 @@ typedef struct {
    * whether to fetch the primary object after fetching its
    * detached metadata (no need if it's already stored). */
   gboolean     object_is_stored;
+
+  /* Only relevant for content objects stored in chunks on the
+   * remote; the manifest, and how many chunks are still being
+   * fetched. */
+  GVariant    *file_chunks;
+  guint        n_pending_chunks;
+
+  /* Set if the object was to come from a remote pack which turned
+   * out to be unusable, so it's fetched loose instead. */
+  gboolean     from_unusable_pack;
 } FetchObjectData;
 
+typedef struct {
+  OtPullData  *pull_data;
+  char        *checksum;
+  guint64      size;
+  GPtrArray   *waiters; /* FetchObjectData waiting for this chunk */
+} FetchChunkData;
+
 typedef struct {
   OtPullData  *pull_data;
   GVariant *objects;
   char *expected_checksum;
+  guint64 usize;
+  GBytes *delta_data;
 } FetchStaticDeltaData;
 
 static SoupURI *
@@ -206,6 +253,20 @@ update_progress (gpointer user_data)
   ostree_async_progress_set_uint64 (pull_data->progress, "bytes-transferred", bytes_transferred);
   ostree_async_progress_set_uint64 (pull_data->progress, "start-time", start_time);
 
+  /* Current HTTP request window and what it's based on */
+  ostree_async_progress_set_uint (pull_data->progress, "fetcher-concurrency",
+                                  _ostree_fetcher_get_concurrency (pull_data->fetcher));
+  ostree_async_progress_set_uint64 (pull_data->progress, "fetcher-rtt-usec",
+                                    _ostree_fetcher_get_rtt_usec (pull_data->fetcher));
+  ostree_async_progress_set_uint64 (pull_data->progress, "fetcher-throughput",
+                                    _ostree_fetcher_get_throughput (pull_data->fetcher));
+
+  /* Conditional requests for the summary and refs */
+  ostree_async_progress_set_uint (pull_data->progress, "fetcher-cache-hits",
+                                  _ostree_fetcher_get_cache_hits (pull_data->fetcher));
+  ostree_async_progress_set_uint (pull_data->progress, "fetcher-cache-misses",
+                                  _ostree_fetcher_get_cache_misses (pull_data->fetcher));
+
   /* Deltas */
   ostree_async_progress_set_uint (pull_data->progress, "fetched-delta-parts",
                                   pull_data->n_fetched_deltaparts);
@@ -220,6 +281,10 @@ update_progress (gpointer user_data)
   ostree_async_progress_set_uint (pull_data->progress, "outstanding-metadata-fetches", pull_data->n_outstanding_metadata_fetches);
   ostree_async_progress_set_uint (pull_data->progress, "metadata-fetched", pull_data->n_fetched_metadata);
 
+  /* Chunks of large content objects */
+  ostree_async_progress_set_uint (pull_data->progress, "fetched-chunks", pull_data->n_fetched_chunks);
+  ostree_async_progress_set_uint (pull_data->progress, "requested-chunks", pull_data->n_requested_chunks);
+
   if (pull_data->fetching_sync_uri)
     {
       g_autofree char *uri_string = soup_uri_to_string (pull_data->fetching_sync_uri, TRUE);
@@ -287,25 +352,39 @@ typedef struct {
   GInputStream   *result_stream;
 } OstreeFetchUriSyncData;
 
+/* If @use_cache is set, @uri is a file which is polled for changes,
+ * such as the summary, so request it conditionally.
+ */
 static gboolean
 fetch_uri_contents_membuf_sync (OtPullData    *pull_data,
                                 SoupURI        *uri,
                                 gboolean        add_nul,
                                 gboolean        allow_noent,
+                                gboolean        use_cache,
                                 GBytes        **out_contents,
                                 GCancellable   *cancellable,
                                 GError        **error)
 {
   gboolean ret;
   pull_data->fetching_sync_uri = uri;
-  ret = _ostree_fetcher_request_uri_to_membuf (pull_data->fetcher,
-                                               uri,
-                                               add_nul,
-                                               allow_noent,
-                                               out_contents,
-                                               OSTREE_MAX_METADATA_SIZE,
-                                               cancellable,
-                                               error);
+  if (use_cache)
+    ret = _ostree_fetcher_request_uri_to_membuf_cached (pull_data->fetcher,
+                                                        uri,
+                                                        add_nul,
+                                                        allow_noent,
+                                                        out_contents,
+                                                        OSTREE_MAX_METADATA_SIZE,
+                                                        cancellable,
+                                                        error);
+  else
+    ret = _ostree_fetcher_request_uri_to_membuf (pull_data->fetcher,
+                                                 uri,
+                                                 add_nul,
+                                                 allow_noent,
+                                                 out_contents,
+                                                 OSTREE_MAX_METADATA_SIZE,
+                                                 cancellable,
+                                                 error);
   pull_data->fetching_sync_uri = NULL;
   return ret;
 }
@@ -322,7 +401,7 @@ fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
   g_autofree char *ret_contents = NULL;
   gsize len;
 
-  if (!fetch_uri_contents_membuf_sync (pull_data, uri, TRUE, FALSE,
+  if (!fetch_uri_contents_membuf_sync (pull_data, uri, TRUE, FALSE, TRUE,
                                        &bytes, cancellable, error))
     goto out;
 
@@ -397,6 +476,9 @@ scan_dirtree_object (OtPullData   *pull_data,
       if (!ot_util_filename_validate (filename, error))
         goto out;
 
+      if (!ostree_validate_structureof_csum_v (csum, error))
+        goto out;
+
       file_checksum = ostree_checksum_from_bytes_v (csum);
 
       if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, file_checksum,
@@ -410,12 +492,11 @@ scan_dirtree_object (OtPullData   *pull_data,
                                                cancellable, error))
             goto out;
         }
-      else if (!file_is_stored && !g_hash_table_lookup (pull_data->requested_content, file_checksum))
-        {
-          g_hash_table_insert (pull_data->requested_content, file_checksum, file_checksum);
-          enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, FALSE, FALSE);
-          file_checksum = NULL;  /* Transfer ownership */
-        }
+      else if (!file_is_stored &&
+               _ostree_object_set_add (pull_data->requested_content,
+                                       ostree_checksum_bytes_peek (csum),
+                                       OSTREE_OBJECT_TYPE_FILE))
+        enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, FALSE, FALSE);
     }
 
     if (pull_data->dir)
@@ -480,14 +561,51 @@ fetch_ref_contents (OtPullData    *pull_data,
 {
   gboolean ret = FALSE;
   g_autofree char *ret_contents = NULL;
+  g_autoptr(GBytes) bytes = NULL;
   SoupURI *target_uri = NULL;
 
   target_uri = suburi_new (pull_data->base_uri, "refs", "heads", ref, NULL);
   
-  if (!fetch_uri_contents_utf8_sync (pull_data, target_uri, &ret_contents, cancellable, error))
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, TRUE, TRUE, TRUE,
+                                       &bytes, cancellable, error))
     goto out;
 
-  g_strchomp (ret_contents);
+  if (bytes)
+    {
+      ret_contents = g_bytes_unref_to_data (bytes, NULL);
+      bytes = NULL;
+      g_strchomp (ret_contents);
+    }
+  else
+    {
+      /* The remote may have run `ostree refs --pack` */
+      if (!pull_data->packed_refs_data)
+        {
+          soup_uri_free (target_uri);
+          target_uri = suburi_new (pull_data->base_uri, "refs", "packed-refs", NULL);
+
+          if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE, TRUE,
+                                               &pull_data->packed_refs_data,
+                                               cancellable, error))
+            goto out;
+        }
+
+      if (pull_data->packed_refs_data)
+        {
+          gsize len;
+          const char *buf = g_bytes_get_data (pull_data->packed_refs_data, &len);
+
+          if (!_ostree_packed_refs_lookup_in_buf (buf, len, ref, &ret_contents, error))
+            goto out;
+        }
+
+      if (ret_contents == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "No such branch '%s' in remote", ref);
+          goto out;
+        }
+    }
 
   if (!ostree_validate_checksum_string (ret_contents, error))
     goto out;
@@ -572,22 +690,35 @@ content_fetch_on_write_complete (GObject        *object,
       goto out;
     }
 
+  /* Archive repositories chunk files themselves if configured to,
+   * and mirrors keep the manifest to serve it; other repositories
+   * keep it so that later pulls can reuse the chunks of this file.
+   */
+  if (fetch_data->file_chunks
+      && (!_OSTREE_REPO_MODE_IS_ARCHIVE (pull_data->repo->mode) || pull_data->is_mirror))
+    {
+      if (!_ostree_repo_write_file_chunks (pull_data->repo, checksum, fetch_data->file_chunks,
+                                           pull_data->cancellable, error))
+        goto out;
+    }
+
   pull_data->n_fetched_content++;
  out:
   pull_data->n_outstanding_content_write_requests--;
   check_outstanding_requests_handle_error (pull_data, local_error);
+  g_clear_pointer (&fetch_data->file_chunks, (GDestroyNotify) g_variant_unref);
   g_variant_unref (fetch_data->object);
   g_free (fetch_data);
 }
 
+/* Like process_fetched_metadata(), for content objects */
 static void
-content_fetch_on_complete (GObject        *object,
-                           GAsyncResult   *result,
-                           gpointer        user_data) 
+process_fetched_content (FetchObjectData   *fetch_data,
+                         const char        *temp_path,
+                         GError            *fetch_error)
 {
-  FetchObjectData *fetch_data = user_data;
   OtPullData *pull_data = fetch_data->pull_data;
-  GError *local_error = NULL;
+  GError *local_error = fetch_error;
   GError **error = &local_error;
   GCancellable *cancellable = NULL;
   guint64 length;
@@ -595,11 +726,9 @@ content_fetch_on_complete (GObject        *object,
   g_autoptr(GVariant) xattrs = NULL;
   g_autoptr(GInputStream) file_in = NULL;
   g_autoptr(GInputStream) object_input = NULL;
-  g_autofree char *temp_path = NULL;
   const char *checksum;
   OstreeObjectType objtype;
 
-  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
   if (!temp_path)
     goto out;
 
@@ -608,7 +737,11 @@ content_fetch_on_complete (GObject        *object,
 
   g_debug ("fetch of %s complete", ostree_object_to_string (checksum, objtype));
 
-  if (pull_data->is_mirror && pull_data->repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+  /* Mirror the object as is only if we'd have compressed it the same
+   * way; otherwise, e.g. a zstd object would end up in an archive-z2
+   * repository that older clients pull from.
+   */
+  if (pull_data->is_mirror && pull_data->repo->mode == pull_data->remote_mode)
     {
       gboolean have_object;
       if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, checksum,
@@ -661,6 +794,300 @@ content_fetch_on_complete (GObject        *object,
   check_outstanding_requests_handle_error (pull_data, local_error);
 }
 
+/* Fetched chunks are stored if the repository would keep them
+ * anyway, and otherwise only kept in temporary files until the end of
+ * the pull.
+ */
+static gboolean
+pull_stores_chunks (OtPullData  *pull_data)
+{
+  return _OSTREE_REPO_MODE_IS_ARCHIVE (pull_data->repo->mode)
+    && (pull_data->is_mirror || pull_data->repo->chunked_content_threshold > 0);
+}
+
+static void
+fetch_chunk_data_free (FetchChunkData *chunk_data)
+{
+  g_free (chunk_data->checksum);
+  g_ptr_array_unref (chunk_data->waiters);
+  g_free (chunk_data);
+}
+
+/* Called once all chunks of a content object are available */
+static void
+finish_chunked_content_fetch (FetchObjectData  *fetch_data)
+{
+  OtPullData *pull_data = fetch_data->pull_data;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+  GCancellable *cancellable = NULL;
+  OstreeChunkSources sources = { pull_data->tmpdir_dfd, NULL, pull_data->chunk_index };
+  g_autoptr(GHashTable) fetched = NULL;
+  g_autoptr(GVariant) chunks = NULL;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GInputStream) file_in = NULL;
+  g_autoptr(GInputStream) object_input = NULL;
+  guint64 length;
+  const char *checksum;
+  OstreeObjectType objtype;
+  gsize i, n;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+
+  g_debug ("fetch of chunks of %s complete", ostree_object_to_string (checksum, objtype));
+
+  /* The write happens in a worker thread, so give it its own table
+   * of the temporary files it needs.
+   */
+  fetched = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  chunks = g_variant_get_child_value (fetch_data->file_chunks, 2);
+  n = g_variant_n_children (chunks);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *chunk_checksum = NULL;
+      const char *temp_path;
+
+      g_variant_get_child (chunks, i, "(@ayt)", &csum_v, NULL);
+      chunk_checksum = ostree_checksum_from_bytes_v (csum_v);
+      temp_path = g_hash_table_lookup (pull_data->fetched_chunks, chunk_checksum);
+      if (temp_path)
+        g_hash_table_replace (fetched, g_steal_pointer (&chunk_checksum), g_strdup (temp_path));
+    }
+  sources.fetched = fetched;
+
+  if (!_ostree_repo_open_chunked_file (pull_data->repo, fetch_data->file_chunks, &sources,
+                                       &file_in, &file_info, &xattrs,
+                                       cancellable, error))
+    goto out;
+
+  if (!ostree_raw_file_to_content_stream (file_in, file_info, xattrs,
+                                          &object_input, &length,
+                                          cancellable, error))
+    goto out;
+
+  pull_data->n_outstanding_content_write_requests++;
+  ostree_repo_write_content_async (pull_data->repo, checksum,
+                                   object_input, length,
+                                   cancellable,
+                                   content_fetch_on_write_complete, fetch_data);
+
+ out:
+  pull_data->n_outstanding_content_fetches--;
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
+static void
+chunk_fetch_on_complete (GObject        *object,
+                         GAsyncResult   *result,
+                         gpointer        user_data)
+{
+  FetchChunkData *chunk_data = user_data;
+  OtPullData *pull_data = chunk_data->pull_data;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+  g_autofree char *temp_path = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GPtrArray) waiters = NULL;
+  guint i;
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
+  if (!temp_path)
+    goto out;
+
+  g_debug ("fetch of chunk %s complete", chunk_data->checksum);
+
+  if (!_ostree_chunk_read_at (pull_data->tmpdir_dfd, temp_path,
+                              chunk_data->checksum, chunk_data->size, &data,
+                              pull_data->cancellable, error))
+    {
+      (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0);
+      goto out;
+    }
+
+  if (pull_stores_chunks (pull_data))
+    {
+      (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0);
+      if (!_ostree_repo_write_chunk (pull_data->repo, chunk_data->checksum,
+                                     g_bytes_get_data (data, NULL), g_bytes_get_size (data),
+                                     pull_data->cancellable, error))
+        goto out;
+    }
+  else
+    g_hash_table_replace (pull_data->fetched_chunks, g_strdup (chunk_data->checksum),
+                          g_steal_pointer (&temp_path));
+
+  pull_data->n_fetched_chunks++;
+
+  waiters = g_ptr_array_ref (chunk_data->waiters);
+  g_hash_table_remove (pull_data->requested_chunks, chunk_data->checksum);
+  for (i = 0; i < waiters->len; i++)
+    {
+      FetchObjectData *fetch_data = waiters->pdata[i];
+
+      if (--fetch_data->n_pending_chunks == 0)
+        finish_chunked_content_fetch (fetch_data);
+    }
+
+ out:
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
+/* Ask for the chunks of a content object that we don't have yet;
+ * chunks already requested for another object are shared.
+ */
+static gboolean
+request_missing_chunks (OtPullData       *pull_data,
+                        FetchObjectData  *fetch_data,
+                        GCancellable     *cancellable,
+                        GError          **error)
+{
+  g_autoptr(GVariant) chunks = NULL;
+  gsize i, n;
+
+  if (!pull_data->chunk_index && !_OSTREE_REPO_MODE_IS_ARCHIVE (pull_data->repo->mode))
+    {
+      if (!_ostree_repo_load_chunk_index (pull_data->repo, &pull_data->chunk_index,
+                                          cancellable, error))
+        return FALSE;
+    }
+
+  chunks = g_variant_get_child_value (fetch_data->file_chunks, 2);
+  n = g_variant_n_children (chunks);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+      FetchChunkData *chunk_data;
+      guint64 size;
+
+      g_variant_get_child (chunks, i, "(@ayt)", &csum_v, &size);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (g_hash_table_contains (pull_data->fetched_chunks, checksum))
+        continue;
+
+      chunk_data = g_hash_table_lookup (pull_data->requested_chunks, checksum);
+      if (!chunk_data)
+        {
+          gboolean have_chunk;
+          char chunk_path[_OSTREE_LOOSE_PATH_MAX];
+          SoupURI *chunk_uri;
+
+          if (!_ostree_repo_has_chunk (pull_data->repo, checksum, &have_chunk,
+                                       cancellable, error))
+            return FALSE;
+          if (have_chunk
+              || (pull_data->chunk_index && g_hash_table_contains (pull_data->chunk_index, checksum)))
+            continue;
+
+          chunk_data = g_new0 (FetchChunkData, 1);
+          chunk_data->pull_data = pull_data;
+          chunk_data->checksum = g_strdup (checksum);
+          chunk_data->size = GUINT64_FROM_BE (size);
+          chunk_data->waiters = g_ptr_array_new ();
+          g_hash_table_insert (pull_data->requested_chunks, g_strdup (checksum), chunk_data);
+
+          g_debug ("queuing fetch of chunk %s", checksum);
+          pull_data->n_requested_chunks++;
+
+          _ostree_chunk_path (chunk_path, checksum);
+          chunk_uri = suburi_new (pull_data->base_uri, "objects", chunk_path, NULL);
+          /* Allow for compression making the data slightly larger */
+          _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, chunk_uri,
+                                                          chunk_data->size + chunk_data->size / 64 + 4096,
+                                                          OSTREE_REPO_PULL_CONTENT_PRIORITY,
+                                                          pull_data->cancellable,
+                                                          chunk_fetch_on_complete, chunk_data);
+          soup_uri_free (chunk_uri);
+        }
+
+      /* A chunk can occur more than once in a file */
+      if (chunk_data->waiters->len == 0
+          || chunk_data->waiters->pdata[chunk_data->waiters->len - 1] != fetch_data)
+        {
+          g_ptr_array_add (chunk_data->waiters, fetch_data);
+          fetch_data->n_pending_chunks++;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+file_chunks_fetch_on_complete (GObject        *object,
+                               GAsyncResult   *result,
+                               gpointer        user_data)
+{
+  FetchObjectData *fetch_data = user_data;
+  OtPullData *pull_data = fetch_data->pull_data;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+  g_autofree char *temp_path = NULL;
+  glnx_fd_close int fd = -1;
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
+  if (!temp_path)
+    goto out;
+
+  fd = openat (pull_data->tmpdir_dfd, temp_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+  (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0);
+
+  if (!ot_util_variant_map_fd (fd, 0, _OSTREE_FILE_CHUNKS_GVARIANT_FORMAT, FALSE,
+                               &fetch_data->file_chunks, error))
+    goto out;
+  if (!_ostree_file_chunks_validate (fetch_data->file_chunks, error))
+    goto out;
+
+  if (!request_missing_chunks (pull_data, fetch_data, pull_data->cancellable, error))
+    goto out;
+
+  /* Everything may already be here */
+  if (fetch_data->n_pending_chunks == 0)
+    finish_chunked_content_fetch (fetch_data);
+  return;
+
+ out:
+  pull_data->n_outstanding_content_fetches--;
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
+/* Objects of an unusable pack can only be fetched loose if the remote
+ * kept loose copies; say so, rather than just that one is missing.
+ */
+static void
+prefix_missing_loose_copy_error (FetchObjectData  *fetch_data,
+                                 GError          **error)
+{
+  if (fetch_data->from_unusable_pack
+      && g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_prefix_error (error, "Couldn't fetch from the remote pack, and the remote has no loose copy "
+                    "(it must not be repacked with --delete-loose to serve this client): ");
+}
+
+static void
+content_fetch_on_complete (GObject        *object,
+                           GAsyncResult   *result,
+                           gpointer        user_data) 
+{
+  FetchObjectData *fetch_data = user_data;
+  GError *local_error = NULL;
+  g_autofree char *temp_path = NULL;
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, &local_error);
+
+  if (!temp_path)
+    prefix_missing_loose_copy_error (fetch_data, &local_error);
+
+  process_fetched_content (fetch_data, temp_path, local_error);
+}
+
 static void
 on_metadata_written (GObject           *object,
                      GAsyncResult      *result,
@@ -708,18 +1135,19 @@ on_metadata_written (GObject           *object,
   check_outstanding_requests_handle_error (pull_data, local_error);
 }
 
+/* Handle a finished metadata fetch; @temp_path is the downloaded
+ * object in the tmpdir, or %NULL if @fetch_error is set.
+ */
 static void
-meta_fetch_on_complete (GObject           *object,
-                        GAsyncResult      *result,
-                        gpointer           user_data)
+process_fetched_metadata (FetchObjectData   *fetch_data,
+                          const char        *temp_path,
+                          GError            *fetch_error)
 {
-  FetchObjectData *fetch_data = user_data;
   OtPullData *pull_data = fetch_data->pull_data;
   g_autoptr(GVariant) metadata = NULL;
-  g_autofree char *temp_path = NULL;
   const char *checksum;
   OstreeObjectType objtype;
-  GError *local_error = NULL;
+  GError *local_error = fetch_error;
   GError **error = &local_error;
   gs_fd_close int fd = -1;
 
@@ -727,7 +1155,6 @@ meta_fetch_on_complete (GObject           *object,
   g_debug ("fetch of %s%s complete", ostree_object_to_string (checksum, objtype),
            fetch_data->is_detached_meta ? " (detached)" : "");
 
-  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
   if (!temp_path)
     {
       if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
@@ -809,15 +1236,74 @@ meta_fetch_on_complete (GObject           *object,
     }
 }
 
+static void
+meta_fetch_on_complete (GObject           *object,
+                        GAsyncResult      *result,
+                        gpointer           user_data)
+{
+  FetchObjectData *fetch_data = user_data;
+  GError *local_error = NULL;
+  g_autofree char *temp_path = NULL;
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, &local_error);
+  if (!temp_path)
+    prefix_missing_loose_copy_error (fetch_data, &local_error);
+  process_fetched_metadata (fetch_data, temp_path, local_error);
+}
+
 static void
 fetch_static_delta_data_free (gpointer  data)
 {
   FetchStaticDeltaData *fetch_data = data;
   g_free (fetch_data->expected_checksum);
   g_variant_unref (fetch_data->objects);
+  g_clear_pointer (&fetch_data->delta_data, (GDestroyNotify) g_bytes_unref);
   g_free (fetch_data);
 }
 
+static void on_static_delta_written (GObject           *object,
+                                     GAsyncResult      *result,
+                                     gpointer           user_data);
+
+/* Start executing fetched delta parts, up to the worker limit and
+ * while the sum of their uncompressed sizes stays under the
+ * repository's static delta memory limit.  A part is always started
+ * if nothing else is executing, so a single part larger than the
+ * limit still makes progress.  Fetches are not throttled; parts that
+ * can't start yet wait here as mmap()ed files.
+ */
+static void
+process_pending_deltapart_executions (OtPullData *pull_data)
+{
+  if (pull_data->caught_error)
+    return;
+
+  while (!g_queue_is_empty (&pull_data->pending_deltapart_executions))
+    {
+      FetchStaticDeltaData *fetch_data = g_queue_peek_head (&pull_data->pending_deltapart_executions);
+
+      if (pull_data->n_executing_deltaparts > 0 &&
+          (pull_data->n_executing_deltaparts >= pull_data->max_executing_deltaparts ||
+           pull_data->executing_deltapart_usize + fetch_data->usize >
+           pull_data->repo->static_delta_memory_limit))
+        break;
+
+      (void) g_queue_pop_head (&pull_data->pending_deltapart_executions);
+
+      pull_data->n_executing_deltaparts++;
+      pull_data->executing_deltapart_usize += fetch_data->usize;
+
+      _ostree_static_delta_part_execute_async (pull_data->repo,
+                                               fetch_data->objects,
+                                               fetch_data->delta_data,
+                                               fetch_data->usize,
+                                               pull_data->cancellable,
+                                               on_static_delta_written,
+                                               fetch_data);
+      g_clear_pointer (&fetch_data->delta_data, (GDestroyNotify) g_bytes_unref);
+    }
+}
+
 static void
 on_static_delta_written (GObject           *object,
                          GAsyncResult      *result,
@@ -834,11 +1320,15 @@ on_static_delta_written (GObject           *object,
     goto out;
 
  out:
+  g_assert (pull_data->n_executing_deltaparts > 0);
+  pull_data->n_executing_deltaparts--;
+  pull_data->executing_deltapart_usize -= fetch_data->usize;
   g_assert (pull_data->n_outstanding_deltapart_write_requests > 0);
   pull_data->n_outstanding_deltapart_write_requests--;
   check_outstanding_requests_handle_error (pull_data, local_error);
   /* Always free state */
   fetch_static_delta_data_free (fetch_data);
+  process_pending_deltapart_executions (pull_data);
 }
 
 static void
@@ -890,12 +1380,11 @@ static_deltapart_fetch_on_complete (GObject           *object,
 
   {
     GMappedFile *mfile = NULL;
-    g_autoptr(GBytes) delta_data = NULL;
 
     mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
     if (!mfile)
       goto out;
-    delta_data = g_mapped_file_get_bytes (mfile);
+    fetch_data->delta_data = g_mapped_file_get_bytes (mfile);
     g_mapped_file_unref (mfile);
 
     /* Unlink now while we're holding an open fd, so that on success
@@ -904,13 +1393,9 @@ static_deltapart_fetch_on_complete (GObject           *object,
      */
     (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0); 
 
-    _ostree_static_delta_part_execute_async (pull_data->repo,
-                                             fetch_data->objects,
-                                             delta_data,
-                                             pull_data->cancellable,
-                                             on_static_delta_written,
-                                             fetch_data);
+    g_queue_push_tail (&pull_data->pending_deltapart_executions, fetch_data);
     pull_data->n_outstanding_deltapart_write_requests++;
+    process_pending_deltapart_executions (pull_data);
   }
 
  out:
@@ -1075,18 +1560,16 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
                             GError            **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GVariant) object = NULL;
   g_autofree char *tmp_checksum = NULL;
   gboolean is_requested;
   gboolean is_stored;
 
-  tmp_checksum = ostree_checksum_from_bytes (csum);
-  object = ostree_object_name_serialize (tmp_checksum, objtype);
-
-  if (g_hash_table_lookup (pull_data->scanned_metadata, object))
+  if (_ostree_object_set_contains (pull_data->scanned_metadata, csum, objtype))
     return TRUE;
 
-  is_requested = g_hash_table_lookup (pull_data->requested_metadata, tmp_checksum) != NULL;
+  tmp_checksum = ostree_checksum_from_bytes (csum);
+
+  is_requested = _ostree_object_set_contains (pull_data->requested_metadata, csum, objtype);
   if (!ostree_repo_has_object (pull_data->repo, objtype, tmp_checksum, &is_stored,
                                cancellable, error))
     goto out;
@@ -1103,10 +1586,9 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
 
   if (!is_stored && !is_requested)
     {
-      char *duped_checksum = g_strdup (tmp_checksum);
       gboolean do_fetch_detached;
 
-      g_hash_table_insert (pull_data->requested_metadata, duped_checksum, duped_checksum);
+      (void) _ostree_object_set_add (pull_data->requested_metadata, csum, objtype);
 
       do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT);
       enqueue_one_object_request (pull_data, tmp_checksum, objtype, do_fetch_detached, FALSE);
@@ -1169,7 +1651,7 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
               break;
             }
         }
-      g_hash_table_insert (pull_data->scanned_metadata, g_variant_ref (object), object);
+      (void) _ostree_object_set_add (pull_data->scanned_metadata, csum, objtype);
       pull_data->n_scanned_metadata++;
     }
 
@@ -1178,37 +1660,727 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
   return ret;
 }
 
-static void
-enqueue_one_object_request (OtPullData        *pull_data,
-                            const char        *checksum,
-                            OstreeObjectType   objtype,
-                            gboolean           is_detached_meta,
-                            gboolean           object_is_stored)
+static guint64
+get_expected_max_size (OtPullData        *pull_data,
+                       FetchObjectData   *fetch_data)
 {
-  SoupURI *obj_uri = NULL;
-  gboolean is_meta;
-  FetchObjectData *fetch_data;
-  g_autofree char *objpath = NULL;
+  const char *checksum;
+  OstreeObjectType objtype;
   guint64 *expected_max_size_p;
-  guint64 expected_max_size;
 
-  g_debug ("queuing fetch of %s.%s%s", checksum,
-           ostree_object_type_to_string (objtype),
-           is_detached_meta ? " (detached)" : "");
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
 
-  if (is_detached_meta)
-    {
-      char buf[_OSTREE_LOOSE_PATH_MAX];
-      _ostree_loose_path_with_suffix (buf, checksum, OSTREE_OBJECT_TYPE_COMMIT,
-                                      pull_data->remote_mode, "meta");
-      obj_uri = suburi_new (pull_data->base_uri, "objects", buf, NULL);
-    }
+  expected_max_size_p = fetch_data->is_detached_meta ? NULL : g_hash_table_lookup (pull_data->expected_commit_sizes, checksum);
+  if (expected_max_size_p)
+    return *expected_max_size_p;
+  else if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    return OSTREE_MAX_METADATA_SIZE;
+  else
+    return 0;
+}
+
+static void
+fetch_object_data_free (FetchObjectData *fetch_data)
+{
+  g_variant_unref (fetch_data->object);
+  g_free (fetch_data);
+}
+
+static void start_loose_object_fetch (OtPullData        *pull_data,
+                                      FetchObjectData   *fetch_data);
+
+static gboolean
+load_chunked_content_at (OtPullData   *pull_data,
+                         int           dfd,
+                         const char   *path,
+                         GError      **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  GMappedFile *mfile = NULL;
+  g_autoptr(GBytes) data = NULL;
+
+  fd = openat (dfd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+  data = g_mapped_file_get_bytes (mfile);
+
+  ret = _ostree_chunked_content_parse (data, pull_data->chunked_content_checksum,
+                                       pull_data->summary_chunked_content, error);
+ out:
+  g_clear_pointer (&mfile, (GDestroyNotify) g_mapped_file_unref);
+  return ret;
+}
+
+/* The list is loaded, or known to be unavailable; go on with the
+ * objects that were waiting for it.
+ */
+static void
+finish_chunked_content_load (OtPullData *pull_data)
+{
+  g_autoptr(GPtrArray) awaiting = pull_data->awaiting_chunked_content;
+  guint i;
+
+  g_clear_pointer (&pull_data->chunked_content_uri, (GDestroyNotify) soup_uri_free);
+  pull_data->loading_chunked_content = FALSE;
+
+  pull_data->awaiting_chunked_content =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) fetch_object_data_free);
+  g_ptr_array_set_free_func (awaiting, NULL);
+
+  for (i = 0; i < awaiting->len; i++)
+    start_loose_object_fetch (pull_data, awaiting->pdata[i]);
+}
+
+static void
+chunked_content_fetch_on_complete (GObject        *object,
+                                   GAsyncResult   *result,
+                                   gpointer        user_data)
+{
+  OtPullData *pull_data = user_data;
+  g_autofree char *temp_path = NULL;
+  GError *local_error = NULL;
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result,
+                                                               &local_error);
+  if (!temp_path)
+    {
+      /* E.g. a mirror which copied the summary; files are then
+       * just fetched whole.
+       */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_debug ("chunked content list %s not found, ignoring",
+                   soup_uri_get_path (pull_data->chunked_content_uri));
+          g_clear_error (&local_error);
+        }
+    }
+  else
+    {
+      if (load_chunked_content_at (pull_data, pull_data->tmpdir_dfd, temp_path,
+                                   &local_error)
+          && pull_data->chunked_content_cache_dfd != -1
+          && renameat (pull_data->tmpdir_dfd, temp_path,
+                       pull_data->chunked_content_cache_dfd,
+                       pull_data->chunked_content_name) == 0)
+        g_clear_pointer (&temp_path, g_free);
+      if (temp_path)
+        (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0);
+    }
+
+  if (local_error)
+    {
+      check_outstanding_requests_handle_error (pull_data, local_error);
+      return;
+    }
+
+  finish_chunked_content_load (pull_data);
+}
+
+/* Load the list of chunked content from the cache, or start fetching
+ * it; content objects wait in awaiting_chunked_content until it is
+ * available.
+ */
+static void
+start_chunked_content_load (OtPullData *pull_data)
+{
+  pull_data->loading_chunked_content = TRUE;
+
+  if (pull_data->chunked_content_cache_dfd != -1)
+    {
+      GError *local_error = NULL;
+
+      if (load_chunked_content_at (pull_data, pull_data->chunked_content_cache_dfd,
+                                   pull_data->chunked_content_name, &local_error))
+        {
+          finish_chunked_content_load (pull_data);
+          return;
+        }
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_debug ("Ignoring cached chunked content list %s: %s",
+                   pull_data->chunked_content_name, local_error->message);
+          (void) unlinkat (pull_data->chunked_content_cache_dfd,
+                           pull_data->chunked_content_name, 0);
+        }
+      g_clear_error (&local_error);
+      g_hash_table_remove_all (pull_data->summary_chunked_content);
+    }
+
+  _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, pull_data->chunked_content_uri,
+                                                  OSTREE_MAX_METADATA_SIZE,
+                                                  OSTREE_REPO_PULL_METADATA_PRIORITY,
+                                                  pull_data->cancellable,
+                                                  chunked_content_fetch_on_complete, pull_data);
+}
+
+static void
+start_loose_object_fetch (OtPullData        *pull_data,
+                          FetchObjectData   *fetch_data)
+{
+  SoupURI *obj_uri = NULL;
+  gboolean is_meta;
+  g_autofree char *objpath = NULL;
+  const char *checksum;
+  OstreeObjectType objtype;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+
+  /* Only now that a file is missing is the list worth having */
+  if (objtype == OSTREE_OBJECT_TYPE_FILE && pull_data->chunked_content_uri)
+    {
+      g_ptr_array_add (pull_data->awaiting_chunked_content, fetch_data);
+      if (!pull_data->loading_chunked_content)
+        start_chunked_content_load (pull_data);
+      return;
+    }
+
+  /* Fetch only the chunks we don't have of files the remote chunked */
+  if (objtype == OSTREE_OBJECT_TYPE_FILE
+      && g_hash_table_contains (pull_data->summary_chunked_content, checksum))
+    {
+      char file_chunks_path[_OSTREE_LOOSE_PATH_MAX];
+
+      _ostree_file_chunks_path (file_chunks_path, checksum);
+      obj_uri = suburi_new (pull_data->base_uri, "objects", file_chunks_path, NULL);
+      _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri,
+                                                      OSTREE_MAX_METADATA_SIZE,
+                                                      OSTREE_REPO_PULL_CONTENT_PRIORITY,
+                                                      pull_data->cancellable,
+                                                      file_chunks_fetch_on_complete, fetch_data);
+      soup_uri_free (obj_uri);
+      return;
+    }
+
+  if (fetch_data->is_detached_meta)
+    {
+      char buf[_OSTREE_LOOSE_PATH_MAX];
+      _ostree_loose_path_with_suffix (buf, checksum, OSTREE_OBJECT_TYPE_COMMIT,
+                                      pull_data->remote_mode, "meta");
+      obj_uri = suburi_new (pull_data->base_uri, "objects", buf, NULL);
+    }
   else
     {
       objpath = _ostree_get_relative_object_path (checksum, objtype, TRUE);
       obj_uri = suburi_new (pull_data->base_uri, objpath, NULL);
     }
 
+  is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
+  _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri,
+                                                  get_expected_max_size (pull_data, fetch_data),
+                                                  is_meta ? OSTREE_REPO_PULL_METADATA_PRIORITY
+                                                          : OSTREE_REPO_PULL_CONTENT_PRIORITY,
+                                                  pull_data->cancellable,
+                                                  is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
+  soup_uri_free (obj_uri);
+}
+
+/* Objects found in a remote pack are collected per pack and fetched
+ * with multi-range requests against its data file.  A batch is sent
+ * once it is large enough, or when the main loop goes idle.
+ */
+#define PACK_BATCH_MAX_OBJECTS (128)
+#define PACK_BATCH_MAX_SIZE (4 * 1024 * 1024)
+/* Merge ranges separated by less than this, rather than paying for
+ * another multipart section.
+ */
+#define PACK_BATCH_MAX_GAP (4096)
+/* Responses are held in memory, so bound how many are in flight */
+#define PACK_BATCH_MAX_OUTSTANDING (8)
+
+typedef struct {
+  OtPullData *pull_data;
+  char *checksum;
+  OstreeRepoPack *pack; /* NULL until the index is loaded */
+  gboolean is_meta;
+  char *index_name; /* In the index cache */
+  SoupURI *index_uri;
+  SoupURI *data_uri;
+  gboolean disabled;
+  GPtrArray *pending; /* PackedObjectRequest, not yet in a batch */
+  guint64 pending_size;
+} RemotePack;
+
+typedef struct {
+  FetchObjectData *fetch_data;
+  guint64 offset;
+  guint64 size;
+  guint range_index;
+} PackedObjectRequest;
+
+typedef struct {
+  OtPullData *pull_data;
+  RemotePack *remote_pack;
+  GPtrArray *objects; /* PackedObjectRequest */
+  SoupRange *ranges;
+  guint n_ranges;
+} PackBatch;
+
+static void
+packed_object_request_free (PackedObjectRequest *req)
+{
+  if (req->fetch_data)
+    {
+      g_variant_unref (req->fetch_data->object);
+      g_free (req->fetch_data);
+    }
+  g_free (req);
+}
+
+static void
+remote_pack_free (RemotePack *remote_pack)
+{
+  g_free (remote_pack->checksum);
+  if (remote_pack->pack)
+    _ostree_repo_pack_free (remote_pack->pack);
+  g_free (remote_pack->index_name);
+  soup_uri_free (remote_pack->index_uri);
+  soup_uri_free (remote_pack->data_uri);
+  g_ptr_array_unref (remote_pack->pending);
+  g_free (remote_pack);
+}
+
+static void
+pack_batch_free (PackBatch *batch)
+{
+  g_ptr_array_unref (batch->objects);
+  g_free (batch->ranges);
+  g_free (batch);
+}
+
+static int
+compare_packed_object_offsets (gconstpointer a,
+                               gconstpointer b)
+{
+  const PackedObjectRequest *req_a = *(const PackedObjectRequest**)a;
+  const PackedObjectRequest *req_b = *(const PackedObjectRequest**)b;
+
+  if (req_a->offset < req_b->offset)
+    return -1;
+  return req_a->offset > req_b->offset ? 1 : 0;
+}
+
+static void pack_batch_fetch_on_complete (GObject        *object,
+                                          GAsyncResult   *result,
+                                          gpointer        user_data);
+
+static void
+process_pending_pack_batches (OtPullData *pull_data)
+{
+  if (pull_data->caught_error)
+    return;
+
+  while (pull_data->n_outstanding_pack_batches < PACK_BATCH_MAX_OUTSTANDING &&
+         !g_queue_is_empty (&pull_data->pending_pack_batches))
+    {
+      PackBatch *batch = g_queue_pop_head (&pull_data->pending_pack_batches);
+      guint i;
+
+      g_ptr_array_sort (batch->objects, compare_packed_object_offsets);
+
+      batch->ranges = g_new (SoupRange, batch->objects->len);
+      batch->n_ranges = 0;
+      for (i = 0; i < batch->objects->len; i++)
+        {
+          PackedObjectRequest *req = batch->objects->pdata[i];
+          goffset start = req->offset;
+          goffset end = req->offset + req->size - 1;
+
+          if (batch->n_ranges > 0 &&
+              start <= batch->ranges[batch->n_ranges - 1].end + 1 + PACK_BATCH_MAX_GAP)
+            {
+              SoupRange *prev = &batch->ranges[batch->n_ranges - 1];
+              prev->end = MAX (prev->end, end);
+            }
+          else
+            {
+              batch->ranges[batch->n_ranges].start = start;
+              batch->ranges[batch->n_ranges].end = end;
+              batch->n_ranges++;
+            }
+          req->range_index = batch->n_ranges - 1;
+        }
+
+      g_debug ("fetching %u objects in %u ranges from pack %s",
+               batch->objects->len, batch->n_ranges,
+               soup_uri_get_path (batch->remote_pack->data_uri));
+
+      pull_data->n_outstanding_pack_batches++;
+      _ostree_fetcher_request_uri_ranges_async (pull_data->fetcher,
+                                                batch->remote_pack->data_uri,
+                                                batch->ranges, batch->n_ranges,
+                                                pull_data->cancellable,
+                                                pack_batch_fetch_on_complete,
+                                                batch);
+    }
+}
+
+static void
+queue_pack_batch (OtPullData   *pull_data,
+                  RemotePack   *remote_pack)
+{
+  PackBatch *batch = g_new0 (PackBatch, 1);
+
+  batch->pull_data = pull_data;
+  batch->remote_pack = remote_pack;
+  batch->objects = remote_pack->pending;
+  remote_pack->pending = g_ptr_array_new_with_free_func ((GDestroyNotify) packed_object_request_free);
+  remote_pack->pending_size = 0;
+
+  g_queue_push_tail (&pull_data->pending_pack_batches, batch);
+  process_pending_pack_batches (pull_data);
+}
+
+static gboolean
+flush_pack_batches (gpointer user_data)
+{
+  OtPullData *pull_data = user_data;
+  guint i;
+
+  g_clear_pointer (&pull_data->pack_flush_source, (GDestroyNotify) g_source_unref);
+
+  for (i = 0; i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *remote_pack = pull_data->remote_packs->pdata[i];
+
+      if (remote_pack->pending->len > 0)
+        queue_pack_batch (pull_data, remote_pack);
+    }
+
+  return FALSE;
+}
+
+static gboolean enqueue_packed_object_request (OtPullData        *pull_data,
+                                               FetchObjectData   *fetch_data);
+
+/* Map the index at @path in @dfd and check it against @remote_pack */
+static OstreeRepoPack *
+load_remote_pack_index_at (RemotePack    *remote_pack,
+                           int            dfd,
+                           const char    *path,
+                           GError       **error)
+{
+  OstreeRepoPack *ret = NULL;
+  glnx_fd_close int fd = -1;
+  GMappedFile *mfile = NULL;
+  g_autoptr(GBytes) index_bytes = NULL;
+
+  fd = openat (dfd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+  index_bytes = g_mapped_file_get_bytes (mfile);
+
+  ret = _ostree_repo_pack_new_from_index (remote_pack->is_meta, remote_pack->checksum,
+                                          index_bytes, error);
+ out:
+  g_clear_pointer (&mfile, (GDestroyNotify) g_mapped_file_unref);
+  return ret;
+}
+
+static void
+pack_index_fetch_on_complete (GObject        *object,
+                              GAsyncResult   *result,
+                              gpointer        user_data)
+{
+  RemotePack *remote_pack = user_data;
+  OtPullData *pull_data = remote_pack->pull_data;
+  g_autofree char *temp_path = NULL;
+  GError *local_error = NULL;
+  guint i;
+
+  g_assert (pull_data->n_loading_pack_indexes > 0);
+  pull_data->n_loading_pack_indexes--;
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result,
+                                                               &local_error);
+  if (!temp_path)
+    {
+      /* E.g. the summary is stale after a repack */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_debug ("pack index %s not found, ignoring",
+                   soup_uri_get_path (remote_pack->index_uri));
+          g_clear_error (&local_error);
+        }
+    }
+  else
+    {
+      remote_pack->pack = load_remote_pack_index_at (remote_pack, pull_data->tmpdir_dfd,
+                                                     temp_path, &local_error);
+
+      /* Indexes are named by their checksum, so a cached one never
+       * goes stale; failing to keep it only costs a later fetch.
+       */
+      if (remote_pack->pack && pull_data->pack_index_cache_dfd != -1
+          && renameat (pull_data->tmpdir_dfd, temp_path,
+                       pull_data->pack_index_cache_dfd, remote_pack->index_name) == 0)
+        g_clear_pointer (&temp_path, g_free);
+      if (temp_path)
+        (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0);
+    }
+
+  if (local_error)
+    {
+      check_outstanding_requests_handle_error (pull_data, local_error);
+      return;
+    }
+
+  if (pull_data->n_loading_pack_indexes == 0)
+    {
+      g_autoptr(GPtrArray) awaiting = pull_data->awaiting_pack_indexes;
+
+      pull_data->awaiting_pack_indexes =
+        g_ptr_array_new_with_free_func ((GDestroyNotify) fetch_object_data_free);
+      g_ptr_array_set_free_func (awaiting, NULL);
+
+      for (i = 0; i < awaiting->len; i++)
+        {
+          FetchObjectData *fetch_data = awaiting->pdata[i];
+
+          if (!enqueue_packed_object_request (pull_data, fetch_data))
+            start_loose_object_fetch (pull_data, fetch_data);
+        }
+    }
+}
+
+/* Load the index of each remote pack from the cache, or start
+ * fetching it; objects wait in awaiting_pack_indexes until all of
+ * the fetches are done.
+ */
+static void
+start_pack_index_loads (OtPullData *pull_data)
+{
+  guint i;
+
+  pull_data->pack_indexes_requested = TRUE;
+
+  for (i = 0; i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *remote_pack = pull_data->remote_packs->pdata[i];
+
+      if (pull_data->pack_index_cache_dfd != -1)
+        {
+          GError *local_error = NULL;
+
+          remote_pack->pack = load_remote_pack_index_at (remote_pack,
+                                                         pull_data->pack_index_cache_dfd,
+                                                         remote_pack->index_name,
+                                                         &local_error);
+          if (remote_pack->pack)
+            continue;
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_debug ("Ignoring cached pack index %s: %s",
+                       remote_pack->index_name, local_error->message);
+              (void) unlinkat (pull_data->pack_index_cache_dfd, remote_pack->index_name, 0);
+            }
+          g_clear_error (&local_error);
+        }
+
+      pull_data->n_loading_pack_indexes++;
+      _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, remote_pack->index_uri,
+                                                      OSTREE_MAX_METADATA_SIZE,
+                                                      OSTREE_REPO_PULL_METADATA_PRIORITY,
+                                                      pull_data->cancellable,
+                                                      pack_index_fetch_on_complete, remote_pack);
+    }
+}
+
+/* Returns %TRUE if the object was queued for fetching from a pack */
+static gboolean
+enqueue_packed_object_request (OtPullData        *pull_data,
+                               FetchObjectData   *fetch_data)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+  gboolean is_meta;
+  guint64 expected_max_size;
+  guint i;
+
+  if (!pull_data->remote_packs || fetch_data->is_detached_meta)
+    return FALSE;
+
+  /* Only now that an object is missing are the indexes worth having */
+  if (!pull_data->pack_indexes_requested)
+    start_pack_index_loads (pull_data);
+  if (pull_data->n_loading_pack_indexes > 0)
+    {
+      g_ptr_array_add (pull_data->awaiting_pack_indexes, fetch_data);
+      return TRUE;
+    }
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+  is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
+  expected_max_size = get_expected_max_size (pull_data, fetch_data);
+
+  for (i = 0; i < pull_data->remote_packs->len; i++)
+    {
+      RemotePack *remote_pack = pull_data->remote_packs->pdata[i];
+      PackedObjectRequest *req;
+      guint64 offset, size;
+
+      if (remote_pack->pack == NULL || remote_pack->disabled
+          || remote_pack->is_meta != is_meta)
+        continue;
+
+      if (!_ostree_repo_pack_lookup (remote_pack->pack, objtype, checksum,
+                                     &offset, &size))
+        continue;
+
+      /* Leave anything odd to the loose path, which enforces limits */
+      if (size == 0 || offset < _OSTREE_PACK_DATA_HEADER_LEN
+          || (expected_max_size > 0 && size > expected_max_size))
+        continue;
+
+      req = g_new0 (PackedObjectRequest, 1);
+      req->fetch_data = fetch_data;
+      req->offset = offset;
+      req->size = size;
+      g_ptr_array_add (remote_pack->pending, req);
+      remote_pack->pending_size += size;
+
+      if (remote_pack->pending->len >= PACK_BATCH_MAX_OBJECTS ||
+          remote_pack->pending_size >= PACK_BATCH_MAX_SIZE)
+        queue_pack_batch (pull_data, remote_pack);
+      else if (!pull_data->pack_flush_source)
+        {
+          pull_data->pack_flush_source = g_idle_source_new ();
+          g_source_set_callback (pull_data->pack_flush_source, flush_pack_batches, pull_data, NULL);
+          g_source_attach (pull_data->pack_flush_source, pull_data->main_context);
+        }
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+write_packed_object (OtPullData    *pull_data,
+                     GBytes        *data,
+                     char         **out_temp_path,
+                     GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autofree char *temp_path = NULL;
+  g_autoptr(GOutputStream) out = NULL;
+  gsize bytes_written;
+
+  if (!gs_file_open_in_tmpdir_at (pull_data->tmpdir_dfd, 0644, &temp_path, &out,
+                                  pull_data->cancellable, error))
+    goto out;
+
+  if (!g_output_stream_write_all (out, g_bytes_get_data (data, NULL), g_bytes_get_size (data),
+                                  &bytes_written, pull_data->cancellable, error))
+    goto out;
+
+  if (!g_output_stream_close (out, pull_data->cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_temp_path, &temp_path);
+ out:
+  if (!ret && temp_path)
+    (void) unlinkat (pull_data->tmpdir_dfd, temp_path, 0);
+  return ret;
+}
+
+static void
+pack_batch_fetch_on_complete (GObject        *object,
+                              GAsyncResult   *result,
+                              gpointer        user_data)
+{
+  PackBatch *batch = user_data;
+  OtPullData *pull_data = batch->pull_data;
+  g_autoptr(GPtrArray) parts = NULL;
+  GError *local_error = NULL;
+  guint i;
+
+  g_assert (pull_data->n_outstanding_pack_batches > 0);
+  pull_data->n_outstanding_pack_batches--;
+
+  parts = _ostree_fetcher_request_uri_ranges_finish ((OstreeFetcher*)object, result, &local_error);
+
+  if (!parts && !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      /* Stop using this pack, and get the objects individually */
+      g_debug ("Fetching from pack %s failed, falling back to loose objects: %s",
+               soup_uri_get_path (batch->remote_pack->data_uri), local_error->message);
+      g_clear_error (&local_error);
+      batch->remote_pack->disabled = TRUE;
+    }
+
+  for (i = 0; i < batch->objects->len; i++)
+    {
+      PackedObjectRequest *req = batch->objects->pdata[i];
+      FetchObjectData *fetch_data = req->fetch_data;
+      const char *checksum;
+      OstreeObjectType objtype;
+      g_autofree char *temp_path = NULL;
+      GError *object_error = NULL;
+
+      ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+
+      /* Ownership of fetch_data passes on below */
+      req->fetch_data = NULL;
+
+      if (local_error)
+        object_error = g_error_copy (local_error);
+      else if (!parts)
+        {
+          fetch_data->from_unusable_pack = TRUE;
+          start_loose_object_fetch (pull_data, fetch_data);
+          continue;
+        }
+      else
+        {
+          SoupRange *range = &batch->ranges[req->range_index];
+          g_autoptr(GBytes) data =
+            g_bytes_new_from_bytes (parts->pdata[req->range_index],
+                                    req->offset - range->start, req->size);
+
+          (void) write_packed_object (pull_data, data, &temp_path, &object_error);
+        }
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        process_fetched_metadata (fetch_data, temp_path, object_error);
+      else
+        process_fetched_content (fetch_data, temp_path, object_error);
+    }
+
+  g_clear_error (&local_error);
+  pack_batch_free (batch);
+  process_pending_pack_batches (pull_data);
+}
+
+static void
+enqueue_one_object_request (OtPullData        *pull_data,
+                            const char        *checksum,
+                            OstreeObjectType   objtype,
+                            gboolean           is_detached_meta,
+                            gboolean           object_is_stored)
+{
+  gboolean is_meta;
+  FetchObjectData *fetch_data;
+
+  g_debug ("queuing fetch of %s.%s%s", checksum,
+           ostree_object_type_to_string (objtype),
+           is_detached_meta ? " (detached)" : "");
+
   is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
   if (is_meta)
     {
@@ -1226,21 +2398,8 @@ enqueue_one_object_request (OtPullData        *pull_data,
   fetch_data->is_detached_meta = is_detached_meta;
   fetch_data->object_is_stored = object_is_stored;
 
-  expected_max_size_p = is_detached_meta ? NULL : g_hash_table_lookup (pull_data->expected_commit_sizes, checksum);
-  if (expected_max_size_p)
-    expected_max_size = *expected_max_size_p;
-  else if (is_meta)
-    expected_max_size = OSTREE_MAX_METADATA_SIZE;
-  else
-    expected_max_size = 0;
-
-  _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri,
-                                                  expected_max_size,
-                                                  is_meta ? OSTREE_REPO_PULL_METADATA_PRIORITY
-                                                          : OSTREE_REPO_PULL_CONTENT_PRIORITY,
-                                                  pull_data->cancellable,
-                                                  is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
-  soup_uri_free (obj_uri);
+  if (!enqueue_packed_object_request (pull_data, fetch_data))
+    start_loose_object_fetch (pull_data, fetch_data);
 }
 
 static gboolean
@@ -1273,17 +2432,22 @@ load_remote_repo_config (OtPullData    *pull_data,
   return ret;
 }
 
+/* If @zstd is set, fetch the superblock of the zstd-compressed
+ * variant of the delta instead.
+ */
 static gboolean
 request_static_delta_superblock_sync (OtPullData  *pull_data,
                                       const char  *from_revision,
                                       const char  *to_revision,
+                                      gboolean     zstd,
                                       GVariant   **out_delta_superblock,
                                       GCancellable *cancellable,
                                       GError     **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GVariant) ret_delta_superblock = NULL;
-  g_autofree char *delta_name =
+  g_autofree char *delta_name = zstd ?
+    _ostree_get_relative_static_delta_zstd_superblock_path (from_revision, to_revision) :
     _ostree_get_relative_static_delta_superblock_path (from_revision, to_revision);
   g_autoptr(GBytes) delta_superblock_data = NULL;
   g_autoptr(GBytes) delta_meta_data = NULL;
@@ -1292,7 +2456,7 @@ request_static_delta_superblock_sync (OtPullData  *pull_data,
   
   target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
   
-  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE, FALSE,
                                        &delta_superblock_data,
                                        pull_data->cancellable, error))
     goto out;
@@ -1313,7 +2477,8 @@ request_static_delta_superblock_sync (OtPullData  *pull_data,
           goto out;
 
         delta = g_strconcat (from_revision ? from_revision : "", from_revision ? "-" : "", to_revision, NULL);
-        summary_csum = g_hash_table_lookup (pull_data->summary_deltas_checksums, delta);
+        summary_csum = g_hash_table_lookup (zstd ? pull_data->summary_zstd_deltas_checksums :
+                                            pull_data->summary_deltas_checksums, delta);
 
         /* At this point we've GPG verified the data, so in theory
          * could trust that they provided the right data, but let's
@@ -1378,24 +2543,21 @@ process_one_static_delta_fallback (OtPullData   *pull_data,
     { 
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
         {
-          if (!g_hash_table_lookup (pull_data->requested_metadata, checksum))
+          if (_ostree_object_set_add (pull_data->requested_metadata,
+                                      ostree_checksum_bytes_peek (csum_v), objtype))
             {
               gboolean do_fetch_detached;
-              g_hash_table_insert (pull_data->requested_metadata, checksum, checksum);
               
               do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT);
               enqueue_one_object_request (pull_data, checksum, objtype, do_fetch_detached, FALSE);
-              checksum = NULL;  /* Transfer ownership */
             }
         }
       else
         {
-          if (!g_hash_table_lookup (pull_data->requested_content, checksum))
-            {
-              g_hash_table_insert (pull_data->requested_content, checksum, checksum);
-              enqueue_one_object_request (pull_data, checksum, OSTREE_OBJECT_TYPE_FILE, FALSE, FALSE);
-              checksum = NULL;  /* Transfer ownership */
-            }
+          if (_ostree_object_set_add (pull_data->requested_content,
+                                      ostree_checksum_bytes_peek (csum_v),
+                                      OSTREE_OBJECT_TYPE_FILE))
+            enqueue_one_object_request (pull_data, checksum, OSTREE_OBJECT_TYPE_FILE, FALSE, FALSE);
         }
     }
 
@@ -1404,11 +2566,33 @@ process_one_static_delta_fallback (OtPullData   *pull_data,
   return ret;
 }
 
+static gboolean
+static_delta_parts_supported (GVariant *delta_superblock)
+{
+  g_autoptr(GVariant) headers = NULL;
+  guint i, n;
+
+  /* Parsing OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT */
+  headers = g_variant_get_child_value (delta_superblock, 6);
+  n = g_variant_n_children (headers);
+  for (i = 0; i < n; i++)
+    {
+      guint32 version;
+
+      g_variant_get_child (headers, i, "(u@aytt@ay)", &version, NULL, NULL, NULL, NULL);
+      if (version > OSTREE_DELTAPART_MAX_VERSION)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 process_one_static_delta (OtPullData   *pull_data,
                           const char   *from_revision,
                           const char   *to_revision,
                           GVariant     *delta_superblock,
+                          gboolean      zstd,
                           GCancellable *cancellable,
                           GError      **error)
 {
@@ -1487,7 +2671,7 @@ process_one_static_delta (OtPullData   *pull_data,
       header = g_variant_get_child_value (headers, i);
       g_variant_get (header, "(u@aytt@ay)", &version, &csum_v, &size, &usize, &objects);
 
-      if (version > OSTREE_DELTAPART_VERSION)
+      if (version > OSTREE_DELTAPART_MAX_VERSION)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Delta part has too new version %u", version);
@@ -1519,8 +2703,12 @@ process_one_static_delta (OtPullData   *pull_data,
       fetch_data->pull_data = pull_data;
       fetch_data->objects = g_variant_ref (objects);
       fetch_data->expected_checksum = ostree_checksum_from_bytes_v (csum_v);
+      fetch_data->usize = usize;
 
-      deltapart_path = _ostree_get_relative_static_delta_part_path (from_revision, to_revision, i);
+      if (zstd)
+        deltapart_path = _ostree_get_relative_static_delta_zstd_part_path (from_revision, to_revision, i);
+      else
+        deltapart_path = _ostree_get_relative_static_delta_part_path (from_revision, to_revision, i);
 
       target_uri = suburi_new (pull_data->base_uri, deltapart_path, NULL);
       _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, target_uri, size,
@@ -1559,6 +2747,74 @@ validate_variant_is_csum (GVariant       *csum,
   return ret;
 }
 
+/* Fill @checksums from @deltas, a summary map from static delta names
+ * to superblock checksums, if it is not %NULL.
+ */
+static gboolean
+load_summary_deltas_checksums (GVariant       *deltas,
+                               GHashTable     *checksums,
+                               GError        **error)
+{
+  gboolean ret = FALSE;
+  gsize i, n;
+
+  n = deltas ? g_variant_n_children (deltas) : 0;
+  for (i = 0; i < n; i++)
+    {
+      const char *delta;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autoptr(GVariant) ref = g_variant_get_child_value (deltas, i);
+
+      g_variant_get_child (ref, 0, "&s", &delta);
+      g_variant_get_child (ref, 1, "v", &csum_v);
+
+      if (!validate_variant_is_csum (csum_v, error))
+        goto out;
+
+      g_hash_table_insert (checksums, g_strdup (delta),
+                           g_memdup (ostree_checksum_bytes_peek (csum_v), 32));
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Note the list of chunked content named by the summary value
+ * @chunked_content, if it is not %NULL.  It is only loaded, from the
+ * cache or the remote, once a content object turns out to be missing;
+ * see start_chunked_content_load().
+ */
+static gboolean
+load_summary_chunked_content (OtPullData  *pull_data,
+                              GVariant    *chunked_content,
+                              GError     **error)
+{
+  g_autoptr(GHashTable) keep_names = NULL;
+  g_autofree char *index_path = NULL;
+
+  if (!chunked_content)
+    return TRUE;
+
+  if (!validate_variant_is_csum (chunked_content, error))
+    {
+      g_prefix_error (error, "Invalid %s in summary: ", OSTREE_SUMMARY_CHUNKED_CONTENT);
+      return FALSE;
+    }
+
+  pull_data->chunked_content_checksum = ostree_checksum_from_bytes_v (chunked_content);
+  index_path = _ostree_get_relative_chunked_content_path (pull_data->chunked_content_checksum);
+  pull_data->chunked_content_name = g_path_get_basename (index_path);
+  pull_data->chunked_content_uri = suburi_new (pull_data->base_uri, "objects", index_path, NULL);
+
+  keep_names = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_add (keep_names, pull_data->chunked_content_name);
+  pull_data->chunked_content_cache_dfd =
+    open_remote_index_cache (pull_data, "state/chunked-content-indexes", keep_names);
+
+  return TRUE;
+}
+
 /* documented in ostree-repo.c */
 gboolean
 ostree_repo_pull (OstreeRepo               *self,
@@ -1599,6 +2855,122 @@ ostree_repo_pull_one_dir (OstreeRepo               *self,
                                         progress, cancellable, error);
 }
 
+/* Open @cache_dir/$remote, where indexes fetched from @pull_data's
+ * remote are kept by name, and drop those not in @keep_names.  The
+ * cache is only an optimization, so this just returns -1 if something
+ * goes wrong.
+ */
+static int
+open_remote_index_cache (OtPullData  *pull_data,
+                         const char  *cache_dir,
+                         GHashTable  *keep_names)
+{
+  g_autofree char *cache_path = NULL;
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  GError *local_error = NULL;
+  int cache_dfd = -1;
+
+  if (!pull_data->remote_name || pull_data->remote_name[0] == '.'
+      || strchr (pull_data->remote_name, '/') != NULL)
+    return -1;
+
+  cache_path = g_strconcat (cache_dir, "/", pull_data->remote_name, NULL);
+  if (!glnx_shutil_mkdir_p_at (pull_data->repo->repo_dir_fd, cache_path, 0755,
+                               NULL, &local_error)
+      || !glnx_opendirat (pull_data->repo->repo_dir_fd, cache_path, TRUE,
+                          &cache_dfd, &local_error))
+    goto out;
+
+  if (!glnx_dirfd_iterator_init_at (cache_dfd, ".", FALSE,
+                                    &dfd_iter, &local_error))
+    goto out;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, &local_error))
+        goto out;
+      if (dent == NULL)
+        break;
+
+      if (!g_hash_table_contains (keep_names, dent->d_name))
+        (void) unlinkat (dfd_iter.fd, dent->d_name, 0);
+    }
+
+ out:
+  if (local_error)
+    {
+      g_debug ("Not caching indexes in %s: %s", cache_path, local_error->message);
+      g_error_free (local_error);
+      if (cache_dfd != -1)
+        {
+          (void) close (cache_dfd);
+          cache_dfd = -1;
+        }
+    }
+  return cache_dfd;
+}
+
+/* Note the packs advertised in the summary.  Their indexes are only
+ * loaded, from the cache or the remote, once an object turns out to
+ * be missing; see start_pack_index_loads().
+ */
+static gboolean
+load_remote_packs (OtPullData    *pull_data,
+                   GVariant      *packs,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GPtrArray) remote_packs = NULL;
+  g_autoptr(GHashTable) index_names = NULL;
+  guint i, n;
+
+  remote_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) remote_pack_free);
+  index_names = g_hash_table_new (g_str_hash, g_str_equal);
+
+  n = g_variant_n_children (packs);
+  for (i = 0; i < n; i++)
+    {
+      gboolean is_meta;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *index_path = NULL;
+      g_autofree char *data_path = NULL;
+      RemotePack *remote_pack;
+
+      g_variant_get_child (packs, i, "(b@ay)", &is_meta, &csum_v);
+      if (g_variant_n_children (csum_v) != 32)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid checksum for pack in summary");
+          goto out;
+        }
+
+      remote_pack = g_new0 (RemotePack, 1);
+      remote_pack->pull_data = pull_data;
+      remote_pack->checksum = ostree_checksum_from_bytes_v (csum_v);
+      remote_pack->is_meta = is_meta;
+      index_path = _ostree_get_relative_pack_path (is_meta, remote_pack->checksum, "index");
+      data_path = _ostree_get_relative_pack_path (is_meta, remote_pack->checksum, "data");
+      remote_pack->index_name = g_path_get_basename (index_path);
+      remote_pack->index_uri = suburi_new (pull_data->base_uri, "objects", index_path, NULL);
+      remote_pack->data_uri = suburi_new (pull_data->base_uri, "objects", data_path, NULL);
+      remote_pack->pending = g_ptr_array_new_with_free_func ((GDestroyNotify) packed_object_request_free);
+      g_ptr_array_add (remote_packs, remote_pack);
+      g_hash_table_add (index_names, remote_pack->index_name);
+    }
+
+  pull_data->pack_index_cache_dfd =
+    open_remote_index_cache (pull_data, "state/pack-indexes", index_names);
+
+  ret = TRUE;
+  if (remote_packs->len > 0)
+    ot_transfer_out_value (&pull_data->remote_packs, &remote_packs);
+ out:
+  return ret;
+}
+
 /* Documented in ostree-repo.c */
 gboolean
 ostree_repo_pull_with_options (OstreeRepo             *self,
@@ -1631,6 +3003,13 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   GSource *update_timeout = NULL;
   gboolean disable_static_deltas = FALSE;
 
+  pull_data->pack_index_cache_dfd = -1;
+  pull_data->awaiting_pack_indexes =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) fetch_object_data_free);
+  pull_data->chunked_content_cache_dfd = -1;
+  pull_data->awaiting_chunked_content =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) fetch_object_data_free);
+
   if (options)
     {
       int flags_i;
@@ -1658,6 +3037,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
 
   pull_data->repo = self;
   pull_data->progress = progress;
+  pull_data->max_executing_deltaparts = MAX (g_get_num_processors (), 1);
 
   pull_data->expected_commit_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                             (GDestroyNotify)g_free,
@@ -1668,12 +3048,21 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   pull_data->summary_deltas_checksums = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                                (GDestroyNotify)g_free,
                                                                (GDestroyNotify)g_free);
-  pull_data->scanned_metadata = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
-                                                       (GDestroyNotify)g_variant_unref, NULL);
-  pull_data->requested_content = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                        (GDestroyNotify)g_free, NULL);
-  pull_data->requested_metadata = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                         (GDestroyNotify)g_free, NULL);
+  pull_data->summary_zstd_deltas_checksums = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                    (GDestroyNotify)g_free,
+                                                                    (GDestroyNotify)g_free);
+  pull_data->summary_chunked_content = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                              (GDestroyNotify)g_free,
+                                                              NULL);
+  pull_data->scanned_metadata = _ostree_object_set_new ();
+  pull_data->requested_content = _ostree_object_set_new ();
+  pull_data->requested_metadata = _ostree_object_set_new ();
+  pull_data->requested_chunks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       (GDestroyNotify)g_free,
+                                                       (GDestroyNotify)fetch_chunk_data_free);
+  pull_data->fetched_chunks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     (GDestroyNotify)g_free,
+                                                     (GDestroyNotify)g_free);
   pull_data->dir = g_strdup (dir_to_pull);
 
   pull_data->start_time = g_get_monotonic_time ();
@@ -1774,6 +3163,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
       pull_data->remote_repo_local = ostree_repo_new (remote_repo_path);
       if (!ostree_repo_open (pull_data->remote_repo_local, cancellable, error))
         goto out;
+      pull_data->remote_mode = ostree_repo_get_mode (pull_data->remote_repo_local);
     }
   else
     {
@@ -1787,7 +3177,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
       if (!ostree_repo_mode_from_string (remote_mode_str, &pull_data->remote_mode, error))
         goto out;
     
-      if (pull_data->remote_mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+      if (!_OSTREE_REPO_MODE_IS_ARCHIVE (pull_data->remote_mode))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Can't pull from archives with mode \"%s\"",
@@ -1805,12 +3195,15 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
     gsize i, n;
     g_autoptr(GVariant) refs = NULL;
     g_autoptr(GVariant) deltas = NULL;
+    g_autoptr(GVariant) zstd_deltas = NULL;
+    g_autoptr(GVariant) chunked_content = NULL;
+    g_autoptr(GVariant) packs = NULL;
     g_autoptr(GVariant) additional_metadata = NULL;
       
     if (!pull_data->summary)
       {
         uri = suburi_new (pull_data->base_uri, "summary", NULL);
-        if (!fetch_uri_contents_membuf_sync (pull_data, uri, FALSE, TRUE,
+        if (!fetch_uri_contents_membuf_sync (pull_data, uri, FALSE, TRUE, TRUE,
                                              &bytes_summary, cancellable, error))
           goto out;
         soup_uri_free (uri);
@@ -1826,7 +3219,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
     if (bytes_summary)
       {
         uri = suburi_new (pull_data->base_uri, "summary.sig", NULL);
-        if (!fetch_uri_contents_membuf_sync (pull_data, uri, FALSE, TRUE,
+        if (!fetch_uri_contents_membuf_sync (pull_data, uri, FALSE, TRUE, TRUE,
                                              &bytes_sig, cancellable, error))
           goto out;
         soup_uri_free (uri);
@@ -1891,24 +3284,26 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
 
         additional_metadata = g_variant_get_child_value (pull_data->summary, 1);
         deltas = g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_STATIC_DELTAS, G_VARIANT_TYPE ("a{sv}"));
-        n = deltas ? g_variant_n_children (deltas) : 0;
-        for (i = 0; i < n; i++)
-          {
-            const char *delta;
-            GVariant *csum_v = NULL;
-            guchar *csum_data = g_malloc (32);
-            g_autoptr(GVariant) ref = g_variant_get_child_value (deltas, i);
+        if (!load_summary_deltas_checksums (deltas, pull_data->summary_deltas_checksums, error))
+          goto out;
 
-            g_variant_get_child (ref, 0, "&s", &delta);
-            g_variant_get_child (ref, 1, "v", &csum_v);
+        zstd_deltas = g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_STATIC_DELTAS_ZSTD, G_VARIANT_TYPE ("a{sv}"));
+        if (!load_summary_deltas_checksums (zstd_deltas, pull_data->summary_zstd_deltas_checksums, error))
+          goto out;
 
-            if (!validate_variant_is_csum (csum_v, error))
+        chunked_content = g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_CHUNKED_CONTENT,
+                                                  G_VARIANT_TYPE ("ay"));
+        if (chunked_content && !pull_data->remote_repo_local)
+          {
+            if (!load_summary_chunked_content (pull_data, chunked_content, error))
               goto out;
+          }
 
-            memcpy (csum_data, ostree_checksum_bytes_peek (csum_v), 32);
-            g_hash_table_insert (pull_data->summary_deltas_checksums,
-                                 g_strdup (delta),
-                                 csum_data);
+        packs = g_variant_lookup_value (additional_metadata, OSTREE_SUMMARY_PACKS, G_VARIANT_TYPE ("a(bay)"));
+        if (packs && !pull_data->remote_repo_local)
+          {
+            if (!load_remote_packs (pull_data, packs, cancellable, error))
+              goto out;
           }
       }
   }
@@ -2033,6 +3428,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
       const char *ref = key;
       const char *to_revision = value;
       GVariant *delta_superblock = NULL;
+      gboolean delta_is_zstd = FALSE;
 
       if (!ostree_repo_resolve_rev (pull_data->repo, ref, TRUE,
                                     &from_revision, error))
@@ -2041,10 +3437,35 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
 #ifdef BUILDOPT_STATIC_DELTAS
       if (!disable_static_deltas && (from_revision == NULL || g_strcmp0 (from_revision, to_revision) != 0))
         {
-          if (!request_static_delta_superblock_sync (pull_data, from_revision, to_revision,
-                                                     &delta_superblock, cancellable, error))
+#ifdef HAVE_ZSTD
+          g_autofree char *delta = g_strconcat (from_revision ? from_revision : "", from_revision ? "-" : "", to_revision, NULL);
+
+          /* Only ask for a zstd superblock the summary lists, so servers
+           * without them don't see a failed request per delta.
+           */
+          if (g_hash_table_contains (pull_data->summary_zstd_deltas_checksums, delta))
+            {
+              if (!request_static_delta_superblock_sync (pull_data, from_revision, to_revision, TRUE,
+                                                         &delta_superblock, cancellable, error))
+                goto out;
+              delta_is_zstd = delta_superblock != NULL;
+            }
+#endif
+
+          if (!delta_superblock
+              && !request_static_delta_superblock_sync (pull_data, from_revision, to_revision, FALSE,
+                                                        &delta_superblock, cancellable, error))
             goto out;
         }
+
+      /* E.g. a superblock listing zstd parts under the regular name,
+       * pulled by a build without zstd
+       */
+      if (delta_superblock && !static_delta_parts_supported (delta_superblock))
+        {
+          g_debug ("unsupported delta part version in %s-%s", from_revision ? from_revision : "empty", to_revision);
+          g_clear_pointer (&delta_superblock, g_variant_unref);
+        }
 #endif
           
       if (!delta_superblock)
@@ -2059,7 +3480,7 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
           g_debug ("processing delta superblock for %s-%s", from_revision ? from_revision : "empty", to_revision);
           g_ptr_array_add (pull_data->static_delta_superblocks, g_variant_ref (delta_superblock));
           if (!process_one_static_delta (pull_data, from_revision, to_revision,
-                                         delta_superblock,
+                                         delta_superblock, delta_is_zstd,
                                          cancellable, error))
             goto out;
         }
@@ -2131,6 +3552,14 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
   end_time = g_get_monotonic_time ();
 
   bytes_transferred = _ostree_fetcher_bytes_transferred (pull_data->fetcher);
+  if (pull_data->progress)
+    {
+      /* Nothing may have been transferred at all if nothing changed */
+      ostree_async_progress_set_uint (pull_data->progress, "fetcher-cache-hits",
+                                      _ostree_fetcher_get_cache_hits (pull_data->fetcher));
+      ostree_async_progress_set_uint (pull_data->progress, "fetcher-cache-misses",
+                                      _ostree_fetcher_get_cache_misses (pull_data->fetcher));
+    }
   if (bytes_transferred > 0 && pull_data->progress)
     {
       guint shift; 
@@ -2195,14 +3624,47 @@ ostree_repo_pull_with_options (OstreeRepo             *self,
     soup_uri_free (pull_data->base_uri);
   g_clear_pointer (&pull_data->summary_data, (GDestroyNotify) g_bytes_unref);
   g_clear_pointer (&pull_data->summary_data_sig, (GDestroyNotify) g_bytes_unref);
+  g_clear_pointer (&pull_data->packed_refs_data, (GDestroyNotify) g_bytes_unref);
   g_clear_pointer (&pull_data->summary, (GDestroyNotify) g_variant_unref);
   g_clear_pointer (&pull_data->static_delta_superblocks, (GDestroyNotify) g_ptr_array_unref);
+  /* Only non-empty if we hit an error */
+  g_queue_foreach (&pull_data->pending_deltapart_executions, (GFunc) fetch_static_delta_data_free, NULL);
+  g_queue_clear (&pull_data->pending_deltapart_executions);
   g_clear_pointer (&pull_data->commit_to_depth, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->expected_commit_sizes, (GDestroyNotify) g_hash_table_unref);
-  g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) _ostree_object_set_unref);
   g_clear_pointer (&pull_data->summary_deltas_checksums, (GDestroyNotify) g_hash_table_unref);
-  g_clear_pointer (&pull_data->requested_content, (GDestroyNotify) g_hash_table_unref);
-  g_clear_pointer (&pull_data->requested_metadata, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->summary_zstd_deltas_checksums, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->summary_chunked_content, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->chunked_content_uri, (GDestroyNotify) soup_uri_free);
+  g_free (pull_data->chunked_content_name);
+  g_free (pull_data->chunked_content_checksum);
+  g_clear_pointer (&pull_data->awaiting_chunked_content, (GDestroyNotify) g_ptr_array_unref);
+  if (pull_data->chunked_content_cache_dfd != -1)
+    (void) close (pull_data->chunked_content_cache_dfd);
+  if (pull_data->pack_flush_source)
+    {
+      g_source_destroy (pull_data->pack_flush_source);
+      g_source_unref (pull_data->pack_flush_source);
+    }
+  /* Only non-empty if we hit an error */
+  g_queue_foreach (&pull_data->pending_pack_batches, (GFunc) pack_batch_free, NULL);
+  g_queue_clear (&pull_data->pending_pack_batches);
+  g_clear_pointer (&pull_data->remote_packs, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&pull_data->awaiting_pack_indexes, (GDestroyNotify) g_ptr_array_unref);
+  if (pull_data->pack_index_cache_dfd != -1)
+    (void) close (pull_data->pack_index_cache_dfd);
+  g_clear_pointer (&pull_data->requested_content, (GDestroyNotify) _ostree_object_set_unref);
+  g_clear_pointer (&pull_data->requested_metadata, (GDestroyNotify) _ostree_object_set_unref);
+  if (pull_data->fetched_chunks)
+    {
+      g_hash_table_iter_init (&hash_iter, pull_data->fetched_chunks);
+      while (g_hash_table_iter_next (&hash_iter, NULL, &value))
+        (void) unlinkat (pull_data->tmpdir_dfd, value, 0);
+    }
+  g_clear_pointer (&pull_data->fetched_chunks, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->requested_chunks, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->chunk_index, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&remote_config, (GDestroyNotify) g_key_file_unref);
   return ret;
 }
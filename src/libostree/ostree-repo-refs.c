@@ -23,6 +23,274 @@
 #include "ostree-repo-private.h"
 #include "otutil.h"
 
+/* The packed refs file holds one "CHECKSUM REFSPEC\n" line per ref,
+ * sorted by refspec, so that a ref can be found by bisecting the
+ * mapped file.  Loose files in refs/heads and refs/remotes take
+ * precedence over it.
+ */
+#define PACKED_REFS_PATH "refs/packed-refs"
+#define PACKED_REFS_LOCK "refs/packed-refs.lock"
+
+static gboolean
+packed_refs_map (OstreeRepo     *self,
+                 GMappedFile   **out_mfile,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  g_autoptr(GMappedFile) ret_mfile = NULL;
+
+  fd = openat (self->repo_dir_fd, PACKED_REFS_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+  else
+    {
+      ret_mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+      if (!ret_mfile)
+        goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_mfile, &ret_mfile);
+ out:
+  return ret;
+}
+
+/* Returns the end of the line starting at @line, or %NULL if it is
+ * malformed.
+ */
+static const char *
+packed_refs_parse_line (const char    *line,
+                        const char    *end,
+                        const char   **out_refspec,
+                        gsize         *out_refspec_len)
+{
+  const char *eol = memchr (line, '\n', end - line);
+
+  if (eol == NULL || eol - line < 66 || line[64] != ' ')
+    return NULL;
+
+  *out_refspec = line + 65;
+  *out_refspec_len = eol - *out_refspec;
+  return eol;
+}
+
+static void
+set_packed_refs_error (GError **error)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Invalid line in %s", PACKED_REFS_PATH);
+}
+
+/* Bisect the packed refs file contents @buf for @refspec; sets
+ * @out_rev to %NULL if it is not there.  Also used by pull to look up
+ * refs in a remote's packed refs file.
+ */
+gboolean
+_ostree_packed_refs_lookup_in_buf (const char    *buf,
+                                   gsize          len,
+                                   const char    *refspec,
+                                   char         **out_rev,
+                                   GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autofree char *ret_rev = NULL;
+  gsize lo, hi;
+  gsize refspec_len = strlen (refspec);
+
+  lo = 0;
+  hi = len;
+
+  /* lo and hi are always at the start of a line */
+  while (lo < hi)
+    {
+      const char *line = buf + lo + (hi - lo) / 2;
+      const char *eol;
+      const char *name;
+      gsize name_len;
+      int c;
+
+      while (line > buf + lo && line[-1] != '\n')
+        line--;
+
+      eol = packed_refs_parse_line (line, buf + hi, &name, &name_len);
+      if (eol == NULL)
+        {
+          set_packed_refs_error (error);
+          goto out;
+        }
+
+      c = memcmp (refspec, name, MIN (refspec_len, name_len));
+      if (c == 0)
+        c = (refspec_len > name_len) - (refspec_len < name_len);
+
+      if (c == 0)
+        {
+          ret_rev = g_strndup (line, 64);
+          if (!ostree_validate_checksum_string (ret_rev, error))
+            goto out;
+          break;
+        }
+      else if (c < 0)
+        hi = line - buf;
+      else
+        lo = eol + 1 - buf;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_rev, &ret_rev);
+ out:
+  return ret;
+}
+
+/* Sets @out_rev to %NULL if @refspec is not packed */
+static gboolean
+packed_refs_lookup (OstreeRepo     *self,
+                    const char     *refspec,
+                    char          **out_rev,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autofree char *ret_rev = NULL;
+
+  if (!packed_refs_map (self, &mfile, error))
+    goto out;
+
+  if (mfile)
+    {
+      if (!_ostree_packed_refs_lookup_in_buf (g_mapped_file_get_contents (mfile),
+                                              g_mapped_file_get_length (mfile),
+                                              refspec, &ret_rev, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_rev, &ret_rev);
+ out:
+  return ret;
+}
+
+/* Sets @out_refs, a mapping from refspec to checksum, to %NULL if
+ * there is no packed refs file.
+ */
+static gboolean
+packed_refs_load (OstreeRepo     *self,
+                  GHashTable    **out_refs,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GHashTable) ret_refs = NULL;
+
+  if (!packed_refs_map (self, &mfile, error))
+    goto out;
+
+  if (mfile)
+    {
+      const char *line = g_mapped_file_get_contents (mfile);
+      const char *end = line + g_mapped_file_get_length (mfile);
+
+      ret_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+      while (line < end)
+        {
+          const char *eol;
+          const char *name;
+          gsize name_len;
+
+          eol = packed_refs_parse_line (line, end, &name, &name_len);
+          if (eol == NULL)
+            {
+              set_packed_refs_error (error);
+              goto out;
+            }
+
+          g_hash_table_insert (ret_refs, g_strndup (name, name_len), g_strndup (line, 64));
+          line = eol + 1;
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_refs, &ret_refs);
+ out:
+  return ret;
+}
+
+/* Atomically replace the packed refs file with @refs; the caller must
+ * hold PACKED_REFS_LOCK.
+ */
+static gboolean
+packed_refs_write (OstreeRepo     *self,
+                   GHashTable     *refs,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GList) refspecs = NULL;
+  GString *buf = NULL;
+  GList *l;
+
+  if (g_hash_table_size (refs) == 0)
+    {
+      if (unlinkat (self->repo_dir_fd, PACKED_REFS_PATH, 0) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+
+      ret = TRUE;
+      goto out;
+    }
+
+  refspecs = g_list_sort (g_hash_table_get_keys (refs), (GCompareFunc) strcmp);
+  buf = g_string_new ("");
+  for (l = refspecs; l; l = l->next)
+    {
+      const char *refspec = l->data;
+
+      g_string_append_printf (buf, "%s %s\n",
+                              (char*)g_hash_table_lookup (refs, refspec), refspec);
+    }
+
+  if (!_ostree_repo_file_replace_contents (self, self->repo_dir_fd, PACKED_REFS_PATH,
+                                           (guint8*)buf->str, buf->len,
+                                           cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (buf)
+    g_string_free (buf, TRUE);
+  return ret;
+}
+
+/* Returns the ref part of the packed @refspec if it belongs to
+ * @remote, which is %NULL for local refs, or %NULL otherwise.
+ */
+static const char *
+packed_refspec_match_remote (const char *refspec,
+                             const char *remote)
+{
+  const char *colon = strchr (refspec, ':');
+
+  if (remote == NULL)
+    return colon == NULL ? refspec : NULL;
+
+  if (colon == NULL
+      || (gsize)(colon - refspec) != strlen (remote)
+      || strncmp (refspec, remote, colon - refspec) != 0)
+    return NULL;
+
+  return colon + 1;
+}
+
 static gboolean
 add_ref_to_set (const char       *remote,
                 GFile            *base,
@@ -158,6 +426,63 @@ find_ref_in_remotes (OstreeRepo         *self,
   return ret;
 }
 
+/* Like find_ref_in_remotes(), for the packed refs file.  @rev may
+ * also be REMOTE/REF, which is preferred.
+ */
+static gboolean
+find_ref_in_packed_remotes (OstreeRepo         *self,
+                            const char         *rev,
+                            char              **out_rev,
+                            GError            **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) packed = NULL;
+  g_autofree char *ret_rev = NULL;
+  const char *slash;
+  const char *value = NULL;
+
+  if (!packed_refs_load (self, &packed, error))
+    goto out;
+
+  if (packed)
+    {
+      slash = strchr (rev, '/');
+      if (slash)
+        {
+          g_autofree char *refspec = g_strdup (rev);
+
+          refspec[slash - rev] = ':';
+          value = g_hash_table_lookup (packed, refspec);
+        }
+
+      if (value == NULL)
+        {
+          GHashTableIter hashiter;
+          gpointer hashkey, hashvalue;
+
+          g_hash_table_iter_init (&hashiter, packed);
+          while (g_hash_table_iter_next (&hashiter, &hashkey, &hashvalue))
+            {
+              const char *colon = strchr (hashkey, ':');
+
+              if (colon != NULL && strcmp (colon + 1, rev) == 0)
+                {
+                  value = hashvalue;
+                  break;
+                }
+            }
+        }
+
+      if (value)
+        ret_rev = g_strdup (value);
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_rev, &ret_rev);
+ out:
+  return ret;
+}
+
 static gboolean
 resolve_refspec (OstreeRepo     *self,
                  const char     *remote,
@@ -226,7 +551,14 @@ resolve_refspec (OstreeRepo     *self,
       child = ot_gfile_resolve_path_printf (self->remote_heads_dir, "%s/%s",
                                             remote, ref);
       if (!g_file_query_exists (child, NULL))
-        g_clear_object (&child);
+        {
+          g_autofree char *refspec = g_strconcat (remote, ":", ref, NULL);
+
+          g_clear_object (&child);
+
+          if (!packed_refs_lookup (self, refspec, &ret_rev, error))
+            goto out;
+        }
     }
   else
     {
@@ -236,6 +568,12 @@ resolve_refspec (OstreeRepo     *self,
         {
           g_clear_object (&child);
 
+          if (!packed_refs_lookup (self, ref, &ret_rev, error))
+            goto out;
+        }
+
+      if (child == NULL && ret_rev == NULL)
+        {
           child = g_file_resolve_relative_path (self->remote_heads_dir, ref);
 
           if (!g_file_query_exists (child, NULL))
@@ -245,6 +583,12 @@ resolve_refspec (OstreeRepo     *self,
               if (!find_ref_in_remotes (self, ref, &child, error))
                 goto out;
             }
+
+          if (child == NULL)
+            {
+              if (!find_ref_in_packed_remotes (self, ref, &ret_rev, error))
+                goto out;
+            }
         }
     }
 
@@ -261,7 +605,7 @@ resolve_refspec (OstreeRepo     *self,
       if (!ostree_validate_checksum_string (ret_rev, error))
         goto out;
     }
-  else
+  else if (ret_rev == NULL)
     {
       if (!resolve_refspec_fallback (self, remote, ref, allow_noent,
                                      &ret_rev, cancellable, error))
@@ -477,6 +821,69 @@ enumerate_refs_recurse (OstreeRepo    *repo,
   return ret;
 }
 
+/* Add the packed refs of @remote under @ref_prefix to @refs, named
+ * the way add_ref_to_set() names loose refs.  A %NULL @ref_prefix adds
+ * every packed ref.
+ */
+static gboolean
+add_packed_refs_to_set (OstreeRepo    *self,
+                        const char    *remote,
+                        const char    *ref_prefix,
+                        GHashTable    *refs,
+                        GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) packed = NULL;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  gsize prefix_len;
+
+  if (!packed_refs_load (self, &packed, error))
+    goto out;
+
+  if (packed == NULL)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  prefix_len = ref_prefix ? strlen (ref_prefix) : 0;
+
+  g_hash_table_iter_init (&hashiter, packed);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *refspec = key;
+      const char *ref;
+
+      if (ref_prefix == NULL)
+        {
+          g_hash_table_insert (refs, g_strdup (refspec), g_strdup (value));
+          continue;
+        }
+
+      ref = packed_refspec_match_remote (refspec, remote);
+      if (ref == NULL)
+        continue;
+
+      if (strcmp (ref, ref_prefix) == 0)
+        {
+          g_hash_table_insert (refs, g_strdup (refspec), g_strdup (value));
+        }
+      else if (strncmp (ref, ref_prefix, prefix_len) == 0 && ref[prefix_len] == '/')
+        {
+          const char *relpath = ref + prefix_len + 1;
+
+          g_hash_table_insert (refs,
+                               remote ? g_strconcat (remote, ":", relpath, NULL) : g_strdup (relpath),
+                               g_strdup (value));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 /**
  * ostree_repo_list_refs:
  * @self: Repo
@@ -517,6 +924,10 @@ ostree_repo_list_refs (OstreeRepo       *self,
       else
         dir = g_object_ref (self->local_heads_dir);
 
+      /* Loose refs are added last, so they replace packed ones */
+      if (!add_packed_refs_to_set (self, remote, ref_prefix, ret_all_refs, error))
+        goto out;
+
       child = g_file_resolve_relative_path (dir, ref_prefix);
       if (!ot_gfile_query_info_allow_noent (child, OSTREE_GIO_FAST_QUERYINFO, 0,
                                             &info, cancellable, error))
@@ -543,6 +954,9 @@ ostree_repo_list_refs (OstreeRepo       *self,
     {
       g_autoptr(GFileEnumerator) remote_enumerator = NULL;
 
+      if (!add_packed_refs_to_set (self, NULL, NULL, ret_all_refs, error))
+        goto out;
+
       if (!enumerate_refs_recurse (self, NULL, self->local_heads_dir, self->local_heads_dir,
                                    ret_all_refs,
                                    cancellable, error))
@@ -653,17 +1067,88 @@ ostree_repo_remote_list_refs (OstreeRepo       *self,
   return ret;
 }
 
-gboolean      
-_ostree_repo_write_ref (OstreeRepo    *self,
-                        const char    *remote,
-                        const char    *ref,
-                        const char    *rev,
-                        GCancellable  *cancellable,
-                        GError       **error)
+static char *
+loose_ref_path (const char *remote,
+                const char *ref)
+{
+  if (remote)
+    return g_strconcat ("refs/remotes/", remote, "/", ref, NULL);
+  else
+    return g_strconcat ("refs/heads/", ref, NULL);
+}
+
+/* Look up @refspec exactly as ostree_repo_list_refs() would list it:
+ * unlike ostree_repo_resolve_rev(), a local ref does not fall back to
+ * remote refs or to the parent repository.  Sets @out_rev to %NULL if
+ * it does not exist.
+ */
+gboolean
+_ostree_repo_lookup_ref (OstreeRepo    *self,
+                         const char    *refspec,
+                         char         **out_rev,
+                         GCancellable  *cancellable,
+                         GError       **error)
 {
   gboolean ret = FALSE;
+  g_autofree char *remote = NULL;
+  g_autofree char *ref = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *ret_rev = NULL;
+  GError *temp_error = NULL;
+
+  if (!ostree_parse_refspec (refspec, &remote, &ref, error))
+    goto out;
+
+  path = loose_ref_path (remote, ref);
+  ret_rev = glnx_file_get_contents_utf8_at (self->repo_dir_fd, path, NULL,
+                                            cancellable, &temp_error);
+  if (ret_rev == NULL)
+    {
+      if (!(g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)
+            || g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY)
+            || g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY)))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_clear_error (&temp_error);
+
+      if (!packed_refs_lookup (self, refspec, &ret_rev, error))
+        goto out;
+    }
+  else
+    {
+      g_strchomp (ret_rev);
+      if (!ostree_validate_checksum_string (ret_rev, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_rev, &ret_rev);
+ out:
+  return ret;
+}
+
+/* Writers hold PACKED_REFS_LOCK shared, so that
+ * ostree_repo_pack_refs() (which holds it exclusively) can't read a
+ * loose ref, and then delete it after it has been updated.
+ */
+static gboolean
+write_loose_ref (OstreeRepo    *self,
+                 const char    *remote,
+                 const char    *ref,
+                 const char    *rev,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  gboolean ret = FALSE;
+  GLnxLockFile lock = GLNX_LOCK_FILE_INIT;
   glnx_fd_close int dfd = -1;
 
+  if (!glnx_make_lock_file (self->repo_dir_fd, PACKED_REFS_LOCK, LOCK_SH,
+                            &lock, error))
+    goto out;
+
   if (remote == NULL)
     {
       if (!glnx_opendirat (self->repo_dir_fd, "refs/heads", TRUE,
@@ -678,31 +1163,104 @@ _ostree_repo_write_ref (OstreeRepo    *self,
                            &refs_remotes_dfd, error))
         goto out;
 
-      if (rev != NULL)
+      /* Ensure we have a dir for the remote */
+      if (!glnx_shutil_mkdir_p_at (refs_remotes_dfd, remote, 0777, cancellable, error))
+        goto out;
+
+      if (!glnx_opendirat (refs_remotes_dfd, remote, TRUE, &dfd, error))
+        goto out;
+    }
+
+  if (!write_checksum_file_at (self, dfd, ref, rev, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  glnx_release_lock_file (&lock);
+  return ret;
+}
+
+/* Delete @refspecs from the packed refs file first, then their loose
+ * files, so that readers never see an older packed value.  The lock
+ * keeps ostree_repo_pack_refs() from packing a ref between the two
+ * steps.
+ */
+static gboolean
+delete_refs (OstreeRepo    *self,
+             GPtrArray     *refspecs,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  gboolean ret = FALSE;
+  GLnxLockFile lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(GHashTable) packed = NULL;
+  gboolean packed_changed = FALSE;
+  guint i;
+
+  if (!glnx_make_lock_file (self->repo_dir_fd, PACKED_REFS_LOCK, LOCK_EX,
+                            &lock, error))
+    goto out;
+
+  if (!packed_refs_load (self, &packed, error))
+    goto out;
+
+  if (packed)
+    {
+      for (i = 0; i < refspecs->len; i++)
         {
-          /* Ensure we have a dir for the remote */
-          if (!glnx_shutil_mkdir_p_at (refs_remotes_dfd, remote, 0777, cancellable, error))
-            goto out;
+          if (g_hash_table_remove (packed, refspecs->pdata[i]))
+            packed_changed = TRUE;
         }
 
-      if (!glnx_opendirat (refs_remotes_dfd, remote, TRUE, &dfd, error))
+      if (packed_changed
+          && !packed_refs_write (self, packed, cancellable, error))
         goto out;
     }
 
-  if (rev == NULL)
+  for (i = 0; i < refspecs->len; i++)
     {
-      if (unlinkat (dfd, ref, 0) != 0)
+      g_autofree char *remote = NULL;
+      g_autofree char *ref = NULL;
+      g_autofree char *path = NULL;
+
+      if (!ostree_parse_refspec (refspecs->pdata[i], &remote, &ref, error))
+        goto out;
+
+      path = loose_ref_path (remote, ref);
+      if (unlinkat (self->repo_dir_fd, path, 0) != 0 && errno != ENOENT && errno != ENOTDIR)
         {
-          if (errno != ENOENT)
-            {
-              glnx_set_error_from_errno (error);
-              goto out;
-            }
+          glnx_set_error_from_errno (error);
+          goto out;
         }
     }
+
+  ret = TRUE;
+ out:
+  glnx_release_lock_file (&lock);
+  return ret;
+}
+
+gboolean      
+_ostree_repo_write_ref (OstreeRepo    *self,
+                        const char    *remote,
+                        const char    *ref,
+                        const char    *rev,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  gboolean ret = FALSE;
+
+  if (rev == NULL)
+    {
+      g_autoptr(GPtrArray) refspecs = g_ptr_array_new_with_free_func (g_free);
+
+      g_ptr_array_add (refspecs, remote ? g_strconcat (remote, ":", ref, NULL) : g_strdup (ref));
+      if (!delete_refs (self, refspecs, cancellable, error))
+        goto out;
+    }
   else
     {
-      if (!write_checksum_file_at (self, dfd, ref, rev, cancellable, error))
+      if (!write_loose_ref (self, remote, ref, rev, cancellable, error))
         goto out;
     }
 
@@ -714,6 +1272,10 @@ _ostree_repo_write_ref (OstreeRepo    *self,
   return ret;
 }
 
+/* Refs which are set are written as loose files, which take precedence
+ * over the packed refs file; all deleted refs are removed from the
+ * packed refs file in a single atomic replacement.
+ */
 gboolean
 _ostree_repo_update_refs (OstreeRepo        *self,
                           GHashTable        *refs,
@@ -723,6 +1285,7 @@ _ostree_repo_update_refs (OstreeRepo        *self,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
+  g_autoptr(GPtrArray) deleted = g_ptr_array_new ();
 
   g_hash_table_iter_init (&hash_iter, refs);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -732,15 +1295,113 @@ _ostree_repo_update_refs (OstreeRepo        *self,
       g_autofree char *remote = NULL;
       g_autofree char *ref = NULL;
 
+      if (rev == NULL)
+        {
+          g_ptr_array_add (deleted, (char*)refspec);
+          continue;
+        }
+
       if (!ostree_parse_refspec (refspec, &remote, &ref, error))
         goto out;
 
-      if (!_ostree_repo_write_ref (self, remote, ref, rev,
-                                   cancellable, error))
+      if (!write_loose_ref (self, remote, ref, rev,
+                            cancellable, error))
         goto out;
     }
 
+  if (deleted->len > 0
+      && !delete_refs (self, deleted, cancellable, error))
+    goto out;
+
+  if (!_ostree_repo_update_mtime (self, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_pack_refs:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write the current value of every local and remote ref into
+ * refs/packed-refs, a single sorted file, and delete the per-ref files
+ * in refs/heads and refs/remotes.  Looking up and listing refs then
+ * does not need to read one file per ref.  Refs which are set later
+ * are written as separate files again, taking precedence over the
+ * packed ones until the next call.
+ *
+ * Versions of OSTree without support for packed refs do not see the
+ * refs stored in this file.
+ */
+gboolean
+ostree_repo_pack_refs (OstreeRepo    *self,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  GLnxLockFile lock = GLNX_LOCK_FILE_INIT;
+  g_autoptr(GHashTable) all_refs = NULL;
+  GHashTableIter hash_iter;
+  gpointer key, value;
+
+  if (!glnx_make_lock_file (self->repo_dir_fd, PACKED_REFS_LOCK, LOCK_EX,
+                            &lock, error))
+    goto out;
+
+  if (!ostree_repo_list_refs (self, NULL, &all_refs, cancellable, error))
+    goto out;
+
+  if (!packed_refs_write (self, all_refs, cancellable, error))
+    goto out;
+
+  /* Only delete loose refs which still hold the value just packed */
+  g_hash_table_iter_init (&hash_iter, all_refs);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *refspec = key;
+      g_autofree char *remote = NULL;
+      g_autofree char *ref = NULL;
+      g_autofree char *path = NULL;
+      g_autofree char *contents = NULL;
+      GError *temp_error = NULL;
+
+      if (!ostree_parse_refspec (refspec, &remote, &ref, error))
+        goto out;
+
+      path = loose_ref_path (remote, ref);
+      contents = glnx_file_get_contents_utf8_at (self->repo_dir_fd, path, NULL,
+                                                 cancellable, &temp_error);
+      if (contents == NULL)
+        {
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_clear_error (&temp_error);
+              continue;
+            }
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+
+      g_strchomp (contents);
+      if (strcmp (contents, value) != 0)
+        continue;
+
+      if (unlinkat (self->repo_dir_fd, path, 0) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+
+  if (!_ostree_repo_update_mtime (self, error))
+    goto out;
+
   ret = TRUE;
  out:
+  glnx_release_lock_file (&lock);
   return ret;
 }
@@ -0,0 +1,387 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "otutil.h"
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/* The stat cache maps a file on disk, identified by device and inode,
+ * to the checksum of the content object it last produced.  An entry
+ * is only used if everything that goes into the content checksum is
+ * unchanged: the size, modification and change times, the mode and
+ * ownership as committed (that is, after any commit modifier), and the
+ * extended attributes.  The object must also still be present in the
+ * repository.
+ *
+ * The cache is stored in the repository at state/stat-cache as a
+ * GVariant of type _OSTREE_STAT_CACHE_GVARIANT_FORMAT, in host byte
+ * order; a cache written by a different version or a host of
+ * different endianness is simply ignored.  Only the entries used by
+ * the last committed transaction are kept.
+ */
+
+#define _OSTREE_STAT_CACHE_PATH "state/stat-cache"
+#define _OSTREE_STAT_CACHE_VERSION (1)
+#define _OSTREE_STAT_CACHE_GVARIANT_FORMAT G_VARIANT_TYPE ("(ua(ttxuxutuuuayay))")
+
+typedef struct {
+  guint64 dev;
+  guint64 ino;
+  gint64  mtime_sec;
+  guint32 mtime_nsec;
+  gint64  ctime_sec;
+  guint32 ctime_nsec;
+  guint64 size;
+  guint32 mode;
+  guint32 uid;
+  guint32 gid;
+  guint8  xattrs_csum[32];
+  guint8  csum[32];
+
+  gboolean used;
+} OstreeStatCacheEntry;
+
+static guint
+stat_cache_entry_hash (gconstpointer a)
+{
+  const OstreeStatCacheEntry *entry = a;
+  return (guint) (entry->dev + entry->ino);
+}
+
+static gboolean
+stat_cache_entry_equal (gconstpointer a,
+                        gconstpointer b)
+{
+  const OstreeStatCacheEntry *entry_a = a;
+  const OstreeStatCacheEntry *entry_b = b;
+  return entry_a->dev == entry_b->dev
+    && entry_a->ino == entry_b->ino;
+}
+
+static void
+checksum_xattrs (GVariant *xattrs,
+                 guint8   *out_csum)
+{
+  OtSha256 *checksum = ot_sha256_new ();
+
+  if (xattrs)
+    {
+      g_autoptr(GVariant) normalized = g_variant_get_normal_form (xattrs);
+      ot_sha256_update (checksum, g_variant_get_data (normalized),
+                        g_variant_get_size (normalized));
+    }
+  ot_sha256_get_digest (checksum, out_csum);
+  ot_sha256_free (checksum);
+}
+
+/* Fill in everything but the content checksum */
+static void
+stat_cache_entry_init (OstreeStatCacheEntry  *entry,
+                       const struct stat     *stbuf,
+                       GFileInfo             *file_info,
+                       GVariant              *xattrs)
+{
+  memset (entry, 0, sizeof (*entry));
+  entry->dev = stbuf->st_dev;
+  entry->ino = stbuf->st_ino;
+  entry->mtime_sec = stbuf->st_mtim.tv_sec;
+  entry->mtime_nsec = stbuf->st_mtim.tv_nsec;
+  entry->ctime_sec = stbuf->st_ctim.tv_sec;
+  entry->ctime_nsec = stbuf->st_ctim.tv_nsec;
+  entry->size = stbuf->st_size;
+  entry->mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  entry->uid = g_file_info_get_attribute_uint32 (file_info, "unix::uid");
+  entry->gid = g_file_info_get_attribute_uint32 (file_info, "unix::gid");
+  checksum_xattrs (xattrs, entry->xattrs_csum);
+}
+
+/**
+ * _ostree_repo_stat_cache_ensure_loaded:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Load the stat cache from disk if it is not loaded yet.  A missing or
+ * unusable cache results in an empty one.
+ */
+gboolean
+_ostree_repo_stat_cache_ensure_loaded (OstreeRepo    *self,
+                                       GCancellable  *cancellable,
+                                       GError       **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  guint32 version;
+  guint i, n;
+
+  if (self->stat_cache)
+    return TRUE;
+
+  self->stat_cache = g_hash_table_new_full (stat_cache_entry_hash, stat_cache_entry_equal,
+                                            NULL, g_free);
+  /* Files changed within the same second as the scan may be changed
+   * again without the timestamps changing; see
+   * _ostree_repo_stat_cache_store().
+   */
+  self->stat_cache_start = g_get_real_time () / G_USEC_PER_SEC;
+
+  fd = openat (self->repo_dir_fd, _OSTREE_STAT_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno == ENOENT)
+        {
+          ret = TRUE;
+          goto out;
+        }
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  if (!ot_util_variant_map_fd (fd, 0, _OSTREE_STAT_CACHE_GVARIANT_FORMAT, FALSE,
+                               &cache, error))
+    goto out;
+
+  g_variant_get_child (cache, 0, "u", &version);
+  if (version != _OSTREE_STAT_CACHE_VERSION)
+    {
+      g_debug ("Ignoring stat cache with unknown version %u", version);
+      ret = TRUE;
+      goto out;
+    }
+
+  entries = g_variant_get_child_value (cache, 1);
+  n = g_variant_n_children (entries);
+  for (i = 0; i < n; i++)
+    {
+      OstreeStatCacheEntry *entry;
+      g_autoptr(GVariant) xattrs_csum_v = NULL;
+      g_autoptr(GVariant) csum_v = NULL;
+
+      entry = g_new0 (OstreeStatCacheEntry, 1);
+      g_variant_get_child (entries, i, "(ttxuxutuuu@ay@ay)",
+                           &entry->dev, &entry->ino,
+                           &entry->mtime_sec, &entry->mtime_nsec,
+                           &entry->ctime_sec, &entry->ctime_nsec,
+                           &entry->size,
+                           &entry->mode, &entry->uid, &entry->gid,
+                           &xattrs_csum_v, &csum_v);
+
+      if (g_variant_n_children (xattrs_csum_v) != 32
+          || g_variant_n_children (csum_v) != 32)
+        {
+          g_free (entry);
+          continue;
+        }
+
+      memcpy (entry->xattrs_csum, ostree_checksum_bytes_peek (xattrs_csum_v), 32);
+      memcpy (entry->csum, ostree_checksum_bytes_peek (csum_v), 32);
+
+      g_hash_table_replace (self->stat_cache, entry, entry);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_stat_cache_lookup:
+ * @self: Repo
+ * @stbuf: Result of stat() on the file being committed
+ * @file_info: File information as it will be committed
+ * @xattrs: (allow-none): Extended attributes as they will be committed
+ * @out_checksum: (out): Content checksum, or %NULL on a cache miss
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Look up a file in the stat cache, updating the transaction's hit and
+ * miss counts.
+ */
+gboolean
+_ostree_repo_stat_cache_lookup (OstreeRepo         *self,
+                                const struct stat  *stbuf,
+                                GFileInfo          *file_info,
+                                GVariant           *xattrs,
+                                char              **out_checksum,
+                                GCancellable       *cancellable,
+                                GError            **error)
+{
+  gboolean ret = FALSE;
+  OstreeStatCacheEntry key;
+  OstreeStatCacheEntry *entry;
+  g_autofree char *ret_checksum = NULL;
+
+  g_assert (self->stat_cache != NULL);
+
+  stat_cache_entry_init (&key, stbuf, file_info, xattrs);
+
+  entry = g_hash_table_lookup (self->stat_cache, &key);
+  if (entry
+      && entry->mtime_sec == key.mtime_sec
+      && entry->mtime_nsec == key.mtime_nsec
+      && entry->ctime_sec == key.ctime_sec
+      && entry->ctime_nsec == key.ctime_nsec
+      && entry->size == key.size
+      && entry->mode == key.mode
+      && entry->uid == key.uid
+      && entry->gid == key.gid
+      && memcmp (entry->xattrs_csum, key.xattrs_csum, 32) == 0)
+    {
+      gboolean have_obj;
+
+      ret_checksum = ostree_checksum_from_bytes (entry->csum);
+
+      /* The object may have been pruned since */
+      if (!ostree_repo_has_object (self, OSTREE_OBJECT_TYPE_FILE, ret_checksum,
+                                   &have_obj, cancellable, error))
+        goto out;
+
+      if (have_obj)
+        entry->used = TRUE;
+      else
+        g_clear_pointer (&ret_checksum, g_free);
+    }
+
+  g_mutex_lock (&self->txn_stats_lock);
+  if (ret_checksum)
+    self->txn_stats.stat_cache_hits++;
+  else
+    self->txn_stats.stat_cache_misses++;
+  g_mutex_unlock (&self->txn_stats_lock);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_checksum, &ret_checksum);
+ out:
+  return ret;
+}
+
+/**
+ * _ostree_repo_stat_cache_store:
+ * @self: Repo
+ * @stbuf: Result of stat() on the file, taken before it was read
+ * @file_info: File information as it was committed
+ * @xattrs: (allow-none): Extended attributes as they were committed
+ * @checksum: Resulting content checksum
+ *
+ * Record the checksum of a newly committed file.
+ */
+void
+_ostree_repo_stat_cache_store (OstreeRepo         *self,
+                               const struct stat  *stbuf,
+                               GFileInfo          *file_info,
+                               GVariant           *xattrs,
+                               const char         *checksum)
+{
+  OstreeStatCacheEntry *entry;
+
+  g_assert (self->stat_cache != NULL);
+
+  entry = g_new0 (OstreeStatCacheEntry, 1);
+  stat_cache_entry_init (entry, stbuf, file_info, xattrs);
+
+  /* If the file was modified in the second we started, a further
+   * write in that same second could leave every timestamp unchanged,
+   * so don't trust it.
+   */
+  if (entry->mtime_sec >= self->stat_cache_start
+      || entry->ctime_sec >= self->stat_cache_start)
+    {
+      g_hash_table_remove (self->stat_cache, entry);
+      g_free (entry);
+      return;
+    }
+
+  ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+  entry->used = TRUE;
+  g_hash_table_replace (self->stat_cache, entry, entry);
+}
+
+/**
+ * _ostree_repo_stat_cache_flush:
+ * @self: Repo
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write the entries used in this transaction to disk, and drop the
+ * in-memory cache.
+ */
+gboolean
+_ostree_repo_stat_cache_flush (OstreeRepo    *self,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  gboolean ret = FALSE;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key;
+  g_autoptr(GVariant) cache = NULL;
+
+  if (!self->stat_cache)
+    return TRUE;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ttxuxutuuuayay)"));
+  g_hash_table_iter_init (&iter, self->stat_cache);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      OstreeStatCacheEntry *entry = key;
+
+      if (!entry->used)
+        continue;
+
+      g_variant_builder_add (&builder, "(ttxuxutuuu@ay@ay)",
+                             entry->dev, entry->ino,
+                             entry->mtime_sec, entry->mtime_nsec,
+                             entry->ctime_sec, entry->ctime_nsec,
+                             entry->size,
+                             entry->mode, entry->uid, entry->gid,
+                             ot_gvariant_new_bytearray (entry->xattrs_csum, 32),
+                             ot_gvariant_new_bytearray (entry->csum, 32));
+    }
+  cache = g_variant_ref_sink (g_variant_new ("(u@a(ttxuxutuuuayay))",
+                                             _OSTREE_STAT_CACHE_VERSION,
+                                             g_variant_builder_end (&builder)));
+
+  if (!glnx_shutil_mkdir_p_at (self->repo_dir_fd, "state", 0777,
+                               cancellable, error))
+    goto out;
+
+  if (!_ostree_repo_file_replace_contents (self, self->repo_dir_fd, _OSTREE_STAT_CACHE_PATH,
+                                           g_variant_get_data (cache),
+                                           g_variant_get_size (cache),
+                                           cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  _ostree_repo_stat_cache_clear (self);
+  return ret;
+}
+
+void
+_ostree_repo_stat_cache_clear (OstreeRepo *self)
+{
+  g_clear_pointer (&self->stat_cache, g_hash_table_unref);
+}
@@ -41,11 +41,194 @@ _ostree_delta_content_sizenames_free (gpointer v)
   g_free (ce);
 }
 
+static void
+unpacked_content_free (OstreeDeltaUnpackedContent *entry)
+{
+  g_free (entry->checksum);
+  g_bytes_unref (entry->content);
+  g_free (entry);
+}
+
+OstreeDeltaGenerationCache *
+_ostree_delta_generation_cache_new (void)
+{
+  OstreeDeltaGenerationCache *cache = g_new0 (OstreeDeltaGenerationCache, 1);
+
+  g_mutex_init (&cache->lock);
+  cache->reachable = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)_ostree_object_set_unref);
+  cache->sizenames = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_ptr_array_unref);
+  cache->file_info = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            g_object_unref);
+  cache->unpacked = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                           (GDestroyNotify)unpacked_content_free);
+  g_queue_init (&cache->unpacked_lru);
+  return cache;
+}
+
+void
+_ostree_delta_generation_cache_free (OstreeDeltaGenerationCache *cache)
+{
+  g_hash_table_unref (cache->reachable);
+  g_hash_table_unref (cache->sizenames);
+  g_hash_table_unref (cache->file_info);
+  g_hash_table_unref (cache->unpacked);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/*
+ * Returns: (transfer full) (nullable): The cached uncompressed content
+ * of @checksum, which is marked as most recently used.
+ */
+GBytes *
+_ostree_delta_generation_cache_lookup_unpacked (OstreeDeltaGenerationCache *cache,
+                                                const char                 *checksum)
+{
+  OstreeDeltaUnpackedContent *entry;
+  GBytes *ret = NULL;
+
+  g_mutex_lock (&cache->lock);
+  entry = g_hash_table_lookup (cache->unpacked, checksum);
+  if (entry)
+    {
+      g_queue_unlink (&cache->unpacked_lru, &entry->link);
+      g_queue_push_head_link (&cache->unpacked_lru, &entry->link);
+      ret = g_bytes_ref (entry->content);
+    }
+  g_mutex_unlock (&cache->lock);
+
+  return ret;
+}
+
+/*
+ * Keep @content for later lookups, dropping the least recently used
+ * objects while the cache is over %_OSTREE_DELTA_UNPACKED_CACHE_MAX.
+ * Callers still holding a dropped object keep it alive.
+ */
+void
+_ostree_delta_generation_cache_add_unpacked (OstreeDeltaGenerationCache *cache,
+                                             const char                 *checksum,
+                                             GBytes                     *content)
+{
+  OstreeDeltaUnpackedContent *entry;
+
+  g_mutex_lock (&cache->lock);
+
+  /* Another thread may have unpacked it meanwhile */
+  if (g_hash_table_contains (cache->unpacked, checksum))
+    goto out;
+
+  entry = g_new0 (OstreeDeltaUnpackedContent, 1);
+  entry->checksum = g_strdup (checksum);
+  entry->content = g_bytes_ref (content);
+  entry->link.data = entry;
+  g_hash_table_insert (cache->unpacked, entry->checksum, entry);
+  g_queue_push_head_link (&cache->unpacked_lru, &entry->link);
+  cache->unpacked_size += g_bytes_get_size (content);
+
+  while (cache->unpacked_size > _OSTREE_DELTA_UNPACKED_CACHE_MAX
+         && cache->unpacked_lru.length > 1)
+    {
+      OstreeDeltaUnpackedContent *oldest = g_queue_pop_tail_link (&cache->unpacked_lru)->data;
+
+      cache->unpacked_size -= g_bytes_get_size (oldest->content);
+      g_hash_table_remove (cache->unpacked, oldest->checksum);
+    }
+
+ out:
+  g_mutex_unlock (&cache->lock);
+}
+
+/*
+ * Like ostree_repo_traverse_commit() with a depth of 0, but the
+ * result is shared between deltas using the same @cache.  The
+ * returned set must not be modified.
+ */
+gboolean
+_ostree_delta_generation_cache_traverse_commit (OstreeRepo                   *repo,
+                                                OstreeDeltaGenerationCache   *cache,
+                                                const char                   *commit_checksum,
+                                                OstreeObjectSet             **out_reachable,
+                                                GCancellable                 *cancellable,
+                                                GError                      **error)
+{
+  gboolean ret = FALSE;
+  OstreeObjectSet *ret_reachable = NULL;
+
+  g_mutex_lock (&cache->lock);
+  ret_reachable = g_hash_table_lookup (cache->reachable, commit_checksum);
+  if (ret_reachable)
+    _ostree_object_set_ref (ret_reachable);
+  g_mutex_unlock (&cache->lock);
+
+  if (!ret_reachable)
+    {
+      ret_reachable = _ostree_object_set_new ();
+      if (!_ostree_repo_traverse_commits_union (repo, &commit_checksum, 1, 0,
+                                                ret_reachable, 0,
+                                                cancellable, error))
+        goto out;
+
+      g_mutex_lock (&cache->lock);
+      g_hash_table_replace (cache->reachable, g_strdup (commit_checksum),
+                            _ostree_object_set_ref (ret_reachable));
+      g_mutex_unlock (&cache->lock);
+    }
+
+  ret = TRUE;
+  gs_transfer_out_value (out_reachable, &ret_reachable);
+ out:
+  if (ret_reachable)
+    _ostree_object_set_unref (ret_reachable);
+  return ret;
+}
+
+/*
+ * Like ostree_repo_load_file() returning only the file info, which
+ * is cached in @cache.
+ */
+gboolean
+_ostree_delta_generation_cache_query_file (OstreeRepo                   *repo,
+                                           OstreeDeltaGenerationCache   *cache,
+                                           const char                   *checksum,
+                                           GFileInfo                   **out_finfo,
+                                           GCancellable                 *cancellable,
+                                           GError                      **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFileInfo) ret_finfo = NULL;
+
+  g_mutex_lock (&cache->lock);
+  ret_finfo = g_hash_table_lookup (cache->file_info, checksum);
+  if (ret_finfo)
+    g_object_ref (ret_finfo);
+  g_mutex_unlock (&cache->lock);
+
+  if (!ret_finfo)
+    {
+      if (!ostree_repo_load_file (repo, checksum, NULL, &ret_finfo, NULL,
+                                  cancellable, error))
+        goto out;
+
+      g_mutex_lock (&cache->lock);
+      g_hash_table_replace (cache->file_info, g_strdup (checksum),
+                            g_object_ref (ret_finfo));
+      g_mutex_unlock (&cache->lock);
+    }
+
+  ret = TRUE;
+  gs_transfer_out_value (out_finfo, &ret_finfo);
+ out:
+  return ret;
+}
+
 static gboolean
 build_content_sizenames_recurse (OstreeRepo                     *repo,
+                                 OstreeDeltaGenerationCache     *cache,
                                  OstreeRepoCommitTraverseIter   *iter,
                                  GHashTable                     *sizenames_map,
-                                 GHashTable                     *include_only_objects,
                                  GCancellable                   *cancellable,
                                  GError                        **error)
 {
@@ -68,9 +251,6 @@ build_content_sizenames_recurse (OstreeRepo                     *repo,
             
           ostree_repo_commit_traverse_iter_get_file (iter, &name, &checksum);
 
-          if (include_only_objects && !g_hash_table_contains (include_only_objects, checksum))
-            continue;
-
           csizenames = g_hash_table_lookup (sizenames_map, checksum);
           if (!csizenames)
             {
@@ -84,9 +264,8 @@ build_content_sizenames_recurse (OstreeRepo                     *repo,
                */
               g_hash_table_replace (sizenames_map, csizenames->checksum, csizenames);
 
-              if (!ostree_repo_load_file (repo, checksum,
-                                          NULL, &finfo, NULL,
-                                          cancellable, error))
+              if (!_ostree_delta_generation_cache_query_file (repo, cache, checksum,
+                                                              &finfo, cancellable, error))
                 goto out;
               
               csizenames->size = g_file_info_get_size (finfo);
@@ -117,8 +296,8 @@ build_content_sizenames_recurse (OstreeRepo                     *repo,
                                                               error))
             goto out;
 
-          if (!build_content_sizenames_recurse (repo, &subiter,
-                                                sizenames_map, include_only_objects,
+          if (!build_content_sizenames_recurse (repo, cache, &subiter,
+                                                sizenames_map,
                                                 cancellable, error))
             goto out;
         }
@@ -142,30 +321,46 @@ compare_sizenames (const void  *a,
 
 /*
  * Generate a sorted array of [(checksum: str, size: uint64, names: array[string]), ...]
- * for regular file content.
+ * for regular file content.  The array is cached in @cache by commit
+ * checksum, and must not be modified.
  */
 static gboolean
-build_content_sizenames_filtered (OstreeRepo              *repo,
-                                  GVariant                *commit,
-                                  GHashTable              *include_only_objects,
-                                  GPtrArray              **out_sizenames,
-                                  GCancellable            *cancellable,
-                                  GError                 **error)
+build_content_sizenames (OstreeRepo                 *repo,
+                         OstreeDeltaGenerationCache *cache,
+                         const char                 *commit_checksum,
+                         GVariant                   *commit,
+                         GPtrArray                 **out_sizenames,
+                         GCancellable               *cancellable,
+                         GError                    **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GPtrArray) ret_sizenames =
-    g_ptr_array_new_with_free_func (_ostree_delta_content_sizenames_free);
+  g_autoptr(GPtrArray) ret_sizenames = NULL;
   g_autoptr(GHashTable) sizenames_map =
     g_hash_table_new_full (g_str_hash, g_str_equal, NULL, _ostree_delta_content_sizenames_free);
   ostree_cleanup_repo_commit_traverse_iter
     OstreeRepoCommitTraverseIter iter = { 0, };
 
+  g_mutex_lock (&cache->lock);
+  ret_sizenames = g_hash_table_lookup (cache->sizenames, commit_checksum);
+  if (ret_sizenames)
+    g_ptr_array_ref (ret_sizenames);
+  g_mutex_unlock (&cache->lock);
+
+  if (ret_sizenames)
+    {
+      ret = TRUE;
+      gs_transfer_out_value (out_sizenames, &ret_sizenames);
+      goto out;
+    }
+
+  ret_sizenames = g_ptr_array_new_with_free_func (_ostree_delta_content_sizenames_free);
+
   if (!ostree_repo_commit_traverse_iter_init_commit (&iter, repo, commit,
                                                      OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
                                                      error))
     goto out;
 
-  if (!build_content_sizenames_recurse (repo, &iter, sizenames_map, include_only_objects,
+  if (!build_content_sizenames_recurse (repo, cache, &iter, sizenames_map,
                                         cancellable, error))
     goto out;
 
@@ -182,6 +377,11 @@ build_content_sizenames_filtered (OstreeRepo              *repo,
 
   g_ptr_array_sort (ret_sizenames, compare_sizenames);
 
+  g_mutex_lock (&cache->lock);
+  g_hash_table_replace (cache->sizenames, g_strdup (commit_checksum),
+                        g_ptr_array_ref (ret_sizenames));
+  g_mutex_unlock (&cache->lock);
+
   ret = TRUE;
   gs_transfer_out_value (out_sizenames, &ret_sizenames);
  out:
@@ -222,7 +422,10 @@ string_array_nonempty_intersection (GPtrArray    *a,
  */
 gboolean
 _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
+                                       OstreeDeltaGenerationCache *cache,
+                                       const char                 *from,
                                        GVariant                   *from_commit,
+                                       const char                 *to,
                                        GVariant                   *to_commit,
                                        GHashTable                 *new_reachable_regfile_content,
                                        guint                       similarity_percent_threshold,
@@ -232,22 +435,32 @@ _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
 {
   gboolean ret = FALSE;
   g_autoptr(GHashTable) ret_modified_regfile_content =
-    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   g_autoptr(GPtrArray) from_sizes = NULL;
+  g_autoptr(GPtrArray) all_to_sizes = NULL;
   g_autoptr(GPtrArray) to_sizes = NULL;
   guint i, j;
   guint lower;
   guint upper;
 
-  if (!build_content_sizenames_filtered (repo, from_commit, NULL,
-                                         &from_sizes,
-                                         cancellable, error))
+  if (!build_content_sizenames (repo, cache, from, from_commit,
+                                &from_sizes,
+                                cancellable, error))
     goto out;
 
-  if (!build_content_sizenames_filtered (repo, to_commit, new_reachable_regfile_content,
-                                         &to_sizes,
-                                         cancellable, error))
+  if (!build_content_sizenames (repo, cache, to, to_commit,
+                                &all_to_sizes,
+                                cancellable, error))
     goto out;
+
+  /* Only new objects are candidates; this keeps the size ordering */
+  to_sizes = g_ptr_array_new ();
+  for (i = 0; i < all_to_sizes->len; i++)
+    {
+      OstreeDeltaContentSizeNames *to_sizenames = all_to_sizes->pdata[i];
+      if (g_hash_table_contains (new_reachable_regfile_content, to_sizenames->checksum))
+        g_ptr_array_add (to_sizes, to_sizenames);
+    }
   
   /* Iterate over all newly added objects, find objects which have
    * similar basename and sizes.
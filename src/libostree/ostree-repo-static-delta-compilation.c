@@ -28,6 +28,9 @@
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-lzma-compressor.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-compressor.h"
+#endif
 #include "ostree-repo-static-delta-private.h"
 #include "ostree-diff.h"
 #include "ostree-rollsum.h"
@@ -59,6 +62,7 @@ typedef struct {
   guint n_rollsum;
   guint n_bsdiff;
   guint n_fallback;
+  guint n_jobs;
 } OstreeStaticDeltaBuilder;
 
 typedef enum {
@@ -414,6 +418,7 @@ typedef struct {
   char *from_checksum;
   GBytes *tmp_from;
   GBytes *tmp_to;
+  GBytes *payload;
 } ContentBsdiff;
 
 typedef struct {
@@ -439,19 +444,24 @@ content_bsdiffs_free (ContentBsdiff  *bsdiff)
   g_free (bsdiff->from_checksum);
   g_bytes_unref (bsdiff->tmp_from);
   g_bytes_unref (bsdiff->tmp_to);
+  if (bsdiff->payload)
+    g_bytes_unref (bsdiff->payload);
   g_free (bsdiff);
 }
 
 /* Load a content object, uncompressing it to an unlinked tmpfile
-   that's mmap()'d and suitable for seeking.
+   that's mmap()'d and suitable for seeking.  The result is kept in
+   @cache, as the same objects are typically the source or target of
+   several deltas, up to %_OSTREE_DELTA_UNPACKED_CACHE_MAX bytes.
  */
 static gboolean
-get_unpacked_unlinked_content (OstreeRepo       *repo,
-                               const char       *checksum,
-                               GBytes          **out_content,
-                               GFileInfo       **out_finfo,
-                               GCancellable     *cancellable,
-                               GError          **error)
+get_unpacked_unlinked_content (OstreeRepo                  *repo,
+                               OstreeDeltaGenerationCache  *cache,
+                               const char                  *checksum,
+                               GBytes                     **out_content,
+                               GFileInfo                  **out_finfo,
+                               GCancellable                *cancellable,
+                               GError                     **error)
 {
   gboolean ret = FALSE;
   g_autofree char *tmpname = g_strdup ("tmpostree-deltaobj-XXXXXX");
@@ -461,6 +471,26 @@ get_unpacked_unlinked_content (OstreeRepo       *repo,
   g_autoptr(GFileInfo) ret_finfo = NULL;
   g_autoptr(GOutputStream) out = NULL;
 
+  if (!_ostree_delta_generation_cache_query_file (repo, cache, checksum, &ret_finfo,
+                                                  cancellable, error))
+    goto out;
+
+  if (g_file_info_get_file_type (ret_finfo) != G_FILE_TYPE_REGULAR)
+    {
+      ret = TRUE;
+      gs_transfer_out_value (out_finfo, &ret_finfo);
+      goto out;
+    }
+
+  ret_content = _ostree_delta_generation_cache_lookup_unpacked (cache, checksum);
+  if (ret_content)
+    {
+      ret = TRUE;
+      gs_transfer_out_value (out_content, &ret_content);
+      gs_transfer_out_value (out_finfo, &ret_finfo);
+      goto out;
+    }
+
   fd = g_mkstemp (tmpname);
   if (fd == -1)
     {
@@ -470,16 +500,10 @@ get_unpacked_unlinked_content (OstreeRepo       *repo,
   /* Doesn't need a name */
   (void) unlink (tmpname);
 
-  if (!ostree_repo_load_file (repo, checksum, &istream, &ret_finfo, NULL,
+  if (!ostree_repo_load_file (repo, checksum, &istream, NULL, NULL,
                               cancellable, error))
     goto out;
 
-  if (g_file_info_get_file_type (ret_finfo) != G_FILE_TYPE_REGULAR)
-    {
-      ret = TRUE;
-      goto out;
-    }
-  
   out = g_unix_output_stream_new (fd, FALSE);
   if (g_output_stream_splice (out, istream, G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
                               cancellable, error) < 0)
@@ -490,14 +514,80 @@ get_unpacked_unlinked_content (OstreeRepo       *repo,
     g_mapped_file_unref (mfile);
   }
 
+  _ostree_delta_generation_cache_add_unpacked (cache, checksum, ret_content);
+
   ret = TRUE;
   gs_transfer_out_value (out_content, &ret_content);
+  gs_transfer_out_value (out_finfo, &ret_finfo);
+ out:
+  return ret;
+}
+
+struct bzdiff_opaque_s
+{
+  GOutputStream *out;
+  GCancellable *cancellable;
+  GError **error;
+};
+
+static int
+bzdiff_write (struct bsdiff_stream* stream, const void* buffer, int size)
+{
+  struct bzdiff_opaque_s *op = stream->opaque;
+  if (!g_output_stream_write (op->out,
+                              buffer,
+                              size,
+                              op->cancellable,
+                              op->error))
+    return -1;
+
+  return 0;
+}
+
+/* This is the expensive part of bsdiff; it's done while analyzing
+ * content (possibly in a worker thread) so that writing the part
+ * later is just a copy.
+ */
+static gboolean
+compute_bsdiff_payload (ContentBsdiff  *bsdiff_content,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  gboolean ret = FALSE;
+  struct bsdiff_stream stream;
+  struct bzdiff_opaque_s op;
+  const guint8 *tmp_to_buf;
+  gsize tmp_to_len;
+  const guint8 *tmp_from_buf;
+  gsize tmp_from_len;
+  g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+
+  tmp_to_buf = g_bytes_get_data (bsdiff_content->tmp_to, &tmp_to_len);
+  tmp_from_buf = g_bytes_get_data (bsdiff_content->tmp_from, &tmp_from_len);
+
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = bzdiff_write;
+  op.out = out;
+  op.cancellable = cancellable;
+  op.error = error;
+  stream.opaque = &op;
+  if (bsdiff (tmp_from_buf, tmp_from_len, tmp_to_buf, tmp_to_len, &stream) < 0)
+    goto out;
+
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+
+  bsdiff_content->payload = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+
+  ret = TRUE;
  out:
   return ret;
 }
 
 static gboolean
 try_content_bsdiff (OstreeRepo                       *repo,
+                    OstreeDeltaGenerationCache       *cache,
                     const char                       *from,
                     const char                       *to,
                     ContentBsdiff                    **out_bsdiff,
@@ -516,10 +606,10 @@ try_content_bsdiff (OstreeRepo                       *repo,
 
   *out_bsdiff = NULL;
 
-  if (!get_unpacked_unlinked_content (repo, from, &tmp_from, &from_finfo,
+  if (!get_unpacked_unlinked_content (repo, cache, from, &tmp_from, &from_finfo,
                                       cancellable, error))
     goto out;
-  if (!get_unpacked_unlinked_content (repo, to, &tmp_to, &to_finfo,
+  if (!get_unpacked_unlinked_content (repo, cache, to, &tmp_to, &to_finfo,
                                       cancellable, error))
     goto out;
 
@@ -534,6 +624,12 @@ try_content_bsdiff (OstreeRepo                       *repo,
   ret_bsdiff->tmp_from = tmp_from; tmp_from = NULL;
   ret_bsdiff->tmp_to = tmp_to; tmp_to = NULL;
 
+  if (!compute_bsdiff_payload (ret_bsdiff, cancellable, error))
+    {
+      content_bsdiffs_free (ret_bsdiff);
+      goto out;
+    }
+
   ret = TRUE;
   gs_transfer_out_value (out_bsdiff, &ret_bsdiff);
  out:
@@ -542,6 +638,7 @@ try_content_bsdiff (OstreeRepo                       *repo,
 
 static gboolean
 try_content_rollsum (OstreeRepo                       *repo,
+                     OstreeDeltaGenerationCache       *cache,
                      DeltaOpts                        opts,
                      const char                       *from,
                      const char                       *to,
@@ -564,10 +661,10 @@ try_content_rollsum (OstreeRepo                       *repo,
   /* Load the content objects, splice them to uncompressed temporary files that
    * we can just mmap() and seek around in conveniently.
    */
-  if (!get_unpacked_unlinked_content (repo, from, &tmp_from, &from_finfo,
+  if (!get_unpacked_unlinked_content (repo, cache, from, &tmp_from, &from_finfo,
                                       cancellable, error))
     goto out;
-  if (!get_unpacked_unlinked_content (repo, to, &tmp_to, &to_finfo,
+  if (!get_unpacked_unlinked_content (repo, cache, to, &tmp_to, &to_finfo,
                                       cancellable, error))
     goto out;
 
@@ -614,27 +711,6 @@ try_content_rollsum (OstreeRepo                       *repo,
   return ret;
 }
 
-struct bzdiff_opaque_s
-{
-  GOutputStream *out;
-  GCancellable *cancellable;
-  GError **error;
-};
-
-static int
-bzdiff_write (struct bsdiff_stream* stream, const void* buffer, int size)
-{
-  struct bzdiff_opaque_s *op = stream->opaque;
-  if (!g_output_stream_write (op->out,
-                              buffer,
-                              size,
-                              op->cancellable,
-                              op->error))
-    return -1;
-
-  return 0;
-}
-
 static void
 append_payload_chunk_and_write (OstreeStaticDeltaPartBuilder    *current_part,
                                 const guint8                    *buf,
@@ -783,10 +859,7 @@ process_one_bsdiff (OstreeRepo                       *repo,
   g_autoptr(GFileInfo) content_finfo = NULL;
   g_autoptr(GVariant) content_xattrs = NULL;
   OstreeStaticDeltaPartBuilder *current_part = *current_part_val;
-  const guint8 *tmp_to_buf;
   gsize tmp_to_len;
-  const guint8 *tmp_from_buf;
-  gsize tmp_from_len;
 
   /* Check to see if this delta has gone over maximum size */
   if (current_part->objects->len > 0 &&
@@ -795,8 +868,7 @@ process_one_bsdiff (OstreeRepo                       *repo,
       *current_part_val = current_part = allocate_part (builder);
     }
 
-  tmp_to_buf = g_bytes_get_data (bsdiff_content->tmp_to, &tmp_to_len);
-  tmp_from_buf = g_bytes_get_data (bsdiff_content->tmp_from, &tmp_from_len);
+  tmp_to_len = g_bytes_get_size (bsdiff_content->tmp_to);
 
   if (!ostree_repo_load_file (repo, to_checksum, &content_stream,
                               &content_finfo, &content_xattrs,
@@ -828,23 +900,8 @@ process_one_bsdiff (OstreeRepo                       *repo,
     _ostree_write_varuint64 (current_part->operations, content_size);
 
     {
-      struct bsdiff_stream stream;
-      struct bzdiff_opaque_s op;
-      const gchar *payload;
-      gssize payload_size;
-      g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
-      stream.malloc = malloc;
-      stream.free = free;
-      stream.write = bzdiff_write;
-      op.out = out;
-      op.cancellable = cancellable;
-      op.error = error;
-      stream.opaque = &op;
-      if (bsdiff (tmp_from_buf, tmp_from_len, tmp_to_buf, tmp_to_len, &stream) < 0)
-        goto out;
-
-      payload = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (out));
-      payload_size = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (out));
+      gsize payload_size;
+      const gchar *payload = g_bytes_get_data (bsdiff_content->payload, &payload_size);
 
       g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_BSPATCH);
       _ostree_write_varuint64 (current_part->operations, current_part->payload->len);
@@ -862,8 +919,87 @@ process_one_bsdiff (OstreeRepo                       *repo,
   return ret;
 }
 
+/* Run @func on each element of @jobs, using up to @n_threads
+ * threads.  Jobs must only write to their own element; callers
+ * collect the results afterwards in array order, which keeps the
+ * generated delta independent of scheduling.
+ */
+static void
+run_delta_jobs (GFunc       func,
+                gpointer    user_data,
+                GPtrArray  *jobs,
+                guint       n_threads)
+{
+  GThreadPool *pool;
+  GError *local_error = NULL;
+  guint i;
+
+  if (n_threads <= 1 || jobs->len <= 1)
+    {
+      for (i = 0; i < jobs->len; i++)
+        func (jobs->pdata[i], user_data);
+      return;
+    }
+
+  pool = g_thread_pool_new (func, user_data, MIN (n_threads, jobs->len), TRUE, &local_error);
+  g_assert_no_error (local_error);
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push (pool, jobs->pdata[i], NULL);
+  /* Waits for all queued jobs */
+  g_thread_pool_free (pool, FALSE, TRUE);
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeDeltaGenerationCache *cache;
+  DeltaOpts opts;
+  guint64 max_bsdiff_size_bytes;
+  GCancellable *cancellable;
+} ModifiedContentJobData;
+
+typedef struct {
+  const char *from_checksum;
+  const char *to_checksum;
+  ContentRollsum *rollsum;
+  ContentBsdiff *bsdiff;
+  GError *error;
+} ModifiedContentJob;
+
+static void
+modified_content_job_free (ModifiedContentJob *job)
+{
+  g_clear_pointer (&job->rollsum, content_rollsums_free);
+  g_clear_pointer (&job->bsdiff, content_bsdiffs_free);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+analyze_modified_content (gpointer datap,
+                          gpointer user_data)
+{
+  ModifiedContentJob *job = datap;
+  ModifiedContentJobData *data = user_data;
+
+  if (!try_content_rollsum (data->repo, data->cache, data->opts, job->from_checksum, job->to_checksum,
+                            &job->rollsum, data->cancellable, &job->error))
+    return;
+
+  if (job->rollsum)
+    return;
+
+  if (!(data->opts & DELTAOPT_FLAG_DISABLE_BSDIFF))
+    {
+      if (!try_content_bsdiff (data->repo, data->cache, job->from_checksum, job->to_checksum,
+                               &job->bsdiff, data->max_bsdiff_size_bytes,
+                               data->cancellable, &job->error))
+        return;
+    }
+}
+
 static gboolean 
 generate_delta_lowlatency (OstreeRepo                       *repo,
+                           OstreeDeltaGenerationCache       *cache,
                            const char                       *from,
                            const char                       *to,
                            DeltaOpts                         opts,
@@ -874,21 +1010,27 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
   gboolean ret = FALSE;
   GHashTableIter hashiter;
   gpointer key, value;
+  OstreeObjectSetIter setiter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  guint i;
+  guint n_new_reachable_metadata = 0;
   OstreeStaticDeltaPartBuilder *current_part = NULL;
   g_autoptr(GFile) root_from = NULL;
   g_autoptr(GVariant) from_commit = NULL;
   g_autoptr(GFile) root_to = NULL;
   g_autoptr(GVariant) to_commit = NULL;
-  g_autoptr(GHashTable) to_reachable_objects = NULL;
-  g_autoptr(GHashTable) from_reachable_objects = NULL;
+  OstreeObjectSet *to_reachable_objects = NULL;
+  OstreeObjectSet *from_reachable_objects = NULL;
+  OstreeObjectSet *new_reachable_objects = NULL;
   g_autoptr(GHashTable) from_regfile_content = NULL;
-  g_autoptr(GHashTable) new_reachable_metadata = NULL;
   g_autoptr(GHashTable) new_reachable_regfile_content = NULL;
   g_autoptr(GHashTable) new_reachable_symlink_content = NULL;
   g_autoptr(GHashTable) modified_regfile_content = NULL;
   g_autoptr(GHashTable) rollsum_optimized_content_objects = NULL;
   g_autoptr(GHashTable) bsdiff_optimized_content_objects = NULL;
   g_autoptr(GHashTable) content_object_to_size = NULL;
+  g_autoptr(GPtrArray) modified_content_jobs = NULL;
 
   if (from != NULL)
     {
@@ -900,8 +1042,9 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                      &from_commit, error))
         goto out;
 
-      if (!ostree_repo_traverse_commit (repo, from, 0, &from_reachable_objects,
-                                        cancellable, error))
+      if (!_ostree_delta_generation_cache_traverse_commit (repo, cache, from,
+                                                           &from_reachable_objects,
+                                                           cancellable, error))
         goto out;
     }
 
@@ -912,36 +1055,34 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                  &to_commit, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, to, 0, &to_reachable_objects,
-                                    cancellable, error))
+  if (!_ostree_delta_generation_cache_traverse_commit (repo, cache, to,
+                                                       &to_reachable_objects,
+                                                       cancellable, error))
     goto out;
 
-  new_reachable_metadata = ostree_repo_traverse_new_reachable ();
+  new_reachable_objects = _ostree_object_set_copy (to_reachable_objects);
+  if (from_reachable_objects)
+    _ostree_object_set_subtract (new_reachable_objects, from_reachable_objects);
+
   new_reachable_regfile_content = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
   new_reachable_symlink_content = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
 
-  g_hash_table_iter_init (&hashiter, to_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  _ostree_object_set_iter_init (&setiter, new_reachable_objects);
+  while (_ostree_object_set_iter_next (&setiter, &csum, &objtype, NULL))
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
-
-      if (from_reachable_objects && g_hash_table_contains (from_reachable_objects, serialized_key))
-        continue;
+      char checksum[65];
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      ostree_checksum_inplace_from_bytes (csum, checksum);
 
-      g_variant_ref (serialized_key);
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-        g_hash_table_add (new_reachable_metadata, serialized_key);
+        n_new_reachable_metadata++;
       else
         {
           g_autoptr(GFileInfo) finfo = NULL;
           GFileType ftype;
 
-          if (!ostree_repo_load_file (repo, checksum, NULL, &finfo, NULL,
-                                      cancellable, error))
+          if (!_ostree_delta_generation_cache_query_file (repo, cache, checksum, &finfo,
+                                                          cancellable, error))
             goto out;
 
           ftype = g_file_info_get_file_type (finfo);
@@ -956,7 +1097,9 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
 
   if (from_commit)
     {
-      if (!_ostree_delta_compute_similar_objects (repo, from_commit, to_commit,
+      if (!_ostree_delta_compute_similar_objects (repo, cache,
+                                                  from, from_commit,
+                                                  to, to_commit,
                                                   new_reachable_regfile_content,
                                                   CONTENT_SIZE_SIMILARITY_THRESHOLD_PERCENT,
                                                   &modified_regfile_content,
@@ -970,14 +1113,14 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
     {
       g_printerr ("modified: %u\n", g_hash_table_size (modified_regfile_content));
       g_printerr ("new reachable: metadata=%u content regular=%u symlink=%u\n",
-                  g_hash_table_size (new_reachable_metadata),
+                  n_new_reachable_metadata,
                   g_hash_table_size (new_reachable_regfile_content),
                   g_hash_table_size (new_reachable_symlink_content));
     }
 
   /* We already ship the to commit in the superblock, don't ship it twice */
-  g_hash_table_remove (new_reachable_metadata,
-                       ostree_object_name_serialize (to, OSTREE_OBJECT_TYPE_COMMIT));
+  (void) _ostree_object_set_remove_checksum (new_reachable_objects, to,
+                                             OSTREE_OBJECT_TYPE_COMMIT);
 
   rollsum_optimized_content_objects = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                              g_free,
@@ -987,34 +1130,44 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                                             g_free,
                                                             (GDestroyNotify) content_bsdiffs_free);
 
+  /* Computing rollsums and bsdiffs dominates generation time; do it
+   * in parallel, then add the results in the original order.
+   */
+  modified_content_jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) modified_content_job_free);
   g_hash_table_iter_init (&hashiter, modified_regfile_content);
   while (g_hash_table_iter_next (&hashiter, &key, &value))
     {
-      const char *to_checksum = key;
-      const char *from_checksum = value;
-      ContentRollsum *rollsum;
-      ContentBsdiff *bsdiff;
+      ModifiedContentJob *job = g_new0 (ModifiedContentJob, 1);
+      job->to_checksum = key;
+      job->from_checksum = value;
+      g_ptr_array_add (modified_content_jobs, job);
+    }
 
-      if (!try_content_rollsum (repo, opts, from_checksum, to_checksum,
-                                &rollsum, cancellable, error))
-        goto out;
+  { ModifiedContentJobData jobdata = { repo, cache, opts, builder->max_bsdiff_size_bytes, cancellable };
+    run_delta_jobs (analyze_modified_content, &jobdata, modified_content_jobs, builder->n_jobs);
+  }
+
+  for (i = 0; i < modified_content_jobs->len; i++)
+    {
+      ModifiedContentJob *job = modified_content_jobs->pdata[i];
 
-      if (rollsum)
+      if (job->error)
         {
-          g_hash_table_insert (rollsum_optimized_content_objects, g_strdup (to_checksum), rollsum);
-          builder->rollsum_size += rollsum->matches->match_size;
-          continue;
+          g_propagate_error (error, job->error);
+          job->error = NULL;
+          goto out;
         }
 
-      if (!(opts & DELTAOPT_FLAG_DISABLE_BSDIFF))
+      if (job->rollsum)
         {
-          if (!try_content_bsdiff (repo, from_checksum, to_checksum,
-                                   &bsdiff, builder->max_bsdiff_size_bytes,
-                                   cancellable, error))
-            goto out;
-
-          if (bsdiff)
-            g_hash_table_insert (bsdiff_optimized_content_objects, g_strdup (to_checksum), bsdiff);
+          builder->rollsum_size += job->rollsum->matches->match_size;
+          g_hash_table_insert (rollsum_optimized_content_objects, g_strdup (job->to_checksum), job->rollsum);
+          job->rollsum = NULL;
+        }
+      else if (job->bsdiff)
+        {
+          g_hash_table_insert (bsdiff_optimized_content_objects, g_strdup (job->to_checksum), job->bsdiff);
+          job->bsdiff = NULL;
         }
     }
 
@@ -1028,14 +1181,15 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
   current_part = allocate_part (builder);
 
   /* Pack the metadata first */
-  g_hash_table_iter_init (&hashiter, new_reachable_metadata);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  _ostree_object_set_iter_init (&setiter, new_reachable_objects);
+  while (_ostree_object_set_iter_next (&setiter, &csum, &objtype, NULL))
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      char checksum[65];
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      if (!OSTREE_OBJECT_TYPE_IS_META (objtype))
+        continue;
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
 
       if (!process_one_object (repo, builder, &current_part,
                                checksum, objtype,
@@ -1142,6 +1296,12 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
 
   ret = TRUE;
  out:
+  if (to_reachable_objects)
+    _ostree_object_set_unref (to_reachable_objects);
+  if (from_reachable_objects)
+    _ostree_object_set_unref (from_reachable_objects);
+  if (new_reachable_objects)
+    _ostree_object_set_unref (new_reachable_objects);
   return ret;
 }
 
@@ -1210,41 +1370,236 @@ get_fallback_headers (OstreeRepo               *self,
   return ret;
 }
 
-/**
- * ostree_repo_static_delta_generate:
- * @self: Repo
- * @opt: High level optimization choice
- * @from: ASCII SHA256 checksum of origin, or %NULL
- * @to: ASCII SHA256 checksum of target
- * @metadata: (allow-none): Optional metadata
- * @params: (allow-none): Parameters, see below
- * @cancellable: Cancellable
- * @error: Error
- *
- * Generate a lookaside "static delta" from @from (%NULL means
- * from-empty) which can generate the objects in @to.  This delta is
- * an optimization over fetching individual objects, and can be
- * conveniently stored and applied offline.
- *
- * The @params argument should be an a{sv}.  The following attributes
- * are known:
- *   - min-fallback-size: u: Minimume uncompressed size in megabytes to use fallback
- *   - max-chunk-size: u: Maximum size in megabytes of a delta part
- *   - max-bsdiff-size: u: Maximum size in megabytes to consider bsdiff compression
- *   for input files
- *   - compression: y: Compression type: 0=none, x=lzma, g=gzip
- *   - bsdiff-enabled: b: Enable bsdiff compression.  Default TRUE.
- *   - verbose: b: Print diagnostic messages.  Default FALSE.
+static gboolean
+compress_delta_part (OstreeRepo                    *self,
+                     OstreeStaticDeltaPartBuilder  *part_builder,
+                     GVariant                      *delta_part_content,
+                     guint8                         compression_type_char,
+                     GVariant                     **out_header,
+                     GFile                        **out_tempfile,
+                     guint64                       *out_compressed_size,
+                     GCancellable                  *cancellable,
+                     GError                       **error)
+{
+  gboolean ret = FALSE;
+  g_autofree guchar *part_checksum = NULL;
+  g_autoptr(GBytes) objtype_checksum_array = NULL;
+  g_autoptr(GBytes) checksum_bytes = NULL;
+  g_autoptr(GFile) part_tempfile = NULL;
+  g_autoptr(GOutputStream) part_temp_outstream = NULL;
+  g_autoptr(GInputStream) part_in = NULL;
+  g_autoptr(GInputStream) part_payload_in = NULL;
+  g_autoptr(GMemoryOutputStream) part_payload_out = NULL;
+  g_autoptr(GConverterOutputStream) part_payload_compressor = NULL;
+  g_autoptr(GConverter) compressor = NULL;
+  g_autoptr(GVariant) delta_part = NULL;
+  g_autoptr(GVariant) delta_part_header = NULL;
+  guint32 part_version = OSTREE_DELTAPART_VERSION;
+
+  switch (compression_type_char)
+    {
+    case 0:
+      break;
+    case 'x':
+      compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
+      break;
+#ifdef HAVE_ZSTD
+    case 'z':
+      compressor = (GConverter*)_ostree_zstd_compressor_new (19);
+      part_version = OSTREE_DELTAPART_VERSION_ZSTD;
+      break;
+#endif
+    default:
+      g_assert_not_reached ();
+    }
+
+  part_payload_in = ot_variant_read (delta_part_content);
+  part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  if (compressor)
+    part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, compressor);
+
+  {
+    gssize n_bytes_written = g_output_stream_splice (part_payload_compressor ? (GOutputStream*)part_payload_compressor : (GOutputStream*)part_payload_out,
+                                                     part_payload_in,
+                                                     G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                                     cancellable, error);
+    if (n_bytes_written < 0)
+      goto out;
+  }
+
+  /* FIXME - avoid duplicating memory here */
+  delta_part = g_variant_new ("(y@ay)",
+                              compression_type_char,
+                              ot_gvariant_new_ay_bytes (g_memory_output_stream_steal_as_bytes (part_payload_out)));
+
+  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
+                               &part_tempfile, &part_temp_outstream,
+                               cancellable, error))
+    goto out;
+  part_in = ot_variant_read (delta_part);
+  if (!ot_gio_splice_get_checksum (part_temp_outstream, part_in,
+                                   &part_checksum,
+                                   cancellable, error))
+    goto out;
+
+  checksum_bytes = g_bytes_new (part_checksum, 32);
+  objtype_checksum_array = objtype_checksum_array_new (part_builder->objects);
+  delta_part_header = g_variant_new ("(u@aytt@ay)",
+                                     part_version,
+                                     ot_gvariant_new_ay_bytes (checksum_bytes),
+                                     (guint64) g_variant_get_size (delta_part),
+                                     part_builder->uncompressed_size,
+                                     ot_gvariant_new_ay_bytes (objtype_checksum_array));
+
+  ret = TRUE;
+  *out_compressed_size = g_variant_get_size (delta_part);
+  gs_transfer_out_value (out_header, &delta_part_header);
+  gs_transfer_out_value (out_tempfile, &part_tempfile);
+ out:
+  return ret;
+}
+
+/* With zstd compression, the part is written twice: compressed with
+ * lzma for the regular superblock, which every client can use, and
+ * with zstd for the zstd superblock.
  */
-gboolean
-ostree_repo_static_delta_generate (OstreeRepo                   *self,
-                                   OstreeStaticDeltaGenerateOpt  opt,
-                                   const char                   *from,
-                                   const char                   *to,
-                                   GVariant                     *metadata,
-                                   GVariant                     *params,
-                                   GCancellable                 *cancellable,
-                                   GError                      **error)
+static gboolean
+write_delta_part (OstreeRepo                    *self,
+                  OstreeStaticDeltaPartBuilder  *part_builder,
+                  guint8                         compression_type_char,
+                  GVariant                     **out_header,
+                  GFile                        **out_tempfile,
+                  guint64                       *out_compressed_size,
+                  GVariant                     **out_zstd_header,
+                  GFile                        **out_zstd_tempfile,
+                  guint64                       *out_zstd_compressed_size,
+                  GCancellable                  *cancellable,
+                  GError                       **error)
+{
+  gboolean ret = FALSE;
+  GBytes *payload_b;
+  GBytes *operations_b;
+  g_autoptr(GVariant) delta_part_content = NULL;
+  GVariantBuilder *mode_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(uuu)"));
+  GVariantBuilder *xattr_builder = g_variant_builder_new (G_VARIANT_TYPE ("aa(ayay)"));
+
+  { guint j;
+    for (j = 0; j < part_builder->modes->len; j++)
+      g_variant_builder_add_value (mode_builder, part_builder->modes->pdata[j]);
+    
+    for (j = 0; j < part_builder->xattrs->len; j++)
+      g_variant_builder_add_value (xattr_builder, part_builder->xattrs->pdata[j]);
+  }
+    
+  payload_b = g_string_free_to_bytes (part_builder->payload);
+  part_builder->payload = NULL;
+  
+  operations_b = g_string_free_to_bytes (part_builder->operations);
+  part_builder->operations = NULL;
+  /* FIXME - avoid duplicating memory here */
+  delta_part_content = g_variant_new ("(a(uuu)aa(ayay)@ay@ay)",
+                                      mode_builder, xattr_builder,
+                                      ot_gvariant_new_ay_bytes (payload_b),
+                                      ot_gvariant_new_ay_bytes (operations_b));
+  g_variant_ref_sink (delta_part_content);
+
+  if (compression_type_char == 'z')
+    {
+      if (!compress_delta_part (self, part_builder, delta_part_content, 'z',
+                                out_zstd_header, out_zstd_tempfile, out_zstd_compressed_size,
+                                cancellable, error))
+        goto out;
+      compression_type_char = 'x';
+    }
+
+  if (!compress_delta_part (self, part_builder, delta_part_content, compression_type_char,
+                            out_header, out_tempfile, out_compressed_size,
+                            cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  guint8 compression;
+  GCancellable *cancellable;
+} DeltaPartJobData;
+
+typedef struct {
+  OstreeStaticDeltaPartBuilder *part_builder;
+  GVariant *header;
+  GFile *tempfile;
+  guint64 compressed_size;
+  GVariant *zstd_header;
+  GFile *zstd_tempfile;
+  guint64 zstd_compressed_size;
+  GError *error;
+} DeltaPartJob;
+
+static void
+delta_part_job_free (DeltaPartJob *job)
+{
+  g_clear_pointer (&job->header, g_variant_unref);
+  g_clear_object (&job->tempfile);
+  g_clear_pointer (&job->zstd_header, g_variant_unref);
+  g_clear_object (&job->zstd_tempfile);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static void
+write_delta_part_job (gpointer datap,
+                      gpointer user_data)
+{
+  DeltaPartJob *job = datap;
+  DeltaPartJobData *data = user_data;
+
+  (void) write_delta_part (data->repo, job->part_builder, data->compression,
+                           &job->header, &job->tempfile, &job->compressed_size,
+                           &job->zstd_header, &job->zstd_tempfile, &job->zstd_compressed_size,
+                           data->cancellable, &job->error);
+}
+
+static GVariant *
+new_delta_superblock (GVariant      *metadata,
+                      guint64        timestamp,
+                      const char    *from,
+                      const char    *to,
+                      GVariant      *to_commit,
+                      GVariantBuilder *part_headers,
+                      GVariant      *fallback_headers)
+{
+  /* floating */ GVariant *from_csum_v =
+    from ? ostree_checksum_to_bytes_v (from) : ot_gvariant_new_bytearray ((guchar *)"", 0);
+  /* floating */ GVariant *to_csum_v =
+    ostree_checksum_to_bytes_v (to);
+
+  return g_variant_ref_sink (g_variant_new ("(@a{sv}t@ay@ay@" OSTREE_COMMIT_GVARIANT_STRING "ay"
+                                            "a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT
+                                            "@a" OSTREE_STATIC_DELTA_FALLBACK_FORMAT ")",
+                                            metadata,
+                                            timestamp,
+                                            from_csum_v,
+                                            to_csum_v,
+                                            to_commit,
+                                            g_variant_builder_new (G_VARIANT_TYPE ("ay")),
+                                            part_headers,
+                                            fallback_headers));
+}
+
+static gboolean
+generate_one_delta (OstreeRepo                   *self,
+                    OstreeDeltaGenerationCache   *cache,
+                    OstreeStaticDeltaGenerateOpt  opt,
+                    const char                   *from,
+                    const char                   *to,
+                    GVariant                     *metadata,
+                    GVariant                     *params,
+                    GCancellable                 *cancellable,
+                    GError                      **error)
 {
   gboolean ret = FALSE;
   OstreeStaticDeltaBuilder builder = { 0, };
@@ -1252,15 +1607,21 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   guint min_fallback_size;
   guint max_bsdiff_size;
   guint max_chunk_size;
+  guint8 compression;
   GVariant *metadata_source;
   DeltaOpts delta_opts = DELTAOPT_FLAG_NONE;
   guint64 total_compressed_size = 0;
   guint64 total_uncompressed_size = 0;
   g_autoptr(GVariantBuilder) part_headers = NULL;
+  g_autoptr(GVariantBuilder) zstd_part_headers = NULL;
   g_autoptr(GPtrArray) part_tempfiles = NULL;
+  g_autoptr(GPtrArray) zstd_part_tempfiles = NULL;
+  g_autoptr(GPtrArray) part_jobs = NULL;
   g_autoptr(GVariant) delta_descriptor = NULL;
+  g_autoptr(GVariant) zstd_delta_descriptor = NULL;
   g_autoptr(GVariant) to_commit = NULL;
   g_autofree char *descriptor_relpath = NULL;
+  g_autofree char *zstd_descriptor_relpath = NULL;
   g_autoptr(GFile) descriptor_path = NULL;
   g_autoptr(GFile) descriptor_dir = NULL;
   g_autoptr(GVariant) tmp_metadata = NULL;
@@ -1279,6 +1640,25 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   if (!g_variant_lookup (params, "max-chunk-size", "u", &max_chunk_size))
     max_chunk_size = 32;
   builder.max_chunk_size_bytes = ((guint64)max_chunk_size) * 1000 * 1000;
+  if (!g_variant_lookup (params, "jobs", "u", &builder.n_jobs))
+    builder.n_jobs = 1;
+  if (builder.n_jobs == 0)
+    builder.n_jobs = g_get_num_processors ();
+  if (!g_variant_lookup (params, "compression", "y", &compression))
+    compression = 'x';
+  switch (compression)
+    {
+    case 0:
+    case 'x':
+#ifdef HAVE_ZSTD
+    case 'z':
+#endif
+      break;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported delta compression type '%c'", compression);
+      goto out;
+    }
 
   { gboolean use_bsdiff;
     if (!g_variant_lookup (params, "bsdiff-enabled", "b", &use_bsdiff))
@@ -1299,109 +1679,65 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
     goto out;
 
   /* Ignore optimization flags */
-  if (!generate_delta_lowlatency (self, from, to, delta_opts, &builder,
+  if (!generate_delta_lowlatency (self, cache, from, to, delta_opts, &builder,
                                   cancellable, error))
     goto out;
 
   part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
+  zstd_part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
   part_tempfiles = g_ptr_array_new_with_free_func (g_object_unref);
+  zstd_part_tempfiles = g_ptr_array_new_with_free_func (g_object_unref);
+
+  /* Serializing and compressing the parts is independent per part */
+  part_jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) delta_part_job_free);
   for (i = 0; i < builder.parts->len; i++)
     {
-      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
-      GBytes *payload_b;
-      GBytes *operations_b;
-      g_autofree guchar *part_checksum = NULL;
-      g_autoptr(GChecksum) checksum = NULL;
-      g_autoptr(GBytes) objtype_checksum_array = NULL;
-      g_autoptr(GBytes) checksum_bytes = NULL;
-      g_autoptr(GFile) part_tempfile = NULL;
-      g_autoptr(GOutputStream) part_temp_outstream = NULL;
-      g_autoptr(GInputStream) part_in = NULL;
-      g_autoptr(GInputStream) part_payload_in = NULL;
-      g_autoptr(GMemoryOutputStream) part_payload_out = NULL;
-      g_autoptr(GConverterOutputStream) part_payload_compressor = NULL;
-      g_autoptr(GConverter) compressor = NULL;
-      g_autoptr(GVariant) delta_part_content = NULL;
-      g_autoptr(GVariant) delta_part = NULL;
-      g_autoptr(GVariant) delta_part_header = NULL;
-      GVariantBuilder *mode_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(uuu)"));
-      GVariantBuilder *xattr_builder = g_variant_builder_new (G_VARIANT_TYPE ("aa(ayay)"));
-      guint8 compression_type_char;
-
-      { guint j;
-        for (j = 0; j < part_builder->modes->len; j++)
-          g_variant_builder_add_value (mode_builder, part_builder->modes->pdata[j]);
-        
-        for (j = 0; j < part_builder->xattrs->len; j++)
-          g_variant_builder_add_value (xattr_builder, part_builder->xattrs->pdata[j]);
-      }
-        
-      payload_b = g_string_free_to_bytes (part_builder->payload);
-      part_builder->payload = NULL;
-      
-      operations_b = g_string_free_to_bytes (part_builder->operations);
-      part_builder->operations = NULL;
-      /* FIXME - avoid duplicating memory here */
-      delta_part_content = g_variant_new ("(a(uuu)aa(ayay)@ay@ay)",
-                                          mode_builder, xattr_builder,
-                                          ot_gvariant_new_ay_bytes (payload_b),
-                                          ot_gvariant_new_ay_bytes (operations_b));
-      g_variant_ref_sink (delta_part_content);
-
-      /* Hardcode xz for now */
-      compressor = (GConverter*)_ostree_lzma_compressor_new (NULL);
-      compression_type_char = 'x';
-      part_payload_in = ot_variant_read (delta_part_content);
-      part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-      part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, compressor);
+      DeltaPartJob *job = g_new0 (DeltaPartJob, 1);
+      job->part_builder = builder.parts->pdata[i];
+      g_ptr_array_add (part_jobs, job);
+    }
 
-      {
-        gssize n_bytes_written = g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
-                                                         G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                                         cancellable, error);
-        if (n_bytes_written < 0)
-          goto out;
-      }
+  { DeltaPartJobData jobdata = { self, compression, cancellable };
+    run_delta_jobs (write_delta_part_job, &jobdata, part_jobs, builder.n_jobs);
+  }
 
-      /* FIXME - avoid duplicating memory here */
-      delta_part = g_variant_new ("(y@ay)",
-                                  compression_type_char,
-                                  ot_gvariant_new_ay_bytes (g_memory_output_stream_steal_as_bytes (part_payload_out)));
+  for (i = 0; i < part_jobs->len; i++)
+    {
+      DeltaPartJob *job = part_jobs->pdata[i];
+      OstreeStaticDeltaPartBuilder *part_builder = job->part_builder;
 
-      if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
-                                   &part_tempfile, &part_temp_outstream,
-                                   cancellable, error))
-        goto out;
-      part_in = ot_variant_read (delta_part);
-      if (!ot_gio_splice_get_checksum (part_temp_outstream, part_in,
-                                       &part_checksum,
-                                       cancellable, error))
-        goto out;
+      if (job->error)
+        {
+          g_propagate_error (error, job->error);
+          job->error = NULL;
+          goto out;
+        }
 
-      checksum_bytes = g_bytes_new (part_checksum, 32);
-      objtype_checksum_array = objtype_checksum_array_new (part_builder->objects);
-      delta_part_header = g_variant_new ("(u@aytt@ay)",
-                                         OSTREE_DELTAPART_VERSION,
-                                         ot_gvariant_new_ay_bytes (checksum_bytes),
-                                         (guint64) g_variant_get_size (delta_part),
-                                         part_builder->uncompressed_size,
-                                         ot_gvariant_new_ay_bytes (objtype_checksum_array));
-      g_variant_builder_add_value (part_headers, g_variant_ref (delta_part_header));
-      g_ptr_array_add (part_tempfiles, g_object_ref (part_tempfile));
+      g_variant_builder_add_value (part_headers, g_variant_ref (job->header));
+      g_ptr_array_add (part_tempfiles, g_object_ref (job->tempfile));
+      if (job->zstd_header)
+        {
+          g_variant_builder_add_value (zstd_part_headers, g_variant_ref (job->zstd_header));
+          g_ptr_array_add (zstd_part_tempfiles, g_object_ref (job->zstd_tempfile));
+        }
       
-      total_compressed_size += g_variant_get_size (delta_part);
+      total_compressed_size += job->compressed_size;
       total_uncompressed_size += part_builder->uncompressed_size;
 
       if (delta_opts & DELTAOPT_FLAG_VERBOSE)
         {
           g_printerr ("part %u n:%u compressed:%" G_GUINT64_FORMAT " uncompressed:%" G_GUINT64_FORMAT "\n",
                       i, part_builder->objects->len,
-                      (guint64)g_variant_get_size (delta_part),
+                      job->compressed_size,
                       part_builder->uncompressed_size);
+          if (job->zstd_header)
+            g_printerr ("part %u zstd compressed:%" G_GUINT64_FORMAT "\n",
+                        i, job->zstd_compressed_size);
         }
     }
 
   descriptor_relpath = _ostree_get_relative_static_delta_superblock_path (from, to);
+  zstd_descriptor_relpath = _ostree_get_relative_static_delta_zstd_superblock_path (from, to);
   descriptor_path = g_file_resolve_relative_path (self->repodir, descriptor_relpath);
   descriptor_dir = g_file_get_parent (descriptor_path);
 
@@ -1418,36 +1754,41 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
         goto out;
     }
 
+  for (i = 0; i < zstd_part_tempfiles->len; i++)
+    {
+      GFile *tempfile = zstd_part_tempfiles->pdata[i];
+      g_autofree char *part_relpath = _ostree_get_relative_static_delta_zstd_part_path (from, to, i);
+      g_autoptr(GFile) part_path = g_file_resolve_relative_path (self->repodir, part_relpath);
+
+      if (!gs_file_rename (tempfile, part_path, cancellable, error))
+        goto out;
+    }
+
   if (metadata != NULL)
     metadata_source = metadata;
   else
     {
-      metadata_source = ot_gvariant_new_empty_string_dict ();
+      tmp_metadata = g_variant_ref_sink (ot_gvariant_new_empty_string_dict ());
+      metadata_source = tmp_metadata;
     }
 
   if (!get_fallback_headers (self, &builder, &fallback_headers,
                              cancellable, error))
     goto out;
 
-  /* Generate OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT */
+  /* Generate OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT; the zstd superblock
+   * only differs in its part headers.
+   */
   {
     GDateTime *now = g_date_time_new_now_utc ();
-    /* floating */ GVariant *from_csum_v =
-      from ? ostree_checksum_to_bytes_v (from) : ot_gvariant_new_bytearray ((guchar *)"", 0);
-    /* floating */ GVariant *to_csum_v =
-      ostree_checksum_to_bytes_v (to);
-
-    delta_descriptor = g_variant_new ("(@a{sv}t@ay@ay@" OSTREE_COMMIT_GVARIANT_STRING "ay"
-                                      "a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT
-                                      "@a" OSTREE_STATIC_DELTA_FALLBACK_FORMAT ")",
-                                      metadata_source,
-                                      GUINT64_TO_BE (g_date_time_to_unix (now)),
-                                      from_csum_v,
-                                      to_csum_v,
-                                      to_commit,
-                                      g_variant_builder_new (G_VARIANT_TYPE ("ay")),
-                                      part_headers,
-                                      fallback_headers);
+    guint64 timestamp = GUINT64_TO_BE (g_date_time_to_unix (now));
+
+    delta_descriptor = new_delta_superblock (metadata_source, timestamp, from, to,
+                                             to_commit, part_headers, fallback_headers);
+    if (zstd_part_tempfiles->len > 0)
+      zstd_delta_descriptor = new_delta_superblock (metadata_source, timestamp, from, to,
+                                                    to_commit, zstd_part_headers,
+                                                    fallback_headers);
     g_date_time_unref (now);
   }
 
@@ -1463,6 +1804,21 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
       g_printerr ("bsdiff=%u objects\n", builder.n_bsdiff);
     }
 
+  /* Write the zstd superblock first, and drop a stale one if this
+   * delta has no zstd parts, so it never refers to missing parts.
+   */
+  if (zstd_delta_descriptor)
+    {
+      g_autoptr(GFile) zstd_descriptor_path =
+        g_file_resolve_relative_path (self->repodir, zstd_descriptor_relpath);
+
+      if (!ot_util_variant_save (zstd_descriptor_path, zstd_delta_descriptor,
+                                 cancellable, error))
+        goto out;
+    }
+  else if (!ot_ensure_unlinked_at (self->repo_dir_fd, zstd_descriptor_relpath, error))
+    goto out;
+
   if (!ot_util_variant_save (descriptor_path, delta_descriptor, cancellable, error))
     goto out;
 
@@ -1472,3 +1828,101 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   g_clear_pointer (&builder.fallback_objects, g_ptr_array_unref);
   return ret;
 }
+
+/**
+ * ostree_repo_static_delta_generate:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @from: ASCII SHA256 checksum of origin, or %NULL
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata
+ * @params: (allow-none): Parameters, see below
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Generate a lookaside "static delta" from @from (%NULL means
+ * from-empty) which can generate the objects in @to.  This delta is
+ * an optimization over fetching individual objects, and can be
+ * conveniently stored and applied offline.
+ *
+ * The @params argument should be an a{sv}.  The following attributes
+ * are known:
+ *   - min-fallback-size: u: Minimume uncompressed size in megabytes to use fallback
+ *   - max-chunk-size: u: Maximum size in megabytes of a delta part
+ *   - max-bsdiff-size: u: Maximum size in megabytes to consider bsdiff compression
+ *   for input files
+ *   - compression: y: Compression type: 0=none, x=lzma (default), z=zstd.
+ *   With zstd, the delta additionally gets lzma-compressed parts and
+ *   superblock, which clients without zstd support use instead.
+ *   - bsdiff-enabled: b: Enable bsdiff compression.  Default TRUE.
+ *   - verbose: b: Print diagnostic messages.  Default FALSE.
+ *   - jobs: u: Number of threads used to compute rollsums and bsdiffs
+ *   and to compress parts; 0 means one per CPU.  Default 1.  The
+ *   generated delta does not depend on this.
+ */
+gboolean
+ostree_repo_static_delta_generate (OstreeRepo                   *self,
+                                   OstreeStaticDeltaGenerateOpt  opt,
+                                   const char                   *from,
+                                   const char                   *to,
+                                   GVariant                     *metadata,
+                                   GVariant                     *params,
+                                   GCancellable                 *cancellable,
+                                   GError                      **error)
+{
+  gboolean ret;
+  OstreeDeltaGenerationCache *cache = _ostree_delta_generation_cache_new ();
+
+  ret = generate_one_delta (self, cache, opt, from, to, metadata, params,
+                            cancellable, error);
+
+  _ostree_delta_generation_cache_free (cache);
+  return ret;
+}
+
+/**
+ * ostree_repo_static_delta_generate_batch:
+ * @self: Repo
+ * @opt: High level optimization choice
+ * @froms: (array zero-terminated=1): ASCII SHA256 checksums of origins
+ * @to: ASCII SHA256 checksum of target
+ * @metadata: (allow-none): Optional metadata
+ * @params: (allow-none): Parameters, see ostree_repo_static_delta_generate()
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Generate a static delta to @to from each commit in @froms, as if by
+ * calling ostree_repo_static_delta_generate() for each one.  This is
+ * much cheaper than separate calls, since the traversal of each commit,
+ * the file metadata, and the uncompressed content of objects are
+ * shared between all of the deltas.
+ */
+gboolean
+ostree_repo_static_delta_generate_batch (OstreeRepo                   *self,
+                                         OstreeStaticDeltaGenerateOpt  opt,
+                                         const char * const           *froms,
+                                         const char                   *to,
+                                         GVariant                     *metadata,
+                                         GVariant                     *params,
+                                         GCancellable                 *cancellable,
+                                         GError                      **error)
+{
+  gboolean ret = FALSE;
+  OstreeDeltaGenerationCache *cache = _ostree_delta_generation_cache_new ();
+  const char * const *iter;
+
+  for (iter = froms; iter && *iter; iter++)
+    {
+      if (!generate_one_delta (self, cache, opt, *iter, to, metadata, params,
+                               cancellable, error))
+        {
+          g_prefix_error (error, "Generating delta %s-%s: ", *iter, to);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  _ostree_delta_generation_cache_free (cache);
+  return ret;
+}
@@ -326,7 +326,7 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
         bytes = g_mapped_file_get_bytes (mfile);
         g_mapped_file_unref (mfile);
         
-        if (!_ostree_static_delta_part_execute (self, objects, bytes,
+        if (!_ostree_static_delta_part_execute (self, objects, bytes, usize,
                                                 cancellable, error))
           {
             g_prefix_error (error, "executing delta part %i: ", i);
@@ -21,6 +21,7 @@
 #pragma once
 
 #include "ostree-core.h"
+#include "ostree-object-set.h"
 
 G_BEGIN_DECLS
 
@@ -31,6 +32,12 @@ G_BEGIN_DECLS
 
 #define OSTREE_SUMMARY_STATIC_DELTAS "ostree.static-deltas"
 
+/* Like OSTREE_SUMMARY_STATIC_DELTAS, but for the checksums of the
+ * zstd superblocks of the deltas which have one.  Clients without zstd
+ * support ignore it and use the lzma superblock.
+ */
+#define OSTREE_SUMMARY_STATIC_DELTAS_ZSTD "ostree.static-deltas-zstd"
+
 /**
  * OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT_V0:
  *
@@ -113,6 +120,7 @@ gboolean _ostree_static_delta_part_validate (OstreeRepo     *repo,
 gboolean _ostree_static_delta_part_execute (OstreeRepo      *repo,
                                             GVariant        *header,
                                             GBytes          *partdata,
+                                            guint64          uncompressed_size_hint,
                                             GCancellable    *cancellable,
                                             GError         **error);
 
@@ -125,6 +133,7 @@ gboolean _ostree_static_delta_part_execute_raw (OstreeRepo      *repo,
 void _ostree_static_delta_part_execute_async (OstreeRepo      *repo,
                                               GVariant        *header,
                                               GBytes          *partdata,
+                                              guint64          uncompressed_size_hint,
                                               GCancellable    *cancellable,
                                               GAsyncReadyCallback  callback,
                                               gpointer         user_data);
@@ -164,9 +173,65 @@ typedef struct {
 
 void _ostree_delta_content_sizenames_free (gpointer v);
 
+/* Bound on the total size of uncompressed content kept around by
+ * OstreeDeltaGenerationCache; least recently used objects are
+ * dropped past it.
+ */
+#define _OSTREE_DELTA_UNPACKED_CACHE_MAX (256 * 1024 * 1024)
+
+typedef struct {
+  char *checksum;
+  GBytes *content;
+  GList link;
+} OstreeDeltaUnpackedContent;
+
+/* State shared between generating several deltas, in particular
+ * many deltas to the same commit.  Safe to use from multiple
+ * threads.
+ */
+typedef struct {
+  GMutex lock;
+  GHashTable *reachable; /* commit checksum -> OstreeObjectSet */
+  GHashTable *sizenames; /* commit checksum -> GPtrArray<OstreeDeltaContentSizeNames> */
+  GHashTable *file_info; /* content checksum -> GFileInfo */
+  GHashTable *unpacked;  /* content checksum -> OstreeDeltaUnpackedContent */
+  GQueue unpacked_lru;   /* of OstreeDeltaUnpackedContent, most recently used first */
+  guint64 unpacked_size;
+} OstreeDeltaGenerationCache;
+
+OstreeDeltaGenerationCache *_ostree_delta_generation_cache_new (void);
+
+void _ostree_delta_generation_cache_free (OstreeDeltaGenerationCache *cache);
+
+GBytes *_ostree_delta_generation_cache_lookup_unpacked (OstreeDeltaGenerationCache *cache,
+                                                        const char                 *checksum);
+
+void _ostree_delta_generation_cache_add_unpacked (OstreeDeltaGenerationCache *cache,
+                                                  const char                 *checksum,
+                                                  GBytes                     *content);
+
+gboolean
+_ostree_delta_generation_cache_traverse_commit (OstreeRepo                   *repo,
+                                                OstreeDeltaGenerationCache   *cache,
+                                                const char                   *commit_checksum,
+                                                OstreeObjectSet             **out_reachable,
+                                                GCancellable                 *cancellable,
+                                                GError                      **error);
+
+gboolean
+_ostree_delta_generation_cache_query_file (OstreeRepo                   *repo,
+                                           OstreeDeltaGenerationCache   *cache,
+                                           const char                   *checksum,
+                                           GFileInfo                   **out_finfo,
+                                           GCancellable                 *cancellable,
+                                           GError                      **error);
+
 gboolean
 _ostree_delta_compute_similar_objects (OstreeRepo                 *repo,
+                                       OstreeDeltaGenerationCache *cache,
+                                       const char                 *from,
                                        GVariant                   *from_commit,
+                                       const char                 *to,
                                        GVariant                   *to_commit,
                                        GHashTable                 *new_reachable_regfile_content,
                                        guint                       similarity_percent_threshold,
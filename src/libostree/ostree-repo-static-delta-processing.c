@@ -31,6 +31,9 @@
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
 #include "ostree-lzma-decompressor.h"
+#ifdef HAVE_ZSTD
+#include "ostree-zstd-decompressor.h"
+#endif
 #include "otutil.h"
 #include "ostree-varint.h"
 #include "bsdiff/bspatch.h"
@@ -282,29 +285,78 @@ _ostree_static_delta_part_execute_raw (OstreeRepo      *repo,
   return ret;
 }
 
+/*
+ * decompress_part:
+ *
+ * Decompress the payload of a delta part.  @uncompressed_size_hint is
+ * the size recorded for the part in the superblock; it does not
+ * include the payload framing, so it is only used to pick a strategy.
+ * Parts that fit in the repository's static delta memory limit are
+ * decompressed into a buffer preallocated to about the right size,
+ * rather than one which grows (and transiently doubles) as it goes.
+ * Larger ones are streamed into an unlinked temporary file which is
+ * then mapped, so their pages are file-backed and can be reclaimed
+ * instead of counting against the process.
+ */
 static gboolean
-decompress_all (GConverter   *converter,
-                GBytes       *data,
-                GBytes      **out_uncompressed,
-                GCancellable *cancellable,
-                GError      **error)
+decompress_part (OstreeRepo   *repo,
+                 GConverter   *converter,
+                 GBytes       *data,
+                 guint64       uncompressed_size_hint,
+                 GBytes      **out_uncompressed,
+                 GCancellable *cancellable,
+                 GError      **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GMemoryInputStream) memin = (GMemoryInputStream*)g_memory_input_stream_new_from_bytes (data);
-  g_autoptr(GMemoryOutputStream) memout = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  g_autoptr(GInputStream) convin = g_converter_input_stream_new ((GInputStream*)memin, converter);
-
-  {
-    gssize n_bytes_written = g_output_stream_splice ((GOutputStream*)memout, convin,
-                                                     G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
-                                                     G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
-                                                     cancellable, error);
-      if (n_bytes_written < 0)
+  g_autoptr(GInputStream) memin = g_memory_input_stream_new_from_bytes (data);
+  g_autoptr(GInputStream) convin = g_converter_input_stream_new (memin, converter);
+  g_autoptr(GBytes) ret_uncompressed = NULL;
+
+  if (uncompressed_size_hint <= repo->static_delta_memory_limit)
+    {
+      /* Leave some room for the payload framing */
+      gsize initial_size = uncompressed_size_hint + (uncompressed_size_hint / 16) + 4096;
+      g_autoptr(GMemoryOutputStream) memout =
+        (GMemoryOutputStream*)g_memory_output_stream_new (g_malloc (initial_size), initial_size,
+                                                          g_realloc, g_free);
+
+      if (g_output_stream_splice ((GOutputStream*)memout, convin,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, error) < 0)
+        goto out;
+
+      ret_uncompressed = g_memory_output_stream_steal_as_bytes (memout);
+    }
+  else
+    {
+      g_autofree char *tmpname = NULL;
+      g_autoptr(GOutputStream) tmpout = NULL;
+      GMappedFile *mfile;
+
+      if (!gs_file_open_in_tmpdir_at (repo->tmp_dir_fd, 0600, &tmpname, &tmpout,
+                                      cancellable, error))
+        goto out;
+      /* We only need the fd from here on */
+      (void) unlinkat (repo->tmp_dir_fd, tmpname, 0);
+
+      if (g_output_stream_splice (tmpout, convin,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                  cancellable, error) < 0)
+        goto out;
+      if (!g_output_stream_flush (tmpout, cancellable, error))
+        goto out;
+
+      mfile = g_mapped_file_new_from_fd (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)tmpout),
+                                         FALSE, error);
+      if (!mfile)
         goto out;
-  }
+      ret_uncompressed = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
+    }
 
   ret = TRUE;
-  *out_uncompressed = g_memory_output_stream_steal_as_bytes (memout);
+  ot_transfer_out_value (out_uncompressed, &ret_uncompressed);
  out:
   return ret;
 }
@@ -313,6 +365,7 @@ gboolean
 _ostree_static_delta_part_execute (OstreeRepo      *repo,
                                    GVariant        *header,
                                    GBytes          *part_bytes,
+                                   guint64          uncompressed_size_hint,
                                    GCancellable    *cancellable,
                                    GError         **error)
 {
@@ -348,11 +401,23 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
         g_autoptr(GConverter) decomp =
           (GConverter*) _ostree_lzma_decompressor_new ();
 
-        if (!decompress_all (decomp, part_payload_bytes, &payload_data,
-                             cancellable, error))
+        if (!decompress_part (repo, decomp, part_payload_bytes, uncompressed_size_hint,
+                              &payload_data, cancellable, error))
+          goto out;
+      }
+      break;
+#ifdef HAVE_ZSTD
+    case 'z':
+      {
+        g_autoptr(GConverter) decomp =
+          (GConverter*) _ostree_zstd_decompressor_new ();
+
+        if (!decompress_part (repo, decomp, part_payload_bytes, uncompressed_size_hint,
+                              &payload_data, cancellable, error))
           goto out;
       }
       break;
+#endif
     default:
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "Invalid compression type '%u'", comptype);
@@ -374,6 +439,7 @@ typedef struct {
   OstreeRepo *repo;
   GVariant *header;
   GBytes *partdata;
+  guint64 uncompressed_size_hint;
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
 } StaticDeltaPartExecuteAsyncData;
@@ -402,6 +468,7 @@ static_delta_part_execute_thread (GSimpleAsyncResult  *res,
   if (!_ostree_static_delta_part_execute (data->repo,
                                           data->header,
                                           data->partdata,
+                                          data->uncompressed_size_hint,
                                           cancellable, &error))
     g_simple_async_result_take_error (res, error);
 }
@@ -410,6 +477,7 @@ void
 _ostree_static_delta_part_execute_async (OstreeRepo      *repo,
                                          GVariant        *header,
                                          GBytes          *partdata,
+                                         guint64          uncompressed_size_hint,
                                          GCancellable    *cancellable,
                                          GAsyncReadyCallback  callback,
                                          gpointer         user_data)
@@ -420,6 +488,7 @@ _ostree_static_delta_part_execute_async (OstreeRepo      *repo,
   asyncdata->repo = g_object_ref (repo);
   asyncdata->header = g_variant_ref (header);
   asyncdata->partdata = g_bytes_ref (partdata);
+  asyncdata->uncompressed_size_hint = uncompressed_size_hint;
   asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
 
   asyncdata->result = g_simple_async_result_new ((GObject*) repo,
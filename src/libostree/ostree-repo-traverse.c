@@ -23,6 +23,7 @@
 #include "config.h"
 
 #include "ostree.h"
+#include "ostree-repo-private.h"
 #include "otutil.h"
 
 struct _OstreeRepoRealCommitTraverseIter {
@@ -295,69 +296,99 @@ ostree_repo_traverse_new_reachable (void)
                                 NULL, (GDestroyNotify)g_variant_unref);
 }
 
-static gboolean
-traverse_dirtree (OstreeRepo           *repo,
-                  const char           *checksum,
-                  GHashTable           *inout_reachable,
-                  GCancellable         *cancellable,
-                  GError              **error);
+/* State shared between the threads of a traversal.  Worker threads
+ * load and parse one dirtree each without holding @lock, then merge
+ * what they found into @reachable under it, queueing any dirtree not
+ * seen before.  Since the set is only ever added to, and a dirtree is
+ * queued exactly when its name is first added, the final set does not
+ * depend on the number of threads or on scheduling.
+ */
+typedef struct {
+  OstreeRepo *repo;
+  OstreeObjectSet *reachable;
+  OstreeRepoTraverseObjectFunc func;
+  gpointer func_data;
+  GCancellable *cancellable;
+  GThreadPool *pool;  /* NULL when traversing in the calling thread */
+  GQueue pending;     /* Queued dirtrees when @pool is NULL */
+
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  GError *error;
+} TraverseData;
+
+/* Binary checksums referenced by a dirtree or commit; these point
+ * into its serialized data, which must be kept alive while they are
+ * used.
+ */
+typedef struct {
+  GPtrArray *files;
+  GPtrArray *dirtrees;
+  GPtrArray *dirmetas;
+} TraverseNames;
+
+static void
+traverse_names_init (TraverseNames *names)
+{
+  names->files = g_ptr_array_new ();
+  names->dirtrees = g_ptr_array_new ();
+  names->dirmetas = g_ptr_array_new ();
+}
+
+static void
+traverse_names_clear (TraverseNames *names)
+{
+  g_clear_pointer (&names->files, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&names->dirtrees, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&names->dirmetas, (GDestroyNotify) g_ptr_array_unref);
+}
 
 static gboolean
-traverse_iter (OstreeRepo                          *repo,
-               OstreeRepoCommitTraverseIter        *iter,
-               GHashTable                          *inout_reachable,
-               GCancellable                        *cancellable,
-               GError                             **error)
+collect_dirtree (GVariant        *dirtree,
+                 TraverseNames   *names,
+                 GError         **error)
 {
   gboolean ret = FALSE;
+  g_autoptr(GVariant) files_variant = NULL;
+  g_autoptr(GVariant) dirs_variant = NULL;
+  guint i, n;
 
-  while (TRUE)
-    {
-      g_autoptr(GVariant) key = NULL;
-      OstreeRepoCommitIterResult iterres =
-        ostree_repo_commit_traverse_iter_next (iter, cancellable, error);
-          
-      if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_ERROR)
-        goto out;
-      else if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_END)
-        break;
-      else if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_FILE)
-        {
-          char *name;
-          char *checksum;
-
-          ostree_repo_commit_traverse_iter_get_file (iter, &name, &checksum);
+  files_variant = g_variant_get_child_value (dirtree, 0);
+  dirs_variant = g_variant_get_child_value (dirtree, 1);
 
-          key = ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_FILE);
-          g_hash_table_replace (inout_reachable, key, key);
-          key = NULL;
-        }
-      else if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_DIR)
-        {
-          char *name;
-          char *content_checksum;
-          char *meta_checksum;
-
-          ostree_repo_commit_traverse_iter_get_dir (iter, &name, &content_checksum,
-                                                    &meta_checksum);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *csum;
+      g_autoptr(GVariant) content_csum_v = NULL;
 
-          key = ostree_object_name_serialize (meta_checksum, OSTREE_OBJECT_TYPE_DIR_META);
-          g_hash_table_replace (inout_reachable, key, key);
-          key = NULL;
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &content_csum_v);
+      csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!csum)
+        goto out;
+      g_ptr_array_add (names->files, (guchar*)csum);
+    }
 
-          key = ostree_object_name_serialize (content_checksum, OSTREE_OBJECT_TYPE_DIR_TREE);
-          if (!g_hash_table_lookup (inout_reachable, key))
-            {
-              g_hash_table_replace (inout_reachable, key, key);
-              key = NULL;
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *csum;
+      g_autoptr(GVariant) content_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
 
-              if (!traverse_dirtree (repo, content_checksum, inout_reachable,
-                                     cancellable, error))
-                goto out;
-            }
-        }
-      else
-        g_assert_not_reached ();
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &content_csum_v, &meta_csum_v);
+      csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!csum)
+        goto out;
+      g_ptr_array_add (names->dirtrees, (guchar*)csum);
+      csum = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+      if (!csum)
+        goto out;
+      g_ptr_array_add (names->dirmetas, (guchar*)csum);
     }
 
   ret = TRUE;
@@ -366,54 +397,135 @@ traverse_iter (OstreeRepo                          *repo,
 }
 
 static gboolean
-traverse_dirtree (OstreeRepo           *repo,
-                  const char           *checksum,
-                  GHashTable           *inout_reachable,
-                  GCancellable         *cancellable,
-                  GError              **error)
+collect_commit_root (GVariant        *commit,
+                     TraverseNames   *names,
+                     GError         **error)
 {
   gboolean ret = FALSE;
-  g_autoptr(GVariant) dirtree = NULL;
-  ostree_cleanup_repo_commit_traverse_iter
-    OstreeRepoCommitTraverseIter iter = { 0, };
-
-  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE,
-                                           checksum, &dirtree,
-                                           error))
-    goto out;
+  g_autoptr(GVariant) content_csum_v = NULL;
+  g_autoptr(GVariant) meta_csum_v = NULL;
+  const guchar *csum;
 
-  if (!ostree_repo_commit_traverse_iter_init_dirtree (&iter, repo, dirtree,
-                                                      OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
-                                                      error))
+  g_variant_get_child (commit, 6, "@ay", &content_csum_v);
+  csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+  if (!csum)
     goto out;
+  g_ptr_array_add (names->dirtrees, (guchar*)csum);
 
-  if (!traverse_iter (repo, &iter, inout_reachable, cancellable, error))
+  g_variant_get_child (commit, 7, "@ay", &meta_csum_v);
+  csum = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+  if (!csum)
     goto out;
+  g_ptr_array_add (names->dirmetas, (guchar*)csum);
 
   ret = TRUE;
  out:
   return ret;
 }
 
-/**
- * ostree_repo_traverse_commit_union: (skip)
- * @repo: Repo
- * @commit_checksum: ASCII SHA256 checksum
- * @maxdepth: Traverse this many parent commits, -1 for unlimited
- * @inout_reachable: Set of reachable objects
- * @cancellable: Cancellable
- * @error: Error
- *
- * Update the set @inout_reachable containing all objects reachable
- * from @commit_checksum, traversing @maxdepth parent commits.
+/* Must be called with data->lock held */
+static gboolean
+add_object (TraverseData     *data,
+            const guchar     *csum,
+            OstreeObjectType  objtype)
+{
+  if (!_ostree_object_set_add (data->reachable, csum, objtype))
+    return FALSE;
+
+  if (data->func)
+    data->func (csum, objtype, data->func_data);
+  return TRUE;
+}
+
+/* Must be called with data->lock held */
+static void
+merge_names (TraverseData  *data,
+             TraverseNames *names)
+{
+  guint i;
+
+  if (data->error)
+    return;
+
+  for (i = 0; i < names->files->len; i++)
+    (void) add_object (data, names->files->pdata[i], OSTREE_OBJECT_TYPE_FILE);
+
+  for (i = 0; i < names->dirmetas->len; i++)
+    (void) add_object (data, names->dirmetas->pdata[i], OSTREE_OBJECT_TYPE_DIR_META);
+
+  for (i = 0; i < names->dirtrees->len; i++)
+    {
+      const guchar *csum = names->dirtrees->pdata[i];
+      gpointer item;
+
+      if (!add_object (data, csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+        continue;
+
+      item = g_memdup (csum, 32);
+      data->n_outstanding++;
+      if (data->pool)
+        g_thread_pool_push (data->pool, item, NULL);
+      else
+        g_queue_push_head (&data->pending, item);
+    }
+}
+
+static void
+traverse_dirtree_worker (gpointer datap,
+                         gpointer user_data)
+{
+  g_autofree guchar *csum = datap;
+  TraverseData *data = user_data;
+  g_autoptr(GVariant) dirtree = NULL;
+  TraverseNames names;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  traverse_names_init (&names);
+
+  g_mutex_lock (&data->lock);
+  failed = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!failed &&
+      !g_cancellable_set_error_if_cancelled (data->cancellable, &local_error))
+    {
+      char checksum[65];
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      if (ostree_repo_load_variant (data->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                    checksum, &dirtree, &local_error))
+        (void) collect_dirtree (dirtree, &names, &local_error);
+    }
+
+  g_mutex_lock (&data->lock);
+  if (local_error)
+    {
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  else
+    merge_names (data, &names);
+
+  data->n_outstanding--;
+  if (data->n_outstanding == 0)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+
+  traverse_names_clear (&names);
+}
+
+/* The history of each commit is walked in the calling thread; only
+ * dirtrees are handed to the worker pool, or processed here if there
+ * is none.
  */
-gboolean
-ostree_repo_traverse_commit_union (OstreeRepo      *repo,
-                                   const char      *commit_checksum,
-                                   int              maxdepth,
-                                   GHashTable      *inout_reachable,
-                                   GCancellable    *cancellable,
-                                   GError         **error)
+static gboolean
+traverse_commit (TraverseData  *data,
+                 const char    *commit_checksum,
+                 int            maxdepth,
+                 GError       **error)
 {
   gboolean ret = FALSE;
   g_autofree char *tmp_checksum = NULL;
@@ -421,38 +533,51 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
   while (TRUE)
     {
       gboolean recurse = FALSE;
-      g_autoptr(GVariant) key = NULL;
+      gboolean have_commit;
+      gboolean failed;
+      guchar commit_csum[32];
       g_autoptr(GVariant) commit = NULL;
-      ostree_cleanup_repo_commit_traverse_iter
-        OstreeRepoCommitTraverseIter iter = { 0, };
-
-      key = ostree_object_name_serialize (commit_checksum, OSTREE_OBJECT_TYPE_COMMIT);
-
-      if (g_hash_table_contains (inout_reachable, key))
+      TraverseNames names;
+      gpointer item;
+
+      ostree_checksum_inplace_to_bytes (commit_checksum, commit_csum);
+
+      g_mutex_lock (&data->lock);
+      failed = data->error != NULL;
+      have_commit = _ostree_object_set_contains (data->reachable, commit_csum,
+                                                 OSTREE_OBJECT_TYPE_COMMIT);
+      g_mutex_unlock (&data->lock);
+      /* A worker error is reported by the caller */
+      if (failed || have_commit)
         break;
 
-      if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT,
+      if (!ostree_repo_load_variant_if_exists (data->repo, OSTREE_OBJECT_TYPE_COMMIT,
                                                commit_checksum, &commit,
                                                error))
         goto out;
-        
+
       /* Just return if the parent isn't found; we do expect most
        * people to have partial repositories.
        */
       if (!commit)
         break;
 
-      g_hash_table_add (inout_reachable, key);
-      key = NULL;
+      traverse_names_init (&names);
+      if (!collect_commit_root (commit, &names, error))
+        {
+          traverse_names_clear (&names);
+          goto out;
+        }
 
-      if (!ostree_repo_commit_traverse_iter_init_commit (&iter, repo, commit,
-                                                         OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
-                                                         error))
-        goto out;
+      g_mutex_lock (&data->lock);
+      (void) add_object (data, commit_csum, OSTREE_OBJECT_TYPE_COMMIT);
+      merge_names (data, &names);
+      g_mutex_unlock (&data->lock);
+      traverse_names_clear (&names);
+
+      while ((item = g_queue_pop_head (&data->pending)) != NULL)
+        traverse_dirtree_worker (item, data);
 
-      if (!traverse_iter (repo, &iter, inout_reachable, cancellable, error))
-        goto out;
-      
       if (maxdepth == -1 || maxdepth > 0)
         {
           g_free (tmp_checksum);
@@ -474,6 +599,175 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
   return ret;
 }
 
+/*
+ * _ostree_repo_traverse_commits_union_full:
+ * @n_threads: Number of dirtree loading threads; 0 for one per CPU,
+ *   1 to traverse in the calling thread
+ * @func: (allow-none): Called for each object added to @inout_reachable
+ *
+ * Like ostree_repo_traverse_commit_union() for each of the @n_commits
+ * checksums in @commits, sharing one pool of worker threads, but
+ * using the compact #OstreeObjectSet.  The resulting set does not
+ * depend on @n_threads.
+ *
+ * @func may be called from any thread, with an internal lock held; it
+ * may block, which stalls the traversal, but must not call back into
+ * it.
+ */
+gboolean
+_ostree_repo_traverse_commits_union_full (OstreeRepo                   *repo,
+                                          const char * const           *commits,
+                                          guint                         n_commits,
+                                          int                           maxdepth,
+                                          OstreeObjectSet              *inout_reachable,
+                                          guint                         n_threads,
+                                          OstreeRepoTraverseObjectFunc  func,
+                                          gpointer                      user_data,
+                                          GCancellable                 *cancellable,
+                                          GError                      **error)
+{
+  gboolean ret = FALSE;
+  TraverseData data = { 0, };
+  GError *local_error = NULL;
+  guint i;
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  data.repo = repo;
+  data.reachable = inout_reachable;
+  data.func = func;
+  data.func_data = user_data;
+  data.cancellable = cancellable;
+  g_queue_init (&data.pending);
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  if (n_threads > 1)
+    {
+      data.pool = g_thread_pool_new (traverse_dirtree_worker, &data, n_threads, FALSE, &local_error);
+      g_assert_no_error (local_error);
+    }
+
+  for (i = 0; i < n_commits; i++)
+    {
+      if (!traverse_commit (&data, commits[i], maxdepth, &local_error))
+        break;
+    }
+
+  /* Always wait for the workers, even on error, since they reference
+   * @data.
+   */
+  g_mutex_lock (&data.lock);
+  if (local_error)
+    {
+      if (data.error == NULL)
+        data.error = local_error;
+      else
+        g_error_free (local_error);
+      local_error = NULL;
+    }
+  if (data.pool)
+    {
+      while (data.n_outstanding > 0)
+        g_cond_wait (&data.cond, &data.lock);
+    }
+  g_mutex_unlock (&data.lock);
+
+  if (data.pool)
+    g_thread_pool_free (data.pool, FALSE, TRUE);
+  g_queue_foreach (&data.pending, (GFunc) g_free, NULL);
+  g_queue_clear (&data.pending);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+gboolean
+_ostree_repo_traverse_commits_union (OstreeRepo         *repo,
+                                     const char * const *commits,
+                                     guint               n_commits,
+                                     int                 maxdepth,
+                                     OstreeObjectSet    *inout_reachable,
+                                     guint               n_threads,
+                                     GCancellable       *cancellable,
+                                     GError            **error)
+{
+  return _ostree_repo_traverse_commits_union_full (repo, commits, n_commits, maxdepth,
+                                                   inout_reachable, n_threads, NULL, NULL,
+                                                   cancellable, error);
+}
+
+/*
+ * _ostree_repo_traverse_commits_union_reachable:
+ *
+ * Like _ostree_repo_traverse_commits_union(), but updating a set
+ * created by ostree_repo_traverse_new_reachable().
+ */
+gboolean
+_ostree_repo_traverse_commits_union_reachable (OstreeRepo         *repo,
+                                               const char * const *commits,
+                                               guint               n_commits,
+                                               int                 maxdepth,
+                                               GHashTable         *inout_reachable,
+                                               guint               n_threads,
+                                               GCancellable       *cancellable,
+                                               GError            **error)
+{
+  gboolean ret = FALSE;
+  OstreeObjectSet *reachable = _ostree_object_set_new ();
+
+  _ostree_object_set_add_from_reachable (reachable, inout_reachable);
+
+  if (!_ostree_repo_traverse_commits_union (repo, commits, n_commits, maxdepth,
+                                            reachable, n_threads,
+                                            cancellable, error))
+    goto out;
+
+  _ostree_object_set_add_to_reachable (reachable, inout_reachable);
+
+  ret = TRUE;
+ out:
+  _ostree_object_set_unref (reachable);
+  return ret;
+}
+
+/**
+ * ostree_repo_traverse_commit_union:
+ * @repo: Repo
+ * @commit_checksum: ASCII SHA256 checksum
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Update the set @inout_reachable containing all objects reachable
+ * from @commit_checksum, traversing @maxdepth parent commits.
+ * Directory trees are loaded using a pool of worker threads;
+ * @inout_reachable must not be accessed by other threads until this
+ * function returns.
+ */
+gboolean
+ostree_repo_traverse_commit_union (OstreeRepo      *repo,
+                                   const char      *commit_checksum,
+                                   int              maxdepth,
+                                   GHashTable      *inout_reachable,
+                                   GCancellable    *cancellable,
+                                   GError         **error)
+{
+  return _ostree_repo_traverse_commits_union_reachable (repo, &commit_checksum, 1, maxdepth,
+                                                        inout_reachable, 0,
+                                                        cancellable, error);
+}
+
 /**
  * ostree_repo_traverse_commit:
  * @repo: Repo
@@ -34,6 +34,8 @@
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-gpg-verifier.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-repo-pack-private.h"
+#include "ostree-repo-chunks-private.h"
 #include "ostree-metalink.h"
 
 #include <locale.h>
@@ -47,7 +49,7 @@
  * The #OstreeRepo is like git, a content-addressed object store.
  * Unlike git, it records uid, gid, and extended attributes.
  *
- * There are three possible "modes" for an #OstreeRepo;
+ * There are four possible "modes" for an #OstreeRepo;
  * %OSTREE_REPO_MODE_BARE is very simple - content files are
  * represented exactly as they are, and checkouts are just hardlinks.
  * %OSTREE_REPO_MODE_BARE_USER is similar, except the uid/gids are not
@@ -55,6 +57,9 @@
  * A %OSTREE_REPO_MODE_ARCHIVE_Z2 repository in contrast stores
  * content files zlib-compressed.  It is suitable for non-root-owned
  * repositories that can be served via a static HTTP server.
+ * %OSTREE_REPO_MODE_ARCHIVE_ZSTD is the same, except that new content
+ * files are compressed with zstd, which is much faster to decompress;
+ * clients that do not support zstd refuse to pull from it.
  *
  * Creating an #OstreeRepo does not invoke any file I/O, and thus needs
  * to be initialized, either from an existing contents or with a new
@@ -486,6 +491,73 @@ _ostree_repo_remote_new_fetcher (OstreeRepo  *self,
       _ostree_fetcher_set_proxy (fetcher, http_proxy);
   }
 
+  {
+    gboolean adaptive;
+    guint64 bounds[2];
+    const char *bound_names[] = { "http-min-concurrency", "http-max-concurrency" };
+    const char *bound_defaults[] = { "4", "96" };
+    guint i;
+
+    if (!_ostree_repo_get_remote_boolean_option (self, remote_name,
+                                                 "http-adaptive-concurrency", TRUE,
+                                                 &adaptive, error))
+      goto out;
+
+    for (i = 0; i < G_N_ELEMENTS (bounds); i++)
+      {
+        g_autofree char *value = NULL;
+        char *endp;
+
+        if (!_ostree_repo_get_remote_option (self, remote_name,
+                                             bound_names[i], bound_defaults[i],
+                                             &value, error))
+          goto out;
+
+        bounds[i] = g_ascii_strtoull (value, &endp, 10);
+        if (endp == value || *endp != '\0' || bounds[i] == 0 || bounds[i] > G_MAXINT)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Remote \"%s\" has invalid \"%s\" value '%s'",
+                         remote_name, bound_names[i], value);
+            goto out;
+          }
+      }
+
+    if (bounds[0] > bounds[1])
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Remote \"%s\" has \"http-min-concurrency\" greater than \"http-max-concurrency\"",
+                     remote_name);
+        goto out;
+      }
+
+    _ostree_fetcher_set_concurrency (fetcher, bounds[0], bounds[1], adaptive);
+  }
+
+  {
+    gboolean http_cache;
+
+    if (!_ostree_repo_get_remote_boolean_option (self, remote_name,
+                                                 "http-cache", TRUE,
+                                                 &http_cache, error))
+      goto out;
+
+    /* The cache is best effort; e.g. unprivileged users can still
+     * fetch the summary of the system repository without it.
+     */
+    if (http_cache
+        && !_ostree_repo_remote_name_is_file (remote_name)
+        && remote_name[0] != '.' && strchr (remote_name, '/') == NULL)
+      {
+        g_autofree char *cache_path = g_strconcat ("state/http-cache/", remote_name, NULL);
+        int cache_dfd = -1;
+
+        if (glnx_shutil_mkdir_p_at (self->repo_dir_fd, cache_path, 0755, NULL, NULL)
+            && glnx_opendirat (self->repo_dir_fd, cache_path, TRUE, &cache_dfd, NULL))
+          _ostree_fetcher_set_cache_dfd (fetcher, cache_dfd);
+      }
+  }
+
   success = TRUE;
 
 out:
@@ -529,6 +601,8 @@ ostree_repo_finalize (GObject *object)
 
   if (self->loose_object_devino_hash)
     g_hash_table_destroy (self->loose_object_devino_hash);
+  g_clear_pointer (&self->stat_cache, g_hash_table_unref);
+  g_clear_pointer (&self->txn_file_chunks, g_hash_table_unref);
   if (self->updated_uncompressed_dirs)
     g_hash_table_destroy (self->updated_uncompressed_dirs);
   if (self->config)
@@ -536,6 +610,8 @@ ostree_repo_finalize (GObject *object)
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
   g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_queue_clear (&self->metadata_cache_lru);
+  g_clear_pointer (&self->metadata_cache, (GDestroyNotify) g_hash_table_unref);
   g_clear_error (&self->writable_error);
   g_clear_pointer (&self->object_sizes, (GDestroyNotify) g_hash_table_unref);
   g_mutex_clear (&self->cache_lock);
@@ -1138,6 +1214,21 @@ impl_repo_remote_delete (OstreeRepo     *self,
   if (!ot_ensure_unlinked_at (self->repo_dir_fd, remote->keyring, error))
     goto out;
 
+  /* And what pulls from it kept */
+  if (name[0] != '.')
+    {
+      g_autofree char *pack_index_cache = g_strconcat ("state/pack-indexes/", name, NULL);
+      g_autofree char *chunked_content_cache = g_strconcat ("state/chunked-content-indexes/", name, NULL);
+      g_autofree char *http_cache = g_strconcat ("state/http-cache/", name, NULL);
+
+      if (!glnx_shutil_rm_rf_at (self->repo_dir_fd, pack_index_cache, cancellable, error))
+        goto out;
+      if (!glnx_shutil_rm_rf_at (self->repo_dir_fd, chunked_content_cache, cancellable, error))
+        goto out;
+      if (!glnx_shutil_rm_rf_at (self->repo_dir_fd, http_cache, cancellable, error))
+        goto out;
+    }
+
   ost_repo_remove_remote (self, remote);
 
   ret = TRUE;
@@ -1714,11 +1805,11 @@ _ostree_preload_metadata_file (OstreeRepo    *self,
       path = g_build_filename (base_path, filename, NULL);
       uri = soup_uri_new_with_base (base_uri, path);
 
-      ret = _ostree_fetcher_request_uri_to_membuf (fetcher, uri,
-                                                   FALSE, TRUE,
-                                                   out_bytes,
-                                                   OSTREE_MAX_METADATA_SIZE,
-                                                   cancellable, error);
+      ret = _ostree_fetcher_request_uri_to_membuf_cached (fetcher, uri,
+                                                          FALSE, TRUE,
+                                                          out_bytes,
+                                                          OSTREE_MAX_METADATA_SIZE,
+                                                          cancellable, error);
       soup_uri_free (uri);
 
       if (!ret)
@@ -1913,6 +2004,9 @@ ostree_repo_mode_to_string (OstreeRepoMode   mode,
     case OSTREE_REPO_MODE_ARCHIVE_Z2:
       ret_mode ="archive-z2";
       break;
+    case OSTREE_REPO_MODE_ARCHIVE_ZSTD:
+      ret_mode = "archive-zstd";
+      break;
     default:
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "Invalid mode '%d'", mode);
@@ -1939,6 +2033,19 @@ ostree_repo_mode_from_string (const char      *mode,
     ret_mode = OSTREE_REPO_MODE_BARE_USER;
   else if (strcmp (mode, "archive-z2") == 0)
     ret_mode = OSTREE_REPO_MODE_ARCHIVE_Z2;
+  else if (strcmp (mode, "archive-zstd") == 0)
+    {
+#ifdef HAVE_ZSTD
+      ret_mode = OSTREE_REPO_MODE_ARCHIVE_ZSTD;
+#else
+      /* Behave like versions predating the mode, so that pulls
+       * fail up front rather than on the first content object.
+       */
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Mode '%s' requires zstd support, which this build of OSTree lacks", mode);
+      goto out;
+#endif
+    }
   else
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -2323,6 +2430,87 @@ ostree_repo_open (OstreeRepo    *self,
       ostree_repo_set_disable_fsync (self, TRUE);
   }
 
+  {
+    g_autofree char *limit_str = NULL;
+    guint64 limit_mb;
+    char *endp;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "static-delta-memory-limit",
+                                            "256", &limit_str, error))
+      goto out;
+
+    limit_mb = g_ascii_strtoull (limit_str, &endp, 10);
+    if (endp == limit_str || *endp != '\0')
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Invalid static-delta-memory-limit '%s'", limit_str);
+        goto out;
+      }
+    self->static_delta_memory_limit = limit_mb * 1024 * 1024;
+  }
+
+  {
+    g_autofree char *level_str = NULL;
+    guint64 level;
+    guint64 max_level;
+    char *endp;
+
+    /* zlib's best compression was always used for archive-z2 */
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "compression-level",
+                                            self->mode == OSTREE_REPO_MODE_ARCHIVE_ZSTD ? "3" : "9",
+                                            &level_str, error))
+      goto out;
+
+    max_level = self->mode == OSTREE_REPO_MODE_ARCHIVE_ZSTD ? 22 : 9;
+    level = g_ascii_strtoull (level_str, &endp, 10);
+    if (endp == level_str || *endp != '\0' || level < 1 || level > max_level)
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Invalid compression-level '%s', must be between 1 and %u",
+                     level_str, (guint)max_level);
+        goto out;
+      }
+    self->compression_level = level;
+  }
+
+  {
+    g_autofree char *threshold_str = NULL;
+    guint64 threshold_mb;
+    char *endp;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "chunked-content-threshold",
+                                            "0", &threshold_str, error))
+      goto out;
+
+    threshold_mb = g_ascii_strtoull (threshold_str, &endp, 10);
+    if (endp == threshold_str || *endp != '\0')
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Invalid chunked-content-threshold '%s'", threshold_str);
+        goto out;
+      }
+    self->chunked_content_threshold = threshold_mb * 1024 * 1024;
+  }
+
+  {
+    g_autofree char *size_str = NULL;
+    guint64 size_mb;
+    char *endp;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "metadata-cache-size",
+                                            "32", &size_str, error))
+      goto out;
+
+    size_mb = g_ascii_strtoull (size_str, &endp, 10);
+    if (endp == size_str || *endp != '\0')
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Invalid metadata-cache-size '%s'", size_str);
+        goto out;
+      }
+    self->metadata_cache_max_size = size_mb * 1024 * 1024;
+  }
+
   if (ostree_repo_is_system (self))
     {
       if (!append_remotes_d (self, cancellable, error))
@@ -2332,7 +2520,10 @@ ostree_repo_open (OstreeRepo    *self,
   if (!gs_file_open_dir_fd (self->tmp_dir, &self->tmp_dir_fd, cancellable, error))
     goto out;
 
-  if (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2 && self->enable_uncompressed_cache)
+  if (!_ostree_repo_load_packs (self, cancellable, error))
+    goto out;
+
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode) && self->enable_uncompressed_cache)
     {
       if (!gs_file_ensure_directory (self->uncompressed_objects_dir, TRUE, cancellable, error))
         goto out;
@@ -2419,9 +2610,13 @@ ostree_repo_get_parent (OstreeRepo  *self)
   return self->parent_repo;
 }
 
+/* Objects are added to @inout_objects, or to @inout_set if it is
+ * non-%NULL.
+ */
 static gboolean
 list_loose_objects_at (OstreeRepo             *self,
                        GHashTable             *inout_objects,
+                       OstreeObjectSet        *inout_set,
                        const char             *prefix,
                        int                     dfd,
                        const char             *commit_starting_with,
@@ -2455,7 +2650,7 @@ list_loose_objects_at (OstreeRepo             *self,
       if (!dot)
         continue;
 
-      if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+      if ((_OSTREE_REPO_MODE_IS_ARCHIVE (self->mode)
            && strcmp (dot, ".filez") == 0) ||
           ((self->mode == OSTREE_REPO_MODE_BARE || self->mode == OSTREE_REPO_MODE_BARE_USER)
            && strcmp (dot, ".file") == 0))
@@ -2490,6 +2685,12 @@ list_loose_objects_at (OstreeRepo             *self,
             continue;
         }
 
+      if (inout_set)
+        {
+          (void) _ostree_object_set_add_checksum (inout_set, buf, objtype);
+          continue;
+        }
+
         key = ostree_object_name_serialize (buf, objtype);
         value = g_variant_new ("(b@as)",
                                TRUE, g_variant_new_strv (NULL, 0));
@@ -2508,6 +2709,7 @@ list_loose_objects_at (OstreeRepo             *self,
 static gboolean
 list_loose_objects (OstreeRepo                     *self,
                     GHashTable                     *inout_objects,
+                    OstreeObjectSet                *inout_set,
                     const char                     *commit_starting_with,
                     GCancellable                   *cancellable,
                     GError                        **error)
@@ -2535,7 +2737,7 @@ list_loose_objects (OstreeRepo                     *self,
             }
         }
       /* Takes ownership of dfd */
-      if (!list_loose_objects_at (self, inout_objects, buf, dfd,
+      if (!list_loose_objects_at (self, inout_objects, inout_set, buf, dfd,
                                        commit_starting_with,
                                        cancellable, error))
         goto out;
@@ -2572,6 +2774,225 @@ openat_allow_noent (int                 dfd,
   return TRUE;
 }
 
+/* Parsed metadata objects are kept in a size-bounded LRU cache, since
+ * traversals, OstreeRepoFile, diff and delta generation load the same
+ * dirtree and dirmeta objects over and over.  Objects are immutable,
+ * so entries only need to be dropped when an object is deleted.
+ */
+
+/* Objects up to this size are read into the heap rather than mapped
+ * when they'll be cached, so cached entries don't each hold a
+ * page-granular mapping.
+ */
+#define METADATA_CACHE_READ_MAX (64 * 1024)
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+} OstreeMetadataCacheKey;
+
+typedef struct {
+  OstreeMetadataCacheKey key;
+  GVariant *variant;
+  GList link;
+} OstreeMetadataCacheEntry;
+
+static guint
+metadata_cache_key_hash (gconstpointer v)
+{
+  const OstreeMetadataCacheKey *key = v;
+  guint h;
+
+  /* Checksums are already uniformly distributed */
+  memcpy (&h, key->csum, sizeof (h));
+  return h ^ key->objtype;
+}
+
+static gboolean
+metadata_cache_key_equal (gconstpointer a,
+                          gconstpointer b)
+{
+  const OstreeMetadataCacheKey *key_a = a;
+  const OstreeMetadataCacheKey *key_b = b;
+
+  return key_a->objtype == key_b->objtype
+    && memcmp (key_a->csum, key_b->csum, sizeof (key_a->csum)) == 0;
+}
+
+static void
+metadata_cache_entry_free (OstreeMetadataCacheEntry *entry)
+{
+  g_variant_unref (entry->variant);
+  g_free (entry);
+}
+
+static void
+metadata_cache_key_init (OstreeMetadataCacheKey *key,
+                         OstreeObjectType        objtype,
+                         const char             *checksum)
+{
+  ostree_checksum_inplace_to_bytes (checksum, key->csum);
+  key->objtype = objtype;
+}
+
+/* Must be called with cache_lock held */
+static void
+metadata_cache_evict (OstreeRepo                *self,
+                      OstreeMetadataCacheEntry  *entry)
+{
+  g_queue_unlink (&self->metadata_cache_lru, &entry->link);
+  self->metadata_cache_size -= g_variant_get_size (entry->variant);
+  g_hash_table_remove (self->metadata_cache, &entry->key);
+}
+
+static GVariant *
+metadata_cache_lookup (OstreeRepo        *self,
+                       OstreeObjectType   objtype,
+                       const char        *checksum)
+{
+  GVariant *ret = NULL;
+  OstreeMetadataCacheKey key;
+  OstreeMetadataCacheEntry *entry;
+
+  if (self->metadata_cache_max_size == 0)
+    return NULL;
+
+  metadata_cache_key_init (&key, objtype, checksum);
+
+  g_mutex_lock (&self->cache_lock);
+  entry = self->metadata_cache ? g_hash_table_lookup (self->metadata_cache, &key) : NULL;
+  if (entry)
+    {
+      g_queue_unlink (&self->metadata_cache_lru, &entry->link);
+      g_queue_push_head_link (&self->metadata_cache_lru, &entry->link);
+      ret = g_variant_ref (entry->variant);
+      self->metadata_cache_hits++;
+    }
+  else
+    self->metadata_cache_misses++;
+  g_mutex_unlock (&self->cache_lock);
+
+  return ret;
+}
+
+static void
+metadata_cache_insert (OstreeRepo        *self,
+                       OstreeObjectType   objtype,
+                       const char        *checksum,
+                       GVariant          *variant)
+{
+  OstreeMetadataCacheEntry *entry;
+  gsize size = g_variant_get_size (variant);
+
+  /* Don't let one huge object flush everything else */
+  if (size > self->metadata_cache_max_size / 4)
+    return;
+
+  entry = g_new0 (OstreeMetadataCacheEntry, 1);
+  metadata_cache_key_init (&entry->key, objtype, checksum);
+  entry->variant = g_variant_ref (variant);
+  entry->link.data = entry;
+
+  g_mutex_lock (&self->cache_lock);
+  if (!self->metadata_cache)
+    self->metadata_cache = g_hash_table_new_full (metadata_cache_key_hash,
+                                                  metadata_cache_key_equal,
+                                                  NULL,
+                                                  (GDestroyNotify) metadata_cache_entry_free);
+
+  if (g_hash_table_contains (self->metadata_cache, &entry->key))
+    {
+      /* Another thread got here first */
+      metadata_cache_entry_free (entry);
+    }
+  else
+    {
+      g_hash_table_insert (self->metadata_cache, &entry->key, entry);
+      g_queue_push_head_link (&self->metadata_cache_lru, &entry->link);
+      self->metadata_cache_size += size;
+
+      while (self->metadata_cache_size > self->metadata_cache_max_size)
+        metadata_cache_evict (self, g_queue_peek_tail (&self->metadata_cache_lru));
+    }
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static void
+metadata_cache_remove (OstreeRepo        *self,
+                       OstreeObjectType   objtype,
+                       const char        *checksum)
+{
+  OstreeMetadataCacheKey key;
+  OstreeMetadataCacheEntry *entry;
+
+  metadata_cache_key_init (&key, objtype, checksum);
+
+  g_mutex_lock (&self->cache_lock);
+  entry = self->metadata_cache ? g_hash_table_lookup (self->metadata_cache, &key) : NULL;
+  if (entry)
+    metadata_cache_evict (self, entry);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+/**
+ * ostree_repo_get_metadata_cache_stats:
+ * @self: Repo
+ * @out_hits: (out) (allow-none): Number of metadata loads served from the cache
+ * @out_misses: (out) (allow-none): Number of metadata loads that missed the cache
+ * @out_size: (out) (allow-none): Current size of the cached objects in bytes
+ *
+ * Parsed metadata objects (commits, dirtrees and dirmetas) are kept in
+ * an in-memory LRU cache whose size is set by the
+ * <literal>core/metadata-cache-size</literal> configuration option.
+ * This returns statistics gathered since @self was opened, which are
+ * useful to pick a size for a given workload.
+ */
+void
+ostree_repo_get_metadata_cache_stats (OstreeRepo  *self,
+                                      guint64     *out_hits,
+                                      guint64     *out_misses,
+                                      guint64     *out_size)
+{
+  g_mutex_lock (&self->cache_lock);
+  if (out_hits)
+    *out_hits = self->metadata_cache_hits;
+  if (out_misses)
+    *out_misses = self->metadata_cache_misses;
+  if (out_size)
+    *out_size = self->metadata_cache_size;
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static GVariant *
+read_metadata_variant_from_fd (int                 fd,
+                               OstreeObjectType    objtype,
+                               gsize               size,
+                               GError            **error)
+{
+  guint8 *buf = g_malloc (size);
+  gsize bytes_read = 0;
+
+  while (bytes_read < size)
+    {
+      gssize n = pread (fd, buf + bytes_read, size - bytes_read, bytes_read);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          gs_set_error_from_errno (error, errno);
+          g_free (buf);
+          return NULL;
+        }
+      if (n == 0)
+        break;
+      bytes_read += n;
+    }
+
+  return g_variant_ref_sink (g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                                      buf, bytes_read, TRUE,
+                                                      g_free, buf));
+}
+
 static gboolean
 load_metadata_internal (OstreeRepo       *self,
                         OstreeObjectType  objtype,
@@ -2588,9 +3009,23 @@ load_metadata_internal (OstreeRepo       *self,
   int fd = -1;
   g_autoptr(GInputStream) ret_stream = NULL;
   g_autoptr(GVariant) ret_variant = NULL;
+  g_autoptr(GBytes) packed_data = NULL;
 
   g_return_val_if_fail (OSTREE_OBJECT_TYPE_IS_META (objtype), FALSE);
 
+  if (out_variant)
+    {
+      ret_variant = metadata_cache_lookup (self, objtype, sha256);
+      if (ret_variant)
+        {
+          if (out_size)
+            *out_size = g_variant_get_size (ret_variant);
+          ret = TRUE;
+          ot_transfer_out_value (out_variant, &ret_variant);
+          goto out;
+        }
+    }
+
   _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
 
   if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
@@ -2608,20 +3043,39 @@ load_metadata_internal (OstreeRepo       *self,
     {
       if (out_variant)
         {
-          GMappedFile *mfile;
+          struct stat stbuf;
 
-          mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
-          if (!mfile)
-            goto out;
-          (void) close (fd); /* Ignore errors, we have it mapped */
+          if (fstat (fd, &stbuf) != 0)
+            {
+              gs_set_error_from_errno (error, errno);
+              goto out;
+            }
+
+          if (self->metadata_cache_max_size > 0 && stbuf.st_size <= METADATA_CACHE_READ_MAX)
+            {
+              ret_variant = read_metadata_variant_from_fd (fd, objtype, stbuf.st_size, error);
+              if (!ret_variant)
+                goto out;
+            }
+          else
+            {
+              GMappedFile *mfile;
+
+              mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+              if (!mfile)
+                goto out;
+              ret_variant = g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                                     g_mapped_file_get_contents (mfile),
+                                                     g_mapped_file_get_length (mfile),
+                                                     TRUE,
+                                                     (GDestroyNotify) g_mapped_file_unref,
+                                                     mfile);
+              g_variant_ref_sink (ret_variant);
+            }
+          (void) close (fd); /* Ignore errors, we have it in memory */
           fd = -1;
-          ret_variant = g_variant_new_from_data (ostree_metadata_variant_type (objtype),
-                                                 g_mapped_file_get_contents (mfile),
-                                                 g_mapped_file_get_length (mfile),
-                                                 TRUE,
-                                                 (GDestroyNotify) g_mapped_file_unref,
-                                                 mfile);
-          g_variant_ref_sink (ret_variant);
+
+          metadata_cache_insert (self, objtype, sha256, ret_variant);
 
           if (out_size)
             *out_size = g_variant_get_size (ret_variant);
@@ -2642,6 +3096,21 @@ load_metadata_internal (OstreeRepo       *self,
             }
         }
     }
+  else if (_ostree_repo_find_packed_object (self, objtype, sha256, &packed_data, NULL))
+    {
+      if (out_variant)
+        {
+          ret_variant = g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                  packed_data, TRUE);
+          g_variant_ref_sink (ret_variant);
+          metadata_cache_insert (self, objtype, sha256, ret_variant);
+        }
+      else if (out_stream)
+        ret_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+      if (out_size)
+        *out_size = g_bytes_get_size (packed_data);
+    }
   else if (self->parent_repo)
     {
       if (!ostree_repo_load_variant (self->parent_repo, objtype, sha256, &ret_variant, error))
@@ -2788,7 +3257,7 @@ ostree_repo_load_file (OstreeRepo         *self,
 
   _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, repo_mode);
 
-  if (repo_mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+  if (_OSTREE_REPO_MODE_IS_ARCHIVE (repo_mode))
     {
       int fd = -1;
       struct stat stbuf;
@@ -2815,6 +3284,24 @@ ostree_repo_load_file (OstreeRepo         *self,
 
           found = TRUE;
         }
+      else
+        {
+          g_autoptr(GBytes) packed_data = NULL;
+
+          if (_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                               &packed_data, NULL))
+            {
+              tmp_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+              if (!ostree_content_stream_parse (TRUE, tmp_stream, g_bytes_get_size (packed_data), TRUE,
+                                                out_input ? &ret_input : NULL,
+                                                &ret_file_info, &ret_xattrs,
+                                                cancellable, error))
+                goto out;
+
+              found = TRUE;
+            }
+        }
     }
   else
     {
@@ -2949,47 +3436,207 @@ ostree_repo_load_file (OstreeRepo         *self,
   return ret;
 }
 
-/**
- * ostree_repo_load_object_stream:
- * @self: Repo
- * @objtype: Object type
- * @checksum: ASCII SHA256 checksum
- * @out_input: (out): Stream for object
- * @out_size: (out): Length of @out_input
- * @cancellable: Cancellable
- * @error: Error
- *
- * Load object as a stream; useful when copying objects between
- * repositories.
- */
-gboolean
-ostree_repo_load_object_stream (OstreeRepo         *self,
-                                OstreeObjectType    objtype,
-                                const char         *checksum,
-                                GInputStream      **out_input,
-                                guint64            *out_size,
-                                GCancellable       *cancellable,
-                                GError            **error)
+/* Read the mode out of the header of the .filez object open at @fd */
+static gboolean
+read_archive_file_mode (int            fd,
+                        guint32       *out_mode,
+                        GError       **error)
 {
   gboolean ret = FALSE;
-  guint64 size;
-  g_autoptr(GInputStream) ret_input = NULL;
+  guint32 sizes[2];
+  guint32 header_size;
+  guchar *buf = NULL;
+  g_autoptr(GVariant) header = NULL;
+  guint32 mode;
+  gssize n;
 
-  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+  do
+    n = pread (fd, sizes, sizeof (sizes), 0);
+  while (G_UNLIKELY (n == -1 && errno == EINTR));
+  if (n == -1)
     {
-      if (!load_metadata_internal (self, objtype, checksum, TRUE, NULL,
-                                   &ret_input, &size,
-                                   cancellable, error))
-        goto out;
+      glnx_set_error_from_errno (error);
+      goto out;
     }
-  else
+
+  header_size = GUINT32_FROM_BE (sizes[0]);
+  if (n != sizeof (sizes) || header_size == 0 || header_size > OSTREE_MAX_METADATA_SIZE)
     {
-      g_autoptr(GInputStream) input = NULL;
-      g_autoptr(GFileInfo) finfo = NULL;
-      g_autoptr(GVariant) xattrs = NULL;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted archive file; invalid header size %u", header_size);
+      goto out;
+    }
 
-      if (!ostree_repo_load_file (self, checksum, &input, &finfo, &xattrs,
-                                  cancellable, error))
+  buf = g_malloc (header_size);
+  do
+    n = pread (fd, buf, header_size, sizeof (sizes));
+  while (G_UNLIKELY (n == -1 && errno == EINTR));
+  if (n == -1)
+    {
+      glnx_set_error_from_errno (error);
+      g_free (buf);
+      goto out;
+    }
+  if (n != header_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted archive file; truncated header");
+      g_free (buf);
+      goto out;
+    }
+
+  header = g_variant_new_from_data (_OSTREE_ZLIB_FILE_HEADER_GVARIANT_FORMAT,
+                                    buf, header_size, TRUE, g_free, buf);
+  g_variant_ref_sink (header);
+  g_variant_get_child (header, 3, "u", &mode);
+
+  ret = TRUE;
+  *out_mode = GUINT32_FROM_BE (mode);
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_load_file_mode:
+ * @out_mode: (out): Mode of the content object, including its type
+ *
+ * Like ostree_repo_load_file(), for just the mode.  It is read from
+ * the stat of a bare object, the extended attribute of a bare-user
+ * one or the header of an archived one, without building a
+ * #GFileInfo.
+ */
+gboolean
+_ostree_repo_load_file_mode (OstreeRepo     *self,
+                             const char     *checksum,
+                             guint32        *out_mode,
+                             GCancellable   *cancellable,
+                             GError        **error)
+{
+  gboolean ret = FALSE;
+  char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
+  g_autoptr(GFileInfo) file_info = NULL;
+
+  _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+
+  if (self->mode == OSTREE_REPO_MODE_BARE)
+    {
+      struct stat stbuf;
+      int res;
+
+      do
+        res = fstatat (self->objects_dir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (res == 0)
+        {
+          *out_mode = stbuf.st_mode;
+          ret = TRUE;
+          goto out;
+        }
+      else if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+    }
+  else if (self->mode == OSTREE_REPO_MODE_BARE_USER)
+    {
+      g_autoptr(GBytes) bytes = NULL;
+      GError *local_error = NULL;
+
+      bytes = ot_lgetxattrat (self->objects_dir_fd, loose_path_buf,
+                              "user.ostreemeta", &local_error);
+      if (bytes)
+        {
+          g_autoptr(GVariant) metadata = NULL;
+          guint32 mode;
+
+          metadata = g_variant_new_from_bytes (OSTREE_FILEMETA_GVARIANT_FORMAT,
+                                               bytes, FALSE);
+          g_variant_ref_sink (metadata);
+          g_variant_get_child (metadata, 2, "u", &mode);
+          *out_mode = GUINT32_FROM_BE (mode);
+          ret = TRUE;
+          goto out;
+        }
+      else if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, local_error);
+          goto out;
+        }
+      g_clear_error (&local_error);
+    }
+  else
+    {
+      glnx_fd_close int fd = -1;
+
+      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                               cancellable, error))
+        goto out;
+
+      if (fd != -1)
+        {
+          if (!read_archive_file_mode (fd, out_mode, error))
+            {
+              g_prefix_error (error, "Reading %s: ", loose_path_buf);
+              goto out;
+            }
+          ret = TRUE;
+          goto out;
+        }
+    }
+
+  /* Packed, or in a parent repository */
+  if (!ostree_repo_load_file (self, checksum, NULL, &file_info, NULL,
+                              cancellable, error))
+    goto out;
+
+  *out_mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_load_object_stream:
+ * @self: Repo
+ * @objtype: Object type
+ * @checksum: ASCII SHA256 checksum
+ * @out_input: (out): Stream for object
+ * @out_size: (out): Length of @out_input
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Load object as a stream; useful when copying objects between
+ * repositories.
+ */
+gboolean
+ostree_repo_load_object_stream (OstreeRepo         *self,
+                                OstreeObjectType    objtype,
+                                const char         *checksum,
+                                GInputStream      **out_input,
+                                guint64            *out_size,
+                                GCancellable       *cancellable,
+                                GError            **error)
+{
+  gboolean ret = FALSE;
+  guint64 size;
+  g_autoptr(GInputStream) ret_input = NULL;
+
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    {
+      if (!load_metadata_internal (self, objtype, checksum, TRUE, NULL,
+                                   &ret_input, &size,
+                                   cancellable, error))
+        goto out;
+    }
+  else
+    {
+      g_autoptr(GInputStream) input = NULL;
+      g_autoptr(GFileInfo) finfo = NULL;
+      g_autoptr(GVariant) xattrs = NULL;
+
+      if (!ostree_repo_load_file (self, checksum, &input, &finfo, &xattrs,
+                                  cancellable, error))
         goto out;
 
       if (!ostree_raw_file_to_content_stream (input, finfo, xattrs,
@@ -3079,8 +3726,73 @@ _ostree_repo_find_object (OstreeRepo           *self,
 {
   gboolean has_object;
   char loose_path[_OSTREE_LOOSE_PATH_MAX];
-  return _ostree_repo_has_loose_object (self, checksum, objtype, &has_object, loose_path,
-                                        out_stored_path, cancellable, error);
+  g_autofree char *pack_data_path = NULL;
+
+  if (!_ostree_repo_has_loose_object (self, checksum, objtype, &has_object, loose_path,
+                                      out_stored_path, cancellable, error))
+    return FALSE;
+
+  if (!has_object
+      && _ostree_repo_find_packed_object (self, objtype, checksum, NULL, &pack_data_path))
+    {
+      has_object = TRUE;
+      if (out_stored_path)
+        *out_stored_path = g_file_resolve_relative_path (self->objects_dir, pack_data_path);
+    }
+
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_stat_object:
+ * @out_stbuf: (out): Result of stat() on the loose object, or on the
+ *   pack data file containing it
+ *
+ * Find where an object is stored.  If it is in neither a loose file
+ * nor a pack, a %G_IO_ERROR_NOT_FOUND error is returned.
+ */
+gboolean
+_ostree_repo_stat_object (OstreeRepo           *self,
+                          OstreeObjectType      objtype,
+                          const char           *checksum,
+                          struct stat          *out_stbuf,
+                          GCancellable         *cancellable,
+                          GError              **error)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  g_autofree char *pack_data_path = NULL;
+  const char *path = loose_path;
+  int res;
+
+  _ostree_loose_path (loose_path, checksum, objtype, self->mode);
+
+  do
+    res = fstatat (self->objects_dir_fd, loose_path, out_stbuf, AT_SYMLINK_NOFOLLOW);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1 && errno == ENOENT
+      && _ostree_repo_find_packed_object (self, objtype, checksum, NULL, &pack_data_path))
+    {
+      path = pack_data_path;
+      do
+        res = fstatat (self->objects_dir_fd, path, out_stbuf, AT_SYMLINK_NOFOLLOW);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+    }
+
+  if (res == -1)
+    {
+      if (errno == ENOENT)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                     "No such object %s.%s", checksum,
+                     ostree_object_type_to_string (objtype));
+      else
+        {
+          glnx_set_error_from_errno (error);
+          g_prefix_error (error, "Stat of %s: ", path);
+        }
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 /**
@@ -3149,11 +3861,15 @@ ostree_repo_delete_object (OstreeRepo           *self,
                            GError              **error)
 {
   gboolean ret = FALSE;
+  gboolean deleted;
   int res;
   char loose_path[_OSTREE_LOOSE_PATH_MAX];
 
   _ostree_loose_path (loose_path, sha256, objtype, self->mode);
 
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    metadata_cache_remove (self, objtype, sha256);
+
   if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
     {
       char meta_loose[_OSTREE_LOOSE_PATH_MAX];
@@ -3177,11 +3893,28 @@ ostree_repo_delete_object (OstreeRepo           *self,
   do
     res = unlinkat (self->objects_dir_fd, loose_path, 0);
   while (G_UNLIKELY (res == -1 && errno == EINTR));
-  if (G_UNLIKELY (res == -1))
+
+  if (res == -1 && errno != ENOENT)
     {
       gs_set_error_from_errno (error, errno);
       goto out;
     }
+  deleted = (res == 0);
+
+  /* A content object may also have a chunk manifest; the chunks
+   * themselves are left for pruning.
+   */
+  if (objtype == OSTREE_OBJECT_TYPE_FILE)
+    {
+      if (!_ostree_repo_delete_file_chunks (self, sha256, error))
+        goto out;
+    }
+
+  if (!deleted)
+    {
+      gs_set_error_from_errno (error, ENOENT);
+      goto out;
+    }
 
   ret = TRUE;
  out:
@@ -3227,17 +3960,39 @@ import_one_object_copy (OstreeRepo    *self,
   gboolean ret = FALSE;
   guint64 length;
   g_autoptr(GInputStream) object = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  int content_fd = -1;
 
-  if (!ostree_repo_load_object_stream (source, objtype, checksum,
-                                       &object, &length,
-                                       cancellable, error))
+  if (objtype == OSTREE_OBJECT_TYPE_FILE
+      && (source->mode == OSTREE_REPO_MODE_BARE || source->mode == OSTREE_REPO_MODE_BARE_USER))
+    {
+      g_autoptr(GFileInfo) file_info = NULL;
+      g_autoptr(GVariant) xattrs = NULL;
+
+      /* Keep hold of the source file, so a bare destination can
+       * clone it rather than copy the data.
+       */
+      if (!ostree_repo_load_file (source, checksum, &content, &file_info, &xattrs,
+                                  cancellable, error))
+        goto out;
+      if (content && G_IS_FILE_DESCRIPTOR_BASED (content))
+        content_fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)content);
+
+      if (!ostree_raw_file_to_content_stream (content, file_info, xattrs,
+                                              &object, &length,
+                                              cancellable, error))
+        goto out;
+    }
+  else if (!ostree_repo_load_object_stream (source, objtype, checksum,
+                                            &object, &length,
+                                            cancellable, error))
     goto out;
 
   if (objtype == OSTREE_OBJECT_TYPE_FILE)
     {
-      if (!ostree_repo_write_content_trusted (self, checksum,
-                                              object, length,
-                                              cancellable, error))
+      if (!_ostree_repo_write_content_from_fd (self, checksum,
+                                               object, length, content_fd, NULL,
+                                               cancellable, error))
         goto out;
     }
   else
@@ -3290,6 +4045,28 @@ import_one_object_link (OstreeRepo    *self,
           *out_was_supported = FALSE;
           ret = TRUE;
         }
+      else if (errno == ENOENT)
+        {
+          gboolean source_has_object;
+
+          /* Not loose; it may still be packed, chunked or in a parent
+           * repo, and then gets copied.
+           */
+          if (!ostree_repo_has_object (source, objtype, checksum, &source_has_object,
+                                       cancellable, error))
+            goto out;
+
+          if (!source_has_object)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                           "No such object %s.%s", checksum,
+                           ostree_object_type_to_string (objtype));
+              goto out;
+            }
+
+          *out_was_supported = FALSE;
+          ret = TRUE;
+        }
       else
         gs_set_error_from_errno (error, errno);
       
@@ -3321,7 +4098,9 @@ import_one_object_link (OstreeRepo    *self,
  * type and on the same filesystem, this will simply be a fast Unix
  * hard link operation.
  *
- * Otherwise, a copy will be performed.
+ * Otherwise, a copy will be performed.  Between bare repositories on
+ * a filesystem supporting it, such as btrfs or XFS, the copy of
+ * content objects shares the data with the source.
  */
 gboolean
 ostree_repo_import_object_from (OstreeRepo           *self,
@@ -3395,7 +4174,18 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
   while (G_UNLIKELY (res == -1 && errno == EINTR));
   if (G_UNLIKELY (res == -1))
     {
-      gs_set_error_from_errno (error, errno);
+      int errsv = errno;
+      g_autoptr(GBytes) packed_data = NULL;
+
+      if (errsv == ENOENT
+          && _ostree_repo_find_packed_object (self, objtype, sha256, &packed_data, NULL))
+        {
+          *out_size = g_bytes_get_size (packed_data);
+          ret = TRUE;
+          goto out;
+        }
+
+      gs_set_error_from_errno (error, errsv);
       goto out;
     }
 
@@ -3539,18 +4329,19 @@ ostree_repo_list_objects (OstreeRepo                  *self,
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_LOOSE)
     {
-      if (!list_loose_objects (self, ret_objects, NULL, cancellable, error))
+      if (!list_loose_objects (self, ret_objects, NULL, NULL, cancellable, error))
         goto out;
       if (self->parent_repo)
         {
-          if (!list_loose_objects (self->parent_repo, ret_objects, NULL, cancellable, error))
+          if (!list_loose_objects (self->parent_repo, ret_objects, NULL, NULL, cancellable, error))
             goto out;
         }
     }
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
     {
-      /* Nothing for now... */
+      if (!_ostree_repo_list_packed_objects (self, ret_objects, cancellable, error))
+        goto out;
     }
 
   ret = TRUE;
@@ -3559,6 +4350,46 @@ ostree_repo_list_objects (OstreeRepo                  *self,
   return ret;
 }
 
+/*
+ * _ostree_repo_list_objects_set:
+ *
+ * Like ostree_repo_list_objects(), but adds the object names to
+ * @inout_objects without any per-object data.
+ */
+gboolean
+_ostree_repo_list_objects_set (OstreeRepo                  *self,
+                               OstreeRepoListObjectsFlags   flags,
+                               OstreeObjectSet             *inout_objects,
+                               GCancellable                *cancellable,
+                               GError                     **error)
+{
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (self->inited, FALSE);
+
+  if (flags & OSTREE_REPO_LIST_OBJECTS_ALL)
+    flags |= (OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_PACKED);
+
+  if (flags & OSTREE_REPO_LIST_OBJECTS_LOOSE)
+    {
+      if (!list_loose_objects (self, NULL, inout_objects, NULL, cancellable, error))
+        goto out;
+      if (self->parent_repo)
+        {
+          if (!list_loose_objects (self->parent_repo, NULL, inout_objects, NULL,
+                                   cancellable, error))
+            goto out;
+        }
+    }
+
+  if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
+    _ostree_repo_list_packed_objects_set (self, inout_objects);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 /**
  * ostree_repo_list_commit_objects_starting_with:
  * @self: Repo
@@ -3589,13 +4420,13 @@ ostree_repo_list_commit_objects_starting_with (OstreeRepo                  *self
                                        (GDestroyNotify) g_variant_unref,
                                        (GDestroyNotify) g_variant_unref);
 
-  if (!list_loose_objects (self, ret_commits, start, cancellable, error))
+  if (!list_loose_objects (self, ret_commits, NULL, start, cancellable, error))
         goto out;
 
 
   if (self->parent_repo)
     {
-      if (!list_loose_objects (self->parent_repo, ret_commits, start,
+      if (!list_loose_objects (self->parent_repo, ret_commits, NULL, start,
                                cancellable, error))
         goto out;
     }
@@ -4441,114 +5272,215 @@ ostree_repo_verify_commit_ext (OstreeRepo    *self,
                                               error);
 }
 
-/**
- * ostree_repo_regenerate_summary:
- * @self: Repo
- * @additional_metadata: (allow-none): A GVariant of type a{sv}, or %NULL
- * @cancellable: Cancellable
- * @error: Error
- *
- * An OSTree repository can contain a high level "summary" file that
- * describes the available branches and other metadata.
- *
- * It is regenerated automatically after a commit if
- * `core/commit-update-summary` is set.
+/* Returns: (transfer floating): an a{sv} of @table, a mapping from
+ * name to #GVariant, with the names in strcmp() order.  The order of
+ * a #GVariantDict depends on the history of its hash table, which
+ * would make summaries with the same contents differ.
  */
-gboolean
-ostree_repo_regenerate_summary (OstreeRepo     *self,
-                                GVariant       *additional_metadata,
-                                GCancellable   *cancellable,
-                                GError        **error)
+static GVariant *
+new_sorted_vardict (GHashTable *table)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GHashTable) refs = NULL;
-  g_autoptr(GVariantBuilder) refs_builder = NULL;
-  g_autoptr(GVariant) summary = NULL;
+  GVariantBuilder builder;
   GList *ordered_keys = NULL;
   GList *iter = NULL;
-  GVariantDict additional_metadata_builder;
-
-  if (!ostree_repo_list_refs (self, NULL, &refs, cancellable, error))
-    goto out;
 
-  g_variant_dict_init (&additional_metadata_builder, additional_metadata);
-  refs_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
 
-  ordered_keys = g_hash_table_get_keys (refs);
+  ordered_keys = g_hash_table_get_keys (table);
   ordered_keys = g_list_sort (ordered_keys, (GCompareFunc)strcmp);
 
   for (iter = ordered_keys; iter; iter = iter->next)
     {
-      const char *ref = iter->data;
-      const char *commit = g_hash_table_lookup (refs, ref);
-      g_autoptr(GVariant) commit_obj = NULL;
+      const char *key = iter->data;
 
-      g_assert (commit);
+      g_variant_builder_add (&builder, "{sv}", key,
+                             g_hash_table_lookup (table, key));
+    }
 
-      if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_obj, error))
-        goto out;
+  g_list_free (ordered_keys);
+  return g_variant_builder_end (&builder);
+}
 
-      g_variant_builder_add_value (refs_builder, 
-                                   g_variant_new ("(s(t@ay@a{sv}))", ref,
-                                                  (guint64) g_variant_get_size (commit_obj),
-                                                  ostree_checksum_to_bytes_v (commit),
-                                                  ot_gvariant_new_empty_string_dict ()));
-    }
+static GHashTable *
+summary_table_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                (GDestroyNotify)g_variant_unref);
+}
 
+/* Set the summary entry of @ref in @refs to the commit @rev */
+static gboolean
+summary_add_ref (OstreeRepo     *self,
+                 GHashTable     *refs,
+                 const char     *ref,
+                 const char     *rev,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GVariant) commit_obj = NULL;
+  GVariant *entry;
 
-  {
-    guint i;
-    g_autoptr(GPtrArray) delta_names = NULL;
-    GVariantDict deltas_builder;
-    g_autoptr(GVariant) deltas = NULL;
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, rev, &commit_obj, error))
+    goto out;
 
-    if (!ostree_repo_list_static_delta_names (self, &delta_names, cancellable, error))
-      goto out;
+  entry = g_variant_new ("(t@ay@a{sv})",
+                         (guint64) g_variant_get_size (commit_obj),
+                         ostree_checksum_to_bytes_v (rev),
+                         ot_gvariant_new_empty_string_dict ());
+  g_hash_table_replace (refs, g_strdup (ref), g_variant_ref_sink (entry));
 
-    g_variant_dict_init (&deltas_builder, NULL);
-    for (i = 0; i < delta_names->len; i++)
-      {
-        gs_free char *from = NULL;
-        gs_free char *to = NULL;
-        gs_free guchar *csum = NULL;
-        gs_free char *superblock;
-        gs_fd_close int superblock_file_fd;
-        g_autoptr(GInputStream) in_stream = NULL;
-
-        _ostree_parse_delta_name (delta_names->pdata[i], &from, &to);
-        superblock = _ostree_get_relative_static_delta_superblock_path ((from && from[0]) ? from : NULL, to);
-        superblock_file_fd = openat (self->repo_dir_fd, superblock, O_RDONLY | O_CLOEXEC);
-        if (superblock_file_fd == -1)
-          {
-            gs_set_error_from_errno (error, errno);
-            goto out;
-          }
+  ret = TRUE;
+ out:
+  return ret;
+}
 
-        in_stream = g_unix_input_stream_new (superblock_file_fd, TRUE);
-        if (!in_stream)
-          goto out;
+/* Set the entry of @name in @deltas to the checksum of the superblock
+ * at @superblock, or remove it if the file does not exist.
+ */
+static gboolean
+summary_add_superblock (OstreeRepo     *self,
+                        GHashTable     *deltas,
+                        const char     *name,
+                        const char     *superblock,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free guchar *csum = NULL;
+  int superblock_file_fd;
+  g_autoptr(GInputStream) in_stream = NULL;
 
-        if (!ot_gio_checksum_stream (in_stream,
-                                     &csum,
-                                     cancellable,
-                                     error))
+  superblock_file_fd = openat (self->repo_dir_fd, superblock, O_RDONLY | O_CLOEXEC);
+  if (superblock_file_fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          gs_set_error_from_errno (error, errno);
           goto out;
+        }
+      g_hash_table_remove (deltas, name);
+      ret = TRUE;
+      goto out;
+    }
 
-        g_variant_dict_insert_value (&deltas_builder, delta_names->pdata[i], ot_gvariant_new_bytearray (csum, 32));
-      }
+  in_stream = g_unix_input_stream_new (superblock_file_fd, TRUE);
+  if (!in_stream)
+    goto out;
 
-    g_variant_dict_insert_value (&additional_metadata_builder, OSTREE_SUMMARY_STATIC_DELTAS, g_variant_dict_end (&deltas_builder));
-  }
+  if (!ot_gio_checksum_stream (in_stream,
+                               &csum,
+                               cancellable,
+                               error))
+    goto out;
 
-  {
-    g_autoptr(GVariantBuilder) summary_builder =
-      g_variant_builder_new (OSTREE_SUMMARY_GVARIANT_FORMAT);
+  g_hash_table_replace (deltas, g_strdup (name),
+                        g_variant_ref_sink (ot_gvariant_new_bytearray (csum, 32)));
 
-    g_variant_builder_add_value (summary_builder, g_variant_builder_end (refs_builder));
-    g_variant_builder_add_value (summary_builder, g_variant_dict_end (&additional_metadata_builder));
-    summary = g_variant_builder_end (summary_builder);
-    g_variant_ref_sink (summary);
-  }
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Set the summary entries of the static delta @name in @deltas and
+ * @zstd_deltas to the checksums of its superblocks, or remove them if
+ * they do not exist.
+ */
+static gboolean
+summary_add_delta (OstreeRepo     *self,
+                   GHashTable     *deltas,
+                   GHashTable     *zstd_deltas,
+                   const char     *name,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *from = NULL;
+  gs_free char *to = NULL;
+  gs_free char *superblock = NULL;
+  gs_free char *zstd_superblock = NULL;
+
+  _ostree_parse_delta_name (name, &from, &to);
+  superblock = _ostree_get_relative_static_delta_superblock_path ((from && from[0]) ? from : NULL, to);
+  zstd_superblock = _ostree_get_relative_static_delta_zstd_superblock_path ((from && from[0]) ? from : NULL, to);
+
+  if (!summary_add_superblock (self, deltas, name, superblock, cancellable, error))
+    goto out;
+  if (!summary_add_superblock (self, zstd_deltas, name, zstd_superblock, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Write the summary from @refs, mapping each ref to its (taya{sv})
+ * entry, and @deltas and @zstd_deltas, mapping each static delta name
+ * to the checksum of its superblock and zstd superblock.  Everything is
+ * sorted, so the result only depends on the contents of the tables.
+ */
+static gboolean
+write_summary (OstreeRepo     *self,
+               GVariant       *additional_metadata,
+               GHashTable     *refs,
+               GHashTable     *deltas,
+               GHashTable     *zstd_deltas,
+               GCancellable   *cancellable,
+               GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) metadata = summary_table_new ();
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) chunked_content = NULL;
+  GVariantBuilder refs_builder;
+  GList *ordered_keys = NULL;
+  GList *iter = NULL;
+
+  if (additional_metadata)
+    {
+      GVariantIter viter;
+      const char *key;
+      GVariant *value;
+
+      g_variant_iter_init (&viter, additional_metadata);
+      while (g_variant_iter_next (&viter, "{&sv}", &key, &value))
+        g_hash_table_replace (metadata, g_strdup (key), value);
+    }
+
+  g_hash_table_replace (metadata, g_strdup (OSTREE_SUMMARY_STATIC_DELTAS),
+                        g_variant_ref_sink (new_sorted_vardict (deltas)));
+  if (g_hash_table_size (zstd_deltas) > 0)
+    g_hash_table_replace (metadata, g_strdup (OSTREE_SUMMARY_STATIC_DELTAS_ZSTD),
+                          g_variant_ref_sink (new_sorted_vardict (zstd_deltas)));
+
+  if (!_ostree_repo_load_packs (self, cancellable, error))
+    goto out;
+  g_hash_table_replace (metadata, g_strdup (OSTREE_SUMMARY_PACKS),
+                        g_variant_ref_sink (_ostree_repo_get_packs_summary (self)));
+
+  if (!_ostree_repo_get_chunked_content_summary (self, &chunked_content,
+                                                 cancellable, error))
+    goto out;
+  if (chunked_content)
+    g_hash_table_replace (metadata, g_strdup (OSTREE_SUMMARY_CHUNKED_CONTENT),
+                          g_variant_ref (chunked_content));
+
+  g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+
+  ordered_keys = g_hash_table_get_keys (refs);
+  ordered_keys = g_list_sort (ordered_keys, (GCompareFunc)strcmp);
+
+  for (iter = ordered_keys; iter; iter = iter->next)
+    {
+      const char *ref = iter->data;
+
+      g_variant_builder_add (&refs_builder, "(s@(taya{sv}))", ref,
+                             g_hash_table_lookup (refs, ref));
+    }
+
+  summary = g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                           g_variant_builder_end (&refs_builder),
+                           new_sorted_vardict (metadata));
+  g_variant_ref_sink (summary);
 
   if (!_ostree_repo_file_replace_contents (self,
                                            self->repo_dir_fd,
@@ -4574,3 +5506,184 @@ ostree_repo_regenerate_summary (OstreeRepo     *self,
     g_list_free (ordered_keys);
   return ret;
 }
+
+/**
+ * ostree_repo_regenerate_summary:
+ * @self: Repo
+ * @additional_metadata: (allow-none): A GVariant of type a{sv}, or %NULL
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * An OSTree repository can contain a high level "summary" file that
+ * describes the available branches and other metadata.
+ *
+ * It is regenerated automatically after a commit if
+ * `core/commit-update-summary` is set.
+ *
+ * The summary also lists the static deltas and pack files of the
+ * repository, so it should be regenerated after
+ * ostree_repo_repack(), and the files stored in chunks if
+ * `core/chunked-content-threshold` is set; clients only fetch those
+ * in chunks if they are listed.
+ */
+gboolean
+ostree_repo_regenerate_summary (OstreeRepo     *self,
+                                GVariant       *additional_metadata,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) all_refs = NULL;
+  g_autoptr(GHashTable) refs = summary_table_new ();
+  g_autoptr(GHashTable) deltas = summary_table_new ();
+  g_autoptr(GHashTable) zstd_deltas = summary_table_new ();
+  g_autoptr(GPtrArray) delta_names = NULL;
+  GHashTableIter hash_iter;
+  gpointer key, value;
+  guint i;
+
+  if (!ostree_repo_list_refs (self, NULL, &all_refs, cancellable, error))
+    goto out;
+
+  g_hash_table_iter_init (&hash_iter, all_refs);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      if (!summary_add_ref (self, refs, key, value, error))
+        goto out;
+    }
+
+  if (!ostree_repo_list_static_delta_names (self, &delta_names, cancellable, error))
+    goto out;
+
+  for (i = 0; i < delta_names->len; i++)
+    {
+      if (!summary_add_delta (self, deltas, zstd_deltas, delta_names->pdata[i],
+                              cancellable, error))
+        goto out;
+    }
+
+  if (!write_summary (self, additional_metadata, refs, deltas, zstd_deltas,
+                      cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_regenerate_summary_incremental:
+ * @self: Repo
+ * @additional_metadata: (allow-none): A GVariant of type a{sv}, or %NULL
+ * @changed_refs: (array zero-terminated=1) (allow-none): Refspecs which were set or deleted since the summary was last written
+ * @changed_deltas: (array zero-terminated=1) (allow-none): Names of static deltas which were generated or deleted since then
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_regenerate_summary(), but start from the existing
+ * summary file and only look up @changed_refs and @changed_deltas,
+ * rather than loading the commit of every ref and checksumming every
+ * static delta.  Entries of the existing summary which are not listed
+ * are trusted to still be current.
+ *
+ * The result is the same, byte for byte, as what
+ * ostree_repo_regenerate_summary() would write.  If there is no
+ * summary yet, this falls back to a full regeneration.
+ */
+gboolean
+ostree_repo_regenerate_summary_incremental (OstreeRepo          *self,
+                                            GVariant            *additional_metadata,
+                                            const char * const  *changed_refs,
+                                            const char * const  *changed_deltas,
+                                            GCancellable        *cancellable,
+                                            GError             **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int fd = -1;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) summary_data = NULL;
+  g_autoptr(GVariant) old_summary = NULL;
+  g_autoptr(GVariant) old_refs = NULL;
+  g_autoptr(GVariant) old_metadata = NULL;
+  g_autoptr(GVariant) old_deltas = NULL;
+  g_autoptr(GVariant) old_zstd_deltas = NULL;
+  g_autoptr(GHashTable) refs = summary_table_new ();
+  g_autoptr(GHashTable) deltas = summary_table_new ();
+  g_autoptr(GHashTable) zstd_deltas = summary_table_new ();
+  GVariantIter viter;
+  const char *name;
+  GVariant *value;
+  const char * const *iter;
+
+  fd = openat (self->repo_dir_fd, "summary", O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          goto out;
+        }
+
+      ret = ostree_repo_regenerate_summary (self, additional_metadata,
+                                            cancellable, error);
+      goto out;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+  summary_data = g_mapped_file_get_bytes (mfile);
+  old_summary = g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                          summary_data, FALSE);
+  g_variant_ref_sink (old_summary);
+
+  old_refs = g_variant_get_child_value (old_summary, 0);
+  g_variant_iter_init (&viter, old_refs);
+  while (g_variant_iter_next (&viter, "(&s@(taya{sv}))", &name, &value))
+    g_hash_table_replace (refs, g_strdup (name), value);
+
+  old_metadata = g_variant_get_child_value (old_summary, 1);
+  old_deltas = g_variant_lookup_value (old_metadata, OSTREE_SUMMARY_STATIC_DELTAS,
+                                       G_VARIANT_TYPE ("a{sv}"));
+  if (old_deltas)
+    {
+      g_variant_iter_init (&viter, old_deltas);
+      while (g_variant_iter_next (&viter, "{&sv}", &name, &value))
+        g_hash_table_replace (deltas, g_strdup (name), value);
+    }
+  old_zstd_deltas = g_variant_lookup_value (old_metadata, OSTREE_SUMMARY_STATIC_DELTAS_ZSTD,
+                                            G_VARIANT_TYPE ("a{sv}"));
+  if (old_zstd_deltas)
+    {
+      g_variant_iter_init (&viter, old_zstd_deltas);
+      while (g_variant_iter_next (&viter, "{&sv}", &name, &value))
+        g_hash_table_replace (zstd_deltas, g_strdup (name), value);
+    }
+
+  for (iter = changed_refs; iter && *iter; iter++)
+    {
+      g_autofree char *rev = NULL;
+
+      if (!_ostree_repo_lookup_ref (self, *iter, &rev, cancellable, error))
+        goto out;
+
+      if (rev == NULL)
+        g_hash_table_remove (refs, *iter);
+      else if (!summary_add_ref (self, refs, *iter, rev, error))
+        goto out;
+    }
+
+  for (iter = changed_deltas; iter && *iter; iter++)
+    {
+      if (!summary_add_delta (self, deltas, zstd_deltas, *iter, cancellable, error))
+        goto out;
+    }
+
+  if (!write_summary (self, additional_metadata, refs, deltas, zstd_deltas,
+                      cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
@@ -137,6 +137,11 @@ gboolean      ostree_repo_remote_fetch_summary (OstreeRepo    *self,
 
 OstreeRepo * ostree_repo_get_parent (OstreeRepo  *self);
 
+void          ostree_repo_get_metadata_cache_stats (OstreeRepo  *self,
+                                                    guint64     *out_hits,
+                                                    guint64     *out_misses,
+                                                    guint64     *out_size);
+
 gboolean      ostree_repo_write_config (OstreeRepo *self,
                                         GKeyFile   *new_config,
                                         GError    **error);
@@ -153,6 +158,19 @@ gboolean      ostree_repo_write_config (OstreeRepo *self,
  * were written to the repository in this transaction.
  * @content_bytes_written: The amount of data added to the repository,
  * in bytes, counting only content objects.
+ * @stat_cache_hits: The number of files whose checksum was taken from
+ * the stat cache; see %OSTREE_REPO_COMMIT_MODIFIER_FLAGS_STAT_CACHE.
+ * @stat_cache_misses: The number of files looked up in the stat cache
+ * which had to be checksummed.
+ * @fsync_usec: Time spent syncing new objects to disk when committing
+ * the transaction, in microseconds.
+ * @rename_usec: Time spent moving new objects into place when committing
+ * the transaction, in microseconds.
+ * @ref_update_usec: Time spent writing refs when committing the
+ * transaction, in microseconds.
+ * @content_bytes_cloned: The amount of content data, in bytes, which
+ * was copied into new objects by the kernel, by sharing extents
+ * (reflinks) or with copy_file_range(), rather than by writing it.
  *
  * A list of statistics for each transaction that may be
  * interesting for reporting purposes.
@@ -166,10 +184,13 @@ struct _OstreeRepoTransactionStats {
   guint content_objects_written;
   guint64 content_bytes_written;
 
-  guint64 padding1;
-  guint64 padding2;
-  guint64 padding3;
-  guint64 padding4;
+  guint32 stat_cache_hits;
+  guint32 stat_cache_misses;
+  guint32 fsync_usec;
+  guint32 rename_usec;
+  guint32 ref_update_usec;
+  guint32 padding3;
+  guint64 content_bytes_cloned;
 };
 
 GType ostree_repo_transaction_stats_get_type (void);
@@ -297,6 +318,10 @@ gboolean ostree_repo_remote_list_refs (OstreeRepo       *self,
                                        GCancellable     *cancellable,
                                        GError          **error);
 
+gboolean ostree_repo_pack_refs (OstreeRepo    *self,
+                                GCancellable  *cancellable,
+                                GError       **error);
+
 gboolean      ostree_repo_load_variant (OstreeRepo  *self,
                                         OstreeObjectType objtype,
                                         const char    *sha256, 
@@ -384,11 +409,16 @@ typedef OstreeRepoCommitFilterResult (*OstreeRepoCommitFilter) (OstreeRepo    *r
  * @OSTREE_REPO_COMMIT_MODIFIER_FLAGS_NONE: No special flags
  * @OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS: Do not process extended attributes
  * @OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES: Generate size information.
+ * @OSTREE_REPO_COMMIT_MODIFIER_FLAGS_STAT_CACHE: Reuse the checksums of
+ * local files whose device, inode, size, timestamps, mode, ownership and
+ * extended attributes are unchanged since a previous commit, using a cache
+ * stored in the repository.
  */
 typedef enum {
   OSTREE_REPO_COMMIT_MODIFIER_FLAGS_NONE = 0,
   OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS = (1 << 0),
-  OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES = (1 << 1)
+  OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES = (1 << 1),
+  OSTREE_REPO_COMMIT_MODIFIER_FLAGS_STAT_CACHE = (1 << 2)
 } OstreeRepoCommitModifierFlags;
 
 /**
@@ -502,18 +532,34 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
  * options.  This is used by ostree_repo_checkout_tree_at() which
  * supercedes previous separate enumeration usage in
  * ostree_repo_checkout_tree().
+ *
+ * Set n_workers to a value greater than one to check out directories
+ * using that many threads.
+ *
+ * Set force_copy to copy files rather than hardlinking them to the
+ * repository, so that the checkout may be modified.  On filesystems
+ * supporting it, copies from bare repositories share the data with
+ * the objects.
+ *
+ * Set from_commit to the checksum of the commit currently checked out
+ * at the destination (with the same subpath and mode) to update it in
+ * place rather than creating a new tree; see
+ * ostree_repo_checkout_tree_at().
  */
 typedef struct {
   OstreeRepoCheckoutMode mode;
   OstreeRepoCheckoutOverwriteMode overwrite_mode;
   
   guint enable_uncompressed_cache : 1;
-  guint unused : 31;
+  guint force_copy : 1;
+  guint unused : 30;
 
   const char *subpath;
 
-  guint unused_uints[6];
-  gpointer unused_ptrs[8];
+  guint n_workers;
+  guint unused_uints[5];
+  const char *from_commit;
+  gpointer unused_ptrs[7];
 } OstreeRepoCheckoutOptions;
 
 gboolean ostree_repo_checkout_tree_at (OstreeRepo                         *self,
@@ -593,6 +639,15 @@ gboolean ostree_repo_static_delta_generate (OstreeRepo                   *self,
                                             GCancellable                 *cancellable,
                                             GError                      **error);
 
+gboolean ostree_repo_static_delta_generate_batch (OstreeRepo                   *self,
+                                                  OstreeStaticDeltaGenerateOpt  opt,
+                                                  const char * const           *froms,
+                                                  const char                   *to,
+                                                  GVariant                     *metadata,
+                                                  GVariant                     *params,
+                                                  GCancellable                 *cancellable,
+                                                  GError                      **error);
+
 gboolean ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
                                                    GFile                         *dir,
                                                    gboolean                       skip_validation,
@@ -689,6 +744,25 @@ gboolean ostree_repo_prune (OstreeRepo        *self,
                             GCancellable      *cancellable,
                             GError           **error);
 
+/**
+ * OstreeRepoRepackFlags:
+ * @OSTREE_REPO_REPACK_FLAGS_NONE: No special options for repacking
+ * @OSTREE_REPO_REPACK_FLAGS_METADATA_ONLY: Leave content objects loose
+ * @OSTREE_REPO_REPACK_FLAGS_KEEP_LOOSE: Don't delete the loose copies of packed objects
+ */
+typedef enum {
+  OSTREE_REPO_REPACK_FLAGS_NONE,
+  OSTREE_REPO_REPACK_FLAGS_METADATA_ONLY = (1 << 0),
+  OSTREE_REPO_REPACK_FLAGS_KEEP_LOOSE = (1 << 1)
+} OstreeRepoRepackFlags;
+
+gboolean ostree_repo_repack (OstreeRepo            *self,
+                             OstreeRepoRepackFlags  flags,
+                             guint                 *out_n_objects_packed,
+                             guint                 *out_n_objects_total,
+                             GCancellable          *cancellable,
+                             GError               **error);
+
 /**
  * OstreeRepoPullFlags:
  * @OSTREE_REPO_PULL_FLAGS_NONE: No special options for pull
@@ -776,5 +850,12 @@ gboolean ostree_repo_regenerate_summary (OstreeRepo     *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
 
+gboolean ostree_repo_regenerate_summary_incremental (OstreeRepo          *self,
+                                                     GVariant            *additional_metadata,
+                                                     const char * const  *changed_refs,
+                                                     const char * const  *changed_deltas,
+                                                     GCancellable        *cancellable,
+                                                     GError             **error);
+
 
 G_END_DECLS
@@ -0,0 +1,228 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ostree-zstd-compressor.h"
+
+#include <string.h>
+#include <zstd.h>
+
+enum {
+  PROP_0,
+  PROP_LEVEL
+};
+
+/**
+ * SECTION:ostree-zstd-compressor
+ * @short_description: Zstandard compressor
+ *
+ * An implementation of #GConverter that compresses data using
+ * Zstandard, writing a single frame.
+ */
+
+static void _ostree_zstd_compressor_iface_init          (GConverterIface *iface);
+
+struct _OstreeZstdCompressor
+{
+  GObject parent_instance;
+
+  int level;
+  ZSTD_CStream *cstream;
+  gboolean initialized;
+};
+
+G_DEFINE_TYPE_WITH_CODE (OstreeZstdCompressor, _ostree_zstd_compressor,
+			 G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+						_ostree_zstd_compressor_iface_init))
+
+static void
+_ostree_zstd_compressor_finalize (GObject *object)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (object);
+
+  ZSTD_freeCStream (self->cstream);
+
+  G_OBJECT_CLASS (_ostree_zstd_compressor_parent_class)->finalize (object);
+}
+
+static void
+_ostree_zstd_compressor_set_property (GObject      *object,
+				      guint         prop_id,
+				      const GValue *value,
+				      GParamSpec   *pspec)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (object);
+
+  switch (prop_id)
+    {
+    case PROP_LEVEL:
+      self->level = g_value_get_int (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+_ostree_zstd_compressor_get_property (GObject    *object,
+				      guint       prop_id,
+				      GValue     *value,
+				      GParamSpec *pspec)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (object);
+
+  switch (prop_id)
+    {
+    case PROP_LEVEL:
+      g_value_set_int (value, self->level);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+_ostree_zstd_compressor_init (OstreeZstdCompressor *self)
+{
+  self->cstream = ZSTD_createCStream ();
+}
+
+static void
+_ostree_zstd_compressor_class_init (OstreeZstdCompressorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = _ostree_zstd_compressor_finalize;
+  gobject_class->get_property = _ostree_zstd_compressor_get_property;
+  gobject_class->set_property = _ostree_zstd_compressor_set_property;
+
+  g_object_class_install_property (gobject_class,
+				   PROP_LEVEL,
+				   g_param_spec_int ("level", "", "",
+						     1, 22, 3,
+						     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+						     G_PARAM_STATIC_STRINGS));
+}
+
+OstreeZstdCompressor *
+_ostree_zstd_compressor_new (int level)
+{
+  return g_object_new (OSTREE_TYPE_ZSTD_COMPRESSOR,
+		       "level", level,
+		       NULL);
+}
+
+static void
+_ostree_zstd_compressor_reset (GConverter *converter)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (converter);
+
+  self->initialized = FALSE;
+}
+
+static GConverterResult
+_ostree_zstd_compressor_convert (GConverter *converter,
+				 const void *inbuf,
+				 gsize       inbuf_size,
+				 void       *outbuf,
+				 gsize       outbuf_size,
+				 GConverterFlags flags,
+				 gsize      *bytes_read,
+				 gsize      *bytes_written,
+				 GError    **error)
+{
+  OstreeZstdCompressor *self = OSTREE_ZSTD_COMPRESSOR (converter);
+  GConverterResult ret = G_CONVERTER_ERROR;
+  ZSTD_inBuffer in = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer out = { outbuf, outbuf_size, 0 };
+  GConverterResult result = G_CONVERTER_CONVERTED;
+  size_t res;
+
+  if (self->cstream == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Out of memory");
+      goto out;
+    }
+
+  if (!self->initialized)
+    {
+      res = ZSTD_initCStream (self->cstream, self->level);
+      if (ZSTD_isError (res))
+        goto zstd_error;
+      self->initialized = TRUE;
+    }
+
+  res = ZSTD_compressStream (self->cstream, &out, &in);
+  if (ZSTD_isError (res))
+    goto zstd_error;
+
+  /* Only end or flush the frame once all of the input is buffered;
+   * a return value of 0 means zstd has nothing left to write.
+   */
+  if (in.pos == in.size)
+    {
+      if (flags & G_CONVERTER_INPUT_AT_END)
+        {
+          res = ZSTD_endStream (self->cstream, &out);
+          if (ZSTD_isError (res))
+            goto zstd_error;
+          if (res == 0)
+            result = G_CONVERTER_FINISHED;
+        }
+      else if (flags & G_CONVERTER_FLUSH)
+        {
+          res = ZSTD_flushStream (self->cstream, &out);
+          if (ZSTD_isError (res))
+            goto zstd_error;
+          if (res == 0)
+            result = G_CONVERTER_FLUSHED;
+        }
+    }
+
+  if (result == G_CONVERTER_CONVERTED && in.pos == 0 && out.pos == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                           "Not enough space in destination");
+      goto out;
+    }
+
+  *bytes_read = in.pos;
+  *bytes_written = out.pos;
+  ret = result;
+  goto out;
+
+ zstd_error:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "zstd compression failed: %s", ZSTD_getErrorName (res));
+ out:
+  return ret;
+}
+
+static void
+_ostree_zstd_compressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = _ostree_zstd_compressor_convert;
+  iface->reset = _ostree_zstd_compressor_reset;
+}
@@ -0,0 +1,145 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ostree-zstd-decompressor.h"
+
+#include <string.h>
+#include <zstd.h>
+
+static void _ostree_zstd_decompressor_iface_init          (GConverterIface *iface);
+
+struct _OstreeZstdDecompressor
+{
+  GObject parent_instance;
+
+  ZSTD_DStream *dstream;
+  gboolean initialized;
+};
+
+G_DEFINE_TYPE_WITH_CODE (OstreeZstdDecompressor, _ostree_zstd_decompressor,
+			 G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+						_ostree_zstd_decompressor_iface_init))
+
+static void
+_ostree_zstd_decompressor_finalize (GObject *object)
+{
+  OstreeZstdDecompressor *self;
+
+  self = OSTREE_ZSTD_DECOMPRESSOR (object);
+  ZSTD_freeDStream (self->dstream);
+
+  G_OBJECT_CLASS (_ostree_zstd_decompressor_parent_class)->finalize (object);
+}
+
+static void
+_ostree_zstd_decompressor_init (OstreeZstdDecompressor *self)
+{
+  self->dstream = ZSTD_createDStream ();
+}
+
+static void
+_ostree_zstd_decompressor_class_init (OstreeZstdDecompressorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = _ostree_zstd_decompressor_finalize;
+}
+
+OstreeZstdDecompressor *
+_ostree_zstd_decompressor_new (void)
+{
+  return g_object_new (OSTREE_TYPE_ZSTD_DECOMPRESSOR, NULL);
+}
+
+static void
+_ostree_zstd_decompressor_reset (GConverter *converter)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (converter);
+
+  self->initialized = FALSE;
+}
+
+static GConverterResult
+_ostree_zstd_decompressor_convert (GConverter *converter,
+                                   const void *inbuf,
+                                   gsize       inbuf_size,
+                                   void       *outbuf,
+                                   gsize       outbuf_size,
+                                   GConverterFlags flags,
+                                   gsize      *bytes_read,
+                                   gsize      *bytes_written,
+                                   GError    **error)
+{
+  OstreeZstdDecompressor *self = OSTREE_ZSTD_DECOMPRESSOR (converter);
+  GConverterResult ret = G_CONVERTER_ERROR;
+  ZSTD_inBuffer in = { inbuf, inbuf_size, 0 };
+  ZSTD_outBuffer out = { outbuf, outbuf_size, 0 };
+  size_t res;
+
+  if (self->dstream == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Out of memory");
+      goto out;
+    }
+
+  if (!self->initialized)
+    {
+      res = ZSTD_initDStream (self->dstream);
+      if (ZSTD_isError (res))
+        goto zstd_error;
+      self->initialized = TRUE;
+    }
+
+  res = ZSTD_decompressStream (self->dstream, &out, &in);
+  if (ZSTD_isError (res))
+    goto zstd_error;
+
+  if (res != 0 && in.pos == 0 && out.pos == 0)
+    {
+      if (flags & G_CONVERTER_INPUT_AT_END)
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Truncated zstd frame");
+      else
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                             "Not enough space in destination");
+      goto out;
+    }
+
+  *bytes_read = in.pos;
+  *bytes_written = out.pos;
+  /* 0 means the frame is complete and fully flushed */
+  ret = res == 0 ? G_CONVERTER_FINISHED : G_CONVERTER_CONVERTED;
+  goto out;
+
+ zstd_error:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+               "zstd decompression failed: %s", ZSTD_getErrorName (res));
+ out:
+  return ret;
+}
+
+static void
+_ostree_zstd_decompressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = _ostree_zstd_decompressor_convert;
+  iface->reset = _ostree_zstd_decompressor_reset;
+}
@@ -26,23 +26,12 @@
 
 #include <string.h>
 
-guchar *
-ot_csum_from_gchecksum (GChecksum  *checksum)
-{
-  guchar *ret = g_malloc (32);
-  gsize len = 32;
-  
-  g_checksum_get_digest (checksum, ret, &len);
-  g_assert (len == 32);
-  return ret;
-}
-
 gboolean
 ot_gio_write_update_checksum (GOutputStream  *out,
                               gconstpointer   data,
                               gsize           len,
                               gsize          *out_bytes_written,
-                              GChecksum      *checksum,
+                              OtSha256       *checksum,
                               GCancellable   *cancellable,
                               GError        **error)
 {
@@ -60,7 +49,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
     }
 
   if (checksum)
-    g_checksum_update (checksum, data, len);
+    ot_sha256_update (checksum, data, len);
   
   ret = TRUE;
  out:
@@ -70,7 +59,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
 gboolean
 ot_gio_splice_update_checksum (GOutputStream  *out,
                                GInputStream   *in,
-                               GChecksum      *checksum,
+                               OtSha256       *checksum,
                                GCancellable   *cancellable,
                                GError        **error)
 {
@@ -81,7 +70,7 @@ ot_gio_splice_update_checksum (GOutputStream  *out,
   if (checksum != NULL)
     {
       gsize bytes_read, bytes_written;
-      char buf[4096];
+      char buf[16384];
       do
         {
           if (!g_input_stream_read_all (in, buf, sizeof(buf), &bytes_read, cancellable, error))
@@ -111,20 +100,21 @@ ot_gio_splice_get_checksum (GOutputStream  *out,
                             GError        **error)
 {
   gboolean ret = FALSE;
-  GChecksum *checksum = NULL;
+  OtSha256 *checksum = NULL;
   g_autofree guchar *ret_csum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = ot_sha256_new ();
 
   if (!ot_gio_splice_update_checksum (out, in, checksum, cancellable, error))
     goto out;
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = g_malloc (32);
+  ot_sha256_get_digest (checksum, ret_csum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, (GDestroyNotify) ot_sha256_free);
   return ret;
 }
 
@@ -155,8 +145,17 @@ ot_checksum_file (GFile          *file,
 
   checksum = g_checksum_new (checksum_type);
 
-  if (!ot_gio_splice_update_checksum (NULL, in, checksum, cancellable, error))
-    goto out;
+  while (TRUE)
+    {
+      gsize bytes_read;
+      char buf[16384];
+
+      if (!g_input_stream_read_all (in, buf, sizeof (buf), &bytes_read, cancellable, error))
+        goto out;
+      if (bytes_read == 0)
+        break;
+      g_checksum_update (checksum, (guchar*)buf, bytes_read);
+    }
 
   ret = g_strdup (g_checksum_get_string (checksum));
  out:
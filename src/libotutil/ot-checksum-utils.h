@@ -26,13 +26,11 @@
 
 G_BEGIN_DECLS
 
-guchar *ot_csum_from_gchecksum (GChecksum *checksum);
-
 gboolean ot_gio_write_update_checksum (GOutputStream  *out,
                                        gconstpointer   data,
                                        gsize           len,
                                        gsize          *out_bytes_written,
-                                       GChecksum      *checksum,
+                                       OtSha256       *checksum,
                                        GCancellable   *cancellable,
                                        GError        **error);
 
@@ -44,7 +42,7 @@ gboolean ot_gio_splice_get_checksum (GOutputStream  *out,
 
 gboolean ot_gio_splice_update_checksum (GOutputStream  *out,
                                         GInputStream   *in,
-                                        GChecksum      *checksum,
+                                        OtSha256       *checksum,
                                         GCancellable   *cancellable,
                                         GError        **error);
 
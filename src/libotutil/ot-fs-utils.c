@@ -24,8 +24,19 @@
 #include "libgsystem.h"
 #include "libglnx.h"
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <gio/gunixinputstream.h>
 
+/* As struct file_clone_range in <linux/fs.h>, which may not be available */
+struct ot_file_clone_range {
+  gint64  src_fd;
+  guint64 src_offset;
+  guint64 src_length;
+  guint64 dest_offset;
+};
+#define OT_FICLONERANGE _IOW(0x94, 13, struct ot_file_clone_range)
+
 int
 ot_opendirat (int dfd, const char *path, gboolean follow)
 {
@@ -205,3 +216,115 @@ ot_ensure_unlinked_at (int dfd,
     }
   return TRUE;
 }
+
+/* Errors meaning the filesystems or the kernel can't do it, as opposed
+ * to an actual I/O error.
+ */
+static gboolean
+clone_errno_is_unsupported (int errsv)
+{
+  switch (errsv)
+    {
+    case ENOSYS:
+    case ENOTTY:
+    case EOPNOTSUPP:
+    case EXDEV:
+    case EINVAL:
+    case EBADF:
+    case ETXTBSY:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/**
+ * ot_regfile_clone:
+ * @src_fd: Regular file to read from, starting at offset 0
+ * @dest_fd: Empty regular file to write to
+ * @size: Number of bytes to copy from the start of @src_fd
+ * @out_cloned: (out): Whether @dest_fd now holds the content of @src_fd
+ * @error: Error
+ *
+ * Copy the first @size bytes of @src_fd into @dest_fd without them
+ * passing through user space: first by sharing extents with the
+ * FICLONERANGE ioctl (btrfs, XFS), then with copy_file_range(), which
+ * lets the kernel or filesystem copy them.  The file offsets of both
+ * descriptors are left unchanged.  Nothing beyond @size is copied even
+ * if @src_fd has grown, so callers that checksummed @size bytes
+ * should still check what @dest_fd ended up with.
+ *
+ * If neither is supported for this pair of files, @out_cloned is set
+ * to %FALSE and the caller should copy the data itself.
+ */
+gboolean
+ot_regfile_clone (int             src_fd,
+                  int             dest_fd,
+                  guint64         size,
+                  gboolean       *out_cloned,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  gboolean cloned = FALSE;
+  struct ot_file_clone_range range = { src_fd, 0, size, 0 };
+  int res;
+
+  if (size == 0)
+    goto done;
+
+  /* This fails with EINVAL if @size isn't block aligned and isn't the
+   * end of @src_fd; copy_file_range() then handles it.
+   */
+  do
+    res = ioctl (dest_fd, OT_FICLONERANGE, &range);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == 0)
+    {
+      cloned = TRUE;
+      goto done;
+    }
+  else if (!clone_errno_is_unsupported (errno))
+    {
+      gs_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+#ifdef __NR_copy_file_range
+  {
+    loff_t off_in = 0;
+    loff_t off_out = 0;
+
+    while ((guint64) off_in < size)
+      {
+        gssize n = syscall (__NR_copy_file_range, src_fd, &off_in, dest_fd, &off_out,
+                            (size_t) MIN (size - off_in, G_MAXSSIZE), 0);
+        if (n == -1 && errno == EINTR)
+          continue;
+        /* Only give up quietly if nothing was copied yet; the caller
+         * then writes from the start.
+         */
+        if (off_in == 0 && (n == 0 || (n == -1 && clone_errno_is_unsupported (errno))))
+          goto done;
+        if (n == -1)
+          {
+            gs_set_error_from_errno (error, errno);
+            goto out;
+          }
+        if (n == 0)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "File shrank while copying: expected %" G_GUINT64_FORMAT " bytes, got %" G_GUINT64_FORMAT,
+                         size, (guint64) off_in);
+            goto out;
+          }
+      }
+    cloned = TRUE;
+  }
+#endif
+
+ done:
+  ret = TRUE;
+  *out_cloned = cloned;
+ out:
+  return ret;
+}
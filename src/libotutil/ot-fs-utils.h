@@ -61,4 +61,10 @@ gboolean ot_ensure_unlinked_at (int dfd,
                                 const char *path,
                                 GError **error);
 
+gboolean ot_regfile_clone (int             src_fd,
+                           int             dest_fd,
+                           guint64         size,
+                           gboolean       *out_cloned,
+                           GError        **error);
+
 G_END_DECLS
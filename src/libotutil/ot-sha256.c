@@ -0,0 +1,520 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "otutil.h"
+
+#include <string.h>
+
+#ifdef HAVE_SHA_NI_INTRINSICS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_ARMV8_CRYPTO_INTRINSICS
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* Each accelerated backend provides only the block transform; the
+ * buffering and padding are shared.  The "glib" backend, used when
+ * the CPU has no SHA-256 instructions, hands everything to GChecksum.
+ * The backend is picked on first use, and can be forced with the
+ * OSTREE_SHA256_BACKEND environment variable.
+ */
+
+typedef void (*OtSha256TransformFunc) (guint32       state[8],
+                                       const guint8 *data,
+                                       gsize         n_blocks);
+
+typedef struct {
+  const char *name;
+  gboolean (*is_supported) (void);
+  OtSha256TransformFunc transform;   /* NULL for GChecksum */
+} OtSha256Backend;
+
+struct OtSha256 {
+  OtSha256TransformFunc transform;
+  GChecksum *gchecksum;
+
+  guint32 state[8];
+  guint64 n_bytes;
+  guint8  buf[64];
+
+  gboolean finished;
+  guint8  digest[32];
+  char    string[65];
+};
+
+static const guint32 initial_state[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#if defined(HAVE_SHA_NI_INTRINSICS) || defined(HAVE_ARMV8_CRYPTO_INTRINSICS)
+static const guint32 round_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+#ifdef HAVE_SHA_NI_INTRINSICS
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+static gboolean
+cpu_has_sha_ni (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return FALSE;
+  if ((ecx & bit_SSSE3) == 0 || (ecx & bit_SSE4_1) == 0)
+    return FALSE;
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return (ebx & bit_SHA) != 0;
+}
+
+/* Four rounds; the state is kept as ABEF and CDGH */
+#define SHA_NI_ROUNDS(msg, k)                                           \
+  G_STMT_START {                                                        \
+    __m128i wk = _mm_add_epi32 ((msg), _mm_loadu_si128 ((const __m128i*) &round_constants[(k)])); \
+    state1 = _mm_sha256rnds2_epu32 (state1, state0, wk);                \
+    wk = _mm_shuffle_epi32 (wk, 0x0E);                                  \
+    state0 = _mm_sha256rnds2_epu32 (state0, state1, wk);                \
+  } G_STMT_END
+
+/* Compute the next four words of the message schedule into @w0,
+ * which holds the words 16 before them.
+ */
+#define SHA_NI_SCHEDULE(w0, w1, w2, w3)                                 \
+  G_STMT_START {                                                        \
+    __m128i t = _mm_sha256msg1_epu32 ((w0), (w1));                      \
+    t = _mm_add_epi32 (t, _mm_alignr_epi8 ((w3), (w2), 4));             \
+    (w0) = _mm_sha256msg2_epu32 (t, (w3));                              \
+  } G_STMT_END
+
+__attribute__((target ("sha,sse4.1")))
+static void
+transform_sha_ni (guint32       state[8],
+                  const guint8 *data,
+                  gsize         n_blocks)
+{
+  const __m128i byteswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, tmp;
+  __m128i abef_save, cdgh_save;
+  __m128i w0, w1, w2, w3;
+  guint i;
+
+  tmp = _mm_loadu_si128 ((const __m128i*) &state[0]);
+  state1 = _mm_loadu_si128 ((const __m128i*) &state[4]);
+  tmp = _mm_shuffle_epi32 (tmp, 0xB1);           /* CDAB */
+  state1 = _mm_shuffle_epi32 (state1, 0x1B);     /* EFGH */
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);     /* ABEF */
+  state1 = _mm_blend_epi16 (state1, tmp, 0xF0);  /* CDGH */
+
+  for (; n_blocks > 0; n_blocks--, data += 64)
+    {
+      abef_save = state0;
+      cdgh_save = state1;
+
+      w0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) (data + 0)), byteswap);
+      SHA_NI_ROUNDS (w0, 0);
+      w1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) (data + 16)), byteswap);
+      SHA_NI_ROUNDS (w1, 4);
+      w2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) (data + 32)), byteswap);
+      SHA_NI_ROUNDS (w2, 8);
+      w3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) (data + 48)), byteswap);
+      SHA_NI_ROUNDS (w3, 12);
+
+      for (i = 16; i < 64; i += 16)
+        {
+          SHA_NI_SCHEDULE (w0, w1, w2, w3);
+          SHA_NI_ROUNDS (w0, i);
+          SHA_NI_SCHEDULE (w1, w2, w3, w0);
+          SHA_NI_ROUNDS (w1, i + 4);
+          SHA_NI_SCHEDULE (w2, w3, w0, w1);
+          SHA_NI_ROUNDS (w2, i + 8);
+          SHA_NI_SCHEDULE (w3, w0, w1, w2);
+          SHA_NI_ROUNDS (w3, i + 12);
+        }
+
+      state0 = _mm_add_epi32 (state0, abef_save);
+      state1 = _mm_add_epi32 (state1, cdgh_save);
+    }
+
+  tmp = _mm_shuffle_epi32 (state0, 0x1B);        /* FEBA */
+  state1 = _mm_shuffle_epi32 (state1, 0xB1);     /* DCHG */
+  state0 = _mm_blend_epi16 (tmp, state1, 0xF0);  /* DCBA */
+  state1 = _mm_alignr_epi8 (state1, tmp, 8);     /* HGFE */
+
+  _mm_storeu_si128 ((__m128i*) &state[0], state0);
+  _mm_storeu_si128 ((__m128i*) &state[4], state1);
+}
+
+#endif  /* HAVE_SHA_NI_INTRINSICS */
+
+#ifdef HAVE_ARMV8_CRYPTO_INTRINSICS
+
+static gboolean
+cpu_has_armv8_sha2 (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+#define ARMV8_ROUNDS(msg, k)                                            \
+  G_STMT_START {                                                        \
+    uint32x4_t wk = vaddq_u32 ((msg), vld1q_u32 (&round_constants[(k)])); \
+    uint32x4_t abcd = state0;                                           \
+    state0 = vsha256hq_u32 (state0, state1, wk);                        \
+    state1 = vsha256h2q_u32 (state1, abcd, wk);                         \
+  } G_STMT_END
+
+#define ARMV8_SCHEDULE(w0, w1, w2, w3)                                  \
+  G_STMT_START {                                                        \
+    (w0) = vsha256su1q_u32 (vsha256su0q_u32 ((w0), (w1)), (w2), (w3));  \
+  } G_STMT_END
+
+__attribute__((target ("arch=armv8-a+crypto")))
+static void
+transform_armv8 (guint32       state[8],
+                 const guint8 *data,
+                 gsize         n_blocks)
+{
+  uint32x4_t state0, state1;
+  uint32x4_t abcd_save, efgh_save;
+  uint32x4_t w0, w1, w2, w3;
+  guint i;
+
+  state0 = vld1q_u32 (&state[0]);
+  state1 = vld1q_u32 (&state[4]);
+
+  for (; n_blocks > 0; n_blocks--, data += 64)
+    {
+      abcd_save = state0;
+      efgh_save = state1;
+
+      w0 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 0)));
+      ARMV8_ROUNDS (w0, 0);
+      w1 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 16)));
+      ARMV8_ROUNDS (w1, 4);
+      w2 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 32)));
+      ARMV8_ROUNDS (w2, 8);
+      w3 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 48)));
+      ARMV8_ROUNDS (w3, 12);
+
+      for (i = 16; i < 64; i += 16)
+        {
+          ARMV8_SCHEDULE (w0, w1, w2, w3);
+          ARMV8_ROUNDS (w0, i);
+          ARMV8_SCHEDULE (w1, w2, w3, w0);
+          ARMV8_ROUNDS (w1, i + 4);
+          ARMV8_SCHEDULE (w2, w3, w0, w1);
+          ARMV8_ROUNDS (w2, i + 8);
+          ARMV8_SCHEDULE (w3, w0, w1, w2);
+          ARMV8_ROUNDS (w3, i + 12);
+        }
+
+      state0 = vaddq_u32 (state0, abcd_save);
+      state1 = vaddq_u32 (state1, efgh_save);
+    }
+
+  vst1q_u32 (&state[0], state0);
+  vst1q_u32 (&state[4], state1);
+}
+
+#endif  /* HAVE_ARMV8_CRYPTO_INTRINSICS */
+
+static const OtSha256Backend backends[] = {
+#ifdef HAVE_SHA_NI_INTRINSICS
+  { "sha-ni", cpu_has_sha_ni, transform_sha_ni },
+#endif
+#ifdef HAVE_ARMV8_CRYPTO_INTRINSICS
+  { "armv8", cpu_has_armv8_sha2, transform_armv8 },
+#endif
+  { "glib", NULL, NULL }
+};
+
+static const OtSha256Backend *selected_backend;
+
+static gboolean
+backend_is_supported (const OtSha256Backend *backend)
+{
+  return backend->is_supported == NULL || backend->is_supported ();
+}
+
+static const OtSha256Backend *
+lookup_backend (const char *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (backends); i++)
+    {
+      if (strcmp (backends[i].name, name) == 0 && backend_is_supported (&backends[i]))
+        return &backends[i];
+    }
+  return NULL;
+}
+
+static const OtSha256Backend *
+get_backend (void)
+{
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *name = g_getenv ("OSTREE_SHA256_BACKEND");
+      const OtSha256Backend *backend = NULL;
+      guint i;
+
+      if (name)
+        {
+          backend = lookup_backend (name);
+          if (!backend)
+            g_warning ("Unsupported OSTREE_SHA256_BACKEND \"%s\"", name);
+        }
+
+      for (i = 0; backend == NULL && i < G_N_ELEMENTS (backends); i++)
+        {
+          if (backend_is_supported (&backends[i]))
+            backend = &backends[i];
+        }
+
+      selected_backend = backend;
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return selected_backend;
+}
+
+/**
+ * ot_sha256_get_backend:
+ *
+ * Returns: The name of the implementation used by new checksums
+ */
+const char *
+ot_sha256_get_backend (void)
+{
+  return get_backend ()->name;
+}
+
+/**
+ * ot_sha256_set_backend:
+ * @name: A name returned by ot_sha256_list_backends()
+ *
+ * Use the implementation @name for new checksums.  This is intended
+ * for tests and benchmarks, and must not race with ot_sha256_new().
+ *
+ * Returns: %FALSE if @name is unknown or not supported by this CPU
+ */
+gboolean
+ot_sha256_set_backend (const char *name)
+{
+  const OtSha256Backend *backend = lookup_backend (name);
+
+  if (!backend)
+    return FALSE;
+
+  (void) get_backend ();
+  selected_backend = backend;
+  return TRUE;
+}
+
+/**
+ * ot_sha256_list_backends:
+ *
+ * Returns: (transfer none): The implementations supported by this CPU,
+ *   fastest first
+ */
+const char * const *
+ot_sha256_list_backends (void)
+{
+  static const char *names[G_N_ELEMENTS (backends) + 1];
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized))
+    {
+      guint i, n = 0;
+
+      for (i = 0; i < G_N_ELEMENTS (backends); i++)
+        {
+          if (backend_is_supported (&backends[i]))
+            names[n++] = backends[i].name;
+        }
+      names[n] = NULL;
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return names;
+}
+
+OtSha256 *
+ot_sha256_new (void)
+{
+  const OtSha256Backend *backend = get_backend ();
+  OtSha256 *self = g_new0 (OtSha256, 1);
+
+  self->transform = backend->transform;
+  if (self->transform)
+    memcpy (self->state, initial_state, sizeof (initial_state));
+  else
+    self->gchecksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  return self;
+}
+
+void
+ot_sha256_free (OtSha256 *self)
+{
+  if (self->gchecksum)
+    g_checksum_free (self->gchecksum);
+  g_free (self);
+}
+
+void
+ot_sha256_update (OtSha256      *self,
+                  gconstpointer  data,
+                  gsize          len)
+{
+  const guint8 *p = data;
+  gsize used;
+
+  if (self->gchecksum)
+    {
+      g_checksum_update (self->gchecksum, data, len);
+      return;
+    }
+
+  g_return_if_fail (!self->finished);
+
+  used = self->n_bytes % 64;
+  self->n_bytes += len;
+
+  if (used > 0)
+    {
+      gsize fill = MIN (64 - used, len);
+
+      memcpy (self->buf + used, p, fill);
+      p += fill;
+      len -= fill;
+      if (used + fill < 64)
+        return;
+      self->transform (self->state, self->buf, 1);
+    }
+
+  if (len >= 64)
+    {
+      gsize n_blocks = len / 64;
+
+      self->transform (self->state, p, n_blocks);
+      p += n_blocks * 64;
+      len -= n_blocks * 64;
+    }
+
+  if (len > 0)
+    memcpy (self->buf, p, len);
+}
+
+static void
+sha256_finish (OtSha256 *self)
+{
+  guint8 padding[72] = { 0x80, };
+  guint64 n_bits = self->n_bytes * 8;
+  gsize used = self->n_bytes % 64;
+  gsize padding_len = (used < 56 ? 56 : 120) - used;
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    padding[padding_len + i] = (guint8) (n_bits >> (56 - 8 * i));
+  ot_sha256_update (self, padding, padding_len + 8);
+  g_assert (self->n_bytes % 64 == 0);
+
+  for (i = 0; i < 8; i++)
+    {
+      guint32 be = GUINT32_TO_BE (self->state[i]);
+      memcpy (self->digest + i * 4, &be, 4);
+    }
+  self->finished = TRUE;
+}
+
+/**
+ * ot_sha256_get_digest:
+ * @self: Checksum
+ * @out_digest: (out caller-allocates) (array fixed-size=32): Digest
+ *
+ * Like g_checksum_get_digest(); @self cannot be updated afterwards.
+ */
+void
+ot_sha256_get_digest (OtSha256 *self,
+                      guint8   *out_digest)
+{
+  if (self->gchecksum)
+    {
+      gsize len = 32;
+      g_checksum_get_digest (self->gchecksum, out_digest, &len);
+      g_assert (len == 32);
+      return;
+    }
+
+  if (!self->finished)
+    sha256_finish (self);
+  memcpy (out_digest, self->digest, 32);
+}
+
+/**
+ * ot_sha256_get_string:
+ * @self: Checksum
+ *
+ * Like g_checksum_get_string(); @self cannot be updated afterwards.
+ *
+ * Returns: (transfer none): The digest in hexadecimal
+ */
+const char *
+ot_sha256_get_string (OtSha256 *self)
+{
+  static const char hex[] = "0123456789abcdef";
+  guint i;
+
+  if (self->gchecksum)
+    return g_checksum_get_string (self->gchecksum);
+
+  if (!self->finished)
+    sha256_finish (self);
+
+  for (i = 0; i < 32; i++)
+    {
+      self->string[i * 2] = hex[self->digest[i] >> 4];
+      self->string[i * 2 + 1] = hex[self->digest[i] & 0xf];
+    }
+  self->string[64] = '\0';
+  return self->string;
+}
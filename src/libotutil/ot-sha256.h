@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A SHA-256 implementation that uses the CPU's instructions for it
+ * where available, and otherwise GChecksum.  The API mirrors
+ * GChecksum.
+ */
+typedef struct OtSha256 OtSha256;
+
+OtSha256 *ot_sha256_new (void);
+
+void ot_sha256_free (OtSha256 *self);
+
+void ot_sha256_update (OtSha256      *self,
+                       gconstpointer  data,
+                       gsize          len);
+
+void ot_sha256_get_digest (OtSha256 *self,
+                           guint8   *out_digest);
+
+const char *ot_sha256_get_string (OtSha256 *self);
+
+const char *ot_sha256_get_backend (void);
+
+gboolean ot_sha256_set_backend (const char *name);
+
+const char * const *ot_sha256_list_backends (void);
+
+G_END_DECLS
@@ -45,6 +45,7 @@
 #include <ot-unix-utils.h>
 #include <ot-variant-utils.h>
 #include <ot-spawn-utils.h>
+#include <ot-sha256.h>
 #include <ot-checksum-utils.h>
 #include <ot-gpg-utils.h>
 
@@ -52,6 +52,7 @@ static OstreeCommand commands[] = {
 #endif
   { "refs", ostree_builtin_refs },
   { "remote", ostree_builtin_remote },
+  { "repack", ostree_builtin_repack },
   { "reset", ostree_builtin_reset },
   { "rev-parse", ostree_builtin_rev_parse },
   { "show", ostree_builtin_show },
@@ -39,6 +39,9 @@ static gboolean opt_union;
 static gboolean opt_from_stdin;
 static char *opt_from_file;
 static gboolean opt_disable_fsync;
+static int opt_jobs;
+static gboolean opt_force_copy;
+static char *opt_from_commit;
 
 static gboolean
 parse_fsync_cb (const char  *option_name,
@@ -64,6 +67,9 @@ static GOptionEntry options[] = {
   { "allow-noent", 0, 0, G_OPTION_ARG_NONE, &opt_allow_noent, "Do nothing if specified path does not exist", NULL },
   { "from-stdin", 0, 0, G_OPTION_ARG_NONE, &opt_from_stdin, "Process many checkouts from standard input", NULL },
   { "from-file", 0, 0, G_OPTION_ARG_STRING, &opt_from_file, "Process many checkouts from input file", "FILE" },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Check out using N threads", "N" },
+  { "force-copy", 'C', 0, G_OPTION_ARG_NONE, &opt_force_copy, "Never hardlink (but may reflink if available)", NULL },
+  { "from-commit", 0, 0, G_OPTION_ARG_STRING, &opt_from_commit, "Update an existing checkout of COMMIT in place", "COMMIT" },
   { "fsync", 0, 0, G_OPTION_ARG_CALLBACK, parse_fsync_cb, "Specify how to invoke fsync()", "POLICY" },
   { NULL }
 };
@@ -71,6 +77,7 @@ static GOptionEntry options[] = {
 static gboolean
 process_one_checkout (OstreeRepo           *repo,
                       const char           *resolved_commit,
+                      const char           *resolved_from_commit,
                       const char           *subpath,
                       const char           *destination,
                       GCancellable         *cancellable,
@@ -83,16 +90,21 @@ process_one_checkout (OstreeRepo           *repo,
    * `ostree_repo_checkout_tree_at` until such time as we have a more
    * convenient infrastructure for testing C APIs with data.
    */
-  if (opt_disable_cache)
+  if (opt_disable_cache || opt_jobs > 1 || opt_force_copy || resolved_from_commit)
     {
       OstreeRepoCheckoutOptions options = { 0, };
       
+      options.enable_uncompressed_cache = !opt_disable_cache;
+      options.force_copy = opt_force_copy;
+      if (opt_jobs > 1)
+        options.n_workers = opt_jobs;
       if (opt_user_mode)
         options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
       if (opt_union)
         options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES;
       if (subpath)
         options.subpath = subpath;
+      options.from_commit = resolved_from_commit;
 
 
       if (!ostree_repo_checkout_tree_at (repo, &options,
@@ -201,7 +213,7 @@ process_many_checkouts (OstreeRepo         *repo,
       if (!ostree_repo_resolve_rev (repo, revision, FALSE, &resolved_commit, error))
         goto out;
 
-      if (!process_one_checkout (repo, resolved_commit, subpath, target,
+      if (!process_one_checkout (repo, resolved_commit, NULL, subpath, target,
                                  cancellable, error))
         {
           g_prefix_error (error, "Processing tree %s: ", resolved_commit);
@@ -230,6 +242,7 @@ ostree_builtin_checkout (int argc, char **argv, GCancellable *cancellable, GErro
   const char *commit;
   const char *destination;
   g_autofree char *resolved_commit = NULL;
+  g_autofree char *resolved_from_commit = NULL;
 
   context = g_option_context_new ("COMMIT [DESTINATION] - Check out a commit into a filesystem tree");
 
@@ -249,6 +262,13 @@ ostree_builtin_checkout (int argc, char **argv, GCancellable *cancellable, GErro
       goto out;
     }
 
+  if ((opt_from_stdin || opt_from_file) && opt_from_commit)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "--from-commit cannot be used with --from-stdin or --from-file");
+      goto out;
+    }
+
   if (opt_from_stdin || opt_from_file)
     {
       destination = argv[1];
@@ -267,7 +287,13 @@ ostree_builtin_checkout (int argc, char **argv, GCancellable *cancellable, GErro
       if (!ostree_repo_resolve_rev (repo, commit, FALSE, &resolved_commit, error))
         goto out;
 
-      if (!process_one_checkout (repo, resolved_commit, opt_subpath,
+      if (opt_from_commit)
+        {
+          if (!ostree_repo_resolve_rev (repo, opt_from_commit, FALSE, &resolved_from_commit, error))
+            goto out;
+        }
+
+      if (!process_one_checkout (repo, resolved_commit, resolved_from_commit, opt_subpath,
                                  destination,
                                  cancellable, error))
         goto out;
@@ -36,6 +36,7 @@ static char *opt_statoverride_file;
 static char **opt_metadata_strings;
 static char **opt_detached_metadata_strings;
 static gboolean opt_link_checkout_speedup;
+static gboolean opt_stat_cache;
 static gboolean opt_skip_if_unchanged;
 static gboolean opt_tar_autocreate_parents;
 static gboolean opt_no_xattrs;
@@ -75,6 +76,7 @@ static GOptionEntry options[] = {
   { "owner-gid", 0, 0, G_OPTION_ARG_INT, &opt_owner_gid, "Set file ownership group id", "GID" },
   { "no-xattrs", 0, 0, G_OPTION_ARG_NONE, &opt_no_xattrs, "Do not import extended attributes", NULL },
   { "link-checkout-speedup", 0, 0, G_OPTION_ARG_NONE, &opt_link_checkout_speedup, "Optimize for commits of trees composed of hardlinks into the repository", NULL },
+  { "stat-cache", 0, 0, G_OPTION_ARG_NONE, &opt_stat_cache, "Reuse checksums of files unchanged since the last commit using this option", NULL },
   { "tar-autocreate-parents", 0, 0, G_OPTION_ARG_NONE, &opt_tar_autocreate_parents, "When loading tar archives, automatically create parent directories as needed", NULL },
   { "skip-if-unchanged", 0, 0, G_OPTION_ARG_NONE, &opt_skip_if_unchanged, "If the contents are unchanged from previous commit, do nothing", NULL },
   { "statoverride", 0, 0, G_OPTION_ARG_FILENAME, &opt_statoverride_file, "File containing list of modifications to make to permissions", "PATH" },
@@ -346,6 +348,8 @@ ostree_builtin_commit (int argc, char **argv, GCancellable *cancellable, GError
     flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS;
   if (opt_generate_sizes)
     flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_GENERATE_SIZES;
+  if (opt_stat_cache)
+    flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_STAT_CACHE;
   if (opt_disable_fsync)
     ostree_repo_set_disable_fsync (repo, TRUE);
 
@@ -548,6 +552,15 @@ ostree_builtin_commit (int argc, char **argv, GCancellable *cancellable, GError
       g_print ("Content Total: %u\n", stats.content_objects_total);
       g_print ("Content Written: %u\n", stats.content_objects_written);
       g_print ("Content Bytes Written: %" G_GUINT64_FORMAT "\n", stats.content_bytes_written);
+      g_print ("Content Bytes Cloned: %" G_GUINT64_FORMAT "\n", stats.content_bytes_cloned);
+      g_print ("Fsync Time: %u usec\n", stats.fsync_usec);
+      g_print ("Rename Time: %u usec\n", stats.rename_usec);
+      g_print ("Ref Update Time: %u usec\n", stats.ref_update_usec);
+      if (opt_stat_cache)
+        {
+          g_print ("Stat Cache Hits: %u\n", stats.stat_cache_hits);
+          g_print ("Stat Cache Misses: %u\n", stats.stat_cache_misses);
+        }
     }
   else
     {
@@ -29,10 +29,12 @@
 
 static gboolean opt_stats;
 static gboolean opt_fs_diff;
+static gboolean opt_parallel;
 
 static GOptionEntry options[] = {
   { "stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats, "Print various statistics", NULL },
   { "fs-diff", 0, 0, G_OPTION_ARG_NONE, &opt_fs_diff, "Print filesystem diff", NULL },
+  { "parallel", 0, 0, G_OPTION_ARG_NONE, &opt_parallel, "Compare directories in parallel", NULL },
   { NULL }
 };
 
@@ -129,6 +131,7 @@ ostree_builtin_diff (int argc, char **argv, GCancellable *cancellable, GError **
   g_autoptr(GPtrArray) modified = NULL;
   g_autoptr(GPtrArray) removed = NULL;
   g_autoptr(GPtrArray) added = NULL;
+  OstreeDiffFlags diff_flags = OSTREE_DIFF_FLAGS_NONE;
 
   context = g_option_context_new ("REV TARGETDIR - Compare directory TARGETDIR against revision REV");
 
@@ -171,7 +174,10 @@ ostree_builtin_diff (int argc, char **argv, GCancellable *cancellable, GError **
       removed = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
       added = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
       
-      if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, srcf, targetf, modified, removed, added, cancellable, error))
+      if (opt_parallel)
+        diff_flags |= OSTREE_DIFF_FLAGS_PARALLEL;
+
+      if (!ostree_diff_dirs (diff_flags, srcf, targetf, modified, removed, added, cancellable, error))
         goto out;
 
       ostree_diff_print (srcf, targetf, modified, removed, added);
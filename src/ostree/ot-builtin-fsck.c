@@ -30,18 +30,261 @@
 
 static gboolean opt_quiet;
 static gboolean opt_delete;
+static int opt_jobs;
+static gboolean opt_incremental;
+static double opt_sample = 1.0;
 
 static GOptionEntry options[] = {
   { "quiet", 'q', 0, G_OPTION_ARG_NONE, &opt_quiet, "Only print error messages", NULL },
   { "delete", 0, 0, G_OPTION_ARG_NONE, &opt_delete, "Remove corrupted objects", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Verify using N threads (0 for one per CPU, the default)", "N" },
+  { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental, "Only verify objects changed since the last fsck, plus a random sample", NULL },
+  { "sample", 0, 0, G_OPTION_ARG_DOUBLE, &opt_sample, "With --incremental, also verify PERCENT of unchanged objects (default 1)", "PERCENT" },
   { NULL }
 };
 
+/* Bound on objects found by the traversal but not yet verified; the
+ * traversal waits for the verification threads beyond this.
+ */
+#define FSCK_MAX_QUEUED (4096)
+
+/* The fsck journal records each object verified by a previous run,
+ * along with the identity of the file it was read from: the loose
+ * object, or the pack data file holding it.  With --incremental, an
+ * object whose file still has the same device, inode, modification
+ * and change times and size is assumed to be intact, unless it is
+ * picked for the random sample.  The change time matters for bare
+ * repositories, where chmod, chown or setxattr on a checked out
+ * hardlink alter the object without touching its mtime.
+ *
+ * The journal is a header followed by an array of entries sorted by
+ * (csum, objtype), in host byte order; a journal of a different
+ * version, or that does not look right, is ignored.  Each run rewrites
+ * it with the objects that were reachable and found intact.
+ */
+#define FSCK_JOURNAL_PATH "state/fsck-journal"
+#define FSCK_JOURNAL_MAGIC "OSTFSCKJ"
+#define FSCK_JOURNAL_VERSION (3)
+
+typedef struct {
+  char    magic[8];
+  guint32 version;
+  guint32 n_entries;
+} FsckJournalHeader;
+
+typedef struct {
+  guint8  csum[32];
+  guint8  objtype;
+  guint8  reserved[7];
+  guint64 dev;
+  guint64 ino;
+  gint64  mtime_sec;
+  gint64  mtime_nsec;
+  gint64  ctime_sec;
+  gint64  ctime_nsec;
+  guint64 size;
+} FsckJournalEntry;
+
+G_STATIC_ASSERT (sizeof (FsckJournalHeader) == 16);
+G_STATIC_ASSERT (sizeof (FsckJournalEntry) == 96);
+
+typedef struct {
+  guchar csum[32];
+  OstreeObjectType objtype;
+  char *message;   /* Missing object, or removed corrupted object */
+  GError *error;
+} FsckResult;
+
+typedef struct {
+  guint64 n_objects;
+  guint64 n_bytes;
+  gint64 usec;     /* Summed over all verification threads */
+} FsckTypeStats;
+
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+  GThreadPool *pool;
+
+  GMutex lock;
+  GCond cond;
+  guint n_queued;
+  guint n_done;
+  GPtrArray *results;
+  FsckTypeStats stats[OSTREE_OBJECT_TYPE_LAST + 1];
+  guint n_skipped;
+
+  /* Journal of the previous run, only loaded with --incremental */
+  GMappedFile *journal;
+  const FsckJournalEntry *journal_entries;
+  guint n_journal_entries;
+  GArray *new_journal_entries;
+} FsckData;
+
+static void
+fsck_result_free (FsckResult *result)
+{
+  g_free (result->message);
+  g_clear_error (&result->error);
+  g_free (result);
+}
+
+static int
+compare_results (gconstpointer ap,
+                 gconstpointer bp)
+{
+  const FsckResult *a = *((FsckResult**)ap);
+  const FsckResult *b = *((FsckResult**)bp);
+  int c = memcmp (a->csum, b->csum, 32);
+
+  if (c != 0)
+    return c;
+  return (int)a->objtype - (int)b->objtype;
+}
+
+static int
+compare_journal_entries (gconstpointer ap,
+                         gconstpointer bp)
+{
+  const FsckJournalEntry *a = ap;
+  const FsckJournalEntry *b = bp;
+  int c = memcmp (a->csum, b->csum, 32);
+
+  if (c != 0)
+    return c;
+  return (int)a->objtype - (int)b->objtype;
+}
+
+static gboolean
+load_journal (OstreeRepo    *repo,
+              FsckData      *data,
+              GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) path = g_file_resolve_relative_path (ostree_repo_get_path (repo), FSCK_JOURNAL_PATH);
+  GError *temp_error = NULL;
+  const FsckJournalHeader *header;
+  gsize len;
+
+  data->journal = g_mapped_file_new (gs_file_get_path_cached (path), FALSE, &temp_error);
+  if (!data->journal)
+    {
+      if (g_error_matches (temp_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&temp_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_prefixed_error (error, temp_error, "Loading fsck journal: ");
+      goto out;
+    }
+
+  len = g_mapped_file_get_length (data->journal);
+  header = (const FsckJournalHeader *) g_mapped_file_get_contents (data->journal);
+  if (len < sizeof (FsckJournalHeader)
+      || memcmp (header->magic, FSCK_JOURNAL_MAGIC, 8) != 0
+      || header->version != FSCK_JOURNAL_VERSION
+      || (len - sizeof (FsckJournalHeader)) / sizeof (FsckJournalEntry) != header->n_entries
+      || (len - sizeof (FsckJournalHeader)) % sizeof (FsckJournalEntry) != 0)
+    {
+      g_printerr ("Ignoring invalid fsck journal\n");
+      g_clear_pointer (&data->journal, g_mapped_file_unref);
+      ret = TRUE;
+      goto out;
+    }
+
+  data->journal_entries = (const FsckJournalEntry *) (header + 1);
+  data->n_journal_entries = header->n_entries;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+write_journal (OstreeRepo    *repo,
+               FsckData      *data,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) path = g_file_resolve_relative_path (ostree_repo_get_path (repo), FSCK_JOURNAL_PATH);
+  g_autoptr(GFile) parent = g_file_get_parent (path);
+  GArray *entries = data->new_journal_entries;
+  FsckJournalHeader header = { { 0, }, FSCK_JOURNAL_VERSION, 0 };
+  g_autoptr(GByteArray) contents = g_byte_array_new ();
+
+  g_array_sort (entries, compare_journal_entries);
+  memcpy (header.magic, FSCK_JOURNAL_MAGIC, 8);
+  header.n_entries = entries->len;
+  g_byte_array_append (contents, (guint8*)&header, sizeof (header));
+  g_byte_array_append (contents, (guint8*)entries->data, entries->len * sizeof (FsckJournalEntry));
+
+  if (!gs_file_ensure_directory (parent, TRUE, cancellable, error))
+    goto out;
+
+  if (!g_file_replace_contents (path, (char*)contents->data, contents->len, NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "Writing fsck journal: ");
+  return ret;
+}
+
+static void
+journal_entry_init (FsckJournalEntry   *entry,
+                    const guchar       *csum,
+                    OstreeObjectType    objtype,
+                    const struct stat  *stbuf)
+{
+  memset (entry, 0, sizeof (*entry));
+  memcpy (entry->csum, csum, 32);
+  entry->objtype = objtype;
+  entry->dev = stbuf->st_dev;
+  entry->ino = stbuf->st_ino;
+  entry->mtime_sec = stbuf->st_mtim.tv_sec;
+  entry->mtime_nsec = stbuf->st_mtim.tv_nsec;
+  entry->ctime_sec = stbuf->st_ctim.tv_sec;
+  entry->ctime_nsec = stbuf->st_ctim.tv_nsec;
+  entry->size = stbuf->st_size;
+}
+
+/* Returns the journal entry of an object that has not changed since
+ * it was last verified, if any.
+ */
+static const FsckJournalEntry *
+lookup_unchanged (FsckData                *data,
+                  const FsckJournalEntry  *key)
+{
+  const FsckJournalEntry *entry;
+
+  if (!data->journal_entries)
+    return NULL;
+
+  entry = bsearch (key, data->journal_entries, data->n_journal_entries,
+                   sizeof (FsckJournalEntry), compare_journal_entries);
+  if (entry
+      && entry->dev == key->dev
+      && entry->ino == key->ino
+      && entry->mtime_sec == key->mtime_sec
+      && entry->mtime_nsec == key->mtime_nsec
+      && entry->ctime_sec == key->ctime_sec
+      && entry->ctime_nsec == key->ctime_nsec
+      && entry->size == key->size)
+    return entry;
+  return NULL;
+}
+
 static gboolean
 load_and_fsck_one_object (OstreeRepo            *repo,
                           const char            *checksum,
                           OstreeObjectType       objtype,
-                          gboolean              *out_found_corruption,
+                          char                 **out_message,
+                          guint64               *out_size,
                           GCancellable          *cancellable,
                           GError               **error)
 {
@@ -61,13 +304,12 @@ load_and_fsck_one_object (OstreeRepo            *repo,
           if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
             {
               g_clear_error (&temp_error);
-              g_printerr ("Object missing: %s.%s\n", checksum,
-                          ostree_object_type_to_string (objtype));
               missing = TRUE;
             }
           else
             {
-              g_prefix_error (error, "Loading metadata object %s: ", checksum);
+              g_propagate_prefixed_error (error, temp_error,
+                                          "Loading metadata object %s: ", checksum);
               goto out;
             }
         }
@@ -101,7 +343,7 @@ load_and_fsck_one_object (OstreeRepo            *repo,
           input = g_memory_input_stream_new_from_data (g_variant_get_data (metadata),
                                                        g_variant_get_size (metadata),
                                                        NULL);
-
+          *out_size = g_variant_get_size (metadata);
         }
     }
   else
@@ -114,8 +356,6 @@ load_and_fsck_one_object (OstreeRepo            *repo,
           if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
             {
               g_clear_error (&temp_error);
-              g_printerr ("Object missing: %s.%s\n", checksum,
-                          ostree_object_type_to_string (objtype));
               missing = TRUE;
             }
           else
@@ -133,12 +373,15 @@ load_and_fsck_one_object (OstreeRepo            *repo,
               g_prefix_error (error, "While validating file '%s': ", checksum);
               goto out;
             }
+          if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+            *out_size = g_file_info_get_size (file_info);
         }
     }
 
   if (missing)
     {
-      *out_found_corruption = TRUE;
+      *out_message = g_strdup_printf ("Object missing: %s.%s", checksum,
+                                      ostree_object_type_to_string (objtype));
     }
   else
     {
@@ -158,9 +401,8 @@ load_and_fsck_one_object (OstreeRepo            *repo,
                                                tmp_checksum);
           if (opt_delete)
             {
-              g_printerr ("%s\n", msg);
               (void) ostree_repo_delete_object (repo, objtype, checksum, cancellable, NULL);
-              *out_found_corruption = TRUE;
+              *out_message = g_strdup (msg);
             }
           else
             {
@@ -175,6 +417,133 @@ load_and_fsck_one_object (OstreeRepo            *repo,
   return ret;
 }
 
+static void
+fsck_object_worker (gpointer datap,
+                    gpointer user_data)
+{
+  FsckResult *result = datap;
+  FsckData *data = user_data;
+  char checksum[65];
+  guint64 size = 0;
+  gint64 start;
+  gint64 elapsed;
+  FsckTypeStats *stats;
+  struct stat stbuf;
+  gboolean have_stbuf;
+  FsckJournalEntry entry;
+  const FsckJournalEntry *unchanged = NULL;
+
+  ostree_checksum_inplace_from_bytes (result->csum, checksum);
+
+  /* Taken before verifying, so that a concurrent change to the file
+   * makes it be verified again next time.  If the object is missing,
+   * verification reports it.
+   */
+  have_stbuf = ostree_cmd__private__()->ostree_repo_stat_object (data->repo, result->objtype, checksum,
+                                                                 &stbuf, NULL, NULL);
+  if (have_stbuf)
+    {
+      journal_entry_init (&entry, result->csum, result->objtype, &stbuf);
+      unchanged = lookup_unchanged (data, &entry);
+      if (unchanged && g_random_double_range (0, 100) < opt_sample)
+        unchanged = NULL;
+    }
+
+  if (unchanged)
+    {
+      g_mutex_lock (&data->lock);
+      g_array_append_vals (data->new_journal_entries, unchanged, 1);
+      data->n_skipped++;
+      fsck_result_free (result);
+      goto done;
+    }
+
+  start = g_get_monotonic_time ();
+  (void) load_and_fsck_one_object (data->repo, checksum, result->objtype,
+                                   &result->message, &size,
+                                   data->cancellable, &result->error);
+  elapsed = g_get_monotonic_time () - start;
+
+  g_mutex_lock (&data->lock);
+  stats = &data->stats[result->objtype];
+  stats->n_objects++;
+  stats->n_bytes += size;
+  stats->usec += elapsed;
+  if (result->message || result->error)
+    g_ptr_array_add (data->results, result);
+  else
+    {
+      if (have_stbuf)
+        g_array_append_val (data->new_journal_entries, entry);
+      fsck_result_free (result);
+    }
+ done:
+  data->n_done++;
+  g_cond_broadcast (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* Called by the traversal, possibly from its own threads */
+static void
+on_reachable_object (const guchar     *csum,
+                     OstreeObjectType  objtype,
+                     gpointer          user_data)
+{
+  FsckData *data = user_data;
+  FsckResult *result = g_new0 (FsckResult, 1);
+
+  memcpy (result->csum, csum, 32);
+  result->objtype = objtype;
+
+  g_mutex_lock (&data->lock);
+  while (data->n_queued - data->n_done >= FSCK_MAX_QUEUED)
+    g_cond_wait (&data->cond, &data->lock);
+  data->n_queued++;
+  g_mutex_unlock (&data->lock);
+
+  g_thread_pool_push (data->pool, result, NULL);
+}
+
+static void
+print_stats (FsckData *data,
+             gint64    elapsed_usec)
+{
+  double secs = MAX (elapsed_usec, 1) / (double) G_USEC_PER_SEC;
+  guint64 n_objects = 0;
+  guint64 n_bytes = 0;
+  OstreeObjectType objtype;
+
+  for (objtype = OSTREE_OBJECT_TYPE_FILE; objtype <= OSTREE_OBJECT_TYPE_LAST; objtype++)
+    {
+      n_objects += data->stats[objtype].n_objects;
+      n_bytes += data->stats[objtype].n_bytes;
+    }
+
+  g_print ("Verified %" G_GUINT64_FORMAT " objects (%.1f MB) in %.1f s: %.0f objects/s, %.1f MB/s\n",
+           n_objects, n_bytes / 1e6, secs, n_objects / secs, n_bytes / 1e6 / secs);
+  if (opt_incremental)
+    g_print ("Skipped %u objects unchanged since they were last verified\n", data->n_skipped);
+
+  for (objtype = OSTREE_OBJECT_TYPE_FILE; objtype <= OSTREE_OBJECT_TYPE_LAST; objtype++)
+    {
+      FsckTypeStats *stats = &data->stats[objtype];
+      double type_secs = MAX (stats->usec, 1) / (double) G_USEC_PER_SEC;
+
+      if (stats->n_objects == 0)
+        continue;
+
+      g_print ("  %s: %" G_GUINT64_FORMAT " objects (%.1f MB), %.0f objects/s, %.1f MB/s per thread\n",
+               ostree_object_type_to_string (objtype), stats->n_objects,
+               stats->n_bytes / 1e6, stats->n_objects / type_secs,
+               stats->n_bytes / 1e6 / type_secs);
+    }
+}
+
+/* Objects are verified by a pool of threads as the traversal finds
+ * them.  Problems are collected and reported sorted by object name
+ * once everything is done, so the output does not depend on the order
+ * in which the threads complete.
+ */
 static gboolean
 fsck_reachable_objects_from_commits (OstreeRepo            *repo,
                                      GHashTable            *commits,
@@ -185,12 +554,17 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  g_autoptr(GHashTable) reachable_objects = NULL;
-  guint i;
+  g_autoptr(GPtrArray) commit_checksums = g_ptr_array_new ();
+  FsckData data = { 0, };
+  GError *first_error = NULL;
+  GError *journal_error = NULL;
+  gboolean traversed;
+  guint n_objects;
+  guint n_threads;
   guint mod;
-  guint count;
-
-  reachable_objects = ostree_repo_traverse_new_reachable ();
+  guint next_report;
+  gint64 start;
+  guint i;
 
   g_hash_table_iter_init (&hash_iter, commits);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -203,34 +577,100 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
 
       g_assert (objtype == OSTREE_OBJECT_TYPE_COMMIT);
 
-      if (!ostree_repo_traverse_commit_union (repo, checksum, 0, reachable_objects,
-                                              cancellable, error))
-        goto out;
+      g_ptr_array_add (commit_checksums, (char*)checksum);
     }
 
-  count = g_hash_table_size (reachable_objects);
-  mod = count / 10;
-  i = 0;
-  g_hash_table_iter_init (&hash_iter, reachable_objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  n_threads = opt_jobs > 0 ? opt_jobs : g_get_num_processors ();
+
+  data.repo = repo;
+  data.cancellable = cancellable;
+  data.results = g_ptr_array_new_with_free_func ((GDestroyNotify)fsck_result_free);
+  data.new_journal_entries = g_array_new (FALSE, FALSE, sizeof (FsckJournalEntry));
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  if (opt_incremental && !load_journal (repo, &data, error))
+    goto out;
+
+  data.pool = g_thread_pool_new (fsck_object_worker, &data, n_threads, FALSE, NULL);
+
+  start = g_get_monotonic_time ();
+
+  /* Traverse all commits at once, loading dirtrees in parallel and
+   * verifying each object as soon as it is found.
+   */
+  traversed = ostree_cmd__private__()->ostree_repo_traverse_commits_foreach (repo,
+                                                                             (const char * const *)commit_checksums->pdata,
+                                                                             commit_checksums->len, 0, opt_jobs,
+                                                                             on_reachable_object, &data,
+                                                                             cancellable, error);
+
+  /* Now that the total is known, report progress until the queue drains */
+  g_mutex_lock (&data.lock);
+  n_objects = data.n_queued;
+  mod = MAX (n_objects / 10, 1);
+  next_report = 0;
+  while (TRUE)
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      if (traversed && n_objects > 0 && data.n_done >= next_report)
+        {
+          g_print ("%u/%u objects\n", data.n_done, n_objects);
+          next_report = (data.n_done / mod + 1) * mod;
+        }
+      if (data.n_done == n_objects)
+        break;
+      g_cond_wait (&data.cond, &data.lock);
+    }
+  g_mutex_unlock (&data.lock);
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+  g_thread_pool_free (data.pool, FALSE, TRUE);
 
-      if (!load_and_fsck_one_object (repo, checksum, objtype, out_found_corruption,
-                                     cancellable, error))
-        goto out;
+  if (!traversed)
+    goto out;
+
+  /* Only intact objects are recorded, so this is also useful after
+   * finding corruption.  A read-only repository is checked without
+   * updating its journal.
+   */
+  if (ostree_repo_is_writable (repo, NULL)
+      && !write_journal (repo, &data, cancellable, &journal_error))
+    {
+      g_printerr ("warning: %s\n", journal_error->message);
+      g_clear_error (&journal_error);
+    }
+
+  g_ptr_array_sort (data.results, compare_results);
+  for (i = 0; i < data.results->len; i++)
+    {
+      FsckResult *result = data.results->pdata[i];
+
+      if (result->message)
+        {
+          g_printerr ("%s\n", result->message);
+          *out_found_corruption = TRUE;
+        }
+      else if (first_error == NULL)
+        first_error = result->error;
+      else
+        g_printerr ("%s\n", result->error->message);
+    }
 
-      if (mod == 0 || (i % mod == 0))
-        g_print ("%u/%u objects\n", i + 1, count);
-      i++;
+  if (first_error)
+    {
+      g_propagate_error (error, g_error_copy (first_error));
+      goto out;
     }
 
+  if (!opt_quiet)
+    print_stats (&data, g_get_monotonic_time () - start);
+
   ret = TRUE;
  out:
+  g_ptr_array_unref (data.results);
+  g_array_unref (data.new_journal_entries);
+  g_clear_pointer (&data.journal, g_mapped_file_unref);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
   return ret;
 }
 
@@ -246,12 +686,37 @@ ostree_builtin_fsck (int argc, char **argv, GCancellable *cancellable, GError **
   guint n_partial = 0;
   g_autoptr(GHashTable) objects = NULL;
   g_autoptr(GHashTable) commits = NULL;
+  g_autoptr(GPtrArray) pack_messages = NULL;
+  guint i;
 
   context = g_option_context_new ("- Check the repository for consistency");
 
   if (!ostree_option_context_parse (context, options, &argc, &argv, OSTREE_BUILTIN_FLAG_NONE, &repo, cancellable, error))
     goto out;
 
+  if (opt_jobs < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --jobs value %d", opt_jobs);
+      goto out;
+    }
+
+  if (opt_sample < 0 || opt_sample > 100)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid --sample value %g", opt_sample);
+      goto out;
+    }
+
+  /* Objects of invalid pack entries would otherwise just look missing */
+  pack_messages = g_ptr_array_new_with_free_func (g_free);
+  ostree_cmd__private__()->ostree_repo_fsck_packs (repo, pack_messages);
+  for (i = 0; i < pack_messages->len; i++)
+    {
+      g_printerr ("%s\n", (char*)pack_messages->pdata[i]);
+      found_corruption = TRUE;
+    }
+
   if (!opt_quiet)
     g_print ("Enumerating objects...\n");
 
@@ -27,9 +27,11 @@
 #include "ostree.h"
 
 static gboolean opt_delete;
+static gboolean opt_pack;
 
 static GOptionEntry options[] = {
   { "delete", 0, 0, G_OPTION_ARG_NONE, &opt_delete, "Delete refs which match PREFIX, rather than listing them", NULL },
+  { "pack", 0, 0, G_OPTION_ARG_NONE, &opt_pack, "Store all refs in a single sorted file", NULL },
   { NULL }
 };
 
@@ -52,6 +54,22 @@ ostree_builtin_refs (int argc, char **argv, GCancellable *cancellable, GError **
   if (argc >= 2)
     refspec_prefix = argv[1];
 
+  if (opt_pack)
+    {
+      if (opt_delete || refspec_prefix != NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "--pack takes no PREFIX, and cannot be combined with --delete");
+          goto out;
+        }
+
+      if (!ostree_repo_pack_refs (repo, cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
+    }
+
   /* Require a prefix when deleting to help avoid accidents. */
   if (opt_delete && refspec_prefix == NULL)
     {
@@ -0,0 +1,87 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ot-main.h"
+#include "ot-builtins.h"
+#include "ostree.h"
+
+static gboolean opt_metadata_only;
+static gboolean opt_keep_loose;
+static gboolean opt_delete_loose;
+
+static GOptionEntry options[] = {
+  { "metadata-only", 0, 0, G_OPTION_ARG_NONE, &opt_metadata_only, "Only pack metadata objects", NULL },
+  { "keep-loose", 0, 0, G_OPTION_ARG_NONE, &opt_keep_loose, "Don't delete the loose copies of packed objects (default for archive repositories)", NULL },
+  { "delete-loose", 0, 0, G_OPTION_ARG_NONE, &opt_delete_loose, "Delete the loose copies of packed objects, even in an archive repository", NULL },
+  { NULL }
+};
+
+gboolean
+ostree_builtin_repack (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  glnx_unref_object OstreeRepo *repo = NULL;
+  OstreeRepoRepackFlags repackflags = 0;
+  guint n_objects_packed;
+  guint n_objects_total;
+  gboolean is_archive;
+
+  context = g_option_context_new ("- Consolidate loose objects into packs");
+
+  if (!ostree_option_context_parse (context, options, &argc, &argv, OSTREE_BUILTIN_FLAG_NONE, &repo, cancellable, error))
+    goto out;
+
+  if (!ostree_ensure_repo_writable (repo, error))
+    goto out;
+
+  if (opt_keep_loose && opt_delete_loose)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Cannot specify both --keep-loose and --delete-loose");
+      goto out;
+    }
+
+  /* Archive repositories are usually served, and clients which can't
+   * fetch from packs still need the loose objects.
+   */
+  is_archive = ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_ARCHIVE_Z2
+    || ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_ARCHIVE_ZSTD;
+
+  if (opt_metadata_only)
+    repackflags |= OSTREE_REPO_REPACK_FLAGS_METADATA_ONLY;
+  if (opt_keep_loose || (is_archive && !opt_delete_loose))
+    repackflags |= OSTREE_REPO_REPACK_FLAGS_KEEP_LOOSE;
+
+  if (!ostree_repo_repack (repo, repackflags, &n_objects_packed, &n_objects_total,
+                           cancellable, error))
+    goto out;
+
+  g_print ("Packed %u loose objects\n", n_objects_packed);
+  g_print ("Total packed objects: %u\n", n_objects_total);
+
+  ret = TRUE;
+ out:
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
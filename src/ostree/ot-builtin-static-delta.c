@@ -31,8 +31,11 @@ static char *opt_to_rev;
 static char *opt_min_fallback_size;
 static char *opt_max_bsdiff_size;
 static char *opt_max_chunk_size;
+static char *opt_compression;
 static gboolean opt_empty;
 static gboolean opt_disable_bsdiff;
+static int opt_jobs = 1;
+static int opt_previous;
 
 #define BUILTINPROTO(name) static gboolean ot_static_delta_builtin_ ## name (int argc, char **argv, GCancellable *cancellable, GError **error)
 
@@ -54,10 +57,13 @@ static GOptionEntry generate_options[] = {
   { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from_rev, "Create delta from revision REV", "REV" },
   { "empty", 0, 0, G_OPTION_ARG_NONE, &opt_empty, "Create delta from scratch", NULL },
   { "to", 0, 0, G_OPTION_ARG_STRING, &opt_to_rev, "Create delta to revision REV", "REV" },
+  { "previous", 0, 0, G_OPTION_ARG_INT, &opt_previous, "Create deltas from each of the N previous commits", "N" },
   { "disable-bsdiff", 0, 0, G_OPTION_ARG_NONE, &opt_disable_bsdiff, "Disable use of bsdiff", NULL },
   { "min-fallback-size", 0, 0, G_OPTION_ARG_STRING, &opt_min_fallback_size, "Minimum uncompressed size in megabytes for individual HTTP request", NULL},
   { "max-bsdiff-size", 0, 0, G_OPTION_ARG_STRING, &opt_max_bsdiff_size, "Maximum size in megabytes to consider bsdiff compression for input files", NULL},
   { "max-chunk-size", 0, 0, G_OPTION_ARG_STRING, &opt_max_chunk_size, "Maximum size of delta chunks in megabytes", NULL},
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Generate using N threads (0 for one per CPU)", "N" },
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, "Compress delta parts with ALGORITHM (lzma, zstd, none)", "ALGORITHM" },
   { NULL }
 };
 
@@ -127,6 +133,61 @@ ot_static_delta_builtin_list (int argc, char **argv, GCancellable *cancellable,
   return ret;
 }
 
+/* Collect up to @n_previous ancestors of @to, stopping early if the
+ * history isn't available locally.
+ */
+static gboolean
+collect_previous_commits (OstreeRepo    *repo,
+                          const char    *to,
+                          int            n_previous,
+                          GPtrArray    **out_froms,
+                          GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GPtrArray) ret_froms = g_ptr_array_new_with_free_func (g_free);
+  g_autofree char *current = g_strdup (to);
+
+  while (ret_froms->len < (guint)n_previous)
+    {
+      g_autoptr(GVariant) commit = NULL;
+      char *parent;
+
+      if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, current,
+                                               &commit, error))
+        goto out;
+      if (!commit)
+        break;
+
+      parent = ostree_commit_get_parent (commit);
+      if (!parent)
+        break;
+
+      g_ptr_array_add (ret_froms, parent);
+      g_free (current);
+      current = g_strdup (parent);
+    }
+
+  /* The last parent may only be referenced, not present */
+  if (ret_froms->len > 0)
+    {
+      gboolean have_commit;
+      const char *last = ret_froms->pdata[ret_froms->len - 1];
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, last,
+                                   &have_commit, NULL, error))
+        goto out;
+      if (!have_commit)
+        g_ptr_array_remove_index (ret_froms, ret_froms->len - 1);
+    }
+
+  g_ptr_array_add (ret_froms, NULL);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_froms, &ret_froms);
+ out:
+  return ret;
+}
+
 static gboolean
 ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -160,7 +221,21 @@ ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellab
 
       g_assert (opt_to_rev);
 
-      if (opt_empty)
+      if (opt_previous < 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid --previous value %d", opt_previous);
+          goto out;
+        }
+
+      if (opt_previous > 0 && (opt_empty || opt_from_rev))
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Cannot specify --previous with --empty or --from=REV");
+          goto out;
+        }
+
+      if (opt_empty || opt_previous > 0)
         {
           if (opt_from_rev)
             {
@@ -201,17 +276,64 @@ ot_static_delta_builtin_generate (int argc, char **argv, GCancellable *cancellab
       if (opt_disable_bsdiff)
         g_variant_builder_add (parambuilder, "{sv}",
                                "bsdiff-enabled", g_variant_new_boolean (FALSE));
+      if (opt_jobs < 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid --jobs value %d", opt_jobs);
+          goto out;
+        }
+      g_variant_builder_add (parambuilder, "{sv}", "jobs", g_variant_new_uint32 (opt_jobs));
+      if (opt_compression)
+        {
+          guint8 compression;
+
+          if (strcmp (opt_compression, "lzma") == 0)
+            compression = 'x';
+          else if (strcmp (opt_compression, "zstd") == 0)
+            compression = 'z';
+          else if (strcmp (opt_compression, "none") == 0)
+            compression = 0;
+          else
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Invalid --compression value '%s'", opt_compression);
+              goto out;
+            }
+          g_variant_builder_add (parambuilder, "{sv}", "compression", g_variant_new_byte (compression));
+        }
 
       g_variant_builder_add (parambuilder, "{sv}", "verbose", g_variant_new_boolean (TRUE));
 
-      g_print ("Generating static delta:\n");
-      g_print ("  From: %s\n", from_resolved ? from_resolved : "empty");
-      g_print ("  To:   %s\n", to_resolved);
-      if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
-                                              from_resolved, to_resolved, NULL,
-                                              g_variant_builder_end (parambuilder),
-                                              cancellable, error))
-        goto out;
+      if (opt_previous > 0)
+        {
+          g_autoptr(GPtrArray) froms = NULL;
+          guint i;
+
+          if (!collect_previous_commits (repo, to_resolved, opt_previous, &froms, error))
+            goto out;
+
+          g_print ("Generating %u static deltas:\n", froms->len - 1);
+          for (i = 0; i < froms->len - 1; i++)
+            g_print ("  From: %s\n", (char*)froms->pdata[i]);
+          g_print ("  To:   %s\n", to_resolved);
+          if (!ostree_repo_static_delta_generate_batch (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                                        (const char * const *)froms->pdata,
+                                                        to_resolved, NULL,
+                                                        g_variant_builder_end (parambuilder),
+                                                        cancellable, error))
+            goto out;
+        }
+      else
+        {
+          g_print ("Generating static delta:\n");
+          g_print ("  From: %s\n", from_resolved ? from_resolved : "empty");
+          g_print ("  To:   %s\n", to_resolved);
+          if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                                  from_resolved, to_resolved, NULL,
+                                                  g_variant_builder_end (parambuilder),
+                                                  cancellable, error))
+            goto out;
+        }
 
     }
 
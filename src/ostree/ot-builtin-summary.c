@@ -28,11 +28,15 @@
 static gboolean opt_update;
 static char **opt_key_ids;
 static char *opt_gpg_homedir;
+static char **opt_refs;
+static char **opt_deltas;
 
 static GOptionEntry options[] = {
   { "update", 'u', 0, G_OPTION_ARG_NONE, &opt_update, "Update the summary", NULL },
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_key_ids, "GPG Key ID to sign the commit with", "KEY-ID"},
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, "GPG Homedir to use when looking for keyrings", "HOMEDIR"},
+  { "ref", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_refs, "Only update the entry of REF, which changed", "REF"},
+  { "delta", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_deltas, "Only update the entry of static delta NAME, which changed", "NAME"},
   { NULL }
 };
 
@@ -53,8 +57,19 @@ ostree_builtin_summary (int argc, char **argv, GCancellable *cancellable, GError
       if (!ostree_ensure_repo_writable (repo, error))
         goto out;
 
-      if (!ostree_repo_regenerate_summary (repo, NULL, cancellable, error))
-        goto out;
+      if (opt_refs || opt_deltas)
+        {
+          if (!ostree_repo_regenerate_summary_incremental (repo, NULL,
+                                                           (const char * const *) opt_refs,
+                                                           (const char * const *) opt_deltas,
+                                                           cancellable, error))
+            goto out;
+        }
+      else
+        {
+          if (!ostree_repo_regenerate_summary (repo, NULL, cancellable, error))
+            goto out;
+        }
 
       if (opt_key_ids)
         {
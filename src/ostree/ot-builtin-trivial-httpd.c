@@ -35,6 +35,7 @@ static char *opt_port_file = NULL;
 static gboolean opt_daemonize;
 static gboolean opt_autoexit;
 static gboolean opt_force_ranges;
+static gboolean opt_disable_ranges;
 static gint opt_port = 0;
 
 typedef struct {
@@ -48,6 +49,7 @@ static GOptionEntry options[] = {
   { "port", 'P', 0, G_OPTION_ARG_INT, &opt_port, "Use the specified TCP port", NULL },
   { "port-file", 'p', 0, G_OPTION_ARG_FILENAME, &opt_port_file, "Write port number to PATH (- for standard output)", "PATH" },
   { "force-range-requests", 0, 0, G_OPTION_ARG_NONE, &opt_force_ranges, "Force range requests by only serving half of files", NULL },
+  { "disable-range-requests", 0, 0, G_OPTION_ARG_NONE, &opt_disable_ranges, "Ignore range requests, always serving whole files", NULL },
   { NULL }
 };
 
@@ -222,7 +224,47 @@ do_get (OtTrivialHttpd    *self,
           soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
           goto out;
         }
-      
+
+      /* Support conditional requests; If-None-Match takes precedence
+       * over If-Modified-Since, as in RFC 7232.
+       */
+      {
+        g_autofree char *etag = NULL;
+        g_autofree char *last_modified = NULL;
+        const char *if_none_match;
+        const char *if_modified_since;
+        SoupDate *date;
+        gboolean not_modified = FALSE;
+
+        etag = g_strdup_printf ("\"%lx-%lx-%lx.%lx\"", (gulong) stbuf.st_ino, (gulong) stbuf.st_size,
+                                (gulong) stbuf.st_mtim.tv_sec, (gulong) stbuf.st_mtim.tv_nsec);
+        date = soup_date_new_from_time_t (stbuf.st_mtime);
+        last_modified = soup_date_to_string (date, SOUP_DATE_HTTP);
+        soup_date_free (date);
+        soup_message_headers_replace (msg->response_headers, "ETag", etag);
+        soup_message_headers_replace (msg->response_headers, "Last-Modified", last_modified);
+
+        if_none_match = soup_message_headers_get_one (msg->request_headers, "If-None-Match");
+        if_modified_since = soup_message_headers_get_one (msg->request_headers, "If-Modified-Since");
+        if (if_none_match)
+          not_modified = strcmp (if_none_match, etag) == 0;
+        else if (if_modified_since)
+          {
+            date = soup_date_new_from_string (if_modified_since);
+            if (date)
+              {
+                not_modified = stbuf.st_mtime <= soup_date_to_time_t (date);
+                soup_date_free (date);
+              }
+          }
+
+        if (not_modified)
+          {
+            soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+            goto out;
+          }
+      }
+
       if (msg->method == SOUP_METHOD_GET)
         {
           GMappedFile *mapping;
@@ -240,6 +282,16 @@ do_get (OtTrivialHttpd    *self,
             }
 
           file_size = g_mapped_file_get_length (mapping);
+
+          /* libsoup turns our full response into a 206 (using
+           * multipart/byteranges when several ranges were asked for)
+           * as long as the Range header is there.
+           */
+          if (opt_disable_ranges)
+            soup_message_headers_remove (msg->request_headers, "Range");
+          else
+            soup_message_headers_replace (msg->response_headers, "Accept-Ranges", "bytes");
+
           have_ranges = soup_message_headers_get_ranges(msg->request_headers, file_size, &ranges, &ranges_length);
           if (opt_force_ranges && !have_ranges && g_strrstr (path, "/objects") != NULL)
             {
@@ -262,7 +314,15 @@ do_get (OtTrivialHttpd    *self,
 
           if (have_ranges)
             {
-              if (ranges_length > 0 && ranges[0].start >= file_size)
+              int i;
+              gboolean satisfiable = FALSE;
+
+              /* Per RFC 7233, only fail if none of the ranges overlap the file */
+              for (i = 0; i < ranges_length; i++)
+                if (ranges[i].start < file_size)
+                  satisfiable = TRUE;
+
+              if (!satisfiable)
                 {
                   soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
                   soup_message_headers_free_ranges (msg->request_headers, ranges);
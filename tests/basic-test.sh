@@ -19,7 +19,7 @@
 
 set -e
 
-echo "1..48"
+echo "1..55"
 
 $OSTREE checkout test2 checkout-test2
 echo "ok checkout"
@@ -129,6 +129,31 @@ cd ${test_tmpdir}
 assert_file_has_content diff-test2-2 'M */four$'
 echo "ok diff file changing type"
 
+cd ${test_tmpdir}
+$OSTREE diff test2^ test2 | sort > diff-serial
+$OSTREE diff --parallel test2^ test2 | sort > diff-parallel
+cmp diff-serial diff-parallel
+cd ${test_tmpdir}/checkout-test2-4
+$OSTREE diff test2 ./ | sort > ${test_tmpdir}/diff-serial
+$OSTREE diff --parallel test2 ./ | sort > ${test_tmpdir}/diff-parallel
+cd ${test_tmpdir}
+cmp diff-serial diff-parallel
+assert_file_has_content diff-parallel 'M */four$'
+echo "ok diff parallel"
+
+cd ${test_tmpdir}
+rm -rf diff-copy
+cp -a checkout-test2-4 diff-copy
+# Same size, so only the contents tell it apart
+echo helloWORLD > diff-copy/yet/message
+chmod 0700 diff-copy/yet/another
+$OSTREE diff ./checkout-test2-4 ./diff-copy | sort > diff-dirs
+assert_streq "$(wc -l < diff-dirs)" 2
+assert_file_has_content diff-dirs 'M *yet/another$'
+assert_file_has_content diff-dirs 'M *yet/message$'
+rm -rf diff-copy
+echo "ok diff directories"
+
 cd ${test_tmpdir}
 mkdir repo2
 ${CMD_PREFIX} ostree --repo=repo2 init
@@ -156,6 +181,55 @@ new_rev=$($OSTREE rev-parse test2)
 assert_streq "${old_rev}" "${new_rev}"
 echo "ok commit --skip-if-unchanged"
 
+cd ${test_tmpdir}
+rm -rf manyfiles
+mkdir manyfiles
+for d in $(seq 8); do
+    mkdir manyfiles/d$d
+    for f in $(seq 64); do
+        echo "$d $f" > manyfiles/d$d/f$f
+    done
+    ln -s f1 manyfiles/d$d/link
+done
+$OSTREE commit -b manyfiles -s 'many files' --tree=dir=manyfiles
+old_rev=$($OSTREE rev-parse manyfiles)
+$OSTREE commit --skip-if-unchanged -b manyfiles -s 'many files again' --tree=dir=manyfiles
+new_rev=$($OSTREE rev-parse manyfiles)
+assert_streq "${old_rev}" "${new_rev}"
+# Each directory alone is small enough to be committed serially; most
+# of them were handed to the worker threads in the commit of the whole
+for d in $(seq 8); do
+    $OSTREE commit -b manyfiles-serial -s "d$d serially" --tree=dir=manyfiles/d$d
+    $OSTREE ls -C -d manyfiles /d$d | awk '{ print $5, $6 }' > manyfiles-d$d.txt
+    $OSTREE ls -C -d manyfiles-serial / | awk '{ print $5, $6 }' > manyfiles-serial-d$d.txt
+    assert_streq "$(cat manyfiles-d$d.txt)" "$(cat manyfiles-serial-d$d.txt)"
+done
+echo "ok commit of many files is reproducible"
+
+cd ${test_tmpdir}
+# Files changed in the same second as the commit are never cached
+sleep 1
+$OSTREE commit --stat-cache --table-output -b manyfiles -s 'stat cache 1' --tree=dir=manyfiles > statcache-1.txt
+assert_file_has_content statcache-1.txt '^Stat Cache Hits: 0$'
+$OSTREE commit --stat-cache --table-output -b manyfiles -s 'stat cache 2' --tree=dir=manyfiles > statcache-2.txt
+assert_file_has_content statcache-2.txt '^Stat Cache Hits: 520$'
+assert_file_has_content statcache-2.txt '^Stat Cache Misses: 0$'
+echo "new content" > manyfiles/d1/f1
+$OSTREE commit --stat-cache --table-output -b manyfiles -s 'stat cache 3' --tree=dir=manyfiles > statcache-3.txt
+assert_file_has_content statcache-3.txt '^Stat Cache Misses: 1$'
+$OSTREE cat manyfiles /d1/f1 > f1-contents
+assert_file_has_content f1-contents "new content"
+echo "ok commit --stat-cache"
+
+cd ${test_tmpdir}
+echo "timing test" > manyfiles/d2/f2
+$OSTREE commit --table-output -b manyfiles -s 'timings' --tree=dir=manyfiles > commit-timings.txt
+assert_file_has_content commit-timings.txt '^Fsync Time: [0-9]* usec$'
+assert_file_has_content commit-timings.txt '^Rename Time: [0-9]* usec$'
+assert_file_has_content commit-timings.txt '^Ref Update Time: [0-9]* usec$'
+$OSTREE fsck
+echo "ok commit phase timings"
+
 cd ${test_tmpdir}/checkout-test2-4
 $OSTREE commit -b test2 -s "no xattrs" --no-xattrs
 echo "ok commit with no xattrs"
@@ -193,6 +267,19 @@ cd checkout-test2-union
 assert_file_has_content ./yet/another/tree/green "leaf"
 echo "ok checkout union 1"
 
+cd ${test_tmpdir}
+rm -rf checkout-test2-serial checkout-test2-jobs
+$OSTREE checkout test2 checkout-test2-serial
+$OSTREE checkout --jobs=4 test2 checkout-test2-jobs
+diff -r checkout-test2-serial checkout-test2-jobs
+for d in checkout-test2-serial checkout-test2-jobs; do
+    (cd $d && find . -printf '%p %m %U %G %s %l\n' | sort) > $d.list
+    (cd $d && find . -type d -printf '%p %T@\n' | sort) > $d.dirtimes
+done
+cmp checkout-test2-serial.list checkout-test2-jobs.list
+cmp checkout-test2-serial.dirtimes checkout-test2-jobs.dirtimes
+echo "ok checkout --jobs"
+
 cd ${test_tmpdir}
 rm -rf shadow-repo
 mkdir shadow-repo
@@ -387,6 +474,13 @@ assert_file_has_content test2-checkout/baz/cow moo
 assert_has_dir repo2/uncompressed-objects-cache
 echo "ok disable cache checkout"
 
+cd ${test_tmpdir}
+rm test2-checkout -rf
+${CMD_PREFIX} ostree --repo=repo checkout -U --force-copy test2 test2-checkout
+assert_file_has_content test2-checkout/baz/cow moo
+assert_streq "$(stat -c '%h' test2-checkout/baz/cow)" 1
+echo "ok checkout --force-copy"
+
 cd ${test_tmpdir}
 rm -rf test2-checkout
 mkdir -p test2-checkout
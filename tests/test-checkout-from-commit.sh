@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_test_repository "bare-user"
+
+echo '1..5'
+
+cd ${test_tmpdir}
+mkdir tree
+cd tree
+mkdir -p unchanged/deeper changed removed-dir to-file
+echo same > unchanged/deeper/file
+echo old > changed/file
+echo gone > changed/removed
+echo gone > removed-dir/file
+echo dir > to-file/file
+echo file > to-dir
+ln -s file changed/link
+$OSTREE commit -b update -s "Version 1"
+old_rev=$($OSTREE rev-parse update)
+
+echo new > changed/file
+rm changed/removed
+echo added > changed/added
+rm changed/link
+ln -s added changed/link
+rm -r removed-dir to-file to-dir
+echo file > to-file
+mkdir -p to-dir added-dir/deeper
+echo dir > to-dir/file
+echo added > added-dir/deeper/file
+chmod 0700 changed
+$OSTREE commit -b update -s "Version 2"
+new_rev=$($OSTREE rev-parse update)
+
+cd ${test_tmpdir}
+# Copy files, so that we can tell whether they were rewritten
+$OSTREE checkout -U --force-copy ${old_rev} co
+stat -c '%i' co/unchanged/deeper/file > inode-before.txt
+$OSTREE checkout -U --force-copy --from-commit=${old_rev} ${new_rev} co
+$OSTREE checkout -U ${new_rev} co-fresh
+diff -r co co-fresh
+assert_streq "$(readlink co/changed/link)" added
+assert_streq "$(stat -c '%a' co/changed)" 700
+assert_streq "$(stat -c '%Y' co/changed)" 0
+stat -c '%i' co/unchanged/deeper/file > inode-after.txt
+cmp inode-before.txt inode-after.txt
+ls -a co co/changed > ls.txt
+assert_not_file_has_content ls.txt ostree-checkout
+echo "ok update checkout from commit"
+
+$OSTREE checkout -U --from-commit=${new_rev} ${old_rev} co
+rm co-fresh -rf
+$OSTREE checkout -U ${old_rev} co-fresh
+diff -r co co-fresh
+echo "ok update checkout back"
+
+$OSTREE checkout -U --from-commit=${old_rev} --subpath=/changed ${new_rev} co/changed
+rm co-fresh -rf
+$OSTREE checkout -U --subpath=/changed ${new_rev} co-fresh
+diff -r co/changed co-fresh
+echo "ok update checkout subpath"
+
+cd ${test_tmpdir}/tree
+rm -rf *
+mkdir -p ro/deeper ro/kept
+echo old > ro/deeper/file
+echo kept > ro/kept/file
+chmod 0555 ro/deeper ro/kept ro
+$OSTREE commit -b readonly -s "Read-only 1"
+ro_old_rev=$($OSTREE rev-parse readonly)
+chmod 0755 ro ro/deeper
+rm -r ro/deeper
+echo new > ro/file
+chmod 0555 ro
+$OSTREE commit -b readonly -s "Read-only 2"
+ro_new_rev=$($OSTREE rev-parse readonly)
+chmod -R u+w ro
+
+cd ${test_tmpdir}
+rm co co-fresh -rf
+$OSTREE checkout -U ${ro_old_rev} co
+$OSTREE checkout -U --from-commit=${ro_old_rev} ${ro_new_rev} co
+$OSTREE checkout -U ${ro_new_rev} co-fresh
+diff -r co co-fresh
+assert_streq "$(stat -c '%a' co/ro)" 555
+assert_streq "$(stat -c '%a' co/ro/kept)" 555
+ls -a co > ls.txt
+assert_not_file_has_content ls.txt ostree-checkout
+chmod -R u+w co co-fresh
+echo "ok update checkout with read-only directories"
+
+cd ${test_tmpdir}/tree
+rm -rf *
+mkdir -p top/middle/bottom top/sibling
+echo old > top/middle/bottom/file
+echo same > top/sibling/file
+$OSTREE commit -b deep -s "Deep 1"
+deep_old_rev=$($OSTREE rev-parse deep)
+echo new > top/middle/bottom/file
+$OSTREE commit -b deep -s "Deep 2"
+deep_new_rev=$($OSTREE rev-parse deep)
+
+cd ${test_tmpdir}
+rm co co-fresh -rf
+$OSTREE checkout -U ${deep_old_rev} co
+stat -c '%i' co/top co/top/middle co/top/sibling > inode-before.txt
+$OSTREE checkout -U --from-commit=${deep_old_rev} ${deep_new_rev} co
+$OSTREE checkout -U ${deep_new_rev} co-fresh
+diff -r co co-fresh
+# Only the directory whose entries changed is replaced
+stat -c '%i' co/top co/top/middle co/top/sibling > inode-after.txt
+cmp inode-before.txt inode-after.txt
+assert_streq "$(stat -c '%Y' co/top/middle)" 0
+echo "ok update checkout leaves unchanged directories in place"
@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-z2"
+
+echo '1..5'
+
+repopath=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${repopath} config set core.chunked-content-threshold 1
+
+${CMD_PREFIX} ostree --repo=${repopath} checkout -U main ${repopath}-files
+cd ${repopath}-files
+dd if=/dev/urandom of=big.img bs=1M count=8 2>/dev/null
+${CMD_PREFIX} ostree --repo=${repopath} commit -b main -s "Add a large file"
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+${CMD_PREFIX} ostree --repo=${repopath} fsck
+cd ${test_tmpdir}
+find ${repopath}/objects -name '*.filechunks' > manifests.txt
+assert_streq "$(wc -l < manifests.txt)" 1
+# The whole object is kept for clients without chunk support
+manifest=$(cat manifests.txt)
+assert_has_file ${manifest%.filechunks}.filez
+# The summary names a published copy of the list of chunked files
+assert_streq "$(stat -c %s ${repopath}/state/chunked-content)" 32
+ls ${repopath}/objects/chunked-content > published.txt
+assert_streq "$(wc -l < published.txt)" 1
+cmp ${repopath}/state/chunked-content ${repopath}/objects/chunked-content/$(cat published.txt)
+find ${repopath}/objects -name '*.chunk' | sort > chunks-v1.txt
+if test $(wc -l < chunks-v1.txt) -lt 2; then
+    assert_not_reached "Expected more than one chunk"
+fi
+echo "ok commit chunked file"
+
+rm repo -rf
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+$OSTREE checkout origin/main checkout-origin-main
+cmp checkout-origin-main/big.img ${repopath}-files/big.img
+assert_file_has_content checkout-origin-main/baz/cow moo
+# The manifest is kept to find chunks later
+find repo/state/file-chunks -name '*.filechunks' > client-manifests.txt
+assert_streq "$(wc -l < client-manifests.txt)" 1
+assert_has_file repo/state/chunked-content-indexes/origin/$(cat published.txt)
+echo "ok pull chunked file"
+
+# Without the summary, a client doesn't know about the chunks, like
+# a version of OSTree without chunk support; it gets the whole object.
+mv ${repopath}/summary summary.saved
+mkdir hidden-chunks
+find ${repopath}/objects -name '*.chunk' -exec mv -t hidden-chunks {} +
+rm repo-nochunks -rf
+mkdir repo-nochunks
+${CMD_PREFIX} ostree --repo=repo-nochunks init
+${CMD_PREFIX} ostree --repo=repo-nochunks remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo-nochunks pull origin main
+${CMD_PREFIX} ostree --repo=repo-nochunks fsck
+${CMD_PREFIX} ostree --repo=repo-nochunks checkout origin/main checkout-nochunks
+cmp checkout-nochunks/big.img ${repopath}-files/big.img
+for chunk in hidden-chunks/*; do
+    name=$(basename ${chunk})
+    mv ${chunk} ${repopath}/objects/${name:0:2}/
+done
+mv summary.saved ${repopath}/summary
+echo "ok pull chunked file without chunk support"
+
+# Change one byte in the middle; only the chunks around it differ.
+# Remove the unchanged chunks and the whole new object from the
+# server, so the pull can only succeed by reading them out of the
+# previous version.
+cd ${repopath}-files
+printf 'x' | dd of=big.img bs=1 seek=4000000 conv=notrunc 2>/dev/null
+${CMD_PREFIX} ostree --repo=${repopath} commit -b main -s "Modify the large file"
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+cd ${test_tmpdir}
+assert_streq "$(stat -c %s ${repopath}/state/chunked-content)" 64
+assert_streq "$(ls ${repopath}/objects/chunked-content | wc -l)" 1
+find ${repopath}/objects -name '*.chunk' | sort > chunks-v2.txt
+comm -12 chunks-v1.txt chunks-v2.txt > shared-chunks.txt
+if test $(wc -l < shared-chunks.txt) -lt 1; then
+    assert_not_reached "Expected chunks to be shared between versions"
+fi
+mkdir saved-chunks
+xargs mv -t saved-chunks < shared-chunks.txt
+find ${repopath}/objects -name '*.filechunks' | grep -v -F -f manifests.txt > new-manifest.txt
+new_manifest=$(cat new-manifest.txt)
+mv ${new_manifest%.filechunks}.filez new-object.filez
+${CMD_PREFIX} ostree --repo=repo pull origin main
+mv new-object.filez ${new_manifest%.filechunks}.filez
+${CMD_PREFIX} ostree --repo=repo fsck
+rm checkout-origin-main -rf
+$OSTREE checkout origin/main checkout-origin-main
+cmp checkout-origin-main/big.img ${repopath}-files/big.img
+for chunk in saved-chunks/*; do
+    name=$(basename ${chunk})
+    mv ${chunk} ${repopath}/objects/${name:0:2}/
+done
+echo "ok pull reuses local chunks"
+
+${CMD_PREFIX} ostree --repo=${repopath} prune --refs-only --depth=0
+${CMD_PREFIX} ostree --repo=${repopath} fsck
+find ${repopath}/objects -name '*.filechunks' > manifests.txt
+assert_streq "$(wc -l < manifests.txt)" 1
+assert_streq "$(stat -c %s ${repopath}/state/chunked-content)" 32
+find ${repopath}/objects -name '*.chunk' | sort > chunks-pruned.txt
+comm -23 chunks-v2.txt chunks-pruned.txt > removed-chunks.txt
+if test $(wc -l < removed-chunks.txt) -lt 1; then
+    assert_not_reached "Expected prune to delete chunks of the old version"
+fi
+rm checkout-main -rf
+${CMD_PREFIX} ostree --repo=${repopath} checkout main checkout-main
+cmp checkout-main/big.img ${repopath}-files/big.img
+echo "ok prune chunks"
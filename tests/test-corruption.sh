@@ -19,7 +19,7 @@
 
 set -e
 
-echo "1..2"
+echo "1..5"
 
 . $(dirname $0)/libtest.sh
 
@@ -41,3 +41,47 @@ chmod o+x firstfile
 $OSTREE fsck -q --delete && (echo 1>&2 "fsck unexpectedly succeeded"; exit 1)
 
 echo "ok chmod"
+
+# The previous test deleted firstfile's object; start over
+cd ${test_tmpdir}
+rm repo files checkout-test2 -rf
+setup_test_repository "bare"
+$OSTREE fsck --jobs 4 > fsck.txt
+assert_file_has_content fsck.txt '^Verified [0-9]* objects'
+assert_file_has_content fsck.txt '^  file: [0-9]* objects'
+$OSTREE checkout test2 checkout-test2
+cd checkout-test2
+chmod o+x firstfile baz/cow
+$OSTREE fsck -q --jobs 1 2>fsck-serial.err && (echo 1>&2 "fsck unexpectedly succeeded"; exit 1)
+$OSTREE fsck -q --jobs 4 2>fsck-parallel.err && (echo 1>&2 "fsck unexpectedly succeeded"; exit 1)
+assert_file_has_content fsck-serial.err 'corrupted object'
+cmp fsck-serial.err fsck-parallel.err
+chmod o-x firstfile baz/cow
+
+echo "ok fsck jobs"
+
+cd ${test_tmpdir}
+rm repo files checkout-test2 -rf
+setup_test_repository "bare"
+$OSTREE fsck
+$OSTREE fsck --incremental --sample=0 > fsck.txt
+assert_file_has_content fsck.txt '^Verified 0 objects'
+assert_not_file_has_content fsck.txt '^Skipped 0 objects'
+$OSTREE checkout test2 checkout-test2
+touch checkout-test2/firstfile
+$OSTREE fsck --incremental --sample=0 > fsck.txt
+assert_file_has_content fsck.txt '^Verified 1 objects'
+$OSTREE fsck --incremental --sample=100 > fsck.txt
+assert_file_has_content fsck.txt '^Skipped 0 objects'
+$OSTREE fsck --incremental --sample=101 && (echo 1>&2 "fsck unexpectedly succeeded"; exit 1)
+
+echo "ok fsck incremental"
+
+# Only the change time of the object moves
+$OSTREE fsck --incremental --sample=0
+chmod o+x checkout-test2/firstfile
+$OSTREE fsck -q --incremental --sample=0 && (echo 1>&2 "fsck unexpectedly succeeded"; exit 1)
+chmod o-x checkout-test2/firstfile
+$OSTREE fsck --incremental --sample=0
+
+echo "ok fsck incremental detects chmod"
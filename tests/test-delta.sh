@@ -24,7 +24,7 @@ set -e
 bindatafiles="bash true ostree"
 morebindatafiles="false ls"
 
-echo '1..2'
+echo '1..4'
 
 mkdir repo
 ostree --repo=repo init --mode=archive-z2
@@ -74,6 +74,31 @@ ostree --repo=repo static-delta generate --max-bsdiff-size=10000 --from=${origre
 
 ostree --repo=repo static-delta list | grep ${origrev}-${newrev} || exit 1
 
+echo 'ok generate'
+
+ostree --repo=repo static-delta generate --jobs=1 --from=${origrev} --to=${newrev}
+(cd repo/deltas && find . -type f ! -name superblock | sort | xargs sha256sum) > parts-serial.txt
+ostree --repo=repo static-delta generate --jobs=4 --from=${origrev} --to=${newrev}
+(cd repo/deltas && find . -type f ! -name superblock | sort | xargs sha256sum) > parts-parallel.txt
+cmp parts-serial.txt parts-parallel.txt
+
+echo 'ok generate --jobs is deterministic'
+
+permuteDirectory 2 files
+ostree --repo=repo commit -b test -s test --tree=dir=files
+newrev2=$(${CMD_PREFIX} ostree --repo=repo rev-parse test)
+ostree --repo=repo static-delta generate --previous=5 --to=test > generate.txt
+assert_file_has_content generate.txt "Generating 2 static deltas"
+ostree --repo=repo static-delta list > deltas.txt
+assert_file_has_content deltas.txt ${origrev}-${newrev2}
+assert_file_has_content deltas.txt ${newrev}-${newrev2}
+(cd repo/deltas && find . -type f ! -name superblock | sort | xargs sha256sum) > parts-batch.txt
+ostree --repo=repo static-delta generate --from=${origrev} --to=${newrev2}
+(cd repo/deltas && find . -type f ! -name superblock | sort | xargs sha256sum) > parts-single.txt
+cmp parts-batch.txt parts-single.txt
+
+echo 'ok generate --previous'
+
 if ${CMD_PREFIX} ostree --repo=repo static-delta generate --from=${origrev} --to=${newrev} --empty 2>>err.txt; then
     assert_not_reached "static-delta generate --from=${origrev} --empty unexpectedly succeeded"
 fi
@@ -81,3 +106,23 @@ fi
 mkdir repo2
 ostree --repo=repo2 init --mode=archive-z2
 ostree --repo=repo2 pull-local repo ${origrev}
+
+${CMD_PREFIX} ostree --repo=repo ls -R -C ${newrev2} > ls-expected.txt
+for limit in 0 1; do
+    rm repo-limit -rf
+    mkdir repo-limit
+    ostree --repo=repo-limit init --mode=archive-z2
+    ostree --repo=repo-limit config set core.static-delta-memory-limit ${limit}
+    ostree --repo=repo-limit remote add --set=gpg-verify=false origin file://$(pwd)/repo
+    ostree --repo=repo-limit pull-local repo ${origrev}
+    mkdir -p repo-limit/refs/remotes/origin
+    echo ${origrev} > repo-limit/refs/remotes/origin/test
+    # Applies the ${origrev}-${newrev2} delta, one part at a time
+    ${CMD_PREFIX} ostree --repo=repo-limit pull origin test
+    ${CMD_PREFIX} ostree --repo=repo-limit fsck
+    assert_streq $(ostree --repo=repo-limit rev-parse origin:test) ${newrev2}
+    ${CMD_PREFIX} ostree --repo=repo-limit ls -R -C ${newrev2} > ls-limit.txt
+    cmp ls-expected.txt ls-limit.txt
+done
+
+echo 'ok pull delta with small static-delta-memory-limit'
@@ -0,0 +1,123 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <glib.h>
+#include "ostree-fetcher-window.h"
+
+#define MSEC(n) ((gint64) (n) * 1000)
+
+static void
+test_fetcher_window_min_rtt (void)
+{
+  OstreeFetcherWindow window;
+  gint64 t0 = 10 * G_USEC_PER_SEC;
+
+  _ostree_fetcher_window_init (&window, 8);
+  g_assert_cmpint (_ostree_fetcher_window_get_min_rtt (&window, t0), ==, 0);
+
+  _ostree_fetcher_window_sample_rtt (&window, t0, MSEC (10));
+  _ostree_fetcher_window_sample_rtt (&window, t0 + MSEC (100), MSEC (30));
+  g_assert_cmpint (_ostree_fetcher_window_get_min_rtt (&window, t0 + MSEC (100)), ==, MSEC (10));
+
+  /* A slower sample a few seconds later doesn't replace the minimum */
+  _ostree_fetcher_window_sample_rtt (&window, t0 + 3 * G_USEC_PER_SEC, MSEC (100));
+  g_assert_cmpint (_ostree_fetcher_window_get_min_rtt (&window, t0 + 3 * G_USEC_PER_SEC), ==, MSEC (10));
+
+  /* But once the fast samples have aged out, it becomes the baseline */
+  g_assert_cmpint (_ostree_fetcher_window_get_min_rtt (&window, t0 + 6 * G_USEC_PER_SEC), ==, MSEC (100));
+  g_assert_cmpint (_ostree_fetcher_window_get_min_rtt (&window, t0 + 9 * G_USEC_PER_SEC), ==, 0);
+}
+
+static void
+test_fetcher_window_adapt (void)
+{
+  OstreeFetcherWindow window;
+  gint64 now = 10 * G_USEC_PER_SEC;
+  guint i;
+
+  _ostree_fetcher_window_init (&window, 24);
+  _ostree_fetcher_window_set_bounds (&window, 8, 64, TRUE);
+  g_assert_cmpint (window.window, ==, 24);
+
+  /* Latency well above the minimum shrinks the window */
+  _ostree_fetcher_window_sample_rtt (&window, now, MSEC (10));
+  for (i = 0; i < 10; i++)
+    _ostree_fetcher_window_sample_rtt (&window, now, MSEC (50));
+  _ostree_fetcher_window_update (&window, now, 0, TRUE);
+  now += _OSTREE_FETCHER_WINDOW_INTERVAL_USEC;
+  _ostree_fetcher_window_update (&window, now, 1000, TRUE);
+  g_assert_cmpint (window.window, ==, 18);
+
+  /* Nothing changes before the interval is up */
+  _ostree_fetcher_window_update (&window, now + 1, 1000, TRUE);
+  g_assert_cmpint (window.window, ==, 18);
+
+  /* Steady throughput with requests waiting grows it */
+  now += _OSTREE_FETCHER_WINDOW_INTERVAL_USEC;
+  _ostree_fetcher_window_update (&window, now, 0, TRUE);
+  g_assert_cmpint (window.window, ==, 20);
+
+  /* ...but not if nothing is waiting on the window */
+  now += _OSTREE_FETCHER_WINDOW_INTERVAL_USEC;
+  _ostree_fetcher_window_update (&window, now, 2000, FALSE);
+  g_assert_cmpint (window.window, ==, 20);
+
+  for (i = 0; i < 100; i++)
+    {
+      now += _OSTREE_FETCHER_WINDOW_INTERVAL_USEC;
+      _ostree_fetcher_window_sample_rtt (&window, now, MSEC (10));
+      _ostree_fetcher_window_update (&window, now, 2000, TRUE);
+    }
+  g_assert_cmpint (window.window, ==, 64);
+}
+
+static void
+test_fetcher_window_fixed (void)
+{
+  OstreeFetcherWindow window;
+  gint64 now = 10 * G_USEC_PER_SEC;
+  guint i;
+
+  _ostree_fetcher_window_init (&window, 24);
+  _ostree_fetcher_window_set_bounds (&window, 4, 16, FALSE);
+  g_assert_cmpint (window.window, ==, 16);
+
+  for (i = 0; i < 10; i++)
+    {
+      now += _OSTREE_FETCHER_WINDOW_INTERVAL_USEC;
+      _ostree_fetcher_window_sample_rtt (&window, now, MSEC (10 * (i + 1)));
+      _ostree_fetcher_window_update (&window, now, 1000, TRUE);
+    }
+  g_assert_cmpint (window.window, ==, 16);
+  /* Throughput is still measured */
+  g_assert_cmpuint (window.throughput, ==, 2000);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/fetcher-window/min-rtt", test_fetcher_window_min_rtt);
+  g_test_add_func ("/fetcher-window/adapt", test_fetcher_window_adapt);
+  g_test_add_func ("/fetcher-window/fixed", test_fetcher_window_fixed);
+
+  return g_test_run();
+}
@@ -0,0 +1,290 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "ostree.h"
+#include "ostree-object-set.h"
+
+/* Fill @csum from @rand; if @collide is set, all checksums share
+ * their first bytes and hence their position in the table.
+ */
+static void
+random_csum (GRand    *rand,
+             gboolean  collide,
+             guchar   *csum)
+{
+  guint i;
+
+  for (i = 0; i < 32; i++)
+    csum[i] = g_rand_int_range (rand, 0, 256);
+  if (collide)
+    memset (csum, 0, 8);
+}
+
+static void
+test_object_set_add_remove (gconstpointer data)
+{
+  gboolean collide = GPOINTER_TO_INT (data);
+  const guint n = 5000;
+  GRand *rand = g_rand_new_with_seed (42);
+  OstreeObjectSet *set = _ostree_object_set_new ();
+  guchar (*csums)[32] = g_new (guchar[32], n);
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      random_csum (rand, collide, csums[i]);
+      g_assert (_ostree_object_set_add (set, csums[i], OSTREE_OBJECT_TYPE_FILE));
+      g_assert (!_ostree_object_set_add (set, csums[i], OSTREE_OBJECT_TYPE_FILE));
+    }
+  g_assert_cmpuint (_ostree_object_set_size (set), ==, n);
+
+  for (i = 0; i < n; i++)
+    {
+      g_assert (_ostree_object_set_contains (set, csums[i], OSTREE_OBJECT_TYPE_FILE));
+      /* The type is part of the name */
+      g_assert (!_ostree_object_set_contains (set, csums[i], OSTREE_OBJECT_TYPE_DIR_TREE));
+    }
+
+  /* Removing every other object must leave the rest findable */
+  for (i = 0; i < n; i += 2)
+    g_assert (_ostree_object_set_remove (set, csums[i], OSTREE_OBJECT_TYPE_FILE));
+  g_assert_cmpuint (_ostree_object_set_size (set), ==, n / 2);
+  for (i = 0; i < n; i++)
+    g_assert (_ostree_object_set_contains (set, csums[i], OSTREE_OBJECT_TYPE_FILE) == (i % 2 == 1));
+  g_assert (!_ostree_object_set_remove (set, csums[0], OSTREE_OBJECT_TYPE_FILE));
+
+  _ostree_object_set_unref (set);
+  g_free (csums);
+  g_rand_free (rand);
+}
+
+static void
+test_object_set_iter (void)
+{
+  GRand *rand = g_rand_new_with_seed (7);
+  OstreeObjectSet *set = _ostree_object_set_new ();
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  OstreeObjectSetIter iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  guint i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      guchar buf[32];
+
+      random_csum (rand, FALSE, buf);
+      g_assert (_ostree_object_set_add (set, buf, OSTREE_OBJECT_TYPE_FILE + (i % 4)));
+    }
+
+  _ostree_object_set_iter_init (&iter, set);
+  while (_ostree_object_set_iter_next (&iter, &csum, &objtype, NULL))
+    {
+      g_autofree char *checksum = ostree_checksum_from_bytes (csum);
+
+      g_assert (_ostree_object_set_contains_checksum (set, checksum, objtype));
+      g_assert (g_hash_table_add (seen, ostree_object_to_string (checksum, objtype)));
+    }
+  g_assert_cmpuint (g_hash_table_size (seen), ==, 1000);
+
+  _ostree_object_set_unref (set);
+  g_rand_free (rand);
+}
+
+static void
+test_object_set_union_subtract (void)
+{
+  GRand *rand = g_rand_new_with_seed (1);
+  OstreeObjectSet *a = _ostree_object_set_new ();
+  OstreeObjectSet *b = _ostree_object_set_new ();
+  OstreeObjectSet *u;
+  guchar csums[300][32];
+  guint i;
+
+  /* a = [0, 200), b = [100, 300) */
+  for (i = 0; i < 300; i++)
+    {
+      random_csum (rand, FALSE, csums[i]);
+      if (i < 200)
+        _ostree_object_set_add (a, csums[i], OSTREE_OBJECT_TYPE_DIR_META);
+      if (i >= 100)
+        _ostree_object_set_add (b, csums[i], OSTREE_OBJECT_TYPE_DIR_META);
+    }
+
+  u = _ostree_object_set_copy (a);
+  _ostree_object_set_union (u, b);
+  g_assert_cmpuint (_ostree_object_set_size (u), ==, 300);
+
+  _ostree_object_set_subtract (a, b);
+  g_assert_cmpuint (_ostree_object_set_size (a), ==, 100);
+  for (i = 0; i < 300; i++)
+    {
+      g_assert (_ostree_object_set_contains (u, csums[i], OSTREE_OBJECT_TYPE_DIR_META));
+      g_assert (_ostree_object_set_contains (a, csums[i], OSTREE_OBJECT_TYPE_DIR_META) == (i < 100));
+    }
+
+  _ostree_object_set_unref (a);
+  _ostree_object_set_unref (b);
+  _ostree_object_set_unref (u);
+  g_rand_free (rand);
+}
+
+static void
+test_object_map (void)
+{
+  GRand *rand = g_rand_new_with_seed (3);
+  OstreeObjectSet *map = _ostree_object_map_new (g_free);
+  guchar csums[500][32];
+  guint i;
+
+  for (i = 0; i < 500; i++)
+    {
+      random_csum (rand, i % 2 == 0, csums[i]);
+      _ostree_object_map_insert (map, csums[i], OSTREE_OBJECT_TYPE_COMMIT, g_strdup_printf ("%u", i));
+    }
+  /* Replacing frees the previous value */
+  _ostree_object_map_insert (map, csums[0], OSTREE_OBJECT_TYPE_COMMIT, g_strdup ("replaced"));
+  g_assert (_ostree_object_set_remove (map, csums[1], OSTREE_OBJECT_TYPE_COMMIT));
+
+  g_assert_cmpuint (_ostree_object_set_size (map), ==, 499);
+  g_assert_cmpstr (_ostree_object_map_lookup (map, csums[0], OSTREE_OBJECT_TYPE_COMMIT), ==, "replaced");
+  g_assert (_ostree_object_map_lookup (map, csums[1], OSTREE_OBJECT_TYPE_COMMIT) == NULL);
+  for (i = 2; i < 500; i++)
+    {
+      g_autofree char *expected = g_strdup_printf ("%u", i);
+      g_assert_cmpstr (_ostree_object_map_lookup (map, csums[i], OSTREE_OBJECT_TYPE_COMMIT), ==, expected);
+    }
+
+  _ostree_object_set_unref (map);
+  g_rand_free (rand);
+}
+
+static void
+test_object_set_reachable (void)
+{
+  g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  g_autoptr(GHashTable) roundtrip = ostree_repo_traverse_new_reachable ();
+  OstreeObjectSet *set = _ostree_object_set_new ();
+  const char *checksum = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+  GVariant *key;
+
+  key = ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_DIR_TREE);
+  g_hash_table_replace (reachable, key, key);
+  key = ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_FILE);
+  g_hash_table_replace (reachable, key, key);
+
+  _ostree_object_set_add_from_reachable (set, reachable);
+  g_assert_cmpuint (_ostree_object_set_size (set), ==, 2);
+  g_assert (_ostree_object_set_contains_checksum (set, checksum, OSTREE_OBJECT_TYPE_FILE));
+
+  _ostree_object_set_add_to_reachable (set, roundtrip);
+  g_assert_cmpuint (g_hash_table_size (roundtrip), ==, 2);
+  g_assert (g_hash_table_contains (roundtrip, key));
+
+  _ostree_object_set_unref (set);
+}
+
+#ifdef __GLIBC__
+static gsize
+get_heap_used (void)
+{
+  struct mallinfo mi = mallinfo ();
+  return (gsize)(guint)mi.uordblks + (gsize)(guint)mi.hblkhd;
+}
+
+/* Compare the memory used by a reachable set of serialized object
+ * names with an #OstreeObjectSet.  Run with -m perf.
+ */
+static void
+test_object_set_memory (void)
+{
+  const guint n = 1000000;
+  GRand *rand = g_rand_new_with_seed (11);
+  GHashTable *reachable;
+  OstreeObjectSet *set;
+  gsize before, hash_bytes, set_bytes;
+  guint i;
+
+  before = get_heap_used ();
+  reachable = ostree_repo_traverse_new_reachable ();
+  for (i = 0; i < n; i++)
+    {
+      guchar csum[32];
+      char checksum[65];
+      GVariant *key;
+
+      random_csum (rand, FALSE, csum);
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_FILE);
+      g_hash_table_replace (reachable, key, key);
+    }
+  hash_bytes = get_heap_used () - before;
+
+  g_rand_set_seed (rand, 11);
+  before = get_heap_used ();
+  set = _ostree_object_set_new ();
+  for (i = 0; i < n; i++)
+    {
+      guchar csum[32];
+
+      random_csum (rand, FALSE, csum);
+      _ostree_object_set_add (set, csum, OSTREE_OBJECT_TYPE_FILE);
+    }
+  set_bytes = get_heap_used () - before;
+
+  g_test_message ("%u objects: GHashTable %" G_GSIZE_FORMAT " bytes/object, "
+                  "OstreeObjectSet %" G_GSIZE_FORMAT " bytes/object",
+                  n, hash_bytes / n, set_bytes / n);
+  g_test_minimized_result ((double) set_bytes / n, "OstreeObjectSet bytes per object");
+  g_assert_cmpuint (set_bytes, <, hash_bytes);
+
+  g_hash_table_unref (reachable);
+  _ostree_object_set_unref (set);
+  g_rand_free (rand);
+}
+#endif
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_data_func ("/object-set/add-remove", GINT_TO_POINTER (FALSE),
+                        test_object_set_add_remove);
+  g_test_add_data_func ("/object-set/add-remove-colliding", GINT_TO_POINTER (TRUE),
+                        test_object_set_add_remove);
+  g_test_add_func ("/object-set/iter", test_object_set_iter);
+  g_test_add_func ("/object-set/union-subtract", test_object_set_union_subtract);
+  g_test_add_func ("/object-set/map", test_object_map);
+  g_test_add_func ("/object-set/reachable", test_object_set_reachable);
+#ifdef __GLIBC__
+  if (g_test_perf ())
+    g_test_add_func ("/object-set/memory", test_object_set_memory);
+#endif
+
+  return g_test_run();
+}
@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# Copyright (C) 2011 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+if ! ${CMD_PREFIX} ostree --version | grep -q -e '\+zstd'; then
+    exit 77
+fi
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-zstd"
+
+echo '1..11'
+
+. ${SRCDIR}/pull-test.sh
+
+cd ${test_tmpdir}
+rm main-files -rf
+ostree --repo=ostree-srv/gnomerepo checkout main main-files
+echo "a file for zstd static deltas" > main-files/zstd-file
+ostree --repo=ostree-srv/gnomerepo commit -b main -s 'zstd static delta test' --tree=dir=main-files
+rm main-files -rf
+ostree --repo=ostree-srv/gnomerepo static-delta generate --compression=zstd main
+ostree --repo=ostree-srv/gnomerepo summary -u
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+rm checkout-origin-main -rf
+$OSTREE checkout origin:main checkout-origin-main
+assert_file_has_content checkout-origin-main/zstd-file "a file for zstd static deltas"
+echo "ok static delta zstd"
+
+cd ${test_tmpdir}
+mkdir levelrepo
+ostree --repo=levelrepo init --mode=archive-zstd
+ostree --repo=levelrepo config set core.compression-level 23
+if ostree --repo=levelrepo refs 2>err.txt; then
+    assert_not_reached "Opened a repository with an invalid compression-level"
+fi
+assert_file_has_content err.txt "Invalid compression-level"
+echo "ok compression-level"
+
+# An archive-z2 repository, which older clients can pull from, with a
+# zstd static delta.  Older clients know neither the zstd superblock nor
+# the summary key listing it; simulate one by pulling from a copy of the
+# repository without them.
+cd ${test_tmpdir}
+z2repo=ostree-srv/z2repo
+ostree --repo=${z2repo} init --mode=archive-z2
+ostree --repo=${z2repo} pull-local ostree-srv/gnomerepo main
+cp -a ${z2repo} ${z2repo}-old
+for name in new old; do
+    mkdir repo-${name}
+    ${CMD_PREFIX} ostree --repo=repo-${name} init
+done
+${CMD_PREFIX} ostree --repo=repo-new remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/z2repo
+${CMD_PREFIX} ostree --repo=repo-old remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/z2repo-old
+${CMD_PREFIX} ostree --repo=repo-new pull origin main
+${CMD_PREFIX} ostree --repo=repo-old pull origin main
+
+rm main-files -rf
+ostree --repo=${z2repo} checkout main main-files
+echo "another file for zstd static deltas" > main-files/zstd-file-2
+ostree --repo=${z2repo} commit -b main -s 'zstd static delta compat test' --tree=dir=main-files
+rm main-files -rf
+ostree --repo=${z2repo} static-delta generate --compression=zstd main
+ostree --repo=${z2repo} summary -u
+find ${z2repo}/deltas -name superblock.zstd > zstd-superblocks.txt
+assert_file_has_content zstd-superblocks.txt superblock.zstd
+find ${z2repo}/deltas -name 0.zstd > zstd-parts.txt
+assert_file_has_content zstd-parts.txt 0.zstd
+for part in $(find ${z2repo}/deltas -name 0); do
+    assert_streq "$(head -c 1 ${part})" x
+done
+
+rm ${z2repo}-old -rf
+cp -a ${z2repo} ${z2repo}-old
+find ${z2repo}-old/deltas -name '*.zstd' -delete
+ostree --repo=${z2repo}-old summary -u
+
+# Both clients can only get the new file from the delta, and the
+# client with zstd support only from the zstd parts
+find ${z2repo}/deltas -name 0 -delete
+checksum=$(ostree --repo=${z2repo} ls -C main /zstd-file-2 | awk '{ print $5 }')
+rm ${z2repo}/objects/${checksum:0:2}/${checksum:2}.filez
+rm ${z2repo}-old/objects/${checksum:0:2}/${checksum:2}.filez
+
+${CMD_PREFIX} ostree --repo=repo-old pull origin main
+${CMD_PREFIX} ostree --repo=repo-old fsck
+${CMD_PREFIX} ostree --repo=repo-old checkout origin:main checkout-old
+assert_file_has_content checkout-old/zstd-file-2 "another file for zstd static deltas"
+echo "ok client without zstd uses lzma delta parts"
+
+${CMD_PREFIX} ostree --repo=repo-new pull origin main
+${CMD_PREFIX} ostree --repo=repo-new fsck
+${CMD_PREFIX} ostree --repo=repo-new checkout origin:main checkout-new
+assert_file_has_content checkout-new/zstd-file-2 "another file for zstd static deltas"
+echo "ok client with zstd uses zstd delta parts"
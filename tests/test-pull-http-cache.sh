@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-z2"
+
+echo '1..5'
+
+repopath=${test_tmpdir}/ostree-srv/gnomerepo
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+
+cd ${test_tmpdir}
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+find repo/state/http-cache/origin -type f > cached.txt
+if test $(wc -l < cached.txt) -lt 1; then
+    assert_not_reached "Expected the summary to be cached"
+fi
+echo "ok pull caches summary"
+
+# Zero the summary on the server without changing its size, inode or
+# mtime, so that its validators stay the same.  The pull can then only
+# succeed by reusing the cached copy after a 304 response.
+cp -p ${repopath}/summary summary.orig
+dd if=/dev/zero of=${repopath}/summary bs=$(stat -c '%s' summary.orig) count=1 conv=notrunc 2>/dev/null
+touch -r summary.orig ${repopath}/summary
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo config set 'remote "origin"'.http-cache false
+if ${CMD_PREFIX} ostree --repo=repo pull origin main 2>/dev/null; then
+    assert_not_reached "Pull with a zeroed summary unexpectedly succeeded"
+fi
+${CMD_PREFIX} ostree --repo=repo config set 'remote "origin"'.http-cache true
+echo "ok pull reuses unchanged summary"
+
+${CMD_PREFIX} ostree --repo=${repopath} checkout -U main ${repopath}-files
+cd ${repopath}-files
+echo updated > updated-file
+${CMD_PREFIX} ostree --repo=${repopath} commit -b main -s "Update"
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=repo pull origin main
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo rev-parse origin:main)" \
+             "$(${CMD_PREFIX} ostree --repo=${repopath} rev-parse main)"
+echo "ok pull fetches changed summary"
+
+# Entries that can be neither read nor replaced, as for an unprivileged
+# user of the system repository, only cost an unconditional request
+for f in repo/state/http-cache/origin/*; do
+    rm -f ${f}
+    mkdir ${f}
+done
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo remote refs origin > refs.txt
+assert_file_has_content refs.txt main
+echo "ok pull ignores unusable cache"
+
+${CMD_PREFIX} ostree --repo=repo remote delete origin
+assert_not_has_dir repo/state/http-cache/origin
+echo "ok remote delete removes cache"
@@ -0,0 +1,121 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_fake_remote_repo1 "archive-z2"
+
+echo '1..5'
+
+repopath=${test_tmpdir}/ostree-srv/gnomerepo
+cp -a ${repopath} ${repopath}.loose
+${CMD_PREFIX} ostree --repo=${repopath} repack --delete-loose
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+find ${repopath}/objects -name '*.filez' -o -name '*.dirtree' -o -name '*.commit' > loose.txt
+assert_file_empty loose.txt
+
+cd ${test_tmpdir}
+rm repo -rf
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/baz/cow moo
+assert_file_has_content checkout-origin-main/baz/deeper/ohyeah hi
+echo "ok pull from packs"
+
+# The indexes are only fetched for objects that are missing, and kept
+find repo/state/pack-indexes/origin -name '*.index' > cached-indexes.txt
+assert_streq "$(wc -l < cached-indexes.txt)" 2
+cp -a repo/state/pack-indexes/origin cached-indexes
+rm repo/state/pack-indexes/origin/*
+${CMD_PREFIX} ostree --repo=repo pull origin main
+find repo/state/pack-indexes/origin -name '*.index' > cached-indexes.txt
+assert_file_empty cached-indexes.txt
+rm repo checkout-origin-main -rf
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+mkdir -p repo/state/pack-indexes
+cp -a cached-indexes repo/state/pack-indexes/origin
+mkdir ${repopath}-hidden-indexes
+mv ${repopath}/objects/pack/*.index ${repopath}-hidden-indexes
+${CMD_PREFIX} ostree --repo=repo pull origin main
+mv ${repopath}-hidden-indexes/*.index ${repopath}/objects/pack
+rmdir ${repopath}-hidden-indexes
+${CMD_PREFIX} ostree --repo=repo fsck
+${CMD_PREFIX} ostree --repo=repo remote delete origin
+assert_not_has_dir repo/state/pack-indexes/origin
+echo "ok pack indexes are fetched lazily and cached"
+
+mkdir ${test_tmpdir}/ostree-srv/gnomerepo-files
+cd ${test_tmpdir}/ostree-srv/gnomerepo-files
+echo new > newfile
+${CMD_PREFIX} ostree --repo=${repopath} commit -b main -s "A loose commit"
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+cd ${test_tmpdir}
+rm repo checkout-origin-main -rf
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/newfile new
+assert_file_has_content checkout-origin-main/baz/saucer alien
+echo "ok pull from packs and loose objects"
+
+# Serve the repositories without range support; the pull can only
+# fall back to loose objects if the server kept them.
+cd ${test_tmpdir}/httpd
+${CMD_PREFIX} ostree trivial-httpd --autoexit --daemonize --disable-range-requests -p ${test_tmpdir}/httpd-noranges-port
+cd ${test_tmpdir}
+rm repo checkout-origin-main -rf
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin http://127.0.0.1:$(cat httpd-noranges-port)/ostree/gnomerepo
+if ${CMD_PREFIX} ostree --repo=repo pull origin main 2>err.txt; then
+    assert_not_reached "pull from packs without range support and loose objects succeeded"
+fi
+assert_file_has_content err.txt "delete-loose"
+echo "ok pull without range support fails clearly"
+
+keeprepopath=${test_tmpdir}/ostree-srv/keeploose
+cp -a ${repopath}.loose ${keeprepopath}
+# Loose copies are kept by default in an archive repository
+${CMD_PREFIX} ostree --repo=${keeprepopath} repack
+${CMD_PREFIX} ostree --repo=${keeprepopath} summary -u
+find ${keeprepopath}/objects/pack -name '*.index' > packs.txt
+assert_streq "$(wc -l < packs.txt)" 2
+find ${keeprepopath}/objects -name '*.filez' -o -name '*.dirtree' -o -name '*.commit' > loose.txt
+assert_not_streq "$(wc -l < loose.txt)" 0
+rm repo checkout-origin-main -rf
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin http://127.0.0.1:$(cat httpd-noranges-port)/ostree/keeploose
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/baz/cow moo
+assert_file_has_content checkout-origin-main/baz/deeper/ohyeah hi
+echo "ok pull falls back to loose objects kept by repack"
@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_test_repository "bare"
+
+echo '1..5'
+
+cd ${test_tmpdir}/files
+$OSTREE commit -b foo/bar -s "Nested ref"
+$OSTREE commit -b other -s "Other ref"
+cd ${test_tmpdir}
+mkdir -p repo/refs/remotes/origin/stable
+cp repo/refs/heads/test2 repo/refs/remotes/origin/stable/main
+$OSTREE refs | sort > refs-before.txt
+for ref in test2 foo/bar other origin:stable/main; do
+    $OSTREE rev-parse ${ref}
+done > revs-before.txt
+
+$OSTREE refs --pack
+assert_has_file repo/refs/packed-refs
+find repo/refs/heads repo/refs/remotes -type f > loose-refs.txt
+assert_file_empty loose-refs.txt
+LC_ALL=C sort -k2 -c repo/refs/packed-refs
+$OSTREE refs | sort > refs-after.txt
+diff -u refs-before.txt refs-after.txt
+for ref in test2 foo/bar other origin:stable/main; do
+    $OSTREE rev-parse ${ref}
+done > revs-after.txt
+diff -u revs-before.txt revs-after.txt
+assert_streq "$($OSTREE rev-parse stable/main)" "$($OSTREE rev-parse test2)"
+$OSTREE refs foo > prefix-refs.txt
+assert_file_has_content prefix-refs.txt '^foo/bar$'
+assert_not_file_has_content prefix-refs.txt other
+$OSTREE fsck
+echo "ok pack refs"
+
+old_rev=$($OSTREE rev-parse other)
+cd ${test_tmpdir}/files
+echo more > more
+$OSTREE commit -b other -s "Update packed ref"
+cd ${test_tmpdir}
+new_rev=$($OSTREE rev-parse other)
+assert_not_streq "${old_rev}" "${new_rev}"
+assert_file_has_content repo/refs/heads/other ${new_rev}
+assert_file_has_content repo/refs/packed-refs "^${old_rev} other$"
+$OSTREE refs --pack
+assert_not_has_file repo/refs/heads/other
+assert_file_has_content repo/refs/packed-refs "^${new_rev} other$"
+assert_streq "$($OSTREE rev-parse other)" "${new_rev}"
+echo "ok loose ref overrides packed ref"
+
+$OSTREE refs --delete foo
+assert_not_file_has_content repo/refs/packed-refs foo/bar
+if $OSTREE rev-parse foo/bar 2>/dev/null; then
+    assert_not_reached "Deleted packed ref still resolves"
+fi
+$OSTREE refs > refs.txt
+assert_not_file_has_content refs.txt foo/bar
+assert_file_has_content refs.txt '^test2$'
+echo "ok delete packed ref"
+
+if $OSTREE refs --pack --delete foo 2>/dev/null; then
+    assert_not_reached "--pack with --delete unexpectedly succeeded"
+fi
+echo "ok pack argument checking"
+
+cd ${test_tmpdir}
+setup_fake_remote_repo1 "archive-z2"
+repopath=${test_tmpdir}/ostree-srv/gnomerepo
+cp ${repopath}/refs/heads/main ${repopath}/refs/heads/other
+${CMD_PREFIX} ostree --repo=${repopath} refs --pack
+assert_not_has_file ${repopath}/refs/heads/main
+assert_not_has_file ${repopath}/summary
+mkdir repo-pull
+${CMD_PREFIX} ostree --repo=repo-pull init
+${CMD_PREFIX} ostree --repo=repo-pull remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo-pull pull origin main other
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo-pull rev-parse origin:main)" "$(${CMD_PREFIX} ostree --repo=${repopath} rev-parse main)"
+assert_streq "$(${CMD_PREFIX} ostree --repo=repo-pull rev-parse origin:other)" "$(${CMD_PREFIX} ostree --repo=${repopath} rev-parse main)"
+if ${CMD_PREFIX} ostree --repo=repo-pull pull origin nosuchref 2>err.txt; then
+    assert_not_reached "pull of missing ref unexpectedly succeeded"
+fi
+assert_file_has_content err.txt "No such branch"
+echo "ok pull packed refs over http"
@@ -0,0 +1,123 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+echo '1..9'
+
+setup_test_repository "archive-z2"
+
+cd ${test_tmpdir}
+$OSTREE repack --delete-loose > repack-output.txt
+assert_file_has_content repack-output.txt "^Packed [1-9][0-9]* loose objects"
+find repo/objects -name '*.filez' -o -name '*.dirtree' -o -name '*.dirmeta' -o -name '*.commit' > loose.txt
+assert_file_empty loose.txt
+ls repo/objects/pack/ostmetapack-*.index
+ls repo/objects/pack/ostdatapack-*.data
+$OSTREE fsck
+echo "ok repack archive-z2"
+
+$OSTREE checkout test2 checkout-test2
+assert_file_has_content checkout-test2/baz/cow moo
+assert_file_has_content checkout-test2/baz/deeper/ohyeah hi
+$OSTREE cat test2 /baz/saucer > saucer-contents
+assert_file_has_content saucer-contents alien
+echo "ok read packed objects"
+
+cd ${test_tmpdir}/files
+echo more > baz/more
+$OSTREE commit -b test2 -s "Test Commit 3"
+cd ${test_tmpdir}
+$OSTREE repack --delete-loose
+ls repo/objects/pack/ostmetapack-*.index | wc -l > n-meta-packs.txt
+assert_file_has_content n-meta-packs.txt "^1$"
+ls repo/objects/pack/ostdatapack-*.index | wc -l > n-content-packs.txt
+assert_file_has_content n-content-packs.txt "^1$"
+$OSTREE fsck
+echo "ok repack consolidates packs"
+
+mkdir repo2
+${CMD_PREFIX} ostree --repo=repo2 init
+${CMD_PREFIX} ostree --repo=repo2 pull-local repo
+${CMD_PREFIX} ostree --repo=repo2 fsck
+${CMD_PREFIX} ostree --repo=repo2 checkout test2 checkout-repo2
+assert_file_has_content checkout-repo2/baz/more more
+echo "ok pull-local from packed repo"
+
+$OSTREE prune > prune-output.txt
+assert_file_has_content prune-output.txt "^Total objects: "
+$OSTREE fsck
+echo "ok prune with packs"
+
+du -sb repo/objects | cut -f 1 > du-before.txt
+$OSTREE prune --no-prune | sed -e 's,^Total objects: ,,' > total-before.txt
+$OSTREE reset test2 test2^
+$OSTREE prune --refs-only --depth=0 > prune-output.txt
+assert_file_has_content prune-output.txt "^Deleted [1-9][0-9]* objects"
+du -sb repo/objects | cut -f 1 > du-after.txt
+$OSTREE prune --no-prune | sed -e 's,^Total objects: ,,' > total-after.txt
+test $(head -1 du-after.txt) -lt $(head -1 du-before.txt)
+test $(head -1 total-after.txt) -lt $(head -1 total-before.txt)
+find repo/objects -name '*.filez' -o -name '*.dirtree' -o -name '*.commit' > loose.txt
+assert_file_empty loose.txt
+$OSTREE fsck
+if $OSTREE cat test2 /baz/more 2>/dev/null; then
+    assert_not_reached "pruned file still reachable"
+fi
+echo "ok prune unreachable packed objects"
+
+rm repo repo2 files checkout-* -rf
+setup_test_repository "bare"
+cd ${test_tmpdir}
+$OSTREE repack
+find repo/objects -name '*.dirtree' -o -name '*.commit' > loose-meta.txt
+assert_file_empty loose-meta.txt
+find repo/objects -name '*.file' > loose-content.txt
+assert_file_has_content loose-content.txt '\.file$'
+$OSTREE checkout test2 checkout-bare
+assert_file_has_content checkout-bare/firstfile first
+$OSTREE fsck
+echo "ok repack bare metadata"
+
+cp -a repo repo-badindex
+index=$(ls repo-badindex/objects/pack/ostmetapack-*.index | head -1)
+chmod u+w ${index}
+# Make fanout[0] larger than the entries after it
+printf '\377\377\377\377' | dd of=${index} bs=1 seek=16 conv=notrunc 2>/dev/null
+if ${CMD_PREFIX} ostree --repo=repo-badindex cat test2 /firstfile 2>err.txt; then
+    assert_not_reached "read from corrupted pack index"
+fi
+assert_file_has_content err.txt "Corrupted pack index"
+echo "ok reject pack index with corrupted fanout"
+
+rm repo-badindex -rf
+cp -a repo repo-badindex
+index=$(ls repo-badindex/objects/pack/ostmetapack-*.index | head -1)
+chmod u+w ${index}
+# Misalign the first entry: the low byte of its offset follows the
+# 1040 byte header, the checksum, objtype and reserved bytes
+offset_byte=$(od -An -tu1 -j1087 -N1 ${index} | tr -d ' ')
+printf "\\$(printf '%03o' $((offset_byte | 1)))" | dd of=${index} bs=1 seek=1087 conv=notrunc 2>/dev/null
+if ${CMD_PREFIX} ostree --repo=repo-badindex fsck 2>err.txt; then
+    assert_not_reached "fsck accepted a misaligned pack entry"
+fi
+assert_file_has_content err.txt "invalid offset"
+echo "ok fsck reports misaligned pack entry"
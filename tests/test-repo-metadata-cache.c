@@ -0,0 +1,149 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include "ostree.h"
+
+static OstreeRepo *
+create_repo (const char *cache_size)
+{
+  GError *error = NULL;
+  g_autofree char *path = g_dir_make_tmp ("test-metadata-cache-XXXXXX", &error);
+  g_autoptr(GFile) repo_path = NULL;
+  g_autoptr(GKeyFile) config = NULL;
+  OstreeRepo *repo;
+
+  g_assert_no_error (error);
+  repo_path = g_file_new_for_path (path);
+  repo = ostree_repo_new (repo_path);
+  g_assert (ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, &error));
+  g_assert_no_error (error);
+
+  config = ostree_repo_copy_config (repo);
+  g_key_file_set_value (config, "core", "metadata-cache-size", cache_size);
+  g_assert (ostree_repo_write_config (repo, config, &error));
+  g_assert_no_error (error);
+  g_object_unref (repo);
+
+  repo = ostree_repo_new (repo_path);
+  g_assert (ostree_repo_open (repo, NULL, &error));
+  g_assert_no_error (error);
+  return repo;
+}
+
+static char *
+write_dirmeta (OstreeRepo *repo,
+               guint32     mode)
+{
+  GError *error = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *csum = NULL;
+
+  dirmeta = g_variant_ref_sink (g_variant_new ("(uuu@a(ayay))",
+                                               GUINT32_TO_BE (0), GUINT32_TO_BE (0),
+                                               GUINT32_TO_BE (mode),
+                                               g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0)));
+
+  g_assert (ostree_repo_prepare_transaction (repo, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                        dirmeta, &csum, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_commit_transaction (repo, NULL, NULL, &error));
+  g_assert_no_error (error);
+
+  return ostree_checksum_from_bytes (csum);
+}
+
+static void
+test_metadata_cache_hits (void)
+{
+  GError *error = NULL;
+  glnx_unref_object OstreeRepo *repo = create_repo ("1");
+  g_autofree char *checksum = write_dirmeta (repo, 040755);
+  g_autoptr(GVariant) first = NULL;
+  g_autoptr(GVariant) second = NULL;
+  guint64 hits, misses, size;
+
+  g_assert (ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                      &first, &error));
+  g_assert_no_error (error);
+  ostree_repo_get_metadata_cache_stats (repo, &hits, &misses, &size);
+  g_assert_cmpuint (hits, ==, 0);
+  g_assert_cmpuint (misses, ==, 1);
+  g_assert_cmpuint (size, ==, g_variant_get_size (first));
+
+  g_assert (ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                      &second, &error));
+  g_assert_no_error (error);
+  g_assert (g_variant_equal (first, second));
+  ostree_repo_get_metadata_cache_stats (repo, &hits, &misses, NULL);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (misses, ==, 1);
+
+  /* Deleted objects must not be served from the cache */
+  g_assert (ostree_repo_delete_object (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                       NULL, &error));
+  g_assert_no_error (error);
+  ostree_repo_get_metadata_cache_stats (repo, NULL, NULL, &size);
+  g_assert_cmpuint (size, ==, 0);
+  g_clear_pointer (&second, (GDestroyNotify) g_variant_unref);
+  g_assert (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                       &second, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+}
+
+static void
+test_metadata_cache_disabled (void)
+{
+  GError *error = NULL;
+  glnx_unref_object OstreeRepo *repo = create_repo ("0");
+  g_autofree char *checksum = write_dirmeta (repo, 040700);
+  guint i;
+  guint64 hits, size;
+
+  for (i = 0; i < 2; i++)
+    {
+      g_autoptr(GVariant) dirmeta = NULL;
+      g_assert (ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                          &dirmeta, &error));
+      g_assert_no_error (error);
+    }
+
+  ostree_repo_get_metadata_cache_stats (repo, &hits, NULL, &size);
+  g_assert_cmpuint (hits, ==, 0);
+  g_assert_cmpuint (size, ==, 0);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/repo-metadata-cache/hits", test_metadata_cache_hits);
+  g_test_add_func ("/repo-metadata-cache/disabled", test_metadata_cache_disabled);
+
+  return g_test_run();
+}
@@ -0,0 +1,189 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include "ostree.h"
+#include "ostree-cmdprivate.h"
+
+static OstreeRepo *
+create_repo (void)
+{
+  GError *error = NULL;
+  g_autofree char *path = g_dir_make_tmp ("test-repo-traverse-XXXXXX", &error);
+  g_autoptr(GFile) repo_path = NULL;
+  OstreeRepo *repo;
+
+  g_assert_no_error (error);
+  repo_path = g_file_new_for_path (path);
+  repo = ostree_repo_new (repo_path);
+  g_assert (ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, &error));
+  g_assert_no_error (error);
+  return repo;
+}
+
+/* Create a tree @depth levels deep with @width subdirectories per
+ * level; @generation is mixed into part of the file contents so
+ * successive commits share some dirtrees but not others.
+ */
+static void
+make_tree (const char *path,
+           guint       depth,
+           guint       width,
+           guint       generation)
+{
+  GError *error = NULL;
+  guint i;
+
+  g_assert_cmpint (g_mkdir_with_parents (path, 0755), ==, 0);
+
+  for (i = 0; i < width; i++)
+    {
+      g_autofree char *filename = g_strdup_printf ("%s/file%u", path, i);
+      g_autofree char *contents = g_strdup_printf ("%s %u", filename,
+                                                   i == 0 ? generation : 0);
+      g_assert (g_file_set_contents (filename, contents, -1, &error));
+      g_assert_no_error (error);
+    }
+
+  if (depth == 0)
+    return;
+
+  for (i = 0; i < width; i++)
+    {
+      g_autofree char *subdir = g_strdup_printf ("%s/dir%u", path, i);
+      make_tree (subdir, depth - 1, width, i == 0 ? generation : 0);
+    }
+}
+
+static char *
+write_commit (OstreeRepo *repo,
+              const char *parent,
+              guint       generation)
+{
+  GError *error = NULL;
+  g_autofree char *path = g_dir_make_tmp ("test-repo-traverse-tree-XXXXXX", &error);
+  g_autoptr(GFile) dir = NULL;
+  g_autoptr(GFile) root = NULL;
+  glnx_unref_object OstreeMutableTree *mtree = ostree_mutable_tree_new ();
+  char *ret_commit = NULL;
+
+  g_assert_no_error (error);
+  make_tree (path, 3, 4, generation);
+  dir = g_file_new_for_path (path);
+
+  g_assert (ostree_repo_prepare_transaction (repo, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_write_directory_to_mtree (repo, dir, mtree, NULL, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_write_mtree (repo, mtree, &root, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_write_commit (repo, parent, "test", NULL, NULL,
+                                      (OstreeRepoFile*)root, &ret_commit,
+                                      NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_commit_transaction (repo, NULL, NULL, &error));
+  g_assert_no_error (error);
+
+  return ret_commit;
+}
+
+static GHashTable *
+traverse (OstreeRepo         *repo,
+          const char * const *commits,
+          guint               n_commits,
+          int                 maxdepth,
+          guint               n_threads)
+{
+  GError *error = NULL;
+  GHashTable *reachable = ostree_repo_traverse_new_reachable ();
+
+  g_assert (ostree_cmd__private__()->ostree_repo_traverse_commits_union (repo, commits, n_commits,
+                                                                         maxdepth, reachable,
+                                                                         n_threads, NULL, &error));
+  g_assert_no_error (error);
+  return reachable;
+}
+
+static void
+assert_same_set (GHashTable *a,
+                 GHashTable *b)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  g_assert_cmpuint (g_hash_table_size (a), ==, g_hash_table_size (b));
+  g_hash_table_iter_init (&iter, a);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_assert (g_hash_table_contains (b, key));
+}
+
+static void
+test_traverse_parallel_matches_serial (void)
+{
+  glnx_unref_object OstreeRepo *repo = create_repo ();
+  g_autofree char *first = write_commit (repo, NULL, 1);
+  g_autofree char *second = write_commit (repo, first, 2);
+  g_autofree char *unrelated = write_commit (repo, NULL, 3);
+  const char *commits[] = { second, unrelated };
+  int maxdepth;
+
+  for (maxdepth = -1; maxdepth <= 1; maxdepth++)
+    {
+      g_autoptr(GHashTable) serial = traverse (repo, commits, G_N_ELEMENTS (commits), maxdepth, 1);
+      g_autoptr(GHashTable) parallel = traverse (repo, commits, G_N_ELEMENTS (commits), maxdepth, 4);
+
+      assert_same_set (serial, parallel);
+    }
+}
+
+static void
+test_traverse_union (void)
+{
+  GError *error = NULL;
+  glnx_unref_object OstreeRepo *repo = create_repo ();
+  g_autofree char *first = write_commit (repo, NULL, 1);
+  g_autofree char *second = write_commit (repo, NULL, 2);
+  const char *commits[] = { first, second };
+  g_autoptr(GHashTable) expected = traverse (repo, commits, G_N_ELEMENTS (commits), 0, 1);
+  g_autoptr(GHashTable) reachable = NULL;
+
+  /* The public API merges into an existing set the same way */
+  g_assert (ostree_repo_traverse_commit (repo, first, 0, &reachable, NULL, &error));
+  g_assert_no_error (error);
+  g_assert (ostree_repo_traverse_commit_union (repo, second, 0, reachable, NULL, &error));
+  g_assert_no_error (error);
+
+  assert_same_set (expected, reachable);
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/repo-traverse/parallel-matches-serial", test_traverse_parallel_matches_serial);
+  g_test_add_func ("/repo-traverse/union", test_traverse_union);
+
+  return g_test_run();
+}
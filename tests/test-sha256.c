@@ -0,0 +1,168 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2015 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "libglnx.h"
+#include <glib.h>
+#include <string.h>
+#include "ostree.h"
+#include "otutil.h"
+
+/* From FIPS 180-2 */
+static const struct {
+  const char *input;
+  guint repeat;
+  const char *sha256;
+} vectors[] = {
+  { "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+  { "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+  { "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+static void
+test_sha256_vectors (void)
+{
+  const char * const *backends = ot_sha256_list_backends ();
+  g_autofree char *orig_backend = g_strdup (ot_sha256_get_backend ());
+  guint i, j, k;
+
+  for (i = 0; backends[i] != NULL; i++)
+    {
+      g_assert (ot_sha256_set_backend (backends[i]));
+      g_assert_cmpstr (ot_sha256_get_backend (), ==, backends[i]);
+
+      for (j = 0; j < G_N_ELEMENTS (vectors); j++)
+        {
+          OtSha256 *checksum = ot_sha256_new ();
+          guint8 digest[32];
+          g_autofree char *hex = NULL;
+
+          for (k = 0; k < vectors[j].repeat; k++)
+            ot_sha256_update (checksum, vectors[j].input, strlen (vectors[j].input));
+          g_assert_cmpstr (ot_sha256_get_string (checksum), ==, vectors[j].sha256);
+
+          ot_sha256_get_digest (checksum, digest);
+          hex = ostree_checksum_from_bytes (digest);
+          g_assert_cmpstr (hex, ==, vectors[j].sha256);
+
+          ot_sha256_free (checksum);
+        }
+    }
+
+  g_assert (!ot_sha256_set_backend ("nonexistent"));
+  g_assert (ot_sha256_set_backend (orig_backend));
+}
+
+/* Every split of the input must give the same digest as GChecksum */
+static void
+test_sha256_chunked (void)
+{
+  const char * const *backends = ot_sha256_list_backends ();
+  g_autofree char *orig_backend = g_strdup (ot_sha256_get_backend ());
+  const gsize len = 100003;
+  GRand *rand = g_rand_new_with_seed (42);
+  g_autofree guint8 *data = g_malloc (len);
+  g_autofree char *expected = NULL;
+  gsize chunk, offset;
+  guint i;
+
+  for (offset = 0; offset < len; offset++)
+    data[offset] = g_rand_int (rand);
+  expected = g_compute_checksum_for_data (G_CHECKSUM_SHA256, data, len);
+
+  for (i = 0; backends[i] != NULL; i++)
+    {
+      g_assert (ot_sha256_set_backend (backends[i]));
+
+      for (chunk = 1; chunk < 300; chunk += 7)
+        {
+          OtSha256 *checksum = ot_sha256_new ();
+
+          for (offset = 0; offset < len; offset += chunk)
+            ot_sha256_update (checksum, data + offset, MIN (chunk, len - offset));
+          g_assert_cmpstr (ot_sha256_get_string (checksum), ==, expected);
+          ot_sha256_free (checksum);
+        }
+    }
+
+  g_assert (ot_sha256_set_backend (orig_backend));
+  g_rand_free (rand);
+}
+
+/* Compare the throughput of each backend and of GChecksum itself.
+ * Run with -m perf.
+ */
+static void
+test_sha256_throughput (void)
+{
+  const char * const *backends = ot_sha256_list_backends ();
+  g_autofree char *orig_backend = g_strdup (ot_sha256_get_backend ());
+  const gsize chunk = 64 * 1024;
+  const guint n_chunks = 4096;
+  g_autofree guint8 *data = g_malloc0 (chunk);
+  GChecksum *gchecksum;
+  gint64 start;
+  double mbs;
+  guint i, j;
+
+  start = g_get_monotonic_time ();
+  gchecksum = g_checksum_new (G_CHECKSUM_SHA256);
+  for (j = 0; j < n_chunks; j++)
+    g_checksum_update (gchecksum, data, chunk);
+  (void) g_checksum_get_string (gchecksum);
+  g_checksum_free (gchecksum);
+  mbs = (double) chunk * n_chunks / (g_get_monotonic_time () - start);
+  g_test_message ("GChecksum: %.0f MB/s", mbs);
+
+  for (i = 0; backends[i] != NULL; i++)
+    {
+      OtSha256 *checksum;
+
+      g_assert (ot_sha256_set_backend (backends[i]));
+
+      start = g_get_monotonic_time ();
+      checksum = ot_sha256_new ();
+      for (j = 0; j < n_chunks; j++)
+        ot_sha256_update (checksum, data, chunk);
+      (void) ot_sha256_get_string (checksum);
+      ot_sha256_free (checksum);
+      mbs = (double) chunk * n_chunks / (g_get_monotonic_time () - start);
+
+      g_test_message ("%s: %.0f MB/s", backends[i], mbs);
+      if (i == 0)
+        g_test_maximized_result (mbs, "%s MB/s", backends[i]);
+    }
+
+  g_assert (ot_sha256_set_backend (orig_backend));
+}
+
+int main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sha256/vectors", test_sha256_vectors);
+  g_test_add_func ("/sha256/chunked", test_sha256_chunked);
+  if (g_test_perf ())
+    g_test_add_func ("/sha256/throughput", test_sha256_throughput);
+
+  return g_test_run();
+}
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Copyright (C) 2015 Colin Walters <walters@verbum.org>
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -e
+
+. $(dirname $0)/libtest.sh
+
+setup_test_repository "archive-z2"
+
+echo '1..4'
+
+# Compare the summary written incrementally with a full regeneration
+assert_summary_matches_full () {
+    cp repo/summary summary-incremental
+    $OSTREE summary -u
+    cmp summary-incremental repo/summary
+}
+
+cd ${test_tmpdir}
+$OSTREE summary -u
+cd ${test_tmpdir}/files
+$OSTREE commit -b other -s "Other branch"
+echo changed > firstfile
+$OSTREE commit -b test2 -s "Update test2"
+cd ${test_tmpdir}
+$OSTREE summary -u --ref=other --ref=test2
+assert_summary_matches_full
+echo "ok incremental summary with new and updated refs"
+
+$OSTREE refs --delete other
+$OSTREE summary -u --ref=other
+assert_summary_matches_full
+$OSTREE summary -u --ref=does-not-exist
+assert_summary_matches_full
+echo "ok incremental summary with deleted refs"
+
+$OSTREE static-delta generate test2
+$OSTREE static-delta list > deltas.txt
+$OSTREE summary -u --delta=$(head -1 deltas.txt)
+assert_summary_matches_full
+echo "ok incremental summary with static deltas"
+
+$OSTREE config set core.commit-update-summary true
+cd ${test_tmpdir}/files
+echo again > firstfile
+$OSTREE commit -b test2 -s "Update test2 again"
+cd ${test_tmpdir}
+assert_summary_matches_full
+rm repo/summary
+$OSTREE summary -u --ref=test2
+assert_summary_matches_full
+echo "ok summary updated after commit"